@@ -0,0 +1,97 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "openslide.h"
+#include "openslide-common.h"
+
+// slides opened in parallel, and kept open until their results are out
+#define BATCH_SIZE 64
+
+static bool process_batch(char **files, int count,
+                          common_slide_fn fn, void *data) {
+  openslide_t **osrs = g_new0(openslide_t *, count);
+  openslide_open_many((const char * const *) files, count, osrs);
+
+  bool success = true;
+  for (int i = 0; i < count; i++) {
+    if (!fn(files[i], osrs[i], data)) {
+      success = false;
+    }
+    if (osrs[i]) {
+      openslide_close(osrs[i]);
+    }
+  }
+  g_free(osrs);
+  return success;
+}
+
+// a line of f without its terminator, or false at the end
+static bool read_line(FILE *f, GString *line) {
+  g_string_truncate(line, 0);
+  int c;
+  while ((c = fgetc(f)) != EOF && c != '\n') {
+    g_string_append_c(line, c);
+  }
+  if (line->len && line->str[line->len - 1] == '\r') {
+    g_string_truncate(line, line->len - 1);
+  }
+  return c != EOF || line->len;
+}
+
+bool common_process_slides(int count, char **files,
+                           common_slide_fn fn, void *data) {
+  bool success = true;
+
+  if (count == 1 && !strcmp(files[0], "-")) {
+    // names from standard input, a batch at a time
+    GPtrArray *batch = g_ptr_array_new();
+    GString *line = g_string_new(NULL);
+    bool more = true;
+    while (more) {
+      more = read_line(stdin, line);
+      if (more && line->len) {
+        g_ptr_array_add(batch, g_strdup(line->str));
+      }
+      if (batch->len == BATCH_SIZE || (!more && batch->len)) {
+        if (!process_batch((char **) batch->pdata, batch->len, fn, data)) {
+          success = false;
+        }
+        for (guint i = 0; i < batch->len; i++) {
+          g_free(batch->pdata[i]);
+        }
+        g_ptr_array_set_size(batch, 0);
+      }
+    }
+    g_string_free(line, TRUE);
+    g_ptr_array_free(batch, TRUE);
+    return success;
+  }
+
+  for (int i = 0; i < count; i += BATCH_SIZE) {
+    if (!process_batch(files + i, MIN(BATCH_SIZE, count - i), fn, data)) {
+      success = false;
+    }
+  }
+  return success;
+}
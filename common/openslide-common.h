@@ -51,4 +51,18 @@ void common_fail(const char *fmt, ...) G_GNUC_NORETURN;
 
 char *common_get_fd_path(int fd);
 
+// batch
+
+struct _openslide;
+
+// called for each slide in order, with what openslide_open() returned,
+// which is closed afterward; false if the slide failed
+typedef bool (*common_slide_fn)(const char *file, struct _openslide *osr,
+                                void *data);
+
+// open the slides of files in parallel batches, or the slides named on
+// standard input, one per line, if files is "-"; false if any failed
+bool common_process_slides(int count, char **files,
+                           common_slide_fn fn, void *data);
+
 #endif
@@ -0,0 +1,94 @@
+/* Time each pixel conversion kernel against its portable version, in
+   million pixels per CPU-second.  Build in a configured tree, after
+   src/openslide-tables.c has been generated: */
+/* gcc -O2 -g -std=gnu99 -I. -Isrc -o pixel-benchmark misc/pixel-benchmark.c \
+   $(pkg-config --cflags --libs glib-2.0 cairo libtiff-4 libcurl) */
+
+#include "openslide-pixel.c"
+#include "openslide-tables.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PIXELS (4096 * 1024)
+#define RUNS 20
+
+typedef void (*kernel_fn)(uint32_t *dest, const int32_t *y, const int32_t *cb,
+                          const int32_t *cr, int64_t count);
+
+static uint32_t *dest;
+static int32_t *c0, *c1, *c2;
+
+static double cpu_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double time_swap(void (*fn)(uint32_t *, int64_t)) {
+  double start = cpu_time();
+  for (int i = 0; i < RUNS; i++) {
+    fn(dest, PIXELS);
+  }
+  return PIXELS * (double) RUNS / ((cpu_time() - start) * 1e6);
+}
+
+static double time_planar(kernel_fn fn) {
+  double start = cpu_time();
+  for (int i = 0; i < RUNS; i++) {
+    fn(dest, c0, c1, c2, PIXELS);
+  }
+  return PIXELS * (double) RUNS / ((cpu_time() - start) * 1e6);
+}
+
+static double time_rgb48(void (*fn)(uint32_t *, const uint8_t *, int64_t)) {
+  double start = cpu_time();
+  for (int i = 0; i < RUNS; i++) {
+    fn(dest, (const uint8_t *) c0, PIXELS / 2);
+  }
+  return PIXELS / 2 * (double) RUNS / ((cpu_time() - start) * 1e6);
+}
+
+static double time_swap_bytes(void (*fn)(void *, int32_t, int64_t)) {
+  double start = cpu_time();
+  for (int i = 0; i < RUNS; i++) {
+    fn(dest, 8, PIXELS / 2);
+  }
+  return PIXELS / 2 * (double) RUNS / ((cpu_time() - start) * 1e6);
+}
+
+static void report(const char *name, double base, double fast) {
+  printf("%-18s %8.1f -> %8.1f  (%.2fx)\n", name, base, fast, fast / base);
+}
+
+int main(void) {
+  dest = malloc(PIXELS * sizeof(*dest));
+  c0 = malloc(PIXELS * sizeof(*c0));
+  c1 = malloc(PIXELS * sizeof(*c1));
+  c2 = malloc(PIXELS * sizeof(*c2));
+  for (int64_t i = 0; i < PIXELS; i++) {
+    dest[i] = rand();
+    c0[i] = rand() & 0xff;
+    c1[i] = rand() & 0xff;
+    c2[i] = rand() & 0xff;
+  }
+
+  init_kernels(NULL);
+  report("abgr_to_argb", time_swap(abgr_to_argb_c),
+         time_swap(kernels.abgr_to_argb));
+  report("rgb_to_argb", time_planar(rgb_to_argb_c),
+         time_planar(kernels.rgb_to_argb));
+  report("ycbcr422_to_argb", time_planar(ycbcr422_to_argb_c),
+         time_planar(kernels.ycbcr422_to_argb));
+  report("rgb48_to_xrgb", time_rgb48(rgb48_to_xrgb_c),
+         time_rgb48(kernels.rgb48_to_xrgb));
+  report("swap_bytes(8)", time_swap_bytes(swap_bytes_c),
+         time_swap_bytes(kernels.swap_bytes));
+
+  free(dest);
+  free(c0);
+  free(c1);
+  free(c2);
+  return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+#include <string.h>
+
+/*
+ * One memory budget for the process, split between spare decode buffers,
+ * decoded tiles and compressed blocks.  The buffers get a small fixed
+ * share.  The rest starts out halved between one tile cache, shared by
+ * the slides opened under the budget, and the urlio block cache; every
+ * second or so a step of it moves to whichever of the two spent more time
+ * refilling itself, decoding tiles or fetching blocks, as long as that one
+ * is full.  A cache which doesn't use half its share gives a step to a
+ * full one.
+ */
+
+#define BUDGET_ENV_VAR "OPENSLIDE_MEMORY_BUDGET"
+
+// seconds between rebalancings
+#define BUDGET_INTERVAL 1
+
+// the share of spare decode buffers, and its largest size
+#define BUDGET_SCRATCH_DIVISOR 16
+#define BUDGET_SCRATCH_MAX (64 * 1024 * 1024)
+
+// steps the caches' part is moved in, and the least steps either keeps
+#define BUDGET_STEPS 32
+#define BUDGET_MIN_STEPS 4
+
+// a cache this full wants more
+#define BUDGET_FULL_PERCENT 90
+
+// how much longer the receiving cache must spend refilling, in percent
+#define BUDGET_HYSTERESIS_PERCENT 125
+
+struct refill_counters {
+  uint64_t decode_us;
+  uint64_t fetch_us;
+};
+
+// under budget_lock
+static GMutex budget_lock;
+static uint64_t budget_total;  // 0 for none
+static uint64_t budget_caches;  // the part split between the two caches
+static uint64_t budget_tiles;  // share of the tile cache
+static struct _openslide_cache *budget_tile_cache;
+static size_t saved_block_capacity;
+static struct refill_counters last_refill;
+
+static volatile gint budget_on;
+static volatile gint64 next_rebalance;
+static GOnce budget_once = G_ONCE_INIT;
+
+// time spent decoding, and in transfers, estimated from their latency
+// histogram with each bucket at the middle of its range
+static void get_refill_counters(struct refill_counters *counters) {
+  struct openslide_stats stats;
+  _openslide_stats_collect(0, &stats);
+  counters->decode_us = stats.decode_us;
+
+  URLIO_STATS urlio;
+  urlio_get_total_stats(&urlio);
+  counters->fetch_us = 0;
+  for (int i = 0; i < URLIO_LATENCY_BUCKETS; i++) {
+    counters->fetch_us += urlio.latency[i] * ((uint64_t) 750 << i);
+  }
+}
+
+// set the shares, budget_lock held
+static void apply_shares(void) {
+  _openslide_cache_set_capacity(budget_tile_cache, budget_tiles);
+  urlio_set_cache_capacity(budget_caches - budget_tiles);
+}
+
+static void set_budget(uint64_t bytes) {
+  g_mutex_lock(&budget_lock);
+  if (bytes && !budget_total) {
+    saved_block_capacity = urlio_get_cache_capacity();
+    budget_tile_cache = _openslide_cache_create(bytes / 2);
+  } else if (!bytes && budget_total) {
+    // slides opened under the budget keep its cache
+    _openslide_cache_release(budget_tile_cache);
+    budget_tile_cache = NULL;
+    urlio_set_cache_capacity(saved_block_capacity);
+    _openslide_buffer_set_depot_limit(0);
+  }
+
+  budget_total = bytes;
+  if (bytes) {
+    uint64_t scratch = MIN(bytes / BUDGET_SCRATCH_DIVISOR, BUDGET_SCRATCH_MAX);
+    _openslide_buffer_set_depot_limit(MAX(scratch, 1));
+    budget_caches = bytes - scratch;
+    budget_tiles = budget_caches / 2;
+    apply_shares();
+    get_refill_counters(&last_refill);
+    next_rebalance = g_get_monotonic_time() + BUDGET_INTERVAL * G_USEC_PER_SEC;
+  }
+  g_atomic_int_set(&budget_on, bytes != 0);
+  g_mutex_unlock(&budget_lock);
+}
+
+static gpointer init_budget(gpointer data G_GNUC_UNUSED) {
+  const char *env = g_getenv(BUDGET_ENV_VAR);
+  if (env && *env) {
+    set_budget(g_ascii_strtoull(env, NULL, 10));
+  }
+  return NULL;
+}
+
+struct _openslide_cache *_openslide_budget_get_tile_cache(void) {
+  g_once(&budget_once, init_budget, NULL);
+  if (!g_atomic_int_get(&budget_on)) {
+    return NULL;
+  }
+  g_mutex_lock(&budget_lock);
+  struct _openslide_cache *cache = NULL;
+  if (budget_tile_cache) {
+    cache = _openslide_cache_ref(budget_tile_cache);
+  }
+  g_mutex_unlock(&budget_lock);
+  return cache;
+}
+
+void _openslide_budget_set(uint64_t bytes) {
+  g_once(&budget_once, init_budget, NULL);
+  set_budget(bytes);
+}
+
+uint64_t _openslide_budget_get(void) {
+  g_once(&budget_once, init_budget, NULL);
+  g_mutex_lock(&budget_lock);
+  uint64_t bytes = budget_total;
+  g_mutex_unlock(&budget_lock);
+  return bytes;
+}
+
+static bool is_full(uint64_t size, uint64_t share) {
+  return size >= share / 100 * BUDGET_FULL_PERCENT;
+}
+
+// budget_lock held
+static void rebalance(void) {
+  struct refill_counters now;
+  get_refill_counters(&now);
+  uint64_t decode_us = now.decode_us - last_refill.decode_us;
+  uint64_t fetch_us = now.fetch_us - last_refill.fetch_us;
+  last_refill = now;
+
+  struct _openslide_cache_stats tiles;
+  _openslide_cache_get_stats(budget_tile_cache, &tiles);
+  uint64_t blocks_size = urlio_get_cache_size();
+  uint64_t blocks_share = budget_caches - budget_tiles;
+  bool tiles_full = is_full(tiles.size, budget_tiles);
+  bool blocks_full = is_full(blocks_size, blocks_share);
+
+  // +1 toward the tiles, -1 toward the blocks
+  int direction = 0;
+  if (tiles_full && blocks_full) {
+    if (decode_us * 100 > fetch_us * BUDGET_HYSTERESIS_PERCENT) {
+      direction = 1;
+    } else if (fetch_us * 100 > decode_us * BUDGET_HYSTERESIS_PERCENT) {
+      direction = -1;
+    }
+  } else if (tiles_full && blocks_size < blocks_share / 2) {
+    direction = 1;
+  } else if (blocks_full && tiles.size < budget_tiles / 2) {
+    direction = -1;
+  }
+
+  uint64_t step = budget_caches / BUDGET_STEPS;
+  uint64_t min = step * BUDGET_MIN_STEPS;
+  if (direction > 0 && blocks_share >= min + step) {
+    budget_tiles += step;
+  } else if (direction < 0 && budget_tiles >= min + step) {
+    budget_tiles -= step;
+  } else {
+    return;
+  }
+  apply_shares();
+}
+
+void _openslide_budget_tick(void) {
+  if (!g_atomic_int_get(&budget_on)) {
+    return;
+  }
+  gint64 now = g_get_monotonic_time();
+  if (now < next_rebalance || !g_mutex_trylock(&budget_lock)) {
+    return;
+  }
+  if (budget_total && now >= next_rebalance) {
+    next_rebalance = now + BUDGET_INTERVAL * G_USEC_PER_SEC;
+    rebalance();
+  }
+  g_mutex_unlock(&budget_lock);
+}
+
+void _openslide_budget_release(double fraction) {
+  _openslide_cache_trim_all(fraction);
+  urlio_trim_cache(fraction);
+  _openslide_buffer_trim();
+}
@@ -0,0 +1,318 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+#include <string.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+/*
+ * Tile buffers are recycled by size: a buffer freed when the cache evicts
+ * a tile is reused for the next decode of a tile of the same dimensions.
+ * Eviction happens on the thread inserting a tile, so each thread keeps a
+ * few buffers of its own, without locking; the rest go to a shared depot.
+ */
+
+// smaller buffers are cheap enough for g_slice
+#define BUFFER_POOL_MIN_SIZE 4096
+
+// sizes, and buffers of each size, a thread keeps
+#define BUFFER_THREAD_SIZES 4
+#define BUFFER_THREAD_COUNT 4
+
+// bytes kept in the shared depot, unless the memory budget says otherwise
+#define BUFFER_DEPOT_MAX (64 * 1024 * 1024)
+
+// hugepage arenas, carved into buffers which are never returned
+#define BUFFER_HUGEPAGE_ENV_VAR "OPENSLIDE_HUGEPAGES"
+#define BUFFER_ARENA_SIZE (32 * 1024 * 1024)
+#define BUFFER_ARENA_ALIGN 64
+
+// free buffers are chained through their first word
+struct free_list {
+  gsize size;
+  void *head;
+  int count;
+};
+
+struct thread_pool {
+  struct free_list lists[BUFFER_THREAD_SIZES];
+};
+
+struct arena {
+  char *start;
+  gsize used;
+};
+
+static GPrivate *thread_buffers_key;
+static GOnce g_init_once = G_ONCE_INIT;
+
+// depot, under g_depot_lock
+static GMutex g_depot_lock;
+static GHashTable *g_depot;  // size -> struct free_list, never freed
+static gsize g_depot_bytes;
+static gsize g_depot_max = BUFFER_DEPOT_MAX;
+static GSList *g_arenas;     // struct arena, newest first
+static bool g_use_hugepages;
+
+static void *take(struct free_list *list) {
+  void *buf = list->head;
+  if (buf) {
+    list->head = *(void **) buf;
+    list->count--;
+  }
+  return buf;
+}
+
+static void give(struct free_list *list, void *buf) {
+  *(void **) buf = list->head;
+  list->head = buf;
+  list->count++;
+}
+
+static bool in_arena(void *buf) {
+  for (GSList *l = g_arenas; l; l = l->next) {
+    struct arena *arena = l->data;
+    if ((char *) buf >= arena->start &&
+        (char *) buf < arena->start + BUFFER_ARENA_SIZE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void depot_put(gsize size, void *buf) {
+  g_mutex_lock(&g_depot_lock);
+  // arena buffers can't be freed, so they are always kept
+  bool arena = in_arena(buf);
+  if (!arena && g_depot_bytes + size > g_depot_max) {
+    g_mutex_unlock(&g_depot_lock);
+    g_slice_free1(size, buf);
+    return;
+  }
+  struct free_list *list = g_hash_table_lookup(g_depot, GSIZE_TO_POINTER(size));
+  if (list == NULL) {
+    list = g_slice_new0(struct free_list);
+    list->size = size;
+    g_hash_table_insert(g_depot, GSIZE_TO_POINTER(size), list);
+  }
+  give(list, buf);
+  if (!arena) {
+    g_depot_bytes += size;
+  }
+  g_mutex_unlock(&g_depot_lock);
+}
+
+static void *depot_get(gsize size) {
+  void *buf = NULL;
+
+  g_mutex_lock(&g_depot_lock);
+  struct free_list *list = g_hash_table_lookup(g_depot, GSIZE_TO_POINTER(size));
+  if (list) {
+    buf = take(list);
+    if (buf && !in_arena(buf)) {
+      g_depot_bytes -= size;
+    }
+  }
+  g_mutex_unlock(&g_depot_lock);
+  return buf;
+}
+
+// hand the buffers of an exiting thread to the depot
+static void thread_pool_destroy(gpointer data) {
+  struct thread_pool *pool = data;
+
+  for (int i = 0; i < BUFFER_THREAD_SIZES; i++) {
+    struct free_list *list = &pool->lists[i];
+    void *buf;
+    while ((buf = take(list))) {
+      depot_put(list->size, buf);
+    }
+  }
+  g_slice_free(struct thread_pool, pool);
+}
+
+static gpointer init_pool(gpointer data G_GNUC_UNUSED) {
+  thread_buffers_key = g_private_new(thread_pool_destroy);
+  g_depot = g_hash_table_new(g_direct_hash, g_direct_equal);
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  const char *env = g_getenv(BUFFER_HUGEPAGE_ENV_VAR);
+  g_use_hugepages = env && *env && strcmp(env, "0");
+#endif
+  return NULL;
+}
+
+static struct thread_pool *get_thread_pool(void) {
+  struct thread_pool *pool = g_private_get(thread_buffers_key);
+  if (pool == NULL) {
+    pool = g_slice_new0(struct thread_pool);
+    g_private_set(thread_buffers_key, pool);
+  }
+  return pool;
+}
+
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+// carve a buffer from a hugepage arena, or return NULL
+static void *arena_alloc(gsize size) {
+  gsize rounded = (size + BUFFER_ARENA_ALIGN - 1) & ~(gsize) (BUFFER_ARENA_ALIGN - 1);
+  if (rounded > BUFFER_ARENA_SIZE / 4) {
+    return NULL;
+  }
+
+  g_mutex_lock(&g_depot_lock);
+  struct arena *arena = g_arenas ? g_arenas->data : NULL;
+  if (arena == NULL || arena->used + rounded > BUFFER_ARENA_SIZE) {
+    void *start = mmap(NULL, BUFFER_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (start == MAP_FAILED) {
+      g_mutex_unlock(&g_depot_lock);
+      return NULL;
+    }
+    madvise(start, BUFFER_ARENA_SIZE, MADV_HUGEPAGE);
+    arena = g_slice_new0(struct arena);
+    arena->start = start;
+    g_arenas = g_slist_prepend(g_arenas, arena);
+  }
+  void *buf = arena->start + arena->used;
+  arena->used += rounded;
+  g_mutex_unlock(&g_depot_lock);
+  return buf;
+}
+#endif
+
+void *_openslide_buffer_alloc(gsize size) {
+  if (size < BUFFER_POOL_MIN_SIZE) {
+    return g_slice_alloc(size);
+  }
+  g_once(&g_init_once, init_pool, NULL);
+
+  // this thread's buffers
+  struct thread_pool *pool = get_thread_pool();
+  for (int i = 0; i < BUFFER_THREAD_SIZES; i++) {
+    struct free_list *list = &pool->lists[i];
+    if (list->size == size && list->head) {
+      return take(list);
+    }
+  }
+
+  // then the depot
+  void *buf = depot_get(size);
+  if (buf) {
+    return buf;
+  }
+
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  if (g_use_hugepages) {
+    buf = arena_alloc(size);
+    if (buf) {
+      return buf;
+    }
+  }
+#endif
+  return g_slice_alloc(size);
+}
+
+void *_openslide_buffer_alloc0(gsize size) {
+  void *buf = _openslide_buffer_alloc(size);
+  memset(buf, 0, size);
+  return buf;
+}
+
+void _openslide_buffer_free(gsize size, void *buf) {
+  if (buf == NULL) {
+    return;
+  }
+  if (size < BUFFER_POOL_MIN_SIZE) {
+    g_slice_free1(size, buf);
+    return;
+  }
+  g_once(&g_init_once, init_pool, NULL);
+
+  // keep it in this thread, preferring a list of the same size, then an
+  // empty one; the least filled list gives way to a new size
+  struct thread_pool *pool = get_thread_pool();
+  struct free_list *target = NULL;
+  for (int i = 0; i < BUFFER_THREAD_SIZES; i++) {
+    struct free_list *list = &pool->lists[i];
+    if (list->size == size) {
+      target = list;
+      break;
+    }
+    if (target == NULL || list->count < target->count) {
+      target = list;
+    }
+  }
+  if (target->size != size) {
+    void *old;
+    while ((old = take(target))) {
+      depot_put(target->size, old);
+    }
+    target->size = size;
+  }
+  if (target->count < BUFFER_THREAD_COUNT) {
+    give(target, buf);
+  } else {
+    depot_put(size, buf);
+  }
+}
+
+// free the spare buffers of the depot beyond limit bytes; arena buffers
+// can't be freed and stay.  g_depot_lock must be held
+static void trim_depot(gsize limit) {
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, g_depot);
+  while (g_depot_bytes > limit && g_hash_table_iter_next(&iter, NULL, &value)) {
+    struct free_list *list = value;
+    struct free_list kept = { .size = list->size };
+    void *buf;
+    while ((buf = take(list))) {
+      if (g_depot_bytes > limit && !in_arena(buf)) {
+        g_slice_free1(list->size, buf);
+        g_depot_bytes -= list->size;
+      } else {
+        give(&kept, buf);
+      }
+    }
+    *list = kept;
+  }
+}
+
+void _openslide_buffer_set_depot_limit(gsize limit) {
+  g_once(&g_init_once, init_pool, NULL);
+  g_mutex_lock(&g_depot_lock);
+  g_depot_max = limit ? limit : BUFFER_DEPOT_MAX;
+  trim_depot(g_depot_max);
+  g_mutex_unlock(&g_depot_lock);
+}
+
+void _openslide_buffer_trim(void) {
+  g_once(&g_init_once, init_pool, NULL);
+  g_mutex_lock(&g_depot_lock);
+  trim_depot(0);
+  g_mutex_unlock(&g_depot_lock);
+}
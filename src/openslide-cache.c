@@ -24,6 +24,7 @@
 #include "openslide-private.h"
 
 #include <glib.h>
+#include <string.h>
 
 #if defined(HAVE_UINTPTR_T) || defined(uintptr_t)
 #define ptr_int uintptr_t
@@ -33,8 +34,17 @@
 #define ptr_int uint64_t
 #endif
 
+// number of independently locked parts of a cache, a power of two
+#define CACHE_STRIPES 16
+
+// share of the capacity for entries hit since they were inserted; the
+// rest is for new entries on probation, so a scan can't flush the others.
+// each stripe protects its part of the share, as it only demotes its own
+#define CACHE_PROTECTED_PERCENT 75
+
 // hash table key
 struct _openslide_cache_key {
+  uint64_t binding_id;  // the slide, planes are only unique while it's open
   void *plane;  // cookie for coordinate plane (level, grid, etc.)
   int64_t x;
   int64_t y;
@@ -44,7 +54,8 @@ struct _openslide_cache_key {
 struct _openslide_cache_value {
   GList *link;            // direct pointer to the node in the list
   struct _openslide_cache_key *key; // for removing keys when aged out
-  struct _openslide_cache *cache; // sadly, for total_bytes and the list
+  struct cache_stripe *stripe; // sadly, for the list and the sizes
+  bool protected;         // in the protected list, else on probation
 
   struct _openslide_cache_entry *entry;  // may outlive the value
 };
@@ -56,59 +67,205 @@ struct _openslide_cache_entry {
   int size;
 };
 
-struct _openslide_cache {
+// a part of the cache with its own lock and lists; a key always lives
+// in the stripe its hash selects.  the lists are a segmented LRU: entries
+// start on probation and move to the protected list when hit again
+struct cache_stripe {
   GMutex *mutex;
-  GQueue *list;
+  GQueue *probation;
+  GQueue *protected;
   GHashTable *hashtable;
+  struct _openslide_cache *cache;
 
-  int capacity;
-  int total_size;
+  // sizes of the entries and of the protected list, under mutex
+  uint64_t size;
+  uint64_t protected_size;
 
-  gint warned_overlarge_entry;
+  // counters, under mutex
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
 };
 
-// eviction
-// mutex must be held
-static void possibly_evict(struct _openslide_cache *cache, int incoming_size) {
-  g_assert(incoming_size >= 0);
+struct _openslide_cache {
+  struct cache_stripe stripes[CACHE_STRIPES];
+
+  gint refcount;  // atomic ops only
 
-  int size = cache->total_size + incoming_size;
-  int target = cache->capacity;
+  // limit, and sums of the sizes of the stripes; atomic ops only, so
+  // that hits and inserts take no lock but the one of their stripe
+  volatile gsize capacity;
+  volatile gsize total_size;
+  volatile gsize protected_size;
 
-  while(size > target) {
-    // get key of last element
-    struct _openslide_cache_value *value = g_queue_peek_tail(cache->list);
-    if (value == NULL) {
-      return; // cache is empty
-    }
-    struct _openslide_cache_key *key = value->key;
+  gint warned_overlarge_entry;
+};
 
-    //g_debug("EVICT: size: %d", value->entry->size);
+// a slide's view of a cache, which may be shared with other slides
+struct _openslide_cache_binding {
+  struct _openslide_cache *cache;  // g_atomic_pointer only
+  uint64_t id;
+  gint streaming;  // atomic ops only
 
-    size -= value->entry->size;
+  GMutex *mutex;   // serializes setting the cache
+  GSList *retired; // caches replaced while readers may still use them
+};
 
-    // remove from hashtable, this will trigger removal from everything
-    bool result = g_hash_table_remove(cache->hashtable, key);
-    g_assert(result);
-  }
-}
+static uint64_t g_next_binding_id = 1;
+static GMutex g_binding_id_lock;
+
+// every live cache, for giving memory back; under g_caches_lock
+static GSList *g_caches;
+static GMutex g_caches_lock;
 
+// set in threads whose hits don't promote
+static GPrivate *passive_key;
+static GOnce passive_once = G_ONCE_INIT;
 
 // hash function helpers
 static guint hash_func(gconstpointer key) {
   const struct _openslide_cache_key *c_key = key;
 
   // assume 32-bit hash
-  return (guint) (((ptr_int) c_key->plane) ^
+  return (guint) (((ptr_int) c_key->plane) ^ c_key->binding_id ^
                   ((34369 * (uint64_t) c_key->y) + ((uint64_t) c_key->x)));
 }
 
+static struct cache_stripe *get_stripe(struct _openslide_cache *cache,
+                                       const struct _openslide_cache_key *key) {
+  // mix the high bits in, neighboring tiles differ in the low ones
+  guint hash = hash_func(key);
+  hash ^= hash >> 16;
+  hash *= 0x45d9f3b;
+  hash ^= hash >> 16;
+  return &cache->stripes[hash & (CACHE_STRIPES - 1)];
+}
+
+// lock a stripe for a reader, tracing the wait if it's contended
+static void lock_stripe(struct cache_stripe *stripe) {
+  if (!g_mutex_trylock(stripe->mutex)) {
+    _openslide_trace_begin("tile cache lock");
+    g_mutex_lock(stripe->mutex);
+    _openslide_trace_end();
+  }
+}
+
+static uint64_t get_size(volatile gsize *size) {
+  return (gsize) g_atomic_pointer_get(size);
+}
+
+static void add_size(volatile gsize *size, int64_t delta) {
+  g_atomic_pointer_add(size, (gssize) delta);
+}
+
+static bool over_capacity(struct _openslide_cache *cache,
+                          uint64_t incoming_size) {
+  return get_size(&cache->total_size) + incoming_size >
+         get_size(&cache->capacity);
+}
+
+// drop the least recently used entry of a stripe, from probation first;
+// its mutex must be held
+static bool evict_one(struct cache_stripe *stripe) {
+  struct _openslide_cache_value *value = g_queue_peek_tail(stripe->probation);
+  if (value == NULL) {
+    value = g_queue_peek_tail(stripe->protected);
+  }
+  if (value == NULL) {
+    return false; // stripe is empty
+  }
+
+  //g_debug("EVICT: size: %d", value->entry->size);
+
+  // remove from hashtable, this will trigger removal from everything
+  bool result = g_hash_table_remove(stripe->hashtable, value->key);
+  g_assert(result);
+  stripe->evictions++;
+  _openslide_stats_add(OPENSLIDE_STAT_CACHE_EVICTIONS, 1);
+  return true;
+}
+
+// eviction: the budget is shared by the stripes and enforced approximately,
+// from the stripe being filled first, then from those not busy elsewhere.
+// mutex of stripe must be held, if there is one
+static void possibly_evict(struct _openslide_cache *cache,
+                           struct cache_stripe *stripe,
+                           uint64_t incoming_size) {
+  if (stripe) {
+    while (over_capacity(cache, incoming_size)) {
+      if (!evict_one(stripe)) {
+        break;
+      }
+    }
+  }
+  for (int i = 0; i < CACHE_STRIPES; i++) {
+    struct cache_stripe *other = &cache->stripes[i];
+    if (!over_capacity(cache, incoming_size)) {
+      return;
+    }
+    if (other == stripe) {
+      continue;
+    }
+    // with a stripe held only trylock, so that two evicting stripes
+    // can't deadlock
+    if (stripe) {
+      if (!g_mutex_trylock(other->mutex)) {
+        continue;
+      }
+    } else {
+      g_mutex_lock(other->mutex);
+    }
+    while (over_capacity(cache, incoming_size)) {
+      if (!evict_one(other)) {
+        break;
+      }
+    }
+    g_mutex_unlock(other->mutex);
+  }
+}
+
+// move a hit entry to the head of the protected list, making room there by
+// moving the least recently used protected entries back to probation.
+// mutex of stripe must be held
+static void promote(struct cache_stripe *stripe,
+                    struct _openslide_cache_value *value) {
+  struct _openslide_cache *cache = stripe->cache;
+
+  if (value->protected) {
+    g_queue_unlink(stripe->protected, value->link);
+    g_queue_push_head_link(stripe->protected, value->link);
+    return;
+  }
+
+  g_queue_unlink(stripe->probation, value->link);
+  g_queue_push_head_link(stripe->protected, value->link);
+  value->protected = true;
+
+  stripe->protected_size += value->entry->size;
+  add_size(&cache->protected_size, value->entry->size);
+  uint64_t limit =
+    get_size(&cache->capacity) / 100 * CACHE_PROTECTED_PERCENT / CACHE_STRIPES;
+  while (stripe->protected_size > limit) {
+    GList *link = g_queue_peek_tail_link(stripe->protected);
+    struct _openslide_cache_value *demoted = link->data;
+    if (demoted == value) {
+      break;
+    }
+    g_queue_unlink(stripe->protected, link);
+    g_queue_push_head_link(stripe->probation, link);
+    demoted->protected = false;
+    stripe->protected_size -= demoted->entry->size;
+    add_size(&cache->protected_size, -demoted->entry->size);
+  }
+}
+
 static gboolean key_equal_func(gconstpointer a,
 			       gconstpointer b) {
   const struct _openslide_cache_key *c_a = a;
   const struct _openslide_cache_key *c_b = b;
 
-  return (c_a->plane == c_b->plane) && (c_a->x == c_b->x) && (c_a->y == c_b->y);
+  return (c_a->binding_id == c_b->binding_id) && (c_a->plane == c_b->plane) &&
+    (c_a->x == c_b->x) && (c_a->y == c_b->y);
 }
 
 static void hash_destroy_key(gpointer data) {
@@ -117,13 +274,20 @@ static void hash_destroy_key(gpointer data) {
 
 static void hash_destroy_value(gpointer data) {
   struct _openslide_cache_value *value = data;
-
-  // remove the item from the list
-  g_queue_delete_link(value->cache->list, value->link);
-
-  // decrement the total size
-  value->cache->total_size -= value->entry->size;
-  g_assert(value->cache->total_size >= 0);
+  struct cache_stripe *stripe = value->stripe;
+  struct _openslide_cache *cache = stripe->cache;
+
+  // remove the item from its list
+  g_queue_delete_link(value->protected ? stripe->protected : stripe->probation,
+                      value->link);
+
+  // decrement the sizes
+  stripe->size -= value->entry->size;
+  add_size(&cache->total_size, -value->entry->size);
+  if (value->protected) {
+    stripe->protected_size -= value->entry->size;
+    add_size(&cache->protected_size, -value->entry->size);
+  }
 
   // unref the entry
   _openslide_cache_entry_unref(value->entry);
@@ -132,72 +296,255 @@ static void hash_destroy_value(gpointer data) {
   g_slice_free(struct _openslide_cache_value, value);
 }
 
-struct _openslide_cache *_openslide_cache_create(int capacity_in_bytes) {
+struct _openslide_cache *_openslide_cache_create(uint64_t capacity_in_bytes) {
   struct _openslide_cache *cache = g_slice_new0(struct _openslide_cache);
 
-  // init mutex
-  cache->mutex = g_mutex_new();
+  for (int i = 0; i < CACHE_STRIPES; i++) {
+    struct cache_stripe *stripe = &cache->stripes[i];
 
-  // init queue
-  cache->list = g_queue_new();
+    // init mutex
+    stripe->mutex = g_mutex_new();
 
-  // init hashtable
-  cache->hashtable = g_hash_table_new_full(hash_func,
-					   key_equal_func,
-					   hash_destroy_key,
-					   hash_destroy_value);
+    // init queues
+    stripe->probation = g_queue_new();
+    stripe->protected = g_queue_new();
+
+    // init hashtable
+    stripe->hashtable = g_hash_table_new_full(hash_func,
+                                              key_equal_func,
+                                              hash_destroy_key,
+                                              hash_destroy_value);
+    stripe->cache = cache;
+  }
 
   // init byte_capacity
-  cache->capacity = capacity_in_bytes;
+  cache->capacity = MIN(capacity_in_bytes, G_MAXSIZE);
+
+  // one ref for the creator
+  cache->refcount = 1;
+
+  g_mutex_lock(&g_caches_lock);
+  g_caches = g_slist_prepend(g_caches, cache);
+  g_mutex_unlock(&g_caches_lock);
 
   return cache;
 }
 
-void _openslide_cache_destroy(struct _openslide_cache *cache) {
-  // clear hashtable (auto-deletes all data)
-  g_mutex_lock(cache->mutex);
-  g_hash_table_unref(cache->hashtable);
-  g_mutex_unlock(cache->mutex);
+struct _openslide_cache *_openslide_cache_ref(struct _openslide_cache *cache) {
+  g_atomic_int_inc(&cache->refcount);
+  return cache;
+}
+
+static void cache_destroy(struct _openslide_cache *cache) {
+  g_mutex_lock(&g_caches_lock);
+  g_caches = g_slist_remove(g_caches, cache);
+  g_mutex_unlock(&g_caches_lock);
+
+  for (int i = 0; i < CACHE_STRIPES; i++) {
+    struct cache_stripe *stripe = &cache->stripes[i];
+
+    // clear hashtable (auto-deletes all data)
+    g_mutex_lock(stripe->mutex);
+    g_hash_table_unref(stripe->hashtable);
+    g_mutex_unlock(stripe->mutex);
 
-  // clear list
-  g_queue_free(cache->list);
+    // clear lists
+    g_queue_free(stripe->probation);
+    g_queue_free(stripe->protected);
 
-  // free mutex
-  g_mutex_free(cache->mutex);
+    // free mutex
+    g_mutex_free(stripe->mutex);
+    g_assert(stripe->size == 0);
+    g_assert(stripe->protected_size == 0);
+  }
+  g_assert(cache->total_size == 0);
+  g_assert(cache->protected_size == 0);
 
   // destroy struct
   g_slice_free(struct _openslide_cache, cache);
 }
 
+void _openslide_cache_release(struct _openslide_cache *cache) {
+  if (g_atomic_int_dec_and_test(&cache->refcount)) {
+    cache_destroy(cache);
+  }
+}
+
+static gboolean key_has_binding(gpointer key,
+                                gpointer value G_GNUC_UNUSED,
+                                gpointer user_data) {
+  const struct _openslide_cache_key *c_key = key;
+  const uint64_t *binding_id = user_data;
+
+  return c_key->binding_id == *binding_id;
+}
+
+// give back the memory of a slide's entries, for other slides sharing
+// the cache
+static void purge_binding(struct _openslide_cache *cache, uint64_t binding_id) {
+  for (int i = 0; i < CACHE_STRIPES; i++) {
+    struct cache_stripe *stripe = &cache->stripes[i];
+
+    g_mutex_lock(stripe->mutex);
+    g_hash_table_foreach_remove(stripe->hashtable, key_has_binding,
+                                &binding_id);
+    g_mutex_unlock(stripe->mutex);
+  }
+}
+
+// binding
+
+struct _openslide_cache_binding *_openslide_cache_binding_create(void) {
+  struct _openslide_cache_binding *cb =
+    g_slice_new0(struct _openslide_cache_binding);
+
+  g_mutex_lock(&g_binding_id_lock);
+  cb->id = g_next_binding_id++;
+  g_mutex_unlock(&g_binding_id_lock);
+
+  cb->mutex = g_mutex_new();
+  // slides share the memory budget's cache while there is one
+  cb->cache = _openslide_budget_get_tile_cache();
+  if (cb->cache == NULL) {
+    cb->cache = _openslide_cache_create(_OPENSLIDE_USEFUL_CACHE_SIZE);
+  }
+
+  return cb;
+}
+
+// readers take the cache without a lock, so a replaced cache stays
+// referenced until the binding goes away; its entries for this slide are
+// dropped right away
+void _openslide_cache_binding_set(struct _openslide_cache_binding *cb,
+                                  struct _openslide_cache *cache) {
+  g_mutex_lock(cb->mutex);
+  struct _openslide_cache *old = g_atomic_pointer_get(&cb->cache);
+  if (old != cache) {
+    g_atomic_pointer_set(&cb->cache, _openslide_cache_ref(cache));
+    purge_binding(old, cb->id);
+    cb->retired = g_slist_prepend(cb->retired, old);
+  }
+  g_mutex_unlock(cb->mutex);
+}
+
+// streaming slides insert at the end of probation and don't promote on
+// hits, so their entries are the first to go
+void _openslide_cache_binding_set_streaming(struct _openslide_cache_binding *cb,
+                                            bool streaming) {
+  g_atomic_int_set(&cb->streaming, streaming);
+}
+
+void _openslide_cache_binding_destroy(struct _openslide_cache_binding *cb) {
+  struct _openslide_cache *cache = g_atomic_pointer_get(&cb->cache);
+  purge_binding(cache, cb->id);
+  _openslide_cache_release(cache);
+
+  for (GSList *l = cb->retired; l; l = l->next) {
+    // a racing put may have landed after the purge
+    purge_binding(l->data, cb->id);
+    _openslide_cache_release(l->data);
+  }
+  g_slist_free(cb->retired);
+
+  g_mutex_free(cb->mutex);
+  g_slice_free(struct _openslide_cache_binding, cb);
+}
+
+
+uint64_t _openslide_cache_get_capacity(struct _openslide_cache *cache) {
+  return get_size(&cache->capacity);
+}
 
-int _openslide_cache_get_capacity(struct _openslide_cache *cache) {
-  g_mutex_lock(cache->mutex);
-  int capacity = cache->capacity;
-  g_mutex_unlock(cache->mutex);
-  return capacity;
+uint64_t _openslide_cache_binding_get_capacity(struct _openslide_cache_binding *cb) {
+  return _openslide_cache_get_capacity(g_atomic_pointer_get(&cb->cache));
 }
 
 void _openslide_cache_set_capacity(struct _openslide_cache *cache,
-				   int capacity_in_bytes) {
-  g_assert(capacity_in_bytes >= 0);
+				   uint64_t capacity_in_bytes) {
+  g_atomic_pointer_set(&cache->capacity,
+                       (gpointer) (gsize) MIN(capacity_in_bytes, G_MAXSIZE));
+  possibly_evict(cache, NULL, 0);
+}
+
+void _openslide_cache_trim_all(double fraction) {
+  fraction = CLAMP(fraction, 0, 1);
+
+  // take a reference on each cache not already on its way out
+  GSList *caches = NULL;
+  g_mutex_lock(&g_caches_lock);
+  for (GSList *l = g_caches; l; l = l->next) {
+    struct _openslide_cache *cache = l->data;
+    gint refs;
+    do {
+      refs = g_atomic_int_get(&cache->refcount);
+    } while (refs && !g_atomic_int_compare_and_exchange(&cache->refcount,
+                                                        refs, refs + 1));
+    if (refs) {
+      caches = g_slist_prepend(caches, cache);
+    }
+  }
+  g_mutex_unlock(&g_caches_lock);
+
+  for (GSList *l = caches; l; l = l->next) {
+    struct _openslide_cache *cache = l->data;
+    uint64_t target = get_size(&cache->total_size) * (1 - fraction);
+    uint64_t capacity = get_size(&cache->capacity);
+    uint64_t room = capacity > target ? capacity - target : 0;
+    // evict as if an entry filling the rest were coming
+    possibly_evict(cache, NULL, room);
+    _openslide_cache_release(cache);
+  }
+  g_slist_free(caches);
+}
+
+void _openslide_cache_get_stats(struct _openslide_cache *cache,
+                                struct _openslide_cache_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < CACHE_STRIPES; i++) {
+    struct cache_stripe *stripe = &cache->stripes[i];
+
+    g_mutex_lock(stripe->mutex);
+    stats->hits += stripe->hits;
+    stats->misses += stripe->misses;
+    stats->evictions += stripe->evictions;
+    g_mutex_unlock(stripe->mutex);
+  }
+  stats->capacity = get_size(&cache->capacity);
+  stats->size = get_size(&cache->total_size);
+  stats->protected_size = get_size(&cache->protected_size);
+}
+
+static gpointer init_passive(gpointer data G_GNUC_UNUSED) {
+  passive_key = g_private_new(NULL);
+  return NULL;
+}
+
+static bool is_passive(void) {
+  g_once(&passive_once, init_passive, NULL);
+  return g_private_get(passive_key) != NULL;
+}
 
-  g_mutex_lock(cache->mutex);
-  cache->capacity = capacity_in_bytes;
-  possibly_evict(cache, 0);
-  g_mutex_unlock(cache->mutex);
+void _openslide_cache_set_passive(bool passive) {
+  g_once(&passive_once, init_passive, NULL);
+  g_private_set(passive_key, passive ? GINT_TO_POINTER(1) : NULL);
 }
 
 // put and get
 
 // the cache retains one reference, and the caller gets another one.  the
 // entry must be unreffed when the caller is done with it.
-void _openslide_cache_put(struct _openslide_cache *cache,
+void _openslide_cache_put(struct _openslide_cache_binding *cb,
 			  void *plane,
 			  int64_t x,
 			  int64_t y,
 			  void *data,
 			  int size_in_bytes,
 			  struct _openslide_cache_entry **_entry) {
+  struct _openslide_cache *cache = g_atomic_pointer_get(&cb->cache);
+  bool streaming = g_atomic_int_get(&cb->streaming);
+
+  g_assert(size_in_bytes >= 0);
+
   // always create cache entry for caller's reference
   struct _openslide_cache_entry *entry =
       g_slice_new(struct _openslide_cache_entry);
@@ -207,78 +554,95 @@ void _openslide_cache_put(struct _openslide_cache *cache,
   entry->size = size_in_bytes;
   *_entry = entry;
 
-  // lock
-  g_mutex_lock(cache->mutex);
-
   // don't try to put anything in the cache that cannot possibly fit
-  if (size_in_bytes > cache->capacity) {
+  if ((uint64_t) size_in_bytes > _openslide_cache_get_capacity(cache)) {
     //g_debug("refused %p", entry);
-    g_mutex_unlock(cache->mutex);
     _openslide_performance_warn_once(&cache->warned_overlarge_entry,
                                      "Rejecting overlarge cache entry of "
                                      "size %d bytes", size_in_bytes);
     return;
   }
 
-  possibly_evict(cache, size_in_bytes); // already checks for size >= 0
-
   // create key
   struct _openslide_cache_key *key = g_slice_new(struct _openslide_cache_key);
+  key->binding_id = cb->id;
   key->plane = plane;
   key->x = x;
   key->y = y;
+  struct cache_stripe *stripe = get_stripe(cache, key);
+
+  // lock
+  lock_stripe(stripe);
+
+  possibly_evict(cache, stripe, size_in_bytes);
 
   // create value
   struct _openslide_cache_value *value =
     g_slice_new(struct _openslide_cache_value);
   value->key = key;
-  value->cache = cache;
+  value->stripe = stripe;
+  value->protected = false;
   value->entry = entry;
 
-  // insert at head of queue
-  g_queue_push_head(cache->list, value);
-  value->link = g_queue_peek_head_link(cache->list);
+  // insert into probation, at the end if streaming
+  if (streaming) {
+    g_queue_push_tail(stripe->probation, value);
+    value->link = g_queue_peek_tail_link(stripe->probation);
+  } else {
+    g_queue_push_head(stripe->probation, value);
+    value->link = g_queue_peek_head_link(stripe->probation);
+  }
 
   // insert into hash table
-  g_hash_table_replace(cache->hashtable, key, value);
+  g_hash_table_replace(stripe->hashtable, key, value);
 
   // increase size
-  cache->total_size += size_in_bytes;
+  stripe->size += size_in_bytes;
+  add_size(&cache->total_size, size_in_bytes);
 
   // another ref for the cache
   g_atomic_int_inc(&entry->refcount);
 
   // unlock
-  g_mutex_unlock(cache->mutex);
+  g_mutex_unlock(stripe->mutex);
+  _openslide_stats_add(OPENSLIDE_STAT_CACHE_INSERT_BYTES, size_in_bytes);
+  _openslide_budget_tick();
 
   //g_debug("insert %p", entry);
 }
 
 // entry must be unreffed when the caller is done with the data
-void *_openslide_cache_get(struct _openslide_cache *cache,
+void *_openslide_cache_get(struct _openslide_cache_binding *cb,
 			   void *plane,
 			   int64_t x,
 			   int64_t y,
 			   struct _openslide_cache_entry **_entry) {
-  // lock
-  g_mutex_lock(cache->mutex);
+  struct _openslide_cache *cache = g_atomic_pointer_get(&cb->cache);
 
   // create key
-  struct _openslide_cache_key key = { .plane = plane, .x = x, .y = y };
+  struct _openslide_cache_key key = { .binding_id = cb->id, .plane = plane,
+                                      .x = x, .y = y };
+  struct cache_stripe *stripe = get_stripe(cache, &key);
+
+  // lock
+  lock_stripe(stripe);
 
   // lookup key, maybe return NULL
-  struct _openslide_cache_value *value = g_hash_table_lookup(cache->hashtable,
+  struct _openslide_cache_value *value = g_hash_table_lookup(stripe->hashtable,
 							     &key);
   if (value == NULL) {
-    g_mutex_unlock(cache->mutex);
+    stripe->misses++;
+    g_mutex_unlock(stripe->mutex);
+    _openslide_stats_add(OPENSLIDE_STAT_CACHE_MISSES, 1);
     *_entry = NULL;
     return NULL;
   }
+  stripe->hits++;
 
-  // if found, move to front of list
-  GList *link = value->link;
-  g_queue_unlink(cache->list, link);
-  g_queue_push_head_link(cache->list, link);
+  // if found, move to front of the protected list, unless streaming
+  if (!g_atomic_int_get(&cb->streaming) && !is_passive()) {
+    promote(stripe, value);
+  }
 
   // acquire entry reference for the caller
   struct _openslide_cache_entry *entry = value->entry;
@@ -287,20 +651,38 @@ void *_openslide_cache_get(struct _openslide_cache *cache,
   //g_debug("cache hit! %p %p %"PRId64" %"PRId64, (void *) entry, (void *) plane, x, y);
 
   // unlock
-  g_mutex_unlock(cache->mutex);
+  g_mutex_unlock(stripe->mutex);
+  _openslide_stats_add(OPENSLIDE_STAT_CACHE_HITS, 1);
 
   // return data
   *_entry = entry;
   return entry->data;
 }
 
+bool _openslide_cache_contains(struct _openslide_cache_binding *cb,
+			       void *plane,
+			       int64_t x,
+			       int64_t y) {
+  struct _openslide_cache *cache = g_atomic_pointer_get(&cb->cache);
+
+  struct _openslide_cache_key key = { .binding_id = cb->id, .plane = plane,
+                                      .x = x, .y = y };
+  struct cache_stripe *stripe = get_stripe(cache, &key);
+
+  lock_stripe(stripe);
+  bool found = g_hash_table_lookup(stripe->hashtable, &key) != NULL;
+  g_mutex_unlock(stripe->mutex);
+
+  return found;
+}
+
 // value unref
 void _openslide_cache_entry_unref(struct _openslide_cache_entry *entry) {
   //g_debug("unref %p, refs %d", entry, g_atomic_int_get(&entry->refcount));
 
   if (g_atomic_int_dec_and_test(&entry->refcount)) {
-    // free the data
-    g_slice_free1(entry->size, entry->data);
+    // recycle the data
+    _openslide_buffer_free(entry->size, entry->data);
 
     // free the entry
     g_slice_free(struct _openslide_cache_entry, entry);
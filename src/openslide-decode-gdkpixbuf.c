@@ -28,6 +28,7 @@
 #include "openslide-decode-gdkpixbuf.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <glib.h>
 #include <glib-object.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
@@ -83,31 +84,23 @@ static void area_prepared(GdkPixbufLoader *loader, void *data) {
   state->pixbuf = pixbuf;
 }
 
-bool _openslide_gdkpixbuf_read(const char *format,
-                               const char *filename,
-                               int64_t offset,
-                               int64_t length,
-                               uint32_t *dest,
-                               int32_t w, int32_t h,
-                               GError **err) {
+// feed the loader from f, read from filename, or from data if f is NULL
+static bool load(const char *format,
+                 URLIO_FILE *f,
+                 const char *filename,
+                 const uint8_t *data,
+                 int64_t length,
+                 uint32_t *dest,
+                 int32_t w, int32_t h,
+                 GError **err) {
   GdkPixbufLoader *loader = NULL;
-  uint8_t *buf = g_slice_alloc(BUFSIZE);
+  uint8_t *buf = f ? g_slice_alloc(BUFSIZE) : NULL;
   bool success = false;
   struct load_state state = {
     .w = w,
     .h = h,
   };
 
-  // open and seek
-  URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
-  if (!f) {
-    goto DONE;
-  }
-  if (urlio_fseek(f, offset, SEEK_SET)) {
-    _openslide_io_error(err, "Couldn't urlio_fseek %s", filename);
-    goto DONE;
-  }
-
   // create loader
   loader = gdk_pixbuf_loader_new_with_type(format, err);
   if (!loader) {
@@ -117,13 +110,22 @@ bool _openslide_gdkpixbuf_read(const char *format,
 
   // read data
   while (length) {
-    size_t count = urlio_fread(buf, 1, MIN(length, BUFSIZE), f);
-    if (!count) {
-      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                  "Short read loading pixbuf from %s", filename);
-      goto DONE;
+    size_t count;
+    const uint8_t *chunk;
+    if (f) {
+      count = urlio_fread(buf, 1, MIN(length, BUFSIZE), f);
+      if (!count) {
+        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                    "Short read loading pixbuf from %s", filename);
+        goto DONE;
+      }
+      chunk = buf;
+    } else {
+      // all of it at once
+      count = length;
+      chunk = data;
     }
-    if (!gdk_pixbuf_loader_write(loader, buf, count, err)) {
+    if (!gdk_pixbuf_loader_write(loader, chunk, count, err)) {
       g_prefix_error(err, "gdk-pixbuf error: ");
       goto DONE;
     }
@@ -163,10 +165,9 @@ DONE:
     gdk_pixbuf_loader_close(loader, NULL);
     g_object_unref(loader);
   }
-  if (f) {
-    urlio_fclose(f);
+  if (buf) {
+    g_slice_free1(BUFSIZE, buf);
   }
-  g_slice_free1(BUFSIZE, buf);
 
   // now that the loader is closed, we know state.err won't be set
   // behind our back
@@ -179,3 +180,91 @@ DONE:
   }
   return success;
 }
+
+bool _openslide_gdkpixbuf_read(const char *format,
+                               const char *filename,
+                               int64_t offset,
+                               int64_t length,
+                               uint32_t *dest,
+                               int32_t w, int32_t h,
+                               GError **err) {
+  // open and seek
+  URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
+  if (!f) {
+    return false;
+  }
+  if (urlio_fseek(f, offset, SEEK_SET)) {
+    _openslide_io_error(err, "Couldn't urlio_fseek %s", filename);
+    urlio_fclose(f);
+    return false;
+  }
+  bool success = load(format, f, filename, NULL, length, dest, w, h, err);
+  urlio_fclose(f);
+  return success;
+}
+
+static uint32_t read_le32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint16_t read_le16(const uint8_t *p) {
+  return p[0] | p[1] << 8;
+}
+
+// Uncompressed 24-bit BMP, which is what MIRAX writes, is decoded here
+// straight into dest in one pass; false, with nothing written, for any
+// other kind, which is left to gdk-pixbuf.
+static bool decode_bmp_rgb(const uint8_t *data, int64_t length,
+                           uint32_t *dest, int32_t w, int32_t h) {
+  if (length < 54 || data[0] != 'B' || data[1] != 'M') {
+    return false;
+  }
+  uint32_t pixel_offset = read_le32(data + 10);
+  uint32_t header_size = read_le32(data + 14);
+  int32_t width = read_le32(data + 18);
+  int32_t height = read_le32(data + 22);
+  if (header_size < 40 ||
+      read_le16(data + 26) != 1 ||   // planes
+      read_le16(data + 28) != 24 ||  // bits per pixel
+      read_le32(data + 30) != 0) {   // BI_RGB
+    return false;
+  }
+  // rows go bottom up, unless the height is negative
+  bool top_down = height < 0;
+  if (top_down) {
+    height = -height;
+  }
+  if (width != w || height != h) {
+    return false;
+  }
+  int64_t stride = ((int64_t) w * 3 + 3) & ~(int64_t) 3;
+  if (pixel_offset > length || (length - pixel_offset) / stride < h) {
+    return false;
+  }
+
+  for (int32_t y = 0; y < h; y++) {
+    const uint8_t *src = data + pixel_offset +
+                         (top_down ? y : h - 1 - y) * stride;
+    uint32_t *row = dest + (int64_t) y * w;
+    for (int32_t x = 0; x < w; x++) {
+      row[x] = 0xFF000000 |    // A
+               src[2] << 16 |  // R
+               src[1] << 8 |   // G
+               src[0];         // B
+      src += 3;
+    }
+  }
+  return true;
+}
+
+bool _openslide_gdkpixbuf_decode_buffer(const char *format,
+                                        const void *buf,
+                                        int64_t length,
+                                        uint32_t *dest,
+                                        int32_t w, int32_t h,
+                                        GError **err) {
+  if (!strcmp(format, "bmp") && decode_bmp_rgb(buf, length, dest, w, h)) {
+    return true;
+  }
+  return load(format, NULL, NULL, buf, length, dest, w, h, err);
+}
@@ -35,4 +35,12 @@ bool _openslide_gdkpixbuf_read(const char *format,
                                int32_t w, int32_t h,
                                GError **err);
 
+// length bytes already read
+bool _openslide_gdkpixbuf_decode_buffer(const char *format,
+                                        const void *buf,
+                                        int64_t length,
+                                        uint32_t *dest,
+                                        int32_t w, int32_t h,
+                                        GError **err);
+
 #endif
@@ -27,10 +27,22 @@
 #include "openslide-private.h"
 #include "openslide-decode-jp2k.h"
 
+#include <stdlib.h>
 #include <openjpeg.h>
 
+// codeblock decoding threads per tile; read_region already decodes
+// tiles in parallel, so one thread per tile is the default
+#define JP2K_THREADS_ENV_VAR "OPENSLIDE_JP2K_THREADS"
+#define JP2K_THREADS_MAX 64
+
+// opj_codec_set_threads() first appeared in OpenJPEG 2.2
+#if defined(HAVE_OPENJPEG2) && defined(OPJ_VERSION_MAJOR) && \
+    (OPJ_VERSION_MAJOR > 2 || (OPJ_VERSION_MAJOR == 2 && OPJ_VERSION_MINOR >= 2))
+#define HAVE_OPJ_CODEC_SET_THREADS 1
+#endif
+
 struct buffer_state {
-  uint8_t *data;
+  const uint8_t *data;
   int32_t offset;
   int32_t length;
 };
@@ -72,30 +84,12 @@ static void unpack_argb(enum _openslide_jp2k_colorspace space,
       c0_sub_y == 1 && c1_sub_y == 1 && c2_sub_y == 1) {
     // Aperio 33003
     for (int32_t y = 0; y < h; y++) {
-      int32_t c0_row_base = y * comps[0].w;
-      int32_t c1_row_base = y * comps[1].w;
-      int32_t c2_row_base = y * comps[2].w;
-      int32_t x;
-      for (x = 0; x < w - 1; x += 2) {
-        uint8_t c0 = comps[0].data[c0_row_base + x];
-        uint8_t c1 = comps[1].data[c1_row_base + (x / 2)];
-        uint8_t c2 = comps[2].data[c2_row_base + (x / 2)];
-        int16_t R_chroma = _openslide_R_Cr[c2];
-        int16_t G_chroma = (_openslide_G_Cb[c1] + _openslide_G_Cr[c2]) >> 16;
-        int16_t B_chroma = _openslide_B_Cb[c1];
-        write_pixel_ycbcr(dest++, c0, R_chroma, G_chroma, B_chroma);
-        c0 = comps[0].data[c0_row_base + x + 1];
-        write_pixel_ycbcr(dest++, c0, R_chroma, G_chroma, B_chroma);
-      }
-      if (x < w) {
-        uint8_t c0 = comps[0].data[c0_row_base + x];
-        uint8_t c1 = comps[1].data[c1_row_base + (x / 2)];
-        uint8_t c2 = comps[2].data[c2_row_base + (x / 2)];
-        int16_t R_chroma = _openslide_R_Cr[c2];
-        int16_t G_chroma = (_openslide_G_Cb[c1] + _openslide_G_Cr[c2]) >> 16;
-        int16_t B_chroma = _openslide_B_Cb[c1];
-        write_pixel_ycbcr(dest++, c0, R_chroma, G_chroma, B_chroma);
-      }
+      _openslide_pixel_ycbcr422_to_argb(dest,
+                                        comps[0].data + y * comps[0].w,
+                                        comps[1].data + y * comps[1].w,
+                                        comps[2].data + y * comps[2].w,
+                                        w);
+      dest += w;
     }
 
   } else if (space == OPENSLIDE_JP2K_YCBCR) {
@@ -128,15 +122,12 @@ static void unpack_argb(enum _openslide_jp2k_colorspace space,
              c0_sub_y == 1 && c1_sub_y == 1 && c2_sub_y == 1) {
     // Aperio 33005
     for (int32_t y = 0; y < h; y++) {
-      int32_t c0_row_base = y * comps[0].w;
-      int32_t c1_row_base = y * comps[1].w;
-      int32_t c2_row_base = y * comps[2].w;
-      for (int32_t x = 0; x < w; x++) {
-        uint8_t c0 = comps[0].data[c0_row_base + x];
-        uint8_t c1 = comps[1].data[c1_row_base + x];
-        uint8_t c2 = comps[2].data[c2_row_base + x];
-        write_pixel_rgb(dest++, c0, c1, c2);
-      }
+      _openslide_pixel_rgb_to_argb(dest,
+                                   comps[0].data + y * comps[0].w,
+                                   comps[1].data + y * comps[1].w,
+                                   comps[2].data + y * comps[2].w,
+                                   w);
+      dest += w;
     }
 
   } else if (space == OPENSLIDE_JP2K_RGB) {
@@ -181,6 +172,22 @@ static void error_callback(const char *msg, void *data) {
   }
 }
 
+#ifdef HAVE_OPJ_CODEC_SET_THREADS
+static gpointer read_threads(gpointer data G_GNUC_UNUSED) {
+  int threads = 1;
+  const char *env = g_getenv(JP2K_THREADS_ENV_VAR);
+  if (env && *env) {
+    threads = CLAMP(atoi(env), 1, JP2K_THREADS_MAX);
+  }
+  return GINT_TO_POINTER(threads);
+}
+
+static int get_threads(void) {
+  static GOnce once = G_ONCE_INIT;
+  return GPOINTER_TO_INT(g_once(&once, read_threads, NULL));
+}
+#endif
+
 #ifdef HAVE_OPENJPEG2
 
 static OPJ_SIZE_T read_callback(void *buf, OPJ_SIZE_T count, void *data) {
@@ -216,11 +223,12 @@ static OPJ_BOOL seek_callback(OPJ_OFF_T offset, void *data) {
   return OPJ_TRUE;
 }
 
-bool _openslide_jp2k_decode_buffer(uint32_t *dest,
-                                   int32_t w, int32_t h,
-                                   void *data, int32_t datalen,
-                                   enum _openslide_jp2k_colorspace space,
-                                   GError **err) {
+static bool decode_buffer_reduced(uint32_t *dest,
+                                  int32_t w, int32_t h,
+                                  const void *data, int32_t datalen,
+                                  enum _openslide_jp2k_colorspace space,
+                                  int reduce,
+                                  GError **err) {
   opj_image_t *image = NULL;
   GError *tmp_err = NULL;
   bool success = false;
@@ -246,7 +254,15 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   opj_codec_t *codec = opj_create_decompress(OPJ_CODEC_J2K);
   opj_dparameters_t parameters;
   opj_set_default_decoder_parameters(&parameters);
+  parameters.cp_reduce = reduce;
   opj_setup_decoder(codec, &parameters);
+#ifdef HAVE_OPJ_CODEC_SET_THREADS
+  int threads = get_threads();
+  if (threads > 1) {
+    // fails harmlessly if OpenJPEG was built without threads
+    opj_codec_set_threads(codec, threads);
+  }
+#endif
 
   // enable error handlers
   // note: don't use info_handler, it outputs lots of junk
@@ -292,8 +308,20 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   }
   g_clear_error(&tmp_err);  // clear any spurious message
 
+  // the decoded size at this resolution
+  int32_t rw = (w + (1 << reduce) - 1) >> reduce;
+  int32_t rh = (h + (1 << reduce) - 1) >> reduce;
+  if (image->comps[0].w != (OPJ_UINT32) rw ||
+      image->comps[0].h != (OPJ_UINT32) rh) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Dimensional mismatch decoding JP2K at reduction %d, "
+                "expected %dx%d, got %ux%u",
+                reduce, rw, rh, image->comps[0].w, image->comps[0].h);
+    goto DONE;
+  }
+
   // copy pixels
-  unpack_argb(space, image->comps, dest, w, h);
+  unpack_argb(space, image->comps, dest, rw, rh);
 
   success = true;
 
@@ -306,11 +334,12 @@ DONE:
 
 #else  // HAVE_OPENJPEG2
 
-bool _openslide_jp2k_decode_buffer(uint32_t *dest,
-                                   int32_t w, int32_t h,
-                                   void *data, int32_t datalen,
-                                   enum _openslide_jp2k_colorspace space,
-                                   GError **err) {
+static bool decode_buffer_reduced(uint32_t *dest,
+                                  int32_t w, int32_t h,
+                                  const void *data, int32_t datalen,
+                                  enum _openslide_jp2k_colorspace space,
+                                  int reduce,
+                                  GError **err) {
   GError *tmp_err = NULL;
   bool success = false;
 
@@ -331,8 +360,10 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
   opj_dparameters_t parameters;
   dinfo = opj_create_decompress(CODEC_J2K);
   opj_set_default_decoder_parameters(&parameters);
+  parameters.cp_reduce = reduce;
   opj_setup_decoder(dinfo, &parameters);
-  stream = opj_cio_open((opj_common_ptr) dinfo, data, datalen);
+  stream = opj_cio_open((opj_common_ptr) dinfo, (unsigned char *) data,
+                        datalen);
   opj_set_event_mgr((opj_common_ptr) dinfo, &event_callbacks, &tmp_err);
 
   // decode
@@ -381,7 +412,18 @@ bool _openslide_jp2k_decode_buffer(uint32_t *dest,
 
   // TODO more checks?
 
-  unpack_argb(space, image->comps, dest, w, h);
+  // the decoded size at this resolution
+  int32_t rw = (w + (1 << reduce) - 1) >> reduce;
+  int32_t rh = (h + (1 << reduce) - 1) >> reduce;
+  if (image->comps[0].w != rw || image->comps[0].h != rh) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Dimensional mismatch decoding JP2K at reduction %d, "
+                "expected %dx%d, got %dx%d",
+                reduce, rw, rh, image->comps[0].w, image->comps[0].h);
+    goto DONE;
+  }
+
+  unpack_argb(space, image->comps, dest, rw, rh);
 
   success = true;
 
@@ -399,3 +441,28 @@ DONE:
 }
 
 #endif // HAVE_OPENJPEG2
+
+bool _openslide_jp2k_decode_buffer_reduced(uint32_t *dest,
+                                           int32_t w, int32_t h,
+                                           const void *data, int32_t datalen,
+                                           enum _openslide_jp2k_colorspace space,
+                                           int reduce,
+                                           GError **err) {
+  _openslide_trace_begin("decode jp2k");
+  int64_t start = g_get_monotonic_time();
+  bool success = decode_buffer_reduced(dest, w, h, data, datalen,
+                                       space, reduce, err);
+  _openslide_stats_add(OPENSLIDE_STAT_DECODED_JP2K, 1);
+  _openslide_stats_add_time(OPENSLIDE_STAT_TIMER_DECODE, start);
+  _openslide_trace_end();
+  return success;
+}
+
+bool _openslide_jp2k_decode_buffer(uint32_t *dest,
+                                   int32_t w, int32_t h,
+                                   const void *data, int32_t datalen,
+                                   enum _openslide_jp2k_colorspace space,
+                                   GError **err) {
+  return _openslide_jp2k_decode_buffer_reduced(dest, w, h, data, datalen,
+                                               space, 0, err);
+}
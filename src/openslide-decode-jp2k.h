@@ -34,8 +34,17 @@ enum _openslide_jp2k_colorspace {
 
 bool _openslide_jp2k_decode_buffer(uint32_t *dest,
                                    int32_t w, int32_t h,
-                                   void *data, int32_t datalen,
+                                   const void *data, int32_t datalen,
                                    enum _openslide_jp2k_colorspace space,
                                    GError **err);
 
+// decode at 1/2^reduce of w x h, the wavelet resolution that many levels
+// below full; dest holds ceil(w / 2^reduce) x ceil(h / 2^reduce) pixels
+bool _openslide_jp2k_decode_buffer_reduced(uint32_t *dest,
+                                           int32_t w, int32_t h,
+                                           const void *data, int32_t datalen,
+                                           enum _openslide_jp2k_colorspace space,
+                                           int reduce,
+                                           GError **err);
+
 #endif
@@ -31,6 +31,7 @@
 #include <setjmp.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <jpeglib.h>
 #include <jerror.h>
 
@@ -62,15 +63,32 @@ struct openslide_jpeg_error_mgr {
   struct jpeg_error_mgr base;
   jmp_buf *env;
   GError *err;
+  bool in_span;  // the longjmp skips the end of a trace span
 };
 
 struct _openslide_jpeg_decompress {
   struct jpeg_decompress_struct cinfo;
   struct openslide_jpeg_error_mgr jerr;
+  bool created;
   JSAMPROW rows[MAX_SAMP_FACTOR];
+  JSAMPROW row_buffers[MAX_SAMP_FACTOR];
   gsize allocated_row_size;
+
+  // copy of the last loaded abbreviated tables, by tables_id
+  uint64_t tables_id;
+  uint32_t quant_tables;  // bitmask of present tables
+  uint32_t dc_huff_tables;
+  uint32_t ac_huff_tables;
+  JQUANT_TBL quant[NUM_QUANT_TBLS];
+  JHUFF_TBL dc_huff[NUM_HUFF_TBLS];
+  JHUFF_TBL ac_huff[NUM_HUFF_TBLS];
 };
 
+// each thread keeps one idle decompressor, so that steady-state decoding
+// doesn't create a libjpeg object, allocate its pools or reparse tables
+static GPrivate *thread_decompressor;
+static GOnce thread_decompressor_once = G_ONCE_INIT;
+
 struct associated_image {
   struct _openslide_associated_image base;
   char *filename;
@@ -84,6 +102,11 @@ static void my_error_exit(j_common_ptr cinfo) {
 
   (jerr->base.output_message) (cinfo);
 
+  if (jerr->in_span) {
+    jerr->in_span = false;
+    _openslide_trace_end();
+  }
+
   //  g_debug("JUMP");
   longjmp(*(jerr->env), 1);
 }
@@ -113,6 +136,7 @@ static struct jpeg_error_mgr *error_handler_init(struct openslide_jpeg_error_mgr
   jerr->base.output_message = my_output_message;
   jerr->base.emit_message = my_emit_message;
   jerr->env = env;
+  jerr->in_span = false;
   return (struct jpeg_error_mgr *) jerr;
 }
 
@@ -154,10 +178,42 @@ static void *detect_jcs_alpha_extensions(void *arg G_GNUC_UNUSED) {
   return GINT_TO_POINTER(alpha_extensions);
 }
 
+static void decompress_free(struct _openslide_jpeg_decompress *dc) {
+  if (dc->created) {
+    jpeg_destroy_decompress(&dc->cinfo);
+  }
+  if (dc->allocated_row_size) {
+    for (uint32_t row = 0; row < G_N_ELEMENTS(dc->row_buffers); row++) {
+      if (dc->row_buffers[row]) {
+        g_slice_free1(dc->allocated_row_size, dc->row_buffers[row]);
+      }
+    }
+  }
+  g_slice_free(struct _openslide_jpeg_decompress, dc);
+}
+
+static void thread_decompressor_destroy(gpointer data) {
+  decompress_free(data);
+}
+
+static gpointer init_thread_decompressor(gpointer data G_GNUC_UNUSED) {
+  thread_decompressor = g_private_new(thread_decompressor_destroy);
+  return NULL;
+}
+
 // the caller must assign the struct _openslide_jpeg_decompress * before
 // calling setjmp() so that nothing will be clobbered by a longjmp()
 struct _openslide_jpeg_decompress *_openslide_jpeg_decompress_create(struct jpeg_decompress_struct **out_cinfo) {
-  struct _openslide_jpeg_decompress *dc = g_slice_new0(struct _openslide_jpeg_decompress);
+  g_once(&thread_decompressor_once, init_thread_decompressor, NULL);
+
+  // take this thread's idle decompressor, if any; a nested decode gets
+  // a new one
+  struct _openslide_jpeg_decompress *dc = g_private_get(thread_decompressor);
+  if (dc) {
+    g_private_set(thread_decompressor, NULL);
+  } else {
+    dc = g_slice_new0(struct _openslide_jpeg_decompress);
+  }
   *out_cinfo = &dc->cinfo;
   return dc;
 }
@@ -166,15 +222,109 @@ struct _openslide_jpeg_decompress *_openslide_jpeg_decompress_create(struct jpeg
 void _openslide_jpeg_decompress_init(struct _openslide_jpeg_decompress *dc,
                                      jmp_buf *env) {
   dc->cinfo.err = error_handler_init(&dc->jerr, env);
-  jpeg_create_decompress(&dc->cinfo);
+  if (!dc->created) {
+    jpeg_create_decompress(&dc->cinfo);
+    dc->created = true;
+  }
 }
 
-bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
-                                    // uint8_t * if grayscale, else uint32_t *
-                                    void *_dest,
-                                    bool grayscale,
-                                    int32_t w, int32_t h,
-                                    GError **err) {
+static void save_tables(struct _openslide_jpeg_decompress *dc,
+                        uint64_t tables_id) {
+  struct jpeg_decompress_struct *cinfo = &dc->cinfo;
+
+  dc->quant_tables = 0;
+  dc->dc_huff_tables = 0;
+  dc->ac_huff_tables = 0;
+  for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+    if (cinfo->quant_tbl_ptrs[i]) {
+      dc->quant[i] = *cinfo->quant_tbl_ptrs[i];
+      dc->quant_tables |= 1 << i;
+    }
+  }
+  for (int i = 0; i < NUM_HUFF_TBLS; i++) {
+    if (cinfo->dc_huff_tbl_ptrs[i]) {
+      dc->dc_huff[i] = *cinfo->dc_huff_tbl_ptrs[i];
+      dc->dc_huff_tables |= 1 << i;
+    }
+    if (cinfo->ac_huff_tbl_ptrs[i]) {
+      dc->ac_huff[i] = *cinfo->ac_huff_tbl_ptrs[i];
+      dc->ac_huff_tables |= 1 << i;
+    }
+  }
+  dc->tables_id = tables_id;
+}
+
+// the tables survive jpeg_abort_decompress(), but a previous image may
+// have redefined them, so copy them back in
+static void restore_tables(struct _openslide_jpeg_decompress *dc) {
+  struct jpeg_decompress_struct *cinfo = &dc->cinfo;
+  j_common_ptr common = (j_common_ptr) cinfo;
+
+  for (int i = 0; i < NUM_QUANT_TBLS; i++) {
+    if (dc->quant_tables & (1 << i)) {
+      if (cinfo->quant_tbl_ptrs[i] == NULL) {
+        cinfo->quant_tbl_ptrs[i] = jpeg_alloc_quant_table(common);
+      }
+      *cinfo->quant_tbl_ptrs[i] = dc->quant[i];
+    }
+  }
+  for (int i = 0; i < NUM_HUFF_TBLS; i++) {
+    if (dc->dc_huff_tables & (1 << i)) {
+      if (cinfo->dc_huff_tbl_ptrs[i] == NULL) {
+        cinfo->dc_huff_tbl_ptrs[i] = jpeg_alloc_huff_table(common);
+      }
+      *cinfo->dc_huff_tbl_ptrs[i] = dc->dc_huff[i];
+    }
+    if (dc->ac_huff_tables & (1 << i)) {
+      if (cinfo->ac_huff_tbl_ptrs[i] == NULL) {
+        cinfo->ac_huff_tbl_ptrs[i] = jpeg_alloc_huff_table(common);
+      }
+      *cinfo->ac_huff_tbl_ptrs[i] = dc->ac_huff[i];
+    }
+  }
+}
+
+// after _init(), load abbreviated-format tables shared by many images.
+// tables_id identifies the tables; a nonzero id already loaded into this
+// decompressor skips parsing them again.
+bool _openslide_jpeg_decompress_load_tables(struct _openslide_jpeg_decompress *dc,
+                                            const void *tables,
+                                            uint32_t tables_len,
+                                            uint64_t tables_id,
+                                            GError **err) {
+  if (tables_id && dc->tables_id == tables_id) {
+    restore_tables(dc);
+    return true;
+  }
+
+  dc->tables_id = 0;
+  _openslide_jpeg_mem_src(&dc->cinfo, tables, tables_len);
+  if (jpeg_read_header(&dc->cinfo, false) != JPEG_HEADER_TABLES_ONLY) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Couldn't load JPEG tables");
+    return false;
+  }
+  if (tables_id) {
+    save_tables(dc, tables_id);
+  }
+  return true;
+}
+
+uint64_t _openslide_jpeg_tables_id_new(void) {
+  static GMutex lock;
+  static uint64_t next_id = 1;
+
+  g_mutex_lock(&lock);
+  uint64_t id = next_id++;
+  g_mutex_unlock(&lock);
+  return id;
+}
+
+static bool decompress_run(struct _openslide_jpeg_decompress *dc,
+                           void *_dest,
+                           bool grayscale,
+                           int32_t w, int32_t h,
+                           GError **err) {
   struct jpeg_decompress_struct *cinfo = &dc->cinfo;
 
   // set color space
@@ -199,9 +349,6 @@ bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
     return false;
   }
 
-  // verify we haven't run already
-  g_assert(dc->rows[0] == NULL);
-
   if (cinfo->out_color_space != JCS_RGB) {
     // decode directly to output
 
@@ -224,11 +371,23 @@ bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
   } else {
     // decode into temporary buffer, then reformat
 
-    // allocate scanline buffers
-    dc->allocated_row_size = sizeof(JSAMPLE) * cinfo->output_width *
-                             cinfo->output_components;
+    // allocate scanline buffers, reusing those of the last image
+    gsize row_size = sizeof(JSAMPLE) * cinfo->output_width *
+                     cinfo->output_components;
+    if (row_size != dc->allocated_row_size) {
+      for (uint32_t i = 0; i < G_N_ELEMENTS(dc->row_buffers); i++) {
+        if (dc->row_buffers[i]) {
+          g_slice_free1(dc->allocated_row_size, dc->row_buffers[i]);
+          dc->row_buffers[i] = NULL;
+        }
+      }
+      dc->allocated_row_size = row_size;
+    }
     for (int i = 0; i < cinfo->rec_outbuf_height; i++) {
-      dc->rows[i] = g_slice_alloc(dc->allocated_row_size);
+      if (dc->row_buffers[i] == NULL) {
+        dc->row_buffers[i] = g_slice_alloc(row_size);
+      }
+      dc->rows[i] = dc->row_buffers[i];
     }
 
     // decompress
@@ -257,21 +416,48 @@ bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
   return true;
 }
 
+bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
+                                    // uint8_t * if grayscale, else uint32_t *
+                                    void *_dest,
+                                    bool grayscale,
+                                    int32_t w, int32_t h,
+                                    GError **err) {
+  _openslide_trace_begin("decode jpeg");
+  int64_t start = g_get_monotonic_time();
+  dc->jerr.in_span = true;
+  bool success = decompress_run(dc, _dest, grayscale, w, h, err);
+  dc->jerr.in_span = false;
+  _openslide_stats_add(OPENSLIDE_STAT_DECODED_JPEG, 1);
+  _openslide_stats_add_time(OPENSLIDE_STAT_TIMER_DECODE, start);
+  _openslide_trace_end();
+  return success;
+}
+
 void _openslide_jpeg_propagate_error(GError **err,
                                      struct _openslide_jpeg_decompress *dc) {
   g_propagate_error(err, dc->jerr.err);
   dc->jerr.err = NULL;
 }
 
+// return the decompressor to this thread for reuse
 void _openslide_jpeg_decompress_destroy(struct _openslide_jpeg_decompress *dc) {
-  jpeg_destroy_decompress(&dc->cinfo);
   g_assert(dc->jerr.err == NULL);
-  if (dc->allocated_row_size) {
-    for (uint32_t row = 0; row < G_N_ELEMENTS(dc->rows); row++) {
-      g_slice_free1(dc->allocated_row_size, dc->rows[row]);
-    }
+  if (!dc->created) {
+    decompress_free(dc);
+    return;
+  }
+
+  // jpeg_abort is valid in any state, even after a longjmp, and frees
+  // the image pool while keeping tables and the source manager
+  jpeg_abort_decompress(&dc->cinfo);
+  jpeg_save_markers(&dc->cinfo, JPEG_COM, 0);
+  memset(dc->rows, 0, sizeof(dc->rows));
+
+  if (g_private_get(thread_decompressor) == NULL) {
+    g_private_set(thread_decompressor, dc);
+  } else {
+    decompress_free(dc);
   }
-  g_slice_free(struct _openslide_jpeg_decompress, dc);
 }
 
 static bool jpeg_get_dimensions(URLIO_FILE *f,  // or:
@@ -79,12 +79,24 @@ void _openslide_jpeg_mem_src (j_decompress_ptr cinfo,
 
 /*
  * Low-level JPEG decoding mechanism
+ *
+ * _create() hands out this thread's idle decompressor and _destroy()
+ * gives it back, so both are cheap in steady state.
  */
 struct _openslide_jpeg_decompress *_openslide_jpeg_decompress_create(struct jpeg_decompress_struct **out_cinfo);
 
 void _openslide_jpeg_decompress_init(struct _openslide_jpeg_decompress *dc,
                                      jmp_buf *env);
 
+bool _openslide_jpeg_decompress_load_tables(struct _openslide_jpeg_decompress *dc,
+                                            const void *tables,
+                                            uint32_t tables_len,
+                                            uint64_t tables_id,
+                                            GError **err);
+
+// a unique id for _openslide_jpeg_decompress_load_tables()
+uint64_t _openslide_jpeg_tables_id_new(void);
+
 bool _openslide_jpeg_decompress_run(struct _openslide_jpeg_decompress *dc,
                                     // uint8_t * if grayscale, else uint32_t *
                                     void *dest,
@@ -33,6 +33,7 @@
 #include <glib.h>
 #include <setjmp.h>
 #include <stdio.h>
+#include <string.h>
 
 struct png_error_ctx {
   jmp_buf env;
@@ -58,11 +59,28 @@ static void read_callback(png_struct *png, png_byte *buf, png_size_t len) {
   }
 }
 
-bool _openslide_png_read(const char *filename,
-                         int64_t offset,
-                         uint32_t *dest,
-                         int64_t w, int64_t h,
-                         GError **err) {
+// a PNG already in memory
+struct png_buffer {
+  const uint8_t *data;
+  size_t len;
+  size_t pos;
+};
+
+static void buffer_read_callback(png_struct *png, png_byte *buf,
+                                 png_size_t len) {
+  struct png_buffer *b = png_get_io_ptr(png);
+  if (len > b->len - b->pos) {
+    png_error(png, "Read past end of buffer");
+  }
+  memcpy(buf, b->data + b->pos, len);
+  b->pos += len;
+}
+
+// rows are decoded straight into dest, with libpng converting them to ARGB
+static bool decode_png(png_rw_ptr read_fn, void *io_ptr,
+                       uint32_t *dest,
+                       int64_t w, int64_t h,
+                       GError **err) {
   png_struct *png = NULL;
   png_info *info = NULL;
   volatile bool success = false;
@@ -76,16 +94,6 @@ bool _openslide_png_read(const char *filename,
     rows[y] = (png_byte *) &dest[y * w];
   }
 
-  // open and seek
-  URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
-  if (!f) {
-    goto DONE;
-  }
-  if (urlio_fseek(f, offset, SEEK_SET)) {
-    _openslide_io_error(err, "Couldn't urlio_fseek %s", filename);
-    goto DONE;
-  }
-
   // init libpng
   png = png_create_read_struct(PNG_LIBPNG_VER_STRING, ectx,
                                error_callback, warning_callback);
@@ -104,7 +112,7 @@ bool _openslide_png_read(const char *filename,
   if (!setjmp(ectx->env)) {
     // We can't use png_init_io(): passing URLIO_FILE * between libraries isn't
     // safe on Windows
-    png_set_read_fn(png, f, read_callback);
+    png_set_read_fn(png, io_ptr, read_fn);
 
     // read header
     png_read_info(png, info);
@@ -179,10 +187,59 @@ bool _openslide_png_read(const char *filename,
 
 DONE:
   png_destroy_read_struct(&png, &info, NULL);
-  if (f) {
-    urlio_fclose(f);
-  }
   g_slice_free1(h * sizeof(*rows), rows);
   g_slice_free(struct png_error_ctx, ectx);
   return success;
 }
+
+static bool read_png(const char *filename,
+                     int64_t offset,
+                     uint32_t *dest,
+                     int64_t w, int64_t h,
+                     GError **err) {
+  // open and seek
+  URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
+  if (!f) {
+    return false;
+  }
+  if (urlio_fseek(f, offset, SEEK_SET)) {
+    _openslide_io_error(err, "Couldn't urlio_fseek %s", filename);
+    urlio_fclose(f);
+    return false;
+  }
+  bool success = decode_png(read_callback, f, dest, w, h, err);
+  urlio_fclose(f);
+  return success;
+}
+
+bool _openslide_png_read(const char *filename,
+                         int64_t offset,
+                         uint32_t *dest,
+                         int64_t w, int64_t h,
+                         GError **err) {
+  _openslide_trace_begin("decode png");
+  int64_t start = g_get_monotonic_time();
+  bool success = read_png(filename, offset, dest, w, h, err);
+  _openslide_stats_add(OPENSLIDE_STAT_DECODED_PNG, 1);
+  _openslide_stats_add_time(OPENSLIDE_STAT_TIMER_DECODE, start);
+  _openslide_trace_end();
+  return success;
+}
+
+bool _openslide_png_decode_buffer(const void *buf,
+                                  int64_t len,
+                                  uint32_t *dest,
+                                  int64_t w, int64_t h,
+                                  GError **err) {
+  _openslide_trace_begin("decode png");
+  int64_t start = g_get_monotonic_time();
+  struct png_buffer b = {
+    .data = buf,
+    .len = len,
+  };
+  bool success = decode_png(buffer_read_callback, &b, dest, w, h, err);
+  _openslide_stats_add(OPENSLIDE_STAT_DECODED_PNG, 1);
+  _openslide_stats_add_time(OPENSLIDE_STAT_TIMER_DECODE, start);
+  _openslide_trace_end();
+  return success;
+}
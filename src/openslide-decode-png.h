@@ -31,4 +31,11 @@ bool _openslide_png_read(const char *filename,
                          int64_t w, int64_t h,
                          GError **err);
 
+// len bytes already read, such as from urlio_read_view()
+bool _openslide_png_decode_buffer(const void *buf,
+                                  int64_t len,
+                                  uint32_t *dest,
+                                  int64_t w, int64_t h,
+                                  GError **err);
+
 #endif
@@ -40,6 +40,242 @@ static void profile_callback(void *arg G_GNUC_UNUSED, const char *sql,
 }
 #endif
 
+/*
+ * A read-only VFS over urlio, so that database pages come through the
+ * block cache, and from remote slides with ranged requests.  Files other
+ * than the main database, such as temporary files, go to the default VFS.
+ */
+
+#define URLIO_VFS_NAME "openslide-urlio"
+
+struct urlio_vfs_file {
+  sqlite3_file base;
+  URLIO_FILE *f;
+};
+
+static sqlite3_vfs urlio_vfs;
+static GOnce urlio_vfs_once = G_ONCE_INIT;
+
+static sqlite3_vfs *default_vfs(void) {
+  return urlio_vfs.pAppData;
+}
+
+static int vfs_file_close(sqlite3_file *file) {
+  struct urlio_vfs_file *uf = (struct urlio_vfs_file *) file;
+  urlio_fclose(uf->f);
+  return SQLITE_OK;
+}
+
+static int vfs_file_read(sqlite3_file *file, void *buf, int amt,
+                         sqlite3_int64 ofst) {
+  struct urlio_vfs_file *uf = (struct urlio_vfs_file *) file;
+  size_t count = urlio_pread(uf->f, buf, amt, ofst);
+  if (count == (size_t) amt) {
+    return SQLITE_OK;
+  }
+  if (ofst + amt <= urlio_fsize(uf->f)) {
+    return SQLITE_IOERR_READ;
+  }
+  // past the end, which SQLite expects to be zeroed
+  memset((char *) buf + count, 0, amt - count);
+  return SQLITE_IOERR_SHORT_READ;
+}
+
+static int vfs_file_write(sqlite3_file *file G_GNUC_UNUSED,
+                          const void *buf G_GNUC_UNUSED,
+                          int amt G_GNUC_UNUSED,
+                          sqlite3_int64 ofst G_GNUC_UNUSED) {
+  return SQLITE_READONLY;
+}
+
+static int vfs_file_truncate(sqlite3_file *file G_GNUC_UNUSED,
+                             sqlite3_int64 size G_GNUC_UNUSED) {
+  return SQLITE_READONLY;
+}
+
+static int vfs_file_sync(sqlite3_file *file G_GNUC_UNUSED,
+                         int flags G_GNUC_UNUSED) {
+  return SQLITE_OK;
+}
+
+static int vfs_file_size(sqlite3_file *file, sqlite3_int64 *size) {
+  struct urlio_vfs_file *uf = (struct urlio_vfs_file *) file;
+  int64_t len = urlio_fsize(uf->f);
+  if (len < 0) {
+    return SQLITE_IOERR_FSTAT;
+  }
+  *size = len;
+  return SQLITE_OK;
+}
+
+// nobody writes the database, so there is nothing to lock
+static int vfs_file_lock(sqlite3_file *file G_GNUC_UNUSED,
+                         int level G_GNUC_UNUSED) {
+  return SQLITE_OK;
+}
+
+static int vfs_file_check_reserved_lock(sqlite3_file *file G_GNUC_UNUSED,
+                                        int *out) {
+  *out = 0;
+  return SQLITE_OK;
+}
+
+static int vfs_file_control(sqlite3_file *file G_GNUC_UNUSED,
+                            int op G_GNUC_UNUSED,
+                            void *arg G_GNUC_UNUSED) {
+  return SQLITE_NOTFOUND;
+}
+
+static int vfs_file_sector_size(sqlite3_file *file G_GNUC_UNUSED) {
+  return 512;
+}
+
+static int vfs_file_device_characteristics(sqlite3_file *file G_GNUC_UNUSED) {
+#ifdef SQLITE_IOCAP_IMMUTABLE
+  return SQLITE_IOCAP_IMMUTABLE;
+#else
+  return 0;
+#endif
+}
+
+static const sqlite3_io_methods urlio_vfs_io_methods = {
+  .iVersion = 1,
+  .xClose = vfs_file_close,
+  .xRead = vfs_file_read,
+  .xWrite = vfs_file_write,
+  .xTruncate = vfs_file_truncate,
+  .xSync = vfs_file_sync,
+  .xFileSize = vfs_file_size,
+  .xLock = vfs_file_lock,
+  .xUnlock = vfs_file_lock,
+  .xCheckReservedLock = vfs_file_check_reserved_lock,
+  .xFileControl = vfs_file_control,
+  .xSectorSize = vfs_file_sector_size,
+  .xDeviceCharacteristics = vfs_file_device_characteristics,
+};
+
+static int vfs_open(sqlite3_vfs *vfs G_GNUC_UNUSED, const char *name,
+                    sqlite3_file *file, int flags, int *out_flags) {
+  if (name == NULL || !(flags & SQLITE_OPEN_MAIN_DB)) {
+    sqlite3_vfs *dflt = default_vfs();
+    return dflt->xOpen(dflt, name, file, flags, out_flags);
+  }
+  if (!(flags & SQLITE_OPEN_READONLY)) {
+    return SQLITE_CANTOPEN;
+  }
+
+  struct urlio_vfs_file *uf = (struct urlio_vfs_file *) file;
+  memset(uf, 0, sizeof(*uf));
+  uf->f = _openslide_fopen(name, "rb", NULL);
+  if (uf->f == NULL) {
+    return SQLITE_CANTOPEN;
+  }
+  uf->base.pMethods = &urlio_vfs_io_methods;
+  if (out_flags) {
+    *out_flags = flags;
+  }
+  return SQLITE_OK;
+}
+
+static int vfs_delete(sqlite3_vfs *vfs G_GNUC_UNUSED, const char *name,
+                      int sync_dir) {
+  sqlite3_vfs *dflt = default_vfs();
+  return dflt->xDelete(dflt, name, sync_dir);
+}
+
+static int vfs_access(sqlite3_vfs *vfs G_GNUC_UNUSED, const char *name,
+                      int flags, int *out) {
+  sqlite3_vfs *dflt = default_vfs();
+  return dflt->xAccess(dflt, name, flags, out);
+}
+
+// urls are kept as they are
+static int vfs_full_pathname(sqlite3_vfs *vfs G_GNUC_UNUSED,
+                             const char *name, int n_out, char *out) {
+  char *scheme = g_uri_parse_scheme(name);
+  bool url = scheme && strlen(scheme) >= 2;
+  g_free(scheme);
+  if (!url) {
+    sqlite3_vfs *dflt = default_vfs();
+    return dflt->xFullPathname(dflt, name, n_out, out);
+  }
+  if ((int) strlen(name) >= n_out) {
+    return SQLITE_CANTOPEN;
+  }
+  strcpy(out, name);
+  return SQLITE_OK;
+}
+
+static void *vfs_dl_open(sqlite3_vfs *vfs G_GNUC_UNUSED, const char *name) {
+  sqlite3_vfs *dflt = default_vfs();
+  return dflt->xDlOpen(dflt, name);
+}
+
+static void vfs_dl_error(sqlite3_vfs *vfs G_GNUC_UNUSED, int n, char *msg) {
+  sqlite3_vfs *dflt = default_vfs();
+  dflt->xDlError(dflt, n, msg);
+}
+
+static void (*vfs_dl_sym(sqlite3_vfs *vfs G_GNUC_UNUSED, void *handle,
+                         const char *symbol))(void) {
+  sqlite3_vfs *dflt = default_vfs();
+  return dflt->xDlSym(dflt, handle, symbol);
+}
+
+static void vfs_dl_close(sqlite3_vfs *vfs G_GNUC_UNUSED, void *handle) {
+  sqlite3_vfs *dflt = default_vfs();
+  dflt->xDlClose(dflt, handle);
+}
+
+static int vfs_randomness(sqlite3_vfs *vfs G_GNUC_UNUSED, int n, char *out) {
+  sqlite3_vfs *dflt = default_vfs();
+  return dflt->xRandomness(dflt, n, out);
+}
+
+static int vfs_sleep(sqlite3_vfs *vfs G_GNUC_UNUSED, int us) {
+  sqlite3_vfs *dflt = default_vfs();
+  return dflt->xSleep(dflt, us);
+}
+
+static int vfs_current_time(sqlite3_vfs *vfs G_GNUC_UNUSED, double *out) {
+  sqlite3_vfs *dflt = default_vfs();
+  return dflt->xCurrentTime(dflt, out);
+}
+
+static int vfs_get_last_error(sqlite3_vfs *vfs G_GNUC_UNUSED, int n,
+                              char *out) {
+  sqlite3_vfs *dflt = default_vfs();
+  return dflt->xGetLastError ? dflt->xGetLastError(dflt, n, out) : 0;
+}
+
+// returns the result of sqlite3_vfs_register()
+static gpointer register_urlio_vfs(gpointer arg G_GNUC_UNUSED) {
+  sqlite3_vfs *dflt = sqlite3_vfs_find(NULL);
+  if (dflt == NULL) {
+    return GINT_TO_POINTER(SQLITE_ERROR);
+  }
+  urlio_vfs.iVersion = 1;
+  // room for the default VFS files, given the ones it opens for us
+  urlio_vfs.szOsFile = MAX((int) sizeof(struct urlio_vfs_file),
+                           dflt->szOsFile);
+  urlio_vfs.mxPathname = MAX(dflt->mxPathname, 4096);
+  urlio_vfs.zName = URLIO_VFS_NAME;
+  urlio_vfs.pAppData = dflt;
+  urlio_vfs.xOpen = vfs_open;
+  urlio_vfs.xDelete = vfs_delete;
+  urlio_vfs.xAccess = vfs_access;
+  urlio_vfs.xFullPathname = vfs_full_pathname;
+  urlio_vfs.xDlOpen = vfs_dl_open;
+  urlio_vfs.xDlError = vfs_dl_error;
+  urlio_vfs.xDlSym = vfs_dl_sym;
+  urlio_vfs.xDlClose = vfs_dl_close;
+  urlio_vfs.xRandomness = vfs_randomness;
+  urlio_vfs.xSleep = vfs_sleep;
+  urlio_vfs.xCurrentTime = vfs_current_time;
+  urlio_vfs.xGetLastError = vfs_get_last_error;
+  return GINT_TO_POINTER(sqlite3_vfs_register(&urlio_vfs, 0));
+}
+
 #undef sqlite3_open_v2
 static sqlite3 *do_open(const char *filename, int flags, GError **err) {
   sqlite3 *db;
@@ -50,8 +286,14 @@ static sqlite3 *do_open(const char *filename, int flags, GError **err) {
                 "Couldn't initialize SQLite: %d", ret);
     return NULL;
   }
+  ret = GPOINTER_TO_INT(g_once(&urlio_vfs_once, register_urlio_vfs, NULL));
+  if (ret) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Couldn't register SQLite VFS: %d", ret);
+    return NULL;
+  }
 
-  ret = sqlite3_open_v2(filename, &db, flags, NULL);
+  ret = sqlite3_open_v2(filename, &db, flags, URLIO_VFS_NAME);
 
   if (ret) {
     if (db) {
@@ -26,6 +26,7 @@
 
 #include "openslide-private.h"
 #include "openslide-decode-tiff.h"
+#include "openslide-decode-tifflike.h"
 #include "openslide-decode-jpeg.h"
 
 #include <glib.h>
@@ -45,6 +46,29 @@ struct _openslide_tiffcache {
   GQueue *cache;
   GMutex *lock;
   int outstanding;
+  // shared by all TIFF handles, read only positionally
+  URLIO_FILE *file;
+
+  // directories parsed by the probe, shared by every handle
+  struct _openslide_tifflike *tl;  // NULL if not given
+  GHashTable *indexes;  // tdir_t -> struct _openslide_tiff_tile_index, under lock
+};
+
+// tile extents of a directory, read from the tifflike when first used,
+// so the JPEG fast path needs neither a TIFF handle nor a directory switch
+struct _openslide_tiff_tile_index {
+  struct _openslide_tifflike *tl;
+  URLIO_FILE *file;
+  tdir_t dir;
+  int64_t count;
+  bool has_tables;
+
+  // set once, racily but to the same values
+  volatile gint loaded;
+  const uint64_t *offsets;
+  const uint64_t *sizes;
+  const void *tables;
+  uint32_t tables_len;
 };
 
 // not thread-safe, like libtiff
@@ -95,6 +119,177 @@ bool _openslide_tiff_set_dir(TIFF *tiff,
 }
 #define TIFFSetDirectory _OPENSLIDE_POISON(_openslide_tiff_set_dir)
 
+static URLIO_FILE *get_file(struct _openslide_tiffcache *tc, GError **err);
+
+// NULL if the directory can't be indexed, leaving libtiff to read it
+static struct _openslide_tiff_tile_index *get_tile_index(struct _openslide_tiffcache *tc,
+                                                         tdir_t dir,
+                                                         int64_t count) {
+  if (tc->tl == NULL) {
+    return NULL;
+  }
+  URLIO_FILE *f = get_file(tc, NULL);
+  if (f == NULL) {
+    return NULL;
+  }
+
+  g_mutex_lock(tc->lock);
+  struct _openslide_tiff_tile_index *index =
+    g_hash_table_lookup(tc->indexes, GINT_TO_POINTER(dir));
+  if (index) {
+    goto DONE;
+  }
+
+  // every tile needs an extent
+  if (dir >= _openslide_tifflike_get_directory_count(tc->tl) ||
+      _openslide_tifflike_get_value_count(tc->tl, dir,
+                                          TIFFTAG_TILEOFFSETS) < count ||
+      _openslide_tifflike_get_value_count(tc->tl, dir,
+                                          TIFFTAG_TILEBYTECOUNTS) < count) {
+    goto DONE;
+  }
+  index = g_slice_new0(struct _openslide_tiff_tile_index);
+  index->tl = tc->tl;
+  index->file = f;
+  index->dir = dir;
+  index->count = count;
+  index->has_tables =
+    _openslide_tifflike_get_value_count(tc->tl, dir, TIFFTAG_JPEGTABLES) > 0;
+  g_hash_table_insert(tc->indexes, GINT_TO_POINTER(dir), index);
+
+DONE:
+  g_mutex_unlock(tc->lock);
+  return index;
+}
+
+static void tile_index_destroy(gpointer data) {
+  g_slice_free(struct _openslide_tiff_tile_index, data);
+}
+
+static bool load_tile_index(struct _openslide_tiff_tile_index *index,
+                            GError **err) {
+  if (g_atomic_int_get(&index->loaded)) {
+    return true;
+  }
+  const uint64_t *offsets =
+    _openslide_tifflike_get_uints(index->tl, index->dir,
+                                  TIFFTAG_TILEOFFSETS, err);
+  if (!offsets) {
+    return false;
+  }
+  const uint64_t *sizes =
+    _openslide_tifflike_get_uints(index->tl, index->dir,
+                                  TIFFTAG_TILEBYTECOUNTS, err);
+  if (!sizes) {
+    return false;
+  }
+  const void *tables = NULL;
+  int64_t tables_len = 0;
+  if (index->has_tables) {
+    tables = _openslide_tifflike_get_buffer(index->tl, index->dir,
+                                            TIFFTAG_JPEGTABLES, err);
+    if (!tables) {
+      return false;
+    }
+    tables_len = _openslide_tifflike_get_value_count(index->tl, index->dir,
+                                                     TIFFTAG_JPEGTABLES);
+  }
+  index->offsets = offsets;
+  index->sizes = sizes;
+  index->tables = tables;
+  index->tables_len = tables_len;
+  g_atomic_int_set(&index->loaded, 1);
+  return true;
+}
+
+static URLIO_FILE *get_level_file(struct _openslide_tiff_level *tiffl,
+                                  TIFF *tiff) {
+  if (tiffl->index) {
+    return tiffl->index->file;
+  }
+  struct tiff_file_handle *hdl = TIFFClientdata(tiff);
+  return hdl->tc->file;
+}
+
+// offset and length of a tile, from the index if there is one
+static bool get_tile_extent(const struct _openslide_tiff_level *tiffl,
+                            TIFF *tiff,
+                            int64_t tile_col, int64_t tile_row,
+                            uint64_t *offset, uint64_t *len,
+                            GError **err) {
+  struct _openslide_tiff_tile_index *index = tiffl->index;
+  if (index) {
+    if (!load_tile_index(index, err)) {
+      return false;
+    }
+    int64_t tile_no = tile_row * tiffl->tiles_across + tile_col;
+    if (tile_no < 0 || tile_no >= index->count) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Tile out of range: %"PRId64, tile_no);
+      return false;
+    }
+    *offset = _openslide_tifflike_uint_fix_offset_ndpi(index->tl, index->dir,
+                                                       index->offsets[tile_no]);
+    *len = index->sizes[tile_no];
+    return true;
+  }
+
+  // set directory
+  SET_DIR_OR_FAIL(tiff, tiffl->dir);
+
+  // get tile number
+  ttile_t tile_no = TIFFComputeTile(tiff,
+                                    tile_col * tiffl->tile_w,
+                                    tile_row * tiffl->tile_h,
+                                    0, 0);
+
+  // get tile extent
+  toff_t *offsets;
+  toff_t *sizes;
+  if (!TIFFGetField(tiff, TIFFTAG_TILEOFFSETS, &offsets) ||
+      !TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &sizes)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot get tile size");
+    return false;
+  }
+  *offset = offsets[tile_no];
+  *len = sizes[tile_no];
+  return true;
+}
+
+bool _openslide_tiff_get_tile_size(const struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   int64_t tile_col, int64_t tile_row,
+                                   uint64_t *size,
+                                   GError **err) {
+  uint64_t offset;
+  return get_tile_extent(tiffl, tiff, tile_col, tile_row, &offset, size, err);
+}
+
+// JPEGTABLES of the level, or NULL
+static bool get_jpeg_tables(struct _openslide_tiff_level *tiffl,
+                            TIFF *tiff,
+                            const void **tables, uint32_t *tables_len,
+                            GError **err) {
+  struct _openslide_tiff_tile_index *index = tiffl->index;
+  if (index) {
+    if (!load_tile_index(index, err)) {
+      return false;
+    }
+    *tables = index->tables;
+    *tables_len = index->tables_len;
+    return true;
+  }
+
+  SET_DIR_OR_FAIL(tiff, tiffl->dir);
+  if (!TIFFGetField(tiff, TIFFTAG_JPEGTABLES, tables_len, tables)) {
+    // no separate tables
+    *tables = NULL;
+    *tables_len = 0;
+  }
+  return true;
+}
+
 bool _openslide_tiff_level_init(TIFF *tiff,
                                 tdir_t dir,
                                 struct _openslide_level *level,
@@ -151,6 +346,11 @@ bool _openslide_tiff_level_init(TIFF *tiff,
 
     tiffl->tile_read_direct = read_direct;
     tiffl->photometric = photometric;
+    tiffl->tables_id = read_direct ? _openslide_jpeg_tables_id_new() : 0;
+
+    struct tiff_file_handle *hdl = TIFFClientdata(tiff);
+    tiffl->index = get_tile_index(hdl->tc, dir,
+                                  tiffl->tiles_across * tiffl->tiles_down);
   }
 
   return true;
@@ -195,10 +395,7 @@ static bool tiff_read_region(TIFF *tiff,
   // draw it
   if (TIFFRGBAImageGet(&img, dest, w, h)) {
     // convert ABGR -> ARGB
-    for (uint32_t *p = dest; p < dest + w * h; p++) {
-      uint32_t val = GUINT32_SWAP_LE_BE(*p);
-      *p = (val << 24) | (val >> 8);
-    }
+    _openslide_pixel_abgr_to_argb(dest, w * h);
     success = true;
   } else {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -213,7 +410,9 @@ static bool tiff_read_region(TIFF *tiff,
 
 static bool decode_jpeg(const void *buf, uint32_t buflen,
                         const void *tables, uint32_t tables_len,  // optional
+                        uint64_t tables_id,
                         J_COLOR_SPACE space,
+                        int scale_denom,
                         uint32_t *dest,
                         int32_t w, int32_t h,
                         GError **err) {
@@ -227,14 +426,12 @@ static bool decode_jpeg(const void *buf, uint32_t buflen,
   if (setjmp(env) == 0) {
     _openslide_jpeg_decompress_init(dc, &env);
 
-    // load JPEG tables
-    if (tables) {
-      _openslide_jpeg_mem_src(cinfo, tables, tables_len);
-      if (jpeg_read_header(cinfo, false) != JPEG_HEADER_TABLES_ONLY) {
-        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                    "Couldn't load JPEG tables");
-        goto DONE;
-      }
+    // load JPEG tables, once per level and thread
+    if (tables && !_openslide_jpeg_decompress_load_tables(dc, tables,
+                                                          tables_len,
+                                                          tables_id,
+                                                          err)) {
+      goto DONE;
     }
 
     // set up I/O
@@ -250,6 +447,10 @@ static bool decode_jpeg(const void *buf, uint32_t buflen,
     // set color space from TIFF photometric tag (for Aperio)
     cinfo->jpeg_color_space = space;
 
+    // decode in the DCT domain at reduced size
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = scale_denom;
+
     // decompress
     if (!_openslide_jpeg_decompress_run(dc, dest, false, w, h, err)) {
       goto DONE;
@@ -271,8 +472,23 @@ bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
                                uint32_t *dest,
                                int64_t tile_col, int64_t tile_row,
                                GError **err) {
-  // set directory
-  SET_DIR_OR_FAIL(tiff, tiffl->dir);
+  return _openslide_tiff_read_tile_scaled(tiffl, tiff, dest,
+                                          tile_col, tile_row, 1, err);
+}
+
+// dest holds (tile_w / scale_denom) x (tile_h / scale_denom) pixels
+bool _openslide_tiff_read_tile_scaled(struct _openslide_tiff_level *tiffl,
+                                      TIFF *tiff,
+                                      uint32_t *dest,
+                                      int64_t tile_col, int64_t tile_row,
+                                      int scale_denom,
+                                      GError **err) {
+  // scaling needs libjpeg
+  if (scale_denom != 1 && !tiffl->tile_read_direct) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot scale tiles of directory %d", tiffl->dir);
+    return false;
+  }
 
   if (tiffl->tile_read_direct) {
     // Fast path: read raw data, decode through libjpeg
@@ -283,40 +499,47 @@ bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
     // libjpeg-turbo.
 
     // read tables
-    void *tables;
+    const void *tables;
     uint32_t tables_len;
-    if (!TIFFGetField(tiff, TIFFTAG_JPEGTABLES, &tables_len, &tables)) {
-      // no separate tables
-      tables = NULL;
-      tables_len = 0;
+    if (!get_jpeg_tables(tiffl, tiff, &tables, &tables_len, err)) {
+      return false;
     }
 
     // read data
-    void *buf;
-    int32_t buflen;
-    if (!_openslide_tiff_read_tile_data(tiffl, tiff,
-                                        &buf, &buflen,
+    URLIO_VIEW *view;
+    if (!_openslide_tiff_read_tile_view(tiffl, tiff, &view,
                                         tile_col, tile_row,
                                         err)) {
       return false;
     }
 
     // decompress
-    bool ret = decode_jpeg(buf, buflen, tables, tables_len,
+    bool ret = decode_jpeg(view->data, view->len, tables, tables_len,
+                           tiffl->tables_id,
                            tiffl->photometric == PHOTOMETRIC_YCBCR ? JCS_YCbCr : JCS_RGB,
+                           scale_denom,
                            dest,
-                           tiffl->tile_w, tiffl->tile_h,
+                           tiffl->tile_w / scale_denom,
+                           tiffl->tile_h / scale_denom,
                            err);
-    g_free(buf);
+    urlio_view_release(view);
     return ret;
   } else {
     // Fallback: read tile through libtiff
+    SET_DIR_OR_FAIL(tiff, tiffl->dir);
     _openslide_performance_warn_once(&tiffl->warned_read_indirect,
                                      "Using slow libtiff read path for "
                                      "directory %d", tiffl->dir);
-    return tiff_read_region(tiff, dest,
-                            tile_col * tiffl->tile_w, tile_row * tiffl->tile_h,
-                            tiffl->tile_w, tiffl->tile_h, err);
+    _openslide_trace_begin("decode libtiff");
+    int64_t start = g_get_monotonic_time();
+    bool ret = tiff_read_region(tiff, dest,
+                                tile_col * tiffl->tile_w,
+                                tile_row * tiffl->tile_h,
+                                tiffl->tile_w, tiffl->tile_h, err);
+    _openslide_stats_add(OPENSLIDE_STAT_DECODED_LIBTIFF, 1);
+    _openslide_stats_add_time(OPENSLIDE_STAT_TIMER_DECODE, start);
+    _openslide_trace_end();
+    return ret;
   }
 }
 
@@ -361,6 +584,101 @@ bool _openslide_tiff_read_tile_data(struct _openslide_tiff_level *tiffl,
   return true;
 }
 
+bool _openslide_tiff_read_tile_view(struct _openslide_tiff_level *tiffl,
+                                    TIFF *tiff,
+                                    URLIO_VIEW **view,
+                                    int64_t tile_col, int64_t tile_row,
+                                    GError **err) {
+  uint64_t offset, len;
+  if (!get_tile_extent(tiffl, tiff, tile_col, tile_row, &offset, &len, err)) {
+    return false;
+  }
+
+  // the raw tile is the byte range libtiff would read, without the copy
+  *view = urlio_read_view(get_level_file(tiffl, tiff), offset, len);
+  if (*view == NULL) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot read raw tile");
+    return false;
+  }
+  return true;
+}
+
+// APP14 segment marking a JPEG as RGB rather than YCbCr
+static const uint8_t adobe_rgb_marker[] = {
+  0xff, 0xee, 0x00, 0x0e, 'A', 'd', 'o', 'b', 'e',
+  0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+bool _openslide_tiff_read_raw_jpeg_tile(struct _openslide_tiff_level *tiffl,
+                                        TIFF *tiff,
+                                        void **_buf, int32_t *_len,
+                                        int64_t tile_col, int64_t tile_row,
+                                        GError **err) {
+  *_buf = NULL;
+  *_len = 0;
+  g_assert(tiffl->tile_read_direct);
+
+  bool is_missing;
+  if (!_openslide_tiff_check_missing_tile(tiffl, tiff, tile_col, tile_row,
+                                          &is_missing, err)) {
+    return false;
+  }
+  if (is_missing) {
+    return true;
+  }
+
+  // read tables
+  const void *_tables;
+  uint32_t tables_len;
+  if (!get_jpeg_tables(tiffl, tiff, &_tables, &tables_len, err)) {
+    return false;
+  }
+  const uint8_t *tables = _tables;
+  if (tables_len < 4) {
+    tables = NULL;
+    tables_len = 0;
+  }
+
+  URLIO_VIEW *view;
+  if (!_openslide_tiff_read_tile_view(tiffl, tiff, &view,
+                                      tile_col, tile_row, err)) {
+    return false;
+  }
+  const uint8_t *data = (const uint8_t *) view->data;
+  if (view->len < 4 || data[0] != 0xff || data[1] != 0xd8) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Tile is not a JPEG image");
+    urlio_view_release(view);
+    return false;
+  }
+
+  // SOI, then the Adobe marker, the tables between their SOI and EOI, and
+  // the rest of the tile
+  bool rgb = tiffl->photometric == PHOTOMETRIC_RGB;
+  int32_t tables_body = tables ? tables_len - 4 : 0;
+  int32_t len = view->len + (rgb ? sizeof(adobe_rgb_marker) : 0) +
+                tables_body;
+  uint8_t *buf = g_malloc(len);
+  uint8_t *p = buf;
+  *p++ = 0xff;
+  *p++ = 0xd8;  // SOI
+  if (rgb) {
+    memcpy(p, adobe_rgb_marker, sizeof(adobe_rgb_marker));
+    p += sizeof(adobe_rgb_marker);
+  }
+  if (tables_body) {
+    memcpy(p, tables + 2, tables_body);
+    p += tables_body;
+  }
+  memcpy(p, data + 2, view->len - 2);
+  urlio_view_release(view);
+
+  *_buf = buf;
+  *_len = len;
+  return true;
+}
+
 // sets out-argument to indicate whether the tile data is zero bytes long
 // returns false on error
 bool _openslide_tiff_check_missing_tile(struct _openslide_tiff_level *tiffl,
@@ -368,33 +686,153 @@ bool _openslide_tiff_check_missing_tile(struct _openslide_tiff_level *tiffl,
                                         int64_t tile_col, int64_t tile_row,
                                         bool *is_missing,
                                         GError **err) {
-  // set directory
-  if (!_openslide_tiff_set_dir(tiff, tiffl->dir, err)) {
+  uint64_t offset, len;
+  if (!get_tile_extent(tiffl, tiff, tile_col, tile_row, &offset, &len, err)) {
     return false;
   }
 
-  // get tile number
-  ttile_t tile_no = TIFFComputeTile(tiff,
-                                    tile_col * tiffl->tile_w,
-                                    tile_row * tiffl->tile_h,
-                                    0, 0);
+  // return result
+  *is_missing = len == 0;
+  return true;
+}
 
-  //g_debug("_openslide_tiff_check_missing_tile: tile %d", tile_no);
+struct tile_range {
+  uint64_t offset;
+  uint64_t len;
+};
 
-  // get tile size
-  toff_t *sizes;
-  if (!TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &sizes)) {
-    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                "Cannot get tile size");
-    return false;
+static gint compare_tile_range(gconstpointer a, gconstpointer b) {
+  const struct tile_range *ra = a;
+  const struct tile_range *rb = b;
+
+  if (ra->offset < rb->offset) {
+    return -1;
   }
-  tsize_t tile_size = sizes[tile_no];
+  return ra->offset > rb->offset;
+}
+
+// fetch the data of tiles, given as column, row pairs, merging the
+// requests for neighboring tiles
+static bool fetch_tiles(struct _openslide_tiff_level *tiffl,
+                        TIFF *tiff,
+                        URLIO_FILE *f,
+                        struct _openslide_cache_binding *cache,
+                        void *cache_plane,
+                        const int64_t *tiles, int64_t count,
+                        int prefetch_id,
+                        GError **err) {
+  GArray *ranges = g_array_new(FALSE, FALSE, sizeof(struct tile_range));
+  for (int64_t i = 0; i < count; i++) {
+    int64_t col = tiles[2 * i];
+    int64_t row = tiles[2 * i + 1];
+    if (col < 0 || col >= tiffl->tiles_across ||
+        row < 0 || row >= tiffl->tiles_down) {
+      continue;
+    }
+    struct tile_range range;
+    if (!get_tile_extent(tiffl, tiff, col, row,
+                         &range.offset, &range.len, err)) {
+      g_array_free(ranges, TRUE);
+      return false;
+    }
+    // missing tiles have no data
+    if (range.len == 0) {
+      continue;
+    }
+    // decoded already
+    if (cache && _openslide_cache_contains(cache, cache_plane, col, row)) {
+      continue;
+    }
+    g_array_append_val(ranges, range);
+  }
+
+  // sort by offset and merge neighbors
+  guint64 gap = urlio_get_range_gap();
+  g_array_sort(ranges, compare_tile_range);
+  struct tile_range cur = { 0, 0 };
+  for (guint i = 0; i < ranges->len; i++) {
+    struct tile_range *range = &g_array_index(ranges, struct tile_range, i);
+    if (cur.len && range->offset <= cur.offset + cur.len + gap) {
+      cur.len = MAX(cur.len, range->offset + range->len - cur.offset);
+      continue;
+    }
+    if (cur.len) {
+      urlio_prefetch(f, cur.offset, cur.len, prefetch_id);
+    }
+    cur = *range;
+  }
+  if (cur.len) {
+    urlio_prefetch(f, cur.offset, cur.len, prefetch_id);
+  }
+  g_array_free(ranges, TRUE);
 
-  // return result
-  *is_missing = tile_size == 0;
   return true;
 }
 
+// start fetching the tiles covering a region of the level, in level
+// coordinates, in the background; tiles close together in the file are
+// requested as one range.  Tiles found in cache under cache_plane are
+// skipped.  prefetch_id tags the fetches for urlio_prefetch_cancel().
+bool _openslide_tiff_fetch_region(struct _openslide_tiff_level *tiffl,
+                                  TIFF *tiff,
+                                  struct _openslide_cache_binding *cache,
+                                  void *cache_plane,
+                                  int64_t x, int64_t y,
+                                  int64_t w, int64_t h,
+                                  int prefetch_id,
+                                  GError **err) {
+  URLIO_FILE *f = get_level_file(tiffl, tiff);
+
+  // local reads are cheap enough one at a time
+  if (f->type != CFTYPE_CURL) {
+    return true;
+  }
+
+  // clip to the level
+  int64_t end_x = MIN(x + w, tiffl->image_w);
+  int64_t end_y = MIN(y + h, tiffl->image_h);
+  x = MAX(x, 0);
+  y = MAX(y, 0);
+  if (end_x <= x || end_y <= y) {
+    return true;
+  }
+
+  int64_t start_col = x / tiffl->tile_w;
+  int64_t start_row = y / tiffl->tile_h;
+  int64_t end_col = (end_x - 1) / tiffl->tile_w;
+  int64_t end_row = (end_y - 1) / tiffl->tile_h;
+
+  GArray *tiles = g_array_new(FALSE, FALSE, sizeof(int64_t));
+  for (int64_t row = start_row; row <= end_row; row++) {
+    for (int64_t col = start_col; col <= end_col; col++) {
+      g_array_append_val(tiles, col);
+      g_array_append_val(tiles, row);
+    }
+  }
+  bool success = fetch_tiles(tiffl, tiff, f, cache, cache_plane,
+                             (const int64_t *) tiles->data, tiles->len / 2,
+                             prefetch_id, err);
+  g_array_free(tiles, TRUE);
+
+  return success;
+}
+
+bool _openslide_tiff_fetch_tiles(struct _openslide_tiff_level *tiffl,
+                                 TIFF *tiff,
+                                 struct _openslide_cache_binding *cache,
+                                 void *cache_plane,
+                                 const int64_t *tiles, int64_t count,
+                                 int prefetch_id,
+                                 GError **err) {
+  URLIO_FILE *f = get_level_file(tiffl, tiff);
+
+  if (f->type != CFTYPE_CURL) {
+    return true;
+  }
+  return fetch_tiles(tiffl, tiff, f, cache, cache_plane, tiles, count,
+                     prefetch_id, err);
+}
+
 static bool _get_associated_image_data(TIFF *tiff,
                                        struct associated_image *img,
                                        uint32_t *dest,
@@ -501,19 +939,9 @@ bool _openslide_tiff_add_associated_image(openslide_t *osr,
 static tsize_t tiff_do_read(thandle_t th, tdata_t buf, tsize_t size) {
   struct tiff_file_handle *hdl = th;
 
-  // don't leave the file handle open between calls
-  // also ensures FD_CLOEXEC is set
-  URLIO_FILE *f = _openslide_fopen(hdl->tc->filename, "rb", NULL);
-  if (f == NULL) {
-    return 0;
-  }
-  if (urlio_fseek(f, hdl->offset, SEEK_SET)) {
-    urlio_fclose(f);
-    return 0;
-  }
-  int64_t rsize = urlio_fread(buf, 1, size, f);
+  // positional read on the handle shared by the whole tiffcache
+  int64_t rsize = urlio_pread(hdl->tc->file, buf, size, hdl->offset);
   hdl->offset += rsize;
-  urlio_fclose(f);
   return rsize;
 }
 
@@ -557,36 +985,38 @@ static toff_t tiff_do_size(thandle_t th) {
 }
 
 #undef TIFFClientOpen
+static URLIO_FILE *get_file(struct _openslide_tiffcache *tc, GError **err) {
+  g_mutex_lock(tc->lock);
+  if (tc->file == NULL) {
+    tc->file = _openslide_fopen(tc->filename, "rb", err);
+  }
+  URLIO_FILE *f = tc->file;
+  g_mutex_unlock(tc->lock);
+  return f;
+}
+
 static TIFF *tiff_open(struct _openslide_tiffcache *tc, GError **err) {
   // open
-  URLIO_FILE *f = _openslide_fopen(tc->filename, "rb", err);
+  URLIO_FILE *f = get_file(tc, err);
   if (f == NULL) {
     return NULL;
   }
 
   // read magic
   uint8_t buf[4];
-  if (urlio_fread(buf, 4, 1, f) != 1) {
+  if (urlio_pread(f, buf, 4, 0) != 4) {
     // can't read
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Couldn't read TIFF magic number for %s", tc->filename);
-    urlio_fclose(f);
     return NULL;
   }
 
   // get size
-  if (urlio_fseek(f, 0, SEEK_END) == -1) {
-    _openslide_io_error(err, "Couldn't seek to end of %s", tc->filename);
-    urlio_fclose(f);
-    return NULL;
-  }
-  int64_t size = urlio_ftell(f);
+  int64_t size = urlio_fsize(f);
   if (size == -1) {
-    _openslide_io_error(err, "Couldn't urlio_ftell() for %s", tc->filename);
-    urlio_fclose(f);
+    _openslide_io_error(err, "Couldn't get size of %s", tc->filename);
     return NULL;
   }
-  urlio_fclose(f);
 
   // check magic
   // TODO: remove if libtiff gets private error/warning callbacks
@@ -639,11 +1069,17 @@ NOT_TIFF:
 }
 #define TIFFClientOpen _OPENSLIDE_POISON(_openslide_tiffcache_get)
 
-struct _openslide_tiffcache *_openslide_tiffcache_create(const char *filename) {
+struct _openslide_tiffcache *_openslide_tiffcache_create(const char *filename,
+                                                         struct _openslide_tifflike *tl) {
   struct _openslide_tiffcache *tc = g_slice_new0(struct _openslide_tiffcache);
   tc->filename = g_strdup(filename);
+  if (tl) {
+    tc->tl = _openslide_tifflike_ref(tl);
+  }
   tc->cache = g_queue_new();
   tc->lock = g_mutex_new();
+  tc->indexes = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                      NULL, tile_index_destroy);
   return tc;
 }
 
@@ -702,6 +1138,11 @@ void _openslide_tiffcache_destroy(struct _openslide_tiffcache *tc) {
   g_mutex_unlock(tc->lock);
   g_queue_free(tc->cache);
   g_mutex_free(tc->lock);
+  g_hash_table_destroy(tc->indexes);
+  _openslide_tifflike_destroy(tc->tl);
+  if (tc->file) {
+    urlio_fclose(tc->file);
+  }
   g_free(tc->filename);
   g_slice_free(struct _openslide_tiffcache, tc);
 }
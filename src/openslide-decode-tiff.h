@@ -29,6 +29,8 @@
 #include <glib.h>
 #include <tiffio.h>
 
+struct _openslide_tiff_tile_index;
+
 struct _openslide_tiff_level {
   tdir_t dir;
   int64_t image_w;
@@ -41,8 +43,18 @@ struct _openslide_tiff_level {
   bool tile_read_direct;
   gint warned_read_indirect;
   uint16_t photometric;
+  uint64_t tables_id;  // JPEGTABLES of dir, for decompressor reuse
+
+  // tile extents and tables shared by all handles, owned by the tiffcache;
+  // NULL if they must come from libtiff
+  struct _openslide_tiff_tile_index *index;
 };
 
+// if true, tiles of the level can be read and fetched with a NULL TIFF *
+static inline bool _openslide_tiff_level_is_indexed(const struct _openslide_tiff_level *tiffl) {
+  return tiffl->index && tiffl->tile_read_direct;
+}
+
 struct _openslide_tiffcache;
 
 bool _openslide_tiff_level_init(TIFF *tiff,
@@ -63,17 +75,67 @@ bool _openslide_tiff_read_tile(struct _openslide_tiff_level *tiffl,
                                int64_t tile_col, int64_t tile_row,
                                GError **err);
 
+// scale_denom 1, 2, 4 or 8, for levels with tile_read_direct
+bool _openslide_tiff_read_tile_scaled(struct _openslide_tiff_level *tiffl,
+                                      TIFF *tiff,
+                                      uint32_t *dest,
+                                      int64_t tile_col, int64_t tile_row,
+                                      int scale_denom,
+                                      GError **err);
+
 bool _openslide_tiff_read_tile_data(struct _openslide_tiff_level *tiffl,
                                     TIFF *tiff,
                                     void **buf, int32_t *len,
                                     int64_t tile_col, int64_t tile_row,
                                     GError **err);
 
+// like _openslide_tiff_read_tile_data(), but lends the data out of the
+// remote block cache when it can; release *view with urlio_view_release()
+// standalone JPEG for a tile_read_direct level, with JPEGTABLES merged
+// in; *buf is NULL for a tile with no data
+bool _openslide_tiff_read_raw_jpeg_tile(struct _openslide_tiff_level *tiffl,
+                                        TIFF *tiff,
+                                        void **buf, int32_t *len,
+                                        int64_t tile_col, int64_t tile_row,
+                                        GError **err);
+
+// compressed size, from the tile index without a directory switch if
+// the level has one
+bool _openslide_tiff_get_tile_size(const struct _openslide_tiff_level *tiffl,
+                                   TIFF *tiff,
+                                   int64_t tile_col, int64_t tile_row,
+                                   uint64_t *size,
+                                   GError **err);
+
+bool _openslide_tiff_read_tile_view(struct _openslide_tiff_level *tiffl,
+                                    TIFF *tiff,
+                                    URLIO_VIEW **view,
+                                    int64_t tile_col, int64_t tile_row,
+                                    GError **err);
+
 bool _openslide_tiff_clip_tile(struct _openslide_tiff_level *tiffl,
                                uint32_t *tiledata,
                                int64_t tile_col, int64_t tile_row,
                                GError **err);
 
+bool _openslide_tiff_fetch_region(struct _openslide_tiff_level *tiffl,
+                                  TIFF *tiff,
+                                  struct _openslide_cache_binding *cache,
+                                  void *cache_plane,
+                                  int64_t x, int64_t y,
+                                  int64_t w, int64_t h,
+                                  int prefetch_id,
+                                  GError **err);
+
+// tiles are column, row pairs
+bool _openslide_tiff_fetch_tiles(struct _openslide_tiff_level *tiffl,
+                                 TIFF *tiff,
+                                 struct _openslide_cache_binding *cache,
+                                 void *cache_plane,
+                                 const int64_t *tiles, int64_t count,
+                                 int prefetch_id,
+                                 GError **err);
+
 bool _openslide_tiff_add_associated_image(openslide_t *osr,
                                           const char *name,
                                           struct _openslide_tiffcache *tc,
@@ -86,8 +148,10 @@ bool _openslide_tiff_set_dir(TIFF *tiff,
 
 
 /* TIFF handles are not thread-safe, so we have a handle cache for
-   multithreaded access */
-struct _openslide_tiffcache *_openslide_tiffcache_create(const char *filename);
+   multithreaded access.  tl, if not NULL, is the file's already parsed
+   directories; the cache keeps a reference and indexes tiles from it */
+struct _openslide_tiffcache *_openslide_tiffcache_create(const char *filename,
+                                                         struct _openslide_tifflike *tl);
 
 TIFF *_openslide_tiffcache_get(struct _openslide_tiffcache *tc, GError **err);
 
@@ -47,13 +47,18 @@
 
 #define NDPI_TAG 65420
 
+// larger values are left to be fetched when first used
+#define PREFETCH_VALUE_MAX (1024 * 1024)
+
 
 struct _openslide_tifflike {
   char *filename;
+  URLIO_FILE *file;  // for values fetched when first used
   bool big_endian;
   bool ndpi;
   GPtrArray *directories;
   GMutex *value_lock;
+  int refcount;
 };
 
 struct tiff_directory {
@@ -77,30 +82,15 @@ struct tiff_item {
 static void fix_byte_order(void *data, int32_t size, int64_t count,
                            bool big_endian) {
   switch (size) {
-  case 1: {
-    break;
-  }
-  case 2: {
-    uint16_t *arr = data;
-    for (int64_t i = 0; i < count; i++) {
-      arr[i] = big_endian ? GUINT16_FROM_BE(arr[i]) : GUINT16_FROM_LE(arr[i]);
-    }
+  case 1:
     break;
-  }
-  case 4: {
-    uint32_t *arr = data;
-    for (int64_t i = 0; i < count; i++) {
-      arr[i] = big_endian ? GUINT32_FROM_BE(arr[i]) : GUINT32_FROM_LE(arr[i]);
+  case 2:
+  case 4:
+  case 8:
+    if (big_endian != (G_BYTE_ORDER == G_BIG_ENDIAN)) {
+      _openslide_pixel_swap_bytes(data, size, count);
     }
     break;
-  }
-  case 8: {
-    uint64_t *arr = data;
-    for (int64_t i = 0; i < count; i++) {
-      arr[i] = big_endian ? GUINT64_FROM_BE(arr[i]) : GUINT64_FROM_LE(arr[i]);
-    }
-    break;
-  }
   default:
     g_assert_not_reached();
     break;
@@ -212,7 +202,7 @@ static uint64_t fix_offset_ndpi(uint64_t diroff, uint64_t offset) {
     }									\
   } while (0)
 
-// value_lock must be held
+// value_lock must be held, unless the item is private
 static bool set_item_values(struct tiff_item *item,
                             const void *buf,
                             GError **err) {
@@ -330,60 +320,73 @@ FAIL:
   return false;
 }
 
+// fetch an array left at its offset with one ranged read, and convert
+// it outside value_lock, so other values can be read meanwhile; once
+// set, values are shared read-only by every caller
 static bool populate_item(struct _openslide_tifflike *tl,
                           struct tiff_item *item,
                           GError **err) {
-  void *buf = NULL;
-  bool success = false;
-
   g_mutex_lock(tl->value_lock);
-  if (item->offset == NO_OFFSET) {
-    g_mutex_unlock(tl->value_lock);
+  uint64_t offset = item->offset;
+  g_mutex_unlock(tl->value_lock);
+  if (offset == NO_OFFSET) {
     return true;
   }
 
-  URLIO_FILE *f = _openslide_fopen(tl->filename, "rb", err);
-  if (!f) {
-    goto FAIL;
-  }
-
   uint64_t count = item->count;
   int32_t value_size = get_value_size(item->type, &count);
   g_assert(value_size);
-  ssize_t len = value_size * count;
+  gsize len = value_size * count;
 
-  buf = g_try_malloc(len);
+  void *buf = g_try_malloc(len);
   if (buf == NULL) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Cannot allocate TIFF value");
-    goto FAIL;
+    return false;
   }
 
-  //g_debug("reading tiff value: len: %"PRId64", offset %"PRIu64, len, item->offset);
-  if (urlio_fseek(f, item->offset, SEEK_SET)) {
-    _openslide_io_error(err, "Couldn't seek to read TIFF value");
-    goto FAIL;
-  }
-  if (urlio_fread(buf, len, 1, f) != 1) {
+  //g_debug("reading tiff value: len: %"PRIu64", offset %"PRIu64, len, offset);
+  guint64 fetch_offset = offset;
+  guint64 fetch_len = len;
+  urlio_fetch_ranges(tl->file, &fetch_offset, &fetch_len, 1);
+  if (urlio_pread(tl->file, buf, len, offset) != len) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Couldn't read TIFF value");
-    goto FAIL;
+    g_free(buf);
+    return false;
   }
 
   fix_byte_order(buf, value_size, count, tl->big_endian);
-  if (!set_item_values(item, buf, err)) {
-    goto FAIL;
+  struct tiff_item values = {
+    .type = item->type,
+    .count = item->count,
+  };
+  bool success = set_item_values(&values, buf, err);
+  g_free(buf);
+  if (!success) {
+    g_free(values.uints);
+    g_free(values.sints);
+    g_free(values.floats);
+    g_free(values.buffer);
+    return false;
   }
 
-  success = true;
-
-FAIL:
-  g_mutex_unlock(tl->value_lock);
-  g_free(buf);
-  if (f) {
-    urlio_fclose(f);
+  // publish, unless another thread got there first
+  g_mutex_lock(tl->value_lock);
+  if (item->offset != NO_OFFSET) {
+    item->uints = values.uints;
+    item->sints = values.sints;
+    item->floats = values.floats;
+    item->buffer = values.buffer;
+    item->offset = NO_OFFSET;
+    values = (struct tiff_item) {0};
   }
-  return success;
+  g_mutex_unlock(tl->value_lock);
+  g_free(values.uints);
+  g_free(values.sints);
+  g_free(values.floats);
+  g_free(values.buffer);
+  return true;
 }
 
 static void tiff_directory_destroy(struct tiff_directory *d) {
@@ -546,6 +549,40 @@ static struct tiff_directory *read_directory(URLIO_FILE *f, int64_t *diroff,
   }
   *diroff = nextdiroff;
 
+  // fetch the values of this directory and the start of the next one in
+  // one go, rather than one round trip each when they are first read.
+  // Not while probing for NDPI, whose guesses may be garbage.
+  if (ndpi && !first_dir) {
+    return d;
+  }
+  GArray *offsets = g_array_new(FALSE, FALSE, sizeof(guint64));
+  GArray *lens = g_array_new(FALSE, FALSE, sizeof(guint64));
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, d->items);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    struct tiff_item *item = value;
+    if (item->offset == NO_OFFSET) {
+      continue;
+    }
+    uint64_t count = item->count;
+    guint64 len = get_value_size(item->type, &count) * count;
+    if (len <= PREFETCH_VALUE_MAX) {
+      g_array_append_val(offsets, item->offset);
+      g_array_append_val(lens, len);
+    }
+  }
+  if (nextdiroff > 0) {
+    guint64 next = nextdiroff;
+    guint64 len = 1;
+    g_array_append_val(offsets, next);
+    g_array_append_val(lens, len);
+  }
+  urlio_fetch_ranges(f, (guint64 *) offsets->data, (guint64 *) lens->data,
+                     offsets->len);
+  g_array_free(offsets, TRUE);
+  g_array_free(lens, TRUE);
+
   // success
   return d;
 
@@ -560,6 +597,8 @@ struct _openslide_tifflike *_openslide_tifflike_create(const char *filename,
   struct _openslide_tifflike *tl = NULL;
   GHashTable *loop_detector = NULL;
 
+  _openslide_trace_begin("parse ifds");
+
   // open file
   URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
   if (!f) {
@@ -616,12 +655,26 @@ struct _openslide_tifflike *_openslide_tifflike_create(const char *filename,
     goto FAIL;
   }
 
+  // the head of a remote file came with its size probe; if the first
+  // directory is near the end, the directories likely all are, so fetch
+  // the tail at once
+  int64_t size = urlio_fsize(f);
+  int64_t tail_start = MAX(size - BOOTSTRAP_TAIL_SIZE, 0);
+  int64_t first_diroff = bigtiff ? diroff : (diroff & 0xffffffff);
+  if (size > 0 && first_diroff >= tail_start) {
+    guint64 offset = tail_start;
+    guint64 len = size - tail_start;
+    urlio_fetch_ranges(f, &offset, &len, 1);
+  }
+
   // allocate struct
   tl = g_slice_new0(struct _openslide_tifflike);
   tl->filename = g_strdup(filename);
   tl->big_endian = big_endian;
   tl->directories = g_ptr_array_new();
   tl->value_lock = g_mutex_new();
+  tl->refcount = 1;
+  tl->file = f;
 
   // initialize directory reading
   loop_detector = g_hash_table_new_full(_openslide_int64_hash,
@@ -696,23 +749,31 @@ struct _openslide_tifflike *_openslide_tifflike_create(const char *filename,
   }
 
   g_hash_table_unref(loop_detector);
-  urlio_fclose(f);
+  _openslide_trace_end();
   return tl;
 
 FAIL:
-  _openslide_tifflike_destroy(tl);
+  if (tl) {
+    // closes f
+    _openslide_tifflike_destroy(tl);
+  } else if (f) {
+    urlio_fclose(f);
+  }
   if (loop_detector) {
     g_hash_table_unref(loop_detector);
   }
-  if (f) {
-    urlio_fclose(f);
-  }
+  _openslide_trace_end();
   return NULL;
 }
 
 
+struct _openslide_tifflike *_openslide_tifflike_ref(struct _openslide_tifflike *tl) {
+  g_atomic_int_inc(&tl->refcount);
+  return tl;
+}
+
 void _openslide_tifflike_destroy(struct _openslide_tifflike *tl) {
-  if (tl == NULL) {
+  if (tl == NULL || !g_atomic_int_dec_and_test(&tl->refcount)) {
     return;
   }
   g_mutex_lock(tl->value_lock);
@@ -721,6 +782,9 @@ void _openslide_tifflike_destroy(struct _openslide_tifflike *tl) {
   }
   g_mutex_unlock(tl->value_lock);
   g_ptr_array_free(tl->directories, true);
+  if (tl->file) {
+    urlio_fclose(tl->file);
+  }
   g_free(tl->filename);
   g_mutex_free(tl->value_lock);
   g_slice_free(struct _openslide_tifflike, tl);
@@ -1153,14 +1217,8 @@ static bool hash_tiff_level(struct _openslide_hash *hash,
   }
 
   // hash raw data of each tile/strip
-  for (int64_t i = 0; i < count; i++) {
-    if (!_openslide_hash_file_part(hash, tl->filename, offsets[i], lengths[i],
-                                   err)) {
-      return false;
-    }
-  }
-
-  return true;
+  return _openslide_hash_file_parts(hash, tl->filename, offsets, lengths,
+                                    count, err);
 }
 
 bool _openslide_tifflike_init_properties_and_hash(openslide_t *osr,
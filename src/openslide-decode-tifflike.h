@@ -35,6 +35,9 @@
 struct _openslide_tifflike *_openslide_tifflike_create(const char *filename,
                                                        GError **err);
 
+struct _openslide_tifflike *_openslide_tifflike_ref(struct _openslide_tifflike *tl);
+
+// drops a reference; the last one frees the directories
 void _openslide_tifflike_destroy(struct _openslide_tifflike *tl);
 
 bool _openslide_tifflike_init_properties_and_hash(openslide_t *osr,
@@ -30,6 +30,8 @@
 #include <stdlib.h>
 #include <math.h>
 #include <libxml/parser.h>
+#include <libxml/parserInternals.h>
+#include <libxml/SAX2.h>
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
@@ -47,6 +49,208 @@ xmlDoc *_openslide_xml_parse(const char *xml, GError **err) {
   return doc;
 }
 
+/*
+ * Pruned parsing: libxml builds the tree, but the text of each element is
+ * cut to a limit before it is copied in, so that large base64 payloads
+ * are never materialized.  Their full contents can be decoded later, as
+ * they stream by, from the path of their element.
+ */
+
+struct pruned_state {
+  int max_text;
+  xmlNode *node;  // element whose text is being counted
+  int text_len;
+};
+
+static void pruned_characters(void *ctx, const xmlChar *ch, int len) {
+  xmlParserCtxt *ctxt = ctx;
+  struct pruned_state *state = ctxt->_private;
+  if (ctxt->node != state->node) {
+    state->node = ctxt->node;
+    state->text_len = 0;
+  }
+  len = MIN(len, state->max_text - state->text_len);
+  if (len > 0) {
+    xmlSAX2Characters(ctx, ch, len);
+    state->text_len += len;
+  }
+}
+
+xmlDoc *_openslide_xml_parse_pruned(const char *xml, int max_text,
+                                    GError **err) {
+  xmlParserCtxt *ctxt = xmlCreateMemoryParserCtxt(xml, strlen(xml));
+  if (ctxt == NULL) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Could not parse XML");
+    return NULL;
+  }
+
+  struct pruned_state state = {
+    .max_text = max_text,
+  };
+  xmlSAXVersion(ctxt->sax, 2);
+  ctxt->sax->characters = pruned_characters;
+  ctxt->sax->cdataBlock = NULL;
+  ctxt->_private = &state;
+  xmlCtxtUseOptions(ctxt, XML_PARSE_NOERROR |
+                          XML_PARSE_NOWARNING |
+                          XML_PARSE_NONET);
+
+  xmlParseDocument(ctxt);
+  xmlDoc *doc = ctxt->myDoc;
+  if (!ctxt->wellFormed) {
+    xmlFreeDoc(doc);
+    doc = NULL;
+  }
+  xmlFreeParserCtxt(ctxt);
+
+  if (doc == NULL || xmlDocGetRootElement(doc) == NULL) {
+    xmlFreeDoc(doc);
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Could not parse XML");
+    return NULL;
+  }
+  return doc;
+}
+
+char *_openslide_xml_get_node_path(xmlNode *node) {
+  GString *path = g_string_new("");
+  for (; node && node->type == XML_ELEMENT_NODE; node = node->parent) {
+    int index = 0;
+    for (xmlNode *sib = xmlPreviousElementSibling(node); sib;
+         sib = xmlPreviousElementSibling(sib)) {
+      index++;
+    }
+    char *elt = g_strdup_printf("/%d", index);
+    g_string_prepend(path, elt);
+    g_free(elt);
+  }
+  return g_string_free(path, false);
+}
+
+struct extract_state {
+  int64_t *path;
+  int path_len;
+  GArray *children;  // elements seen so far at each depth
+  int depth;
+  int matched;       // leading path components we are within
+  bool found;
+
+  GByteArray *out;
+  gint b64_state;
+  guint b64_save;
+};
+
+static void extract_start_element(void *ctx,
+                                  const xmlChar *localname G_GNUC_UNUSED,
+                                  const xmlChar *prefix G_GNUC_UNUSED,
+                                  const xmlChar *uri G_GNUC_UNUSED,
+                                  int nb_namespaces G_GNUC_UNUSED,
+                                  const xmlChar **namespaces G_GNUC_UNUSED,
+                                  int nb_attributes G_GNUC_UNUSED,
+                                  int nb_defaulted G_GNUC_UNUSED,
+                                  const xmlChar **attributes G_GNUC_UNUSED) {
+  xmlParserCtxt *ctxt = ctx;
+  struct extract_state *state = ctxt->_private;
+
+  if ((int) state->children->len < state->depth + 2) {
+    g_array_set_size(state->children, state->depth + 2);
+  }
+  int64_t index = g_array_index(state->children, int64_t, state->depth)++;
+  g_array_index(state->children, int64_t, state->depth + 1) = 0;
+  if (state->matched == state->depth && state->depth < state->path_len &&
+      state->path[state->depth] == index) {
+    state->matched++;
+  }
+  state->depth++;
+}
+
+static void extract_end_element(void *ctx,
+                                const xmlChar *localname G_GNUC_UNUSED,
+                                const xmlChar *prefix G_GNUC_UNUSED,
+                                const xmlChar *uri G_GNUC_UNUSED) {
+  xmlParserCtxt *ctxt = ctx;
+  struct extract_state *state = ctxt->_private;
+
+  if (state->matched == state->path_len && state->depth == state->path_len) {
+    // done with the element
+    state->found = true;
+    xmlStopParser(ctxt);
+  }
+  state->depth--;
+  state->matched = MIN(state->matched, state->depth);
+}
+
+static void extract_characters(void *ctx, const xmlChar *ch, int len) {
+  xmlParserCtxt *ctxt = ctx;
+  struct extract_state *state = ctxt->_private;
+
+  if (state->matched != state->path_len ||
+      state->depth != state->path_len) {
+    return;
+  }
+  guint pos = state->out->len;
+  g_byte_array_set_size(state->out, pos + (len / 4) * 3 + 3);
+  gsize count = g_base64_decode_step((const gchar *) ch, len,
+                                     state->out->data + pos,
+                                     &state->b64_state, &state->b64_save);
+  g_byte_array_set_size(state->out, pos + count);
+}
+
+void *_openslide_xml_decode_base64_at_path(const char *xml, const char *path,
+                                           gsize *len, GError **err) {
+  // parse path
+  char **components = g_strsplit(path, "/", 0);
+  GArray *path_arr = g_array_new(false, false, sizeof(int64_t));
+  for (char **c = components; *c; c++) {
+    if (**c) {
+      int64_t index = g_ascii_strtoll(*c, NULL, 10);
+      g_array_append_val(path_arr, index);
+    }
+  }
+  g_strfreev(components);
+
+  xmlParserCtxt *ctxt = xmlCreateMemoryParserCtxt(xml, strlen(xml));
+  if (ctxt == NULL) {
+    g_array_free(path_arr, true);
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Could not parse XML");
+    return NULL;
+  }
+
+  struct extract_state state = {
+    .path = (int64_t *) path_arr->data,
+    .path_len = path_arr->len,
+    .children = g_array_new(false, true, sizeof(int64_t)),
+    .out = g_byte_array_new(),
+  };
+  // no tree, just the callbacks
+  memset(ctxt->sax, 0, sizeof(*ctxt->sax));
+  ctxt->sax->initialized = XML_SAX2_MAGIC;
+  ctxt->sax->startElementNs = extract_start_element;
+  ctxt->sax->endElementNs = extract_end_element;
+  ctxt->sax->characters = extract_characters;
+  ctxt->sax->cdataBlock = extract_characters;
+  ctxt->_private = &state;
+  xmlCtxtUseOptions(ctxt, XML_PARSE_NOERROR |
+                          XML_PARSE_NOWARNING |
+                          XML_PARSE_NONET);
+
+  xmlParseDocument(ctxt);
+  xmlFreeParserCtxt(ctxt);
+  g_array_free(state.children, true);
+  g_array_free(path_arr, true);
+
+  if (!state.found) {
+    g_byte_array_free(state.out, true);
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Couldn't find XML element %s", path);
+    return NULL;
+  }
+  *len = state.out->len;
+  return g_byte_array_free(state.out, false);
+}
+
 bool _openslide_xml_has_default_namespace(xmlDoc *doc, const char *ns) {
   xmlNode *root = xmlDocGetRootElement(doc);
   if (ns && root->ns) {
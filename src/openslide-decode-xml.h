@@ -33,6 +33,17 @@
 
 xmlDoc *_openslide_xml_parse(const char *xml, GError **err);
 
+// like _openslide_xml_parse, but element text is cut to max_text bytes
+xmlDoc *_openslide_xml_parse_pruned(const char *xml, int max_text,
+                                    GError **err);
+
+// element indices from the root, for _openslide_xml_decode_base64_at_path
+char *_openslide_xml_get_node_path(xmlNode *node);
+
+// decode the full text of an element as it streams by, without a tree
+void *_openslide_xml_decode_base64_at_path(const char *xml, const char *path,
+                                           gsize *len, GError **err);
+
 bool _openslide_xml_has_default_namespace(xmlDoc *doc, const char *ns);
 
 int64_t _openslide_xml_parse_int_attr(xmlNode *node, const char *name,
@@ -20,15 +20,20 @@
  */
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <glib.h>
 #include <cairo.h>
 #include "openslide-private.h"
 
-#define RANGE_BIN_SIZE_MULTIPLIER 3
+// tilemaps at least this full are stored in arrays
+#define TILEMAP_DENSE_MIN_PERCENT 50
+
+// children per node of the range grid index
+#define RANGE_NODE_FANOUT 16
 #define COLOR_TILE 0.6, 0,   0,   0.3
-#define COLOR_BIN  0,   0,   0.6, 0.15
+#define COLOR_NODE 0,   0,   0.6, 0.15
 
 struct region {
   double x;
@@ -86,12 +91,17 @@ struct simple_grid {
   int64_t tiles_across;
   int64_t tiles_down;
   _openslide_grid_simple_read_fn read_tile;
+  _openslide_grid_simple_tile_fn get_tile;
 };
 
 struct tilemap_grid {
   struct _openslide_grid base;
 
-  GHashTable *tiles;
+  GHashTable *tiles;  // until finished, or kept if sparse
+
+  // tiles of a mostly full map, arrays indexed by
+  // (row - dense_row) * dense_cols + (col - dense_col)
+  struct tilemap_dense *dense;
   _openslide_grid_tilemap_read_fn read_tile;
   GDestroyNotify destroy_tile;
 
@@ -109,6 +119,20 @@ struct tilemap_grid {
   int32_t extra_tiles_right;
 };
 
+struct tilemap_dense {
+  int64_t col;
+  int64_t row;
+  int64_t cols;
+  int64_t rows;
+
+  uint32_t *present;  // bitmap
+  void **data;
+  double *w;
+  double *h;
+  double *offset_x;
+  double *offset_y;
+};
+
 struct tilemap_tile {
   struct tilemap_grid *grid;
   void *data;
@@ -126,12 +150,25 @@ struct tilemap_tile {
 struct range_grid {
   struct _openslide_grid base;
 
-  int bin_width;
-  int bin_height;
-
-  GPtrArray *tiles;
-  GHashTable *bins_init;  // address -> GPtrArray<tile>
-  GHashTable *bins_runtime;  // address -> [tile]
+  // tiles as parallel arrays, in order of id while adding, then in
+  // paint order
+  int64_t count;
+  int64_t alloc;
+  double *x;
+  double *y;
+  double *w;
+  double *h;
+  void **data;
+  int64_t *ids;  // of each sorted tile, once finished
+
+  // packed R-tree, built when adding tiles is finished.  leaves are the
+  // tiles in paint order, and each node covers RANGE_NODE_FANOUT
+  // consecutive nodes of the level below, so a depth-first walk finds the
+  // tiles of a region already in paint order
+  struct range_node *nodes;    // all levels, bottom first
+  int level_count;
+  int64_t level_start[64];     // index of the first node of each level
+  int64_t level_len[64];
 
   _openslide_grid_range_read_fn read_tile;
   GDestroyNotify destroy_tile;
@@ -143,19 +180,11 @@ struct range_grid {
   double right;
 };
 
-struct range_bin_address {
-  int64_t col;
-  int64_t row;
-};
-
-struct range_tile {
-  int64_t id;
-  void *data;
-
-  double x;
-  double y;
-  double w;
-  double h;
+struct range_node {
+  double x0;
+  double y0;
+  double x1;
+  double y1;
 };
 
 static void compute_region(struct _openslide_grid *grid,
@@ -234,6 +263,20 @@ static bool read_tiles(cairo_t *cr,
   return true;
 }
 
+static const cairo_user_data_key_t direct_target_key;
+
+void _openslide_grid_set_direct_target(cairo_surface_t *surface) {
+  cairo_surface_set_user_data(surface, &direct_target_key,
+                              (void *) &direct_target_key, NULL);
+}
+
+// painting goes straight to a marked surface, not into a group
+bool _openslide_grid_is_direct_target(cairo_t *cr) {
+  cairo_surface_t *target = cairo_get_group_target(cr);
+  return cairo_surface_get_user_data(target, &direct_target_key) != NULL &&
+    cairo_image_surface_get_format(target) == CAIRO_FORMAT_ARGB32;
+}
+
 static void label_tile(cairo_t *cr,
                        double r, double g, double b, double a,
                        double w, double h,
@@ -290,6 +333,91 @@ static bool simple_read_tile(struct _openslide_grid *_grid,
   return true;
 }
 
+// with whole-pixel tiles and offsets, copy the clipped rows of each tile
+// into the direct target; returns false in *handled if that doesn't apply
+static bool simple_copy_region(struct simple_grid *grid,
+                               cairo_t *cr,
+                               void *arg,
+                               double x, double y,
+                               struct _openslide_level *level,
+                               int32_t w, int32_t h,
+                               bool *handled,
+                               GError **err) {
+  *handled = false;
+
+  int64_t adv_x = grid->base.tile_advance_x;
+  int64_t adv_y = grid->base.tile_advance_y;
+  cairo_matrix_t matrix;
+  cairo_get_matrix(cr, &matrix);
+  if (!grid->get_tile ||
+      _openslide_debug(OPENSLIDE_DEBUG_TILES) ||
+      adv_x != grid->base.tile_advance_x ||
+      adv_y != grid->base.tile_advance_y ||
+      x != floor(x) || y != floor(y) ||
+      matrix.xx != 1 || matrix.yy != 1 || matrix.xy != 0 || matrix.yx != 0 ||
+      matrix.x0 != floor(matrix.x0) || matrix.y0 != floor(matrix.y0) ||
+      !_openslide_grid_is_direct_target(cr)) {
+    return true;
+  }
+  *handled = true;
+
+  cairo_surface_t *target = cairo_get_group_target(cr);
+  cairo_surface_flush(target);
+  uint8_t *data = cairo_image_surface_get_data(target);
+  int64_t stride = cairo_image_surface_get_stride(target);
+
+  // region in the target, clipped to it
+  int64_t x0 = matrix.x0;
+  int64_t y0 = matrix.y0;
+  int64_t left = MAX(x0, 0);
+  int64_t top = MAX(y0, 0);
+  int64_t right = MIN(x0 + w, cairo_image_surface_get_width(target));
+  int64_t bottom = MIN(y0 + h, cairo_image_surface_get_height(target));
+  if (left >= right || top >= bottom) {
+    return true;
+  }
+
+  // tiles under it, in the level plane
+  int64_t lx = x + (left - x0);
+  int64_t ly = y + (top - y0);
+  int64_t start_col = MAX(lx / adv_x, 0);
+  int64_t start_row = MAX(ly / adv_y, 0);
+  int64_t end_col = MIN((lx + (right - left) + adv_x - 1) / adv_x,
+                        grid->tiles_across);
+  int64_t end_row = MIN((ly + (bottom - top) + adv_y - 1) / adv_y,
+                        grid->tiles_down);
+
+  for (int64_t row = start_row; row < end_row; row++) {
+    for (int64_t col = start_col; col < end_col; col++) {
+      uint32_t *tiledata;
+      struct _openslide_cache_entry *cache_entry;
+      if (!grid->get_tile(grid->base.osr, level, col, row, arg,
+                          &tiledata, &cache_entry, err)) {
+        cairo_surface_mark_dirty(target);
+        return false;
+      }
+
+      // tile rectangle in the target, clipped to the region
+      int64_t tx = col * adv_x - x + x0;
+      int64_t ty = row * adv_y - y + y0;
+      int64_t cx0 = MAX(tx, left);
+      int64_t cy0 = MAX(ty, top);
+      int64_t cx1 = MIN(tx + adv_x, right);
+      int64_t cy1 = MIN(ty + adv_y, bottom);
+      for (int64_t cy = cy0; cy < cy1; cy++) {
+        memcpy(data + cy * stride + cx0 * 4,
+               tiledata + (cy - ty) * adv_x + (cx0 - tx),
+               (cx1 - cx0) * 4);
+      }
+      _openslide_cache_entry_unref(cache_entry);
+    }
+  }
+
+  cairo_surface_mark_dirty_rectangle(target, left, top,
+                                     right - left, bottom - top);
+  return true;
+}
+
 static bool simple_paint_region(struct _openslide_grid *_grid,
                                 cairo_t *cr,
                                 void *arg,
@@ -300,6 +428,13 @@ static bool simple_paint_region(struct _openslide_grid *_grid,
   struct simple_grid *grid = (struct simple_grid *) _grid;
   struct region region;
 
+  bool handled;
+  bool success = simple_copy_region(grid, cr, arg, x, y, level, w, h,
+                                    &handled, err);
+  if (handled) {
+    return success;
+  }
+
   compute_region(_grid, x, y, w, h, &region);
 
   // check if completely outside grid
@@ -366,6 +501,13 @@ struct _openslide_grid *_openslide_grid_create_simple(openslide_t *osr,
   return (struct _openslide_grid *) grid;
 }
 
+void _openslide_grid_simple_set_tile_fn(struct _openslide_grid *_grid,
+                                        _openslide_grid_simple_tile_fn get_tile) {
+  g_assert(_grid->ops == &simple_grid_ops);
+  struct simple_grid *grid = (struct simple_grid *) _grid;
+  grid->get_tile = get_tile;
+}
+
 
 
 static guint tilemap_tile_hash_func(gconstpointer key) {
@@ -390,6 +532,40 @@ static void tilemap_tile_hash_destroy_value(gpointer data) {
   g_slice_free(struct tilemap_tile, tile);
 }
 
+// find a tile; a tile of a dense map is filled into storage
+static struct tilemap_tile *tilemap_lookup(struct tilemap_grid *grid,
+                                           int64_t col, int64_t row,
+                                           struct tilemap_tile *storage) {
+  struct tilemap_dense *dense = grid->dense;
+
+  if (dense == NULL) {
+    struct tilemap_tile coords = {
+      .col = col,
+      .row = row,
+    };
+    return g_hash_table_lookup(grid->tiles, &coords);
+  }
+
+  col -= dense->col;
+  row -= dense->row;
+  if (col < 0 || row < 0 || col >= dense->cols || row >= dense->rows) {
+    return NULL;
+  }
+  int64_t i = row * dense->cols + col;
+  if (!(dense->present[i / 32] & (1U << (i % 32)))) {
+    return NULL;
+  }
+  storage->grid = grid;
+  storage->data = dense->data[i];
+  storage->col = col + dense->col;
+  storage->row = row + dense->row;
+  storage->w = dense->w[i];
+  storage->h = dense->h[i];
+  storage->offset_x = dense->offset_x[i];
+  storage->offset_y = dense->offset_y[i];
+  return storage;
+}
+
 static void tilemap_get_bounds(struct _openslide_grid *_grid,
                                struct bounds *bounds) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
@@ -411,11 +587,9 @@ static bool tilemap_read_tile(struct _openslide_grid *_grid,
                               GError **err) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
 
-  struct tilemap_tile coords = {
-    .col = tile_col,
-    .row = tile_row,
-  };
-  struct tilemap_tile *tile = g_hash_table_lookup(grid->tiles, &coords);
+  struct tilemap_tile dense_tile;
+  struct tilemap_tile *tile = tilemap_lookup(grid, tile_col, tile_row,
+                                             &dense_tile);
   if (tile == NULL) {
     //g_debug("no tile at %"PRId64", %"PRId64, tile_col, tile_row);
     return true;
@@ -494,7 +668,26 @@ static bool tilemap_paint_region(struct _openslide_grid *_grid,
 static void tilemap_destroy(struct _openslide_grid *_grid) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
 
-  g_hash_table_destroy(grid->tiles);
+  struct tilemap_dense *dense = grid->dense;
+  if (dense) {
+    int64_t count = dense->cols * dense->rows;
+    for (int64_t i = 0; i < count; i++) {
+      if ((dense->present[i / 32] & (1U << (i % 32))) &&
+          grid->destroy_tile && dense->data[i]) {
+        grid->destroy_tile(dense->data[i]);
+      }
+    }
+    g_free(dense->present);
+    g_free(dense->data);
+    g_free(dense->w);
+    g_free(dense->h);
+    g_free(dense->offset_x);
+    g_free(dense->offset_y);
+    g_slice_free(struct tilemap_dense, dense);
+  }
+  if (grid->tiles) {
+    g_hash_table_destroy(grid->tiles);
+  }
   g_slice_free(struct tilemap_grid, grid);
 }
 
@@ -504,6 +697,36 @@ static const struct grid_ops tilemap_grid_ops = {
   .destroy = tilemap_destroy,
 };
 
+void _openslide_grid_tilemap_get_tiles(struct _openslide_grid *_grid,
+                                       double x, double y,
+                                       int32_t w, int32_t h,
+                                       GPtrArray *tiles) {
+  struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
+  g_assert(grid->base.ops == &tilemap_grid_ops);
+  struct region region;
+
+  // the tiles tilemap_paint_region() would read
+  compute_region(_grid, x, y, w, h, &region);
+  for (int64_t row = region.start_tile_y - grid->extra_tiles_top;
+       row < region.end_tile_y + grid->extra_tiles_bottom; row++) {
+    for (int64_t col = region.start_tile_x - grid->extra_tiles_left;
+         col < region.end_tile_x + grid->extra_tiles_right; col++) {
+      struct tilemap_tile dense_tile;
+      struct tilemap_tile *tile = tilemap_lookup(grid, col, row, &dense_tile);
+      if (tile == NULL) {
+        continue;
+      }
+      double tx = col * grid->base.tile_advance_x + tile->offset_x;
+      double ty = row * grid->base.tile_advance_y + tile->offset_y;
+      if (tx + tile->w <= x || ty + tile->h <= y ||
+          tx >= x + w || ty >= y + h) {
+        continue;
+      }
+      g_ptr_array_add(tiles, tile->data);
+    }
+  }
+}
+
 void _openslide_grid_tilemap_add_tile(struct _openslide_grid *_grid,
                                       int64_t col, int64_t row,
                                       double offset_x, double offset_y,
@@ -511,6 +734,7 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *_grid,
                                       void *data) {
   struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
   g_assert(grid->base.ops == &tilemap_grid_ops);
+  g_assert(grid->dense == NULL);
 
   struct tilemap_tile *tile = g_slice_new0(struct tilemap_tile);
   tile->grid = grid;
@@ -559,6 +783,73 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *_grid,
   //g_debug("%p: extra_left: %d, extra_right: %d, extra_top: %d, extra_bottom: %d", (void *) grid, grid->extra_tiles_left, grid->extra_tiles_right, grid->extra_tiles_top, grid->extra_tiles_bottom);
 }
 
+// move the tiles of a mostly full map into arrays, which take far less
+// memory than hash entries and are indexed directly
+void _openslide_grid_tilemap_finish_adding_tiles(struct _openslide_grid *_grid) {
+  struct tilemap_grid *grid = (struct tilemap_grid *) _grid;
+  g_assert(grid->base.ops == &tilemap_grid_ops);
+  g_assert(grid->dense == NULL);
+
+  guint count = g_hash_table_size(grid->tiles);
+  if (count == 0) {
+    return;
+  }
+
+  // extent of the map
+  int64_t min_col = INT64_MAX;
+  int64_t min_row = INT64_MAX;
+  int64_t max_col = INT64_MIN;
+  int64_t max_row = INT64_MIN;
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, grid->tiles);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    struct tilemap_tile *tile = value;
+    min_col = MIN(min_col, tile->col);
+    min_row = MIN(min_row, tile->row);
+    max_col = MAX(max_col, tile->col);
+    max_row = MAX(max_row, tile->row);
+  }
+  int64_t cols = max_col - min_col + 1;
+  int64_t rows = max_row - min_row + 1;
+  if (cols > INT64_MAX / rows ||
+      cols * rows / 100 * TILEMAP_DENSE_MIN_PERCENT > (int64_t) count) {
+    return;
+  }
+
+  struct tilemap_dense *dense = g_slice_new0(struct tilemap_dense);
+  int64_t cells = cols * rows;
+  dense->col = min_col;
+  dense->row = min_row;
+  dense->cols = cols;
+  dense->rows = rows;
+  dense->present = g_new0(uint32_t, (cells + 31) / 32);
+  dense->data = g_new(void *, cells);
+  dense->w = g_new(double, cells);
+  dense->h = g_new(double, cells);
+  dense->offset_x = g_new(double, cells);
+  dense->offset_y = g_new(double, cells);
+
+  g_hash_table_iter_init(&iter, grid->tiles);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    struct tilemap_tile *tile = value;
+    int64_t i = (tile->row - min_row) * cols + (tile->col - min_col);
+    dense->present[i / 32] |= 1U << (i % 32);
+    dense->data[i] = tile->data;
+    dense->w[i] = tile->w;
+    dense->h[i] = tile->h;
+    dense->offset_x[i] = tile->offset_x;
+    dense->offset_y[i] = tile->offset_y;
+
+    // the tile data now belongs to the arrays
+    g_hash_table_iter_steal(&iter);
+    g_slice_free(struct tilemap_tile, tile);
+  }
+  g_hash_table_destroy(grid->tiles);
+  grid->tiles = NULL;
+  grid->dense = dense;
+}
+
 struct _openslide_grid *_openslide_grid_create_tilemap(openslide_t *osr,
                                                        double tile_advance_x,
                                                        double tile_advance_y,
@@ -587,46 +878,35 @@ struct _openslide_grid *_openslide_grid_create_tilemap(openslide_t *osr,
 
 
 
-static guint range_bin_address_hash_func(gconstpointer key) {
-  const struct range_bin_address *addr = key;
-
-  // assume 32-bit hash
-  return (guint) ((34369 * (uint64_t) addr->row) + ((uint64_t) addr->col));
-}
-
-static gboolean range_bin_address_hash_key_equal(gconstpointer a,
-                                                 gconstpointer b) {
-  const struct range_bin_address *c_a = a;
-  const struct range_bin_address *c_b = b;
-
-  return (c_a->col == c_b->col) && (c_a->row == c_b->row);
-}
+// paint order: bottom to top, right to left
+static gint range_compare_tiles(gconstpointer a, gconstpointer b,
+                                gpointer user_data) {
+  const struct range_grid *grid = user_data;
+  int64_t i_a = *(const int64_t *) a;
+  int64_t i_b = *(const int64_t *) b;
 
-static void range_bin_address_free(void *data) {
-  g_slice_free(struct range_bin_address, data);
-}
-
-static void range_ptr_array_free(void *data) {
-  g_ptr_array_free(data, true);
-}
-
-static int range_compare_tiles(gconstpointer a, gconstpointer b) {
-  const struct range_tile *c_a = a;
-  const struct range_tile *c_b = b;
-
-  if (c_a->y < c_b->y) {
+  if (grid->y[i_a] < grid->y[i_b]) {
     return 1;
-  } else if (c_a->y > c_b->y) {
+  } else if (grid->y[i_a] > grid->y[i_b]) {
     return -1;
-  } else if (c_a->x < c_b->x) {
+  } else if (grid->x[i_a] < grid->x[i_b]) {
     return 1;
-  } else if (c_a->x > c_b->x) {
+  } else if (grid->x[i_a] > grid->x[i_b]) {
     return -1;
   } else {
     return 0;
   }
 }
 
+// reorder an array of tile attributes by the sorted ids, through tmp
+static void *range_permute(void *array, void *tmp, gsize size,
+                           const int64_t *ids, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    memcpy((char *) tmp + i * size, (char *) array + ids[i] * size, size);
+  }
+  return tmp;
+}
+
 static void range_get_bounds(struct _openslide_grid *_grid,
                              struct bounds *bounds) {
   struct range_grid *grid = (struct range_grid *) _grid;
@@ -639,6 +919,74 @@ static void range_get_bounds(struct _openslide_grid *_grid,
   }
 }
 
+static bool range_intersects(double x0, double y0, double x1, double y1,
+                             double x, double y, int32_t w, int32_t h) {
+  return x1 > x && y1 > y && x0 < x + w && y0 < y + h;
+}
+
+// paint the tiles under a node which lie in the region, in paint order
+static bool range_paint_node(struct range_grid *grid,
+                             cairo_t *cr,
+                             const cairo_matrix_t *matrix,
+                             void *arg,
+                             double x, double y,
+                             struct _openslide_level *level,
+                             int32_t w, int32_t h,
+                             int node_level, int64_t node,
+                             GError **err) {
+  int64_t start = node * RANGE_NODE_FANOUT;
+
+  if (node_level == 0) {
+    int64_t end = MIN(start + RANGE_NODE_FANOUT, grid->count);
+    for (int64_t i = start; i < end; i++) {
+      if (!range_intersects(grid->x[i], grid->y[i],
+                            grid->x[i] + grid->w[i], grid->y[i] + grid->h[i],
+                            x, y, w, h)) {
+        continue;
+      }
+
+      // draw
+      //g_debug("tile x %g y %g", grid->x[i], grid->y[i]);
+      cairo_translate(cr, grid->x[i] - x, grid->y[i] - y);
+      bool success = grid->read_tile(grid->base.osr, cr, level,
+                                     grid->ids[i], grid->data[i],
+                                     arg, err);
+      if (success && _openslide_debug(OPENSLIDE_DEBUG_TILES)) {
+        char *coordinates = g_strdup_printf("%"PRId64, grid->ids[i]);
+        label_tile(cr, COLOR_TILE, grid->w[i], grid->h[i], coordinates);
+        g_free(coordinates);
+      }
+      cairo_set_matrix(cr, matrix);
+      if (!success) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int64_t end = MIN(start + RANGE_NODE_FANOUT,
+                    grid->level_len[node_level - 1]);
+  for (int64_t child = start; child < end; child++) {
+    struct range_node *n =
+      &grid->nodes[grid->level_start[node_level - 1] + child];
+    if (!range_intersects(n->x0, n->y0, n->x1, n->y1, x, y, w, h)) {
+      continue;
+    }
+    if (node_level == 1 && _openslide_debug(OPENSLIDE_DEBUG_TILES)) {
+      char *coordinates = g_strdup_printf("%"PRId64, child);
+      cairo_translate(cr, n->x0 - x, n->y0 - y);
+      label_tile(cr, COLOR_NODE, n->x1 - n->x0, n->y1 - n->y0, coordinates);
+      cairo_set_matrix(cr, matrix);
+      g_free(coordinates);
+    }
+    if (!range_paint_node(grid, cr, matrix, arg, x, y, level, w, h,
+                          node_level - 1, child, err)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static bool range_paint_region(struct _openslide_grid *_grid,
                                cairo_t *cr,
                                void *arg,
@@ -647,109 +995,44 @@ static bool range_paint_region(struct _openslide_grid *_grid,
                                int32_t w, int32_t h,
                                GError **err) {
   struct range_grid *grid = (struct range_grid *) _grid;
-  GList *tiles = NULL;
-  bool result = false;
 
   // ensure _openslide_grid_range_finish_adding_tiles() was called
-  g_assert(grid->bins_runtime);
+  g_assert(grid->nodes);
+
+  if (grid->count == 0) {
+    return true;
+  }
 
   // save
   cairo_matrix_t matrix;
   cairo_get_matrix(cr, &matrix);
 
-  // accumulate relevant tiles
-  struct range_bin_address addr;
-  for (addr.row = y / grid->bin_height;
-       addr.row < (int64_t) (y + h + grid->bin_height - 1) / grid->bin_height;
-       addr.row++) {
-    for (addr.col = x / grid->bin_width;
-         addr.col < (int64_t) (x + w + grid->bin_width - 1) / grid->bin_width;
-         addr.col++) {
-      struct range_tile **cur = g_hash_table_lookup(grid->bins_runtime,
-                                                    &addr);
-      if (cur) {
-        for (; *cur; cur++) {
-          struct range_tile *tile = *cur;
-          // skip tile if it's outside the requested region
-          if (tile->x + tile->w <= x ||
-              tile->y + tile->h <= y ||
-              tile->x >= x + w ||
-              tile->y >= y + h) {
-            //g_debug("skip x %g w %g y %g h %g, region x %g w %d y %g h %d", tile->x, tile->w, tile->y, tile->h, x, w, y, h);
-            continue;
-          }
-          tiles = g_list_prepend(tiles, tile);
-        }
-      }
-      if (_openslide_debug(OPENSLIDE_DEBUG_TILES)) {
-        char *coordinates = g_strdup_printf("%"PRId64", %"PRId64,
-                                            addr.col, addr.row);
-        cairo_translate(cr,
-                        addr.col * grid->bin_width - x,
-                        addr.row * grid->bin_height - y);
-        label_tile(cr, COLOR_BIN,
-                   grid->bin_width, grid->bin_height,
-                   coordinates);
-        cairo_set_matrix(cr, &matrix);
-        g_free(coordinates);
-      }
-    }
-  }
-  tiles = g_list_sort(tiles, range_compare_tiles);
-
-  // draw tiles
-  struct range_tile *prev_tile = NULL;
-  for (GList *cur = tiles; cur; cur = cur->next) {
-    // get tile struct
-    struct range_tile *tile = cur->data;
-    if (tile == prev_tile) {
-      //g_debug("skipping repeated tile");
-      continue;
-    }
-    prev_tile = tile;
-
-    // draw
-    //g_debug("tile x %g y %g", tile->x, tile->y);
-    cairo_translate(cr, tile->x - x, tile->y - y);
-    bool success = grid->read_tile(grid->base.osr, cr, level,
-                                   tile->id, tile->data,
-                                   arg, err);
-    if (success && _openslide_debug(OPENSLIDE_DEBUG_TILES)) {
-      char *coordinates = g_strdup_printf("%"PRId64, tile->id);
-      label_tile(cr, COLOR_TILE, tile->w, tile->h, coordinates);
-      g_free(coordinates);
-    }
-    cairo_set_matrix(cr, &matrix);
-    if (!success) {
-      goto DONE;
-    }
+  // walk down from the root
+  int top = grid->level_count - 1;
+  struct range_node *root = &grid->nodes[grid->level_start[top]];
+  if (!range_intersects(root->x0, root->y0, root->x1, root->y1,
+                        x, y, w, h)) {
+    return true;
   }
-
-  // success
-  result = true;
-
-DONE:
-  g_list_free(tiles);
-  return result;
+  return range_paint_node(grid, cr, &matrix, arg, x, y, level, w, h,
+                          top, 0, err);
 }
 
 static void range_destroy(struct _openslide_grid *_grid) {
   struct range_grid *grid = (struct range_grid *) _grid;
 
-  if (grid->bins_init) {
-    g_hash_table_destroy(grid->bins_init);
-  }
-  if (grid->bins_runtime) {
-    g_hash_table_destroy(grid->bins_runtime);
-  }
-  for (uint64_t cur = 0; cur < grid->tiles->len; cur++) {
-    struct range_tile *tile = grid->tiles->pdata[cur];
-    if (grid->destroy_tile && tile->data) {
-      grid->destroy_tile(tile->data);
+  g_free(grid->nodes);
+  for (int64_t cur = 0; cur < grid->count; cur++) {
+    if (grid->destroy_tile && grid->data[cur]) {
+      grid->destroy_tile(grid->data[cur]);
     }
-    g_slice_free(struct range_tile, tile);
   }
-  g_ptr_array_free(grid->tiles, true);
+  g_free(grid->x);
+  g_free(grid->y);
+  g_free(grid->w);
+  g_free(grid->h);
+  g_free(grid->data);
+  g_free(grid->ids);
   g_slice_free(struct range_grid, grid);
 }
 
@@ -765,36 +1048,22 @@ void _openslide_grid_range_add_tile(struct _openslide_grid *_grid,
                                     void *data) {
   struct range_grid *grid = (struct range_grid *) _grid;
   g_assert(grid->base.ops == &range_grid_ops);
-  g_assert(grid->bins_init);
-
-  struct range_tile *tile = g_slice_new0(struct range_tile);
-  tile->id = grid->tiles->len;
-  tile->data = data;
-  tile->x = x;
-  tile->y = y;
-  tile->w = w;
-  tile->h = h;
-  g_ptr_array_add(grid->tiles, tile);
-
-  struct range_bin_address addr;
-  for (addr.row = y / grid->bin_height;
-       addr.row < (int64_t) (y + h + grid->bin_height - 1) / grid->bin_height;
-       addr.row++) {
-    for (addr.col = x / grid->bin_width;
-         addr.col < (int64_t) (x + w + grid->bin_width - 1) / grid->bin_width;
-         addr.col++) {
-      GPtrArray *bin = g_hash_table_lookup(grid->bins_init, &addr);
-      if (!bin) {
-        bin = g_ptr_array_new();
-        struct range_bin_address *addr2 =
-          g_slice_new(struct range_bin_address);
-        addr2->col = addr.col;
-        addr2->row = addr.row;
-        g_hash_table_insert(grid->bins_init, addr2, bin);
-      }
-      g_ptr_array_add(bin, tile);
-    }
+  g_assert(!grid->nodes);
+
+  if (grid->count == grid->alloc) {
+    grid->alloc = MAX(2 * grid->alloc, 256);
+    grid->x = g_renew(double, grid->x, grid->alloc);
+    grid->y = g_renew(double, grid->y, grid->alloc);
+    grid->w = g_renew(double, grid->w, grid->alloc);
+    grid->h = g_renew(double, grid->h, grid->alloc);
+    grid->data = g_renew(void *, grid->data, grid->alloc);
   }
+  int64_t id = grid->count++;
+  grid->x[id] = x;
+  grid->y[id] = y;
+  grid->w[id] = w;
+  grid->h[id] = h;
+  grid->data[id] = data;
 
   grid->left = MIN(x, grid->left);
   grid->top = MIN(y, grid->top);
@@ -802,36 +1071,77 @@ void _openslide_grid_range_add_tile(struct _openslide_grid *_grid,
   grid->bottom = MAX(y + h, grid->bottom);
 }
 
-static void range_postprocess_bin(void *key, void *value, void *data) {
-  struct range_grid *grid = data;
-  GPtrArray *tiles = value;
-
-  struct range_tile **tile_array = g_new(struct range_tile *, tiles->len + 1);
-  memcpy(tile_array, tiles->pdata, tiles->len * sizeof(struct range_tile *));
-  tile_array[tiles->len] = NULL;
-  g_ptr_array_free(tiles, true);
-
-  g_hash_table_replace(grid->bins_runtime, key, tile_array);
-}
-
 void _openslide_grid_range_finish_adding_tiles(struct _openslide_grid *_grid) {
   struct range_grid *grid = (struct range_grid *) _grid;
   g_assert(grid->base.ops == &range_grid_ops);
-  g_assert(grid->bins_init);
-
-  grid->bins_runtime = g_hash_table_new_full(range_bin_address_hash_func,
-                                             range_bin_address_hash_key_equal,
-                                             range_bin_address_free,
-                                             g_free);
-  g_hash_table_foreach(grid->bins_init, range_postprocess_bin, grid);
-  g_hash_table_steal_all(grid->bins_init);
-  g_hash_table_destroy(grid->bins_init);
-  grid->bins_init = NULL;
+  g_assert(!grid->nodes);
+
+  // leaves, in paint order; the arrays are trimmed to the tile count
+  // while they are reordered
+  int64_t count = grid->count;
+  grid->ids = g_new(int64_t, MAX(count, 1));
+  for (int64_t i = 0; i < count; i++) {
+    grid->ids[i] = i;
+  }
+  g_qsort_with_data(grid->ids, count, sizeof(*grid->ids),
+                    range_compare_tiles, grid);
+  double *tmp = g_new(double, MAX(count, 1));
+  double **coords[] = { &grid->x, &grid->y, &grid->w, &grid->h };
+  for (guint i = 0; i < G_N_ELEMENTS(coords); i++) {
+    double *old = *coords[i];
+    *coords[i] = range_permute(old, tmp, sizeof(double), grid->ids, count);
+    tmp = g_renew(double, old, MAX(count, 1));
+  }
+  g_free(tmp);
+  void **data = g_new(void *, MAX(count, 1));
+  range_permute(grid->data, data, sizeof(void *), grid->ids, count);
+  g_free(grid->data);
+  grid->data = data;
+  grid->alloc = count;
+
+  // size the levels, up to a single root
+  int64_t total = 0;
+  int64_t len = count;
+  grid->level_count = 0;
+  do {
+    len = (len + RANGE_NODE_FANOUT - 1) / RANGE_NODE_FANOUT;
+    grid->level_start[grid->level_count] = total;
+    grid->level_len[grid->level_count] = len;
+    grid->level_count++;
+    total += len;
+  } while (len > 1);
+  grid->nodes = g_new(struct range_node, MAX(total, 1));
+
+  // bounding boxes, bottom up
+  for (int lvl = 0; lvl < grid->level_count; lvl++) {
+    for (int64_t n = 0; n < grid->level_len[lvl]; n++) {
+      struct range_node *node = &grid->nodes[grid->level_start[lvl] + n];
+      node->x0 = node->y0 = INFINITY;
+      node->x1 = node->y1 = -INFINITY;
+
+      int64_t start = n * RANGE_NODE_FANOUT;
+      int64_t end = MIN(start + RANGE_NODE_FANOUT,
+                        lvl ? grid->level_len[lvl - 1] : count);
+      for (int64_t i = start; i < end; i++) {
+        if (lvl == 0) {
+          node->x0 = MIN(node->x0, grid->x[i]);
+          node->y0 = MIN(node->y0, grid->y[i]);
+          node->x1 = MAX(node->x1, grid->x[i] + grid->w[i]);
+          node->y1 = MAX(node->y1, grid->y[i] + grid->h[i]);
+        } else {
+          struct range_node *child =
+            &grid->nodes[grid->level_start[lvl - 1] + i];
+          node->x0 = MIN(node->x0, child->x0);
+          node->y0 = MIN(node->y0, child->y0);
+          node->x1 = MAX(node->x1, child->x1);
+          node->y1 = MAX(node->y1, child->y1);
+        }
+      }
+    }
+  }
 }
 
 struct _openslide_grid *_openslide_grid_create_range(openslide_t *osr,
-                                                     int typical_tile_width,
-                                                     int typical_tile_height,
                                                      _openslide_grid_range_read_fn read_tile,
                                                      GDestroyNotify destroy_tile) {
   struct range_grid *grid = g_slice_new0(struct range_grid);
@@ -839,13 +1149,6 @@ struct _openslide_grid *_openslide_grid_create_range(openslide_t *osr,
   grid->base.ops = &range_grid_ops;
   grid->base.tile_advance_x = NAN;  // unused
   grid->base.tile_advance_y = NAN;  // unused
-  grid->bin_width = typical_tile_width * RANGE_BIN_SIZE_MULTIPLIER;
-  grid->bin_height = typical_tile_height * RANGE_BIN_SIZE_MULTIPLIER;
-  grid->tiles = g_ptr_array_new();
-  grid->bins_init = g_hash_table_new_full(range_bin_address_hash_func,
-                                          range_bin_address_hash_key_equal,
-                                          range_bin_address_free,
-                                          range_ptr_array_free);
   grid->read_tile = read_tile;
   grid->destroy_tile = destroy_tile;
 
@@ -61,59 +61,76 @@ bool _openslide_hash_file(struct _openslide_hash *hash, const char *filename,
   return _openslide_hash_file_part(hash, filename, 0, -1, err);
 }
 
+// hashed from the block cache this much at a time
+#define HASH_CHUNK_SIZE (1 << 20)
+
+static bool hash_range(struct _openslide_hash *hash, URLIO_FILE *f,
+                       const char *filename,
+                       uint64_t offset, uint64_t size,
+                       GError **err) {
+  while (size > 0) {
+    uint64_t len = MIN(size, HASH_CHUNK_SIZE);
+    URLIO_VIEW *view = urlio_read_view(f, offset, len);
+    if (view == NULL) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Can't read from %s", filename);
+      return false;
+    }
+    //g_debug("hash '%s' %"PRIu64" %"PRIu64, filename, offset, len);
+    _openslide_hash_data(hash, view->data, view->len);
+    urlio_view_release(view);
+    offset += len;
+    size -= len;
+  }
+  return true;
+}
+
 bool _openslide_hash_file_part(struct _openslide_hash *hash,
 			       const char *filename,
 			       int64_t offset, int64_t size,
 			       GError **err) {
-  bool success = false;
-
-  URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
-  if (f == NULL) {
-    return false;
-  }
-
   if (size == -1) {
-    // hash to end of file
-    if (urlio_fseek(f, 0, SEEK_END)) {
-      _openslide_io_error(err, "Couldn't seek %s", filename);
-      goto DONE;
+    URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
+    if (f == NULL) {
+      return false;
     }
-    int64_t len = urlio_ftell(f);
+    // hash to end of file
+    int64_t len = urlio_fsize(f);
+    urlio_fclose(f);
     if (len == -1) {
       _openslide_io_error(err, "Couldn't get size of %s", filename);
-      goto DONE;
+      return false;
     }
     size = len - offset;
   }
+  uint64_t off = offset;
+  uint64_t len = size;
+  return _openslide_hash_file_parts(hash, filename, &off, &len, 1, err);
+}
 
-  uint8_t buf[4096];
-
-  if (urlio_fseek(f, offset, SEEK_SET) == -1) {
-    _openslide_io_error(err, "Can't seek in %s", filename);
-    goto DONE;
+bool _openslide_hash_file_parts(struct _openslide_hash *hash,
+                                const char *filename,
+                                const uint64_t *offsets,
+                                const uint64_t *lengths,
+                                int64_t count,
+                                GError **err) {
+  // nothing would be hashed, so don't read
+  if (hash == NULL || !hash->enabled || count == 0) {
+    return true;
   }
 
-  int64_t bytes_left = size;
-  while (bytes_left > 0) {
-    int64_t bytes_to_read = MIN((int64_t) sizeof buf, bytes_left);
-    int64_t bytes_read = urlio_fread(buf, 1, bytes_to_read, f);
-
-    if (bytes_read != bytes_to_read) {
-      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                  "Can't read from %s", filename);
-      goto DONE;
-    }
-
-    //    g_debug("hash '%s' %"PRId64" %d", filename, offset + (size - bytes_left), bytes_to_read);
-
-    bytes_left -= bytes_read;
-
-    _openslide_hash_data(hash, buf, bytes_read);
+  URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
+  if (f == NULL) {
+    return false;
   }
 
-  success = true;
+  // fetch every range at once, then hash them in the order given
+  urlio_fetch_ranges(f, offsets, lengths, count);
+  bool success = true;
+  for (int64_t i = 0; i < count && success; i++) {
+    success = hash_range(hash, f, filename, offsets[i], lengths[i], err);
+  }
 
-DONE:
   urlio_fclose(f);
   return success;
 }
@@ -133,6 +150,16 @@ const char *_openslide_hash_get_string(struct _openslide_hash *hash) {
   }
 }
 
+char *_openslide_hash_copy_string(struct _openslide_hash *hash) {
+  if (hash == NULL || !hash->enabled) {
+    return NULL;
+  }
+  GChecksum *copy = g_checksum_copy(hash->checksum);
+  char *str = g_strdup(g_checksum_get_string(copy));
+  g_checksum_free(copy);
+  return str;
+}
+
 void _openslide_hash_destroy(struct _openslide_hash *hash) {
   g_checksum_free(hash->checksum);
   g_slice_free(struct _openslide_hash, hash);
@@ -46,12 +46,21 @@ bool _openslide_hash_file_part(struct _openslide_hash *hash,
 			       const char *filename,
 			       int64_t offset, int64_t size,
 			       GError **err);
+// ranges are fetched together, and hashed in the order given
+bool _openslide_hash_file_parts(struct _openslide_hash *hash,
+                                const char *filename,
+                                const uint64_t *offsets,
+                                const uint64_t *lengths,
+                                int64_t count,
+                                GError **err);
 
 // lockout
 void _openslide_hash_disable(struct _openslide_hash *hash);
 
 // accessor
 const char *_openslide_hash_get_string(struct _openslide_hash *hash);
+// the digest so far, leaving the hash open for more data; free with g_free
+char *_openslide_hash_copy_string(struct _openslide_hash *hash);
 
 // destructor
 void _openslide_hash_destroy(struct _openslide_hash *hash);
@@ -37,6 +37,7 @@ typedef struct {
   struct jpeg_source_mgr pub;	/* public fields */
 
   URLIO_FILE * infile;		/* source stream */
+  int64_t offset;		/* next position to read, the stream's own is kept */
   JOCTET * buffer;		/* start of buffer */
   boolean start_of_file;	/* have we gotten any data yet? */
 } my_source_mgr;
@@ -106,7 +107,8 @@ static boolean fill_input_buffer (j_decompress_ptr cinfo)
   my_src_ptr src = (my_src_ptr) cinfo->src;
   size_t nbytes;
 
-  nbytes = urlio_fread(src->buffer, 1, INPUT_BUF_SIZE, src->infile);
+  nbytes = urlio_pread(src->infile, src->buffer, INPUT_BUF_SIZE, src->offset);
+  src->offset += nbytes;
 
   if (nbytes <= 0) {
     if (src->start_of_file)	/* Treat empty input file as fatal error */
@@ -208,6 +210,8 @@ static void term_source (j_decompress_ptr cinfo G_GNUC_UNUSED)
  * Prepare for input from a stdio stream.
  * The caller must have already opened the stream, and is responsible
  * for closing it after finishing decompression.
+ * Data is read positionally from the current position of the stream, which
+ * is left alone, so a stream may be shared with other threads.
  */
 
 void _openslide_jpeg_stdio_src (j_decompress_ptr cinfo, URLIO_FILE * infile)
@@ -218,8 +222,8 @@ void _openslide_jpeg_stdio_src (j_decompress_ptr cinfo, URLIO_FILE * infile)
    * of JPEG images can be read from the same file by calling jpeg_stdio_src
    * only before the first one.  (If we discarded the buffer at the end of
    * one image, we'd likely lose the start of the next one.)
-   * This makes it unsafe to use this manager and a different source
-   * manager serially with the same JPEG object.  Caveat programmer.
+   * _openslide_jpeg_mem_src allocates the same object, so the two can be
+   * used serially with the same JPEG object; other managers can't.
    */
   if (cinfo->src == NULL) {	/* first time for this JPEG object? */
     cinfo->src = (struct jpeg_source_mgr *)
@@ -238,6 +242,7 @@ void _openslide_jpeg_stdio_src (j_decompress_ptr cinfo, URLIO_FILE * infile)
   src->pub.resync_to_restart = jpeg_resync_to_restart; /* use default method */
   src->pub.term_source = term_source;
   src->infile = infile;
+  src->offset = urlio_ftell(infile);
   src->pub.bytes_in_buffer = 0; /* forces fill_input_buffer on first read */
   src->pub.next_input_byte = NULL; /* until buffer loaded */
 }
@@ -258,12 +263,16 @@ void _openslide_jpeg_mem_src (j_decompress_ptr cinfo,
 
   /* The source object is made permanent so that a series of JPEG images
    * can be read from the same buffer by calling jpeg_mem_src only before
-   * the first one.
+   * the first one.  It is allocated as a stdio source object, with its
+   * buffer, since recycled JPEG objects switch between the two managers.
    */
   if (cinfo->src == NULL) {	/* first time for this JPEG object? */
     cinfo->src = (struct jpeg_source_mgr *)
       (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
-				  sizeof(struct jpeg_source_mgr));
+				  sizeof(my_source_mgr));
+    ((my_src_ptr) cinfo->src)->buffer = (JOCTET *)
+      (*cinfo->mem->alloc_small) ((j_common_ptr) cinfo, JPOOL_PERMANENT,
+				  INPUT_BUF_SIZE * sizeof(JOCTET));
   }
 
   src = cinfo->src;
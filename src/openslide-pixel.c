@@ -0,0 +1,833 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+
+/*
+ * Pixel format conversion kernels, a 2x2 box reduction of ARGB rows, and a
+ * byte swap for TIFF value arrays.
+ * Each has a portable version and vectorized ones, chosen once by the
+ * features of the running CPU, which produce the same output bit for bit.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PIXEL_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON) && !defined(__ARM_BIG_ENDIAN)
+#define PIXEL_NEON 1
+#include <arm_neon.h>
+#endif
+
+// fixed-point factors reproducing _openslide_R_Cr and _openslide_B_Cb
+#define YCBCR_R_CR 91881   // 1.402 << 16
+#define YCBCR_B_CB 116130  // 1.772 << 16
+
+struct pixel_kernels {
+  void (*abgr_to_argb)(uint32_t *buf, int64_t count);
+  void (*rgb_to_argb)(uint32_t *dest,
+                      const int32_t *r, const int32_t *g, const int32_t *b,
+                      int64_t count);
+  void (*ycbcr422_to_argb)(uint32_t *dest,
+                           const int32_t *y, const int32_t *cb,
+                           const int32_t *cr,
+                           int64_t count);
+  void (*argb_to_packed)(uint8_t *dest, const uint32_t *src, int64_t count,
+                         bool bgr);
+  void (*argb_to_planar)(uint8_t *r, uint8_t *g, uint8_t *b,
+                         const uint32_t *src, int64_t count);
+  void (*argb_to_planar_float)(float *r, float *g, float *b,
+                               const uint32_t *src, int64_t count,
+                               const float *scale, const float *offset);
+  void (*rgb48_to_xrgb)(uint32_t *dest, const uint8_t *src, int64_t count);
+  void (*swap_bytes)(void *data, int32_t size, int64_t count);
+  void (*reduce_2x2)(uint32_t *dest, const uint32_t *row0,
+                     const uint32_t *row1, int64_t count);
+};
+
+static struct pixel_kernels kernels;
+static GOnce kernels_once = G_ONCE_INIT;
+
+
+/* portable */
+
+static void abgr_to_argb_c(uint32_t *buf, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    uint32_t val = buf[i];
+    buf[i] = (val & 0xff00ff00) | ((val >> 16) & 0xff) | ((val & 0xff) << 16);
+  }
+}
+
+static void rgb_to_argb_c(uint32_t *dest,
+                          const int32_t *r, const int32_t *g, const int32_t *b,
+                          int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    dest[i] = 0xff000000 | (uint8_t) r[i] << 16 | (uint8_t) g[i] << 8 |
+              (uint8_t) b[i];
+  }
+}
+
+static inline uint32_t ycbcr_pixel(uint8_t Y, int16_t R_chroma,
+                                   int16_t G_chroma, int16_t B_chroma) {
+  int16_t R = Y + R_chroma;
+  int16_t G = Y + G_chroma;
+  int16_t B = Y + B_chroma;
+
+  R = CLAMP(R, 0, 255);
+  G = CLAMP(G, 0, 255);
+  B = CLAMP(B, 0, 255);
+
+  return 0xff000000 | ((uint8_t) R << 16) | ((uint8_t) G << 8) | ((uint8_t) B);
+}
+
+// from output pixel start, which must be even
+static void ycbcr422_to_argb_tail(uint32_t *dest,
+                                  const int32_t *y, const int32_t *cb,
+                                  const int32_t *cr,
+                                  int64_t start, int64_t count) {
+  for (int64_t x = start; x < count; x++) {
+    uint8_t c1 = cb[x / 2];
+    uint8_t c2 = cr[x / 2];
+    int16_t R_chroma = _openslide_R_Cr[c2];
+    int16_t G_chroma = (_openslide_G_Cb[c1] + _openslide_G_Cr[c2]) >> 16;
+    int16_t B_chroma = _openslide_B_Cb[c1];
+    dest[x] = ycbcr_pixel(y[x], R_chroma, G_chroma, B_chroma);
+  }
+}
+
+static void ycbcr422_to_argb_c(uint32_t *dest,
+                               const int32_t *y, const int32_t *cb,
+                               const int32_t *cr,
+                               int64_t count) {
+  ycbcr422_to_argb_tail(dest, y, cb, cr, 0, count);
+}
+
+static inline uint8_t unpremultiply(uint32_t c, uint32_t a) {
+  if (a == 255) {
+    return c;
+  } else if (a == 0) {
+    return 0;
+  }
+  return MIN((c * 255 + a / 2) / a, 255);
+}
+
+// samples are step bytes apart
+static void argb_to_samples_c(uint8_t *r, uint8_t *g, uint8_t *b, int step,
+                              const uint32_t *src, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    uint32_t val = src[i];
+    uint32_t a = val >> 24;
+    r[i * step] = unpremultiply((val >> 16) & 0xff, a);
+    g[i * step] = unpremultiply((val >> 8) & 0xff, a);
+    b[i * step] = unpremultiply(val & 0xff, a);
+  }
+}
+
+static void argb_to_packed_c(uint8_t *dest, const uint32_t *src,
+                             int64_t count, bool bgr) {
+  if (bgr) {
+    argb_to_samples_c(dest + 2, dest + 1, dest, 3, src, count);
+  } else {
+    argb_to_samples_c(dest, dest + 1, dest + 2, 3, src, count);
+  }
+}
+
+static void argb_to_planar_c(uint8_t *r, uint8_t *g, uint8_t *b,
+                             const uint32_t *src, int64_t count) {
+  argb_to_samples_c(r, g, b, 1, src, count);
+}
+
+static void argb_to_planar_float_c(float *r, float *g, float *b,
+                                   const uint32_t *src, int64_t count,
+                                   const float *scale, const float *offset) {
+  for (int64_t i = 0; i < count; i++) {
+    uint32_t val = src[i];
+    uint32_t a = val >> 24;
+    r[i] = (float) unpremultiply((val >> 16) & 0xff, a) * scale[0] + offset[0];
+    g[i] = (float) unpremultiply((val >> 8) & 0xff, a) * scale[1] + offset[1];
+    b[i] = (float) unpremultiply(val & 0xff, a) * scale[2] + offset[2];
+  }
+}
+
+static void rgb48_to_xrgb_c(uint32_t *dest, const uint8_t *src,
+                            int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    const uint8_t *p = src + 6 * i;
+    // bits 4-11 of each little-endian sample
+    uint8_t r = (p[0] | p[1] << 8) >> 4;
+    uint8_t g = (p[2] | p[3] << 8) >> 4;
+    uint8_t b = (p[4] | p[5] << 8) >> 4;
+    dest[i] = (r << 16) | (g << 8) | b;
+  }
+}
+
+static void swap_bytes_c(void *data, int32_t size, int64_t count) {
+  switch (size) {
+  case 2: {
+    uint16_t *arr = data;
+    for (int64_t i = 0; i < count; i++) {
+      arr[i] = GUINT16_SWAP_LE_BE(arr[i]);
+    }
+    break;
+  }
+  case 4: {
+    uint32_t *arr = data;
+    for (int64_t i = 0; i < count; i++) {
+      arr[i] = GUINT32_SWAP_LE_BE(arr[i]);
+    }
+    break;
+  }
+  case 8: {
+    uint64_t *arr = data;
+    for (int64_t i = 0; i < count; i++) {
+      arr[i] = GUINT64_SWAP_LE_BE(arr[i]);
+    }
+    break;
+  }
+  }
+}
+
+// each channel of dest[i] is the rounded mean of source pixels 2i and 2i+1
+// of both rows
+static void reduce_2x2_c(uint32_t *dest, const uint32_t *row0,
+                         const uint32_t *row1, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    uint32_t a = row0[2 * i], b = row0[2 * i + 1];
+    uint32_t c = row1[2 * i], d = row1[2 * i + 1];
+    uint32_t p = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      uint32_t sum = ((a >> shift) & 0xff) + ((b >> shift) & 0xff) +
+                     ((c >> shift) & 0xff) + ((d >> shift) & 0xff);
+      p |= ((sum + 2) >> 2) << shift;
+    }
+    dest[i] = p;
+  }
+}
+
+
+#ifdef PIXEL_X86
+
+/* SSE2, always present on x86-64 */
+
+static void abgr_to_argb_sse2(uint32_t *buf, int64_t count) {
+  const __m128i ag = _mm_set1_epi32((int) 0xff00ff00);
+  const __m128i lo = _mm_set1_epi32(0xff);
+  int64_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+    __m128i r = _mm_and_si128(_mm_srli_epi32(v, 16), lo);
+    __m128i b = _mm_slli_epi32(_mm_and_si128(v, lo), 16);
+    v = _mm_or_si128(_mm_and_si128(v, ag), _mm_or_si128(r, b));
+    _mm_storeu_si128((__m128i *) (buf + i), v);
+  }
+  abgr_to_argb_c(buf + i, count - i);
+}
+
+static void rgb_to_argb_sse2(uint32_t *dest,
+                             const int32_t *r, const int32_t *g,
+                             const int32_t *b,
+                             int64_t count) {
+  const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+  const __m128i lo = _mm_set1_epi32(0xff);
+  int64_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i vr = _mm_and_si128(_mm_loadu_si128((const __m128i *) (r + i)), lo);
+    __m128i vg = _mm_and_si128(_mm_loadu_si128((const __m128i *) (g + i)), lo);
+    __m128i vb = _mm_and_si128(_mm_loadu_si128((const __m128i *) (b + i)), lo);
+    __m128i v = _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(vr, 16)),
+                             _mm_or_si128(_mm_slli_epi32(vg, 8), vb));
+    _mm_storeu_si128((__m128i *) (dest + i), v);
+  }
+  rgb_to_argb_c(dest + i, r + i, g + i, b + i, count - i);
+}
+
+// premultiplied pixels are handed to the portable version, opaque ones
+// need no division
+static inline bool opaque_sse2(__m128i v) {
+  const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+  return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, alpha),
+                                           alpha)) == 0xffff;
+}
+
+static inline __m128i channel_sse2(__m128i v, int shift) {
+  return _mm_and_si128(_mm_srli_epi32(v, shift), _mm_set1_epi32(0xff));
+}
+
+static void argb_to_planar_sse2(uint8_t *r, uint8_t *g, uint8_t *b,
+                                const uint32_t *src, int64_t count) {
+  int64_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *) (src + i));
+    __m128i v1 = _mm_loadu_si128((const __m128i *) (src + i + 4));
+    __m128i v2 = _mm_loadu_si128((const __m128i *) (src + i + 8));
+    __m128i v3 = _mm_loadu_si128((const __m128i *) (src + i + 12));
+    if (!opaque_sse2(_mm_and_si128(_mm_and_si128(v0, v1),
+                                   _mm_and_si128(v2, v3)))) {
+      argb_to_planar_c(r + i, g + i, b + i, src + i, 16);
+      continue;
+    }
+    uint8_t *planes[3] = {r + i, g + i, b + i};
+    for (int c = 0; c < 3; c++) {
+      int shift = 16 - 8 * c;
+      __m128i lo = _mm_packs_epi32(channel_sse2(v0, shift),
+                                   channel_sse2(v1, shift));
+      __m128i hi = _mm_packs_epi32(channel_sse2(v2, shift),
+                                   channel_sse2(v3, shift));
+      _mm_storeu_si128((__m128i *) planes[c], _mm_packus_epi16(lo, hi));
+    }
+  }
+  argb_to_planar_c(r + i, g + i, b + i, src + i, count - i);
+}
+
+static void argb_to_planar_float_sse2(float *r, float *g, float *b,
+                                      const uint32_t *src, int64_t count,
+                                      const float *scale,
+                                      const float *offset) {
+  float *planes[3] = {r, g, b};
+  __m128 vscale[3], voffset[3];
+  for (int c = 0; c < 3; c++) {
+    vscale[c] = _mm_set1_ps(scale[c]);
+    voffset[c] = _mm_set1_ps(offset[c]);
+  }
+  int64_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    if (!opaque_sse2(v)) {
+      argb_to_planar_float_c(r + i, g + i, b + i, src + i, 4, scale, offset);
+      continue;
+    }
+    for (int c = 0; c < 3; c++) {
+      __m128 f = _mm_cvtepi32_ps(channel_sse2(v, 16 - 8 * c));
+      f = _mm_add_ps(_mm_mul_ps(f, vscale[c]), voffset[c]);
+      _mm_storeu_ps(planes[c] + i, f);
+    }
+  }
+  argb_to_planar_float_c(r + i, g + i, b + i, src + i, count - i,
+                         scale, offset);
+}
+
+// the channel sums of two output pixels from four pixels of each row
+static inline __m128i reduce_pair_sse2(__m128i v, __m128i w) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(v, zero),
+                             _mm_unpacklo_epi8(w, zero));
+  __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(v, zero),
+                             _mm_unpackhi_epi8(w, zero));
+  lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+  hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+  return _mm_unpacklo_epi64(lo, hi);
+}
+
+static void reduce_2x2_sse2(uint32_t *dest, const uint32_t *row0,
+                            const uint32_t *row1, int64_t count) {
+  const __m128i two = _mm_set1_epi16(2);
+  int64_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const __m128i *p0 = (const __m128i *) (row0 + 2 * i);
+    const __m128i *p1 = (const __m128i *) (row1 + 2 * i);
+    __m128i a = reduce_pair_sse2(_mm_loadu_si128(p0), _mm_loadu_si128(p1));
+    __m128i b = reduce_pair_sse2(_mm_loadu_si128(p0 + 1),
+                                 _mm_loadu_si128(p1 + 1));
+    a = _mm_srli_epi16(_mm_add_epi16(a, two), 2);
+    b = _mm_srli_epi16(_mm_add_epi16(b, two), 2);
+    _mm_storeu_si128((__m128i *) (dest + i), _mm_packus_epi16(a, b));
+  }
+  reduce_2x2_c(dest + i, row0 + 2 * i, row1 + 2 * i, count - i);
+}
+
+
+/* AVX2 */
+
+__attribute__((target("avx2")))
+static void abgr_to_argb_avx2(uint32_t *buf, int64_t count) {
+  const __m256i shuf = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                        10, 9, 8, 11, 14, 13, 12, 15,
+                                        2, 1, 0, 3, 6, 5, 4, 7,
+                                        10, 9, 8, 11, 14, 13, 12, 15);
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+    _mm256_storeu_si256((__m256i *) (buf + i), _mm256_shuffle_epi8(v, shuf));
+  }
+  abgr_to_argb_c(buf + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void rgb_to_argb_avx2(uint32_t *dest,
+                             const int32_t *r, const int32_t *g,
+                             const int32_t *b,
+                             int64_t count) {
+  const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+  const __m256i lo = _mm256_set1_epi32(0xff);
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i vr = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (r + i)), lo);
+    __m256i vg = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (g + i)), lo);
+    __m256i vb = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (b + i)), lo);
+    __m256i v = _mm256_or_si256(_mm256_or_si256(alpha, _mm256_slli_epi32(vr, 16)),
+                                _mm256_or_si256(_mm256_slli_epi32(vg, 8), vb));
+    _mm256_storeu_si256((__m256i *) (dest + i), v);
+  }
+  rgb_to_argb_c(dest + i, r + i, g + i, b + i, count - i);
+}
+
+// the G precursors aren't linear in the input, so they are gathered from
+// the tables; R and B are computed
+__attribute__((target("avx2")))
+static void ycbcr422_to_argb_avx2(uint32_t *dest,
+                                  const int32_t *y, const int32_t *cb,
+                                  const int32_t *cr,
+                                  int64_t count) {
+  const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+  const __m256i lo = _mm256_set1_epi32(0xff);
+  const __m256i center = _mm256_set1_epi32(128);
+  const __m256i half = _mm256_set1_epi32(1 << 15);
+  const __m256i r_cr = _mm256_set1_epi32(YCBCR_R_CR);
+  const __m256i b_cb = _mm256_set1_epi32(YCBCR_B_CB);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i dup = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+  int64_t x = 0;
+  for (; x + 8 <= count; x += 8) {
+    __m256i vy = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (y + x)), lo);
+    __m128i cb4 = _mm_loadu_si128((const __m128i *) (cb + x / 2));
+    __m128i cr4 = _mm_loadu_si128((const __m128i *) (cr + x / 2));
+    __m256i vcb = _mm256_and_si256(
+      _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(cb4), dup), lo);
+    __m256i vcr = _mm256_and_si256(
+      _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(cr4), dup), lo);
+
+    __m256i R_chroma = _mm256_srai_epi32(
+      _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(vcr, center), r_cr),
+                       half), 16);
+    __m256i B_chroma = _mm256_srai_epi32(
+      _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(vcb, center), b_cb),
+                       half), 16);
+    __m256i G_chroma = _mm256_srai_epi32(
+      _mm256_add_epi32(_mm256_i32gather_epi32((const int *) _openslide_G_Cb, vcb, 4),
+                       _mm256_i32gather_epi32((const int *) _openslide_G_Cr, vcr, 4)),
+      16);
+
+    __m256i R = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(vy, R_chroma), zero), lo);
+    __m256i G = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(vy, G_chroma), zero), lo);
+    __m256i B = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(vy, B_chroma), zero), lo);
+    __m256i v = _mm256_or_si256(_mm256_or_si256(alpha, _mm256_slli_epi32(R, 16)),
+                                _mm256_or_si256(_mm256_slli_epi32(G, 8), B));
+    _mm256_storeu_si256((__m256i *) (dest + x), v);
+  }
+  ycbcr422_to_argb_tail(dest, y, cb, cr, x, count);
+}
+
+__attribute__((target("avx2")))
+static inline bool opaque_avx2(__m256i v) {
+  const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(v, alpha),
+                                                 alpha)) == -1;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i channel_avx2(__m256i v, int shift) {
+  return _mm256_and_si256(_mm256_srli_epi32(v, shift),
+                          _mm256_set1_epi32(0xff));
+}
+
+// each 16-byte store spills 4 bytes into the next pixels, so the loop
+// stops short of the end
+__attribute__((target("avx2")))
+static void argb_to_packed_avx2(uint8_t *dest, const uint32_t *src,
+                                int64_t count, bool bgr) {
+  const __m256i rgb = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9,
+                                       8, 14, 13, 12, -1, -1, -1, -1,
+                                       2, 1, 0, 6, 5, 4, 10, 9,
+                                       8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i bgr_ = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+                                        10, 12, 13, 14, -1, -1, -1, -1,
+                                        0, 1, 2, 4, 5, 6, 8, 9,
+                                        10, 12, 13, 14, -1, -1, -1, -1);
+  const __m256i shuf = bgr ? bgr_ : rgb;
+  int64_t i = 0;
+  for (; i + 10 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    if (!opaque_avx2(v)) {
+      argb_to_packed_c(dest + 3 * i, src + i, 8, bgr);
+      continue;
+    }
+    v = _mm256_shuffle_epi8(v, shuf);
+    _mm_storeu_si128((__m128i *) (dest + 3 * i), _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *) (dest + 3 * i + 12),
+                     _mm256_extracti128_si256(v, 1));
+  }
+  argb_to_packed_c(dest + 3 * i, src + i, count - i, bgr);
+}
+
+// in-lane packing leaves groups of four pixels in the order of order
+__attribute__((target("avx2")))
+static void argb_to_planar_avx2(uint8_t *r, uint8_t *g, uint8_t *b,
+                                const uint32_t *src, int64_t count) {
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int64_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i *) (src + i + 8));
+    __m256i v2 = _mm256_loadu_si256((const __m256i *) (src + i + 16));
+    __m256i v3 = _mm256_loadu_si256((const __m256i *) (src + i + 24));
+    if (!opaque_avx2(_mm256_and_si256(_mm256_and_si256(v0, v1),
+                                      _mm256_and_si256(v2, v3)))) {
+      argb_to_planar_c(r + i, g + i, b + i, src + i, 32);
+      continue;
+    }
+    uint8_t *planes[3] = {r + i, g + i, b + i};
+    for (int c = 0; c < 3; c++) {
+      int shift = 16 - 8 * c;
+      __m256i lo = _mm256_packs_epi32(channel_avx2(v0, shift),
+                                      channel_avx2(v1, shift));
+      __m256i hi = _mm256_packs_epi32(channel_avx2(v2, shift),
+                                      channel_avx2(v3, shift));
+      __m256i p = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi),
+                                              order);
+      _mm256_storeu_si256((__m256i *) planes[c], p);
+    }
+  }
+  argb_to_planar_c(r + i, g + i, b + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void argb_to_planar_float_avx2(float *r, float *g, float *b,
+                                      const uint32_t *src, int64_t count,
+                                      const float *scale,
+                                      const float *offset) {
+  float *planes[3] = {r, g, b};
+  __m256 vscale[3], voffset[3];
+  for (int c = 0; c < 3; c++) {
+    vscale[c] = _mm256_set1_ps(scale[c]);
+    voffset[c] = _mm256_set1_ps(offset[c]);
+  }
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    if (!opaque_avx2(v)) {
+      argb_to_planar_float_c(r + i, g + i, b + i, src + i, 8, scale, offset);
+      continue;
+    }
+    for (int c = 0; c < 3; c++) {
+      __m256 f = _mm256_cvtepi32_ps(channel_avx2(v, 16 - 8 * c));
+      f = _mm256_add_ps(_mm256_mul_ps(f, vscale[c]), voffset[c]);
+      _mm256_storeu_ps(planes[c] + i, f);
+    }
+  }
+  argb_to_planar_float_c(r + i, g + i, b + i, src + i, count - i,
+                         scale, offset);
+}
+
+// samples are narrowed in 16-bit lanes, then the triplets of each four
+// pixels are spread into words
+__attribute__((target("avx2")))
+static void rgb48_to_xrgb_avx2(uint32_t *dest, const uint8_t *src,
+                               int64_t count) {
+  const __m128i lo = _mm_set1_epi16(0xff);
+  const __m128i shuf = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                     8, 7, 6, -1, 11, 10, 9, -1);
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const __m128i *p = (const __m128i *) (src + 6 * i);
+    __m128i v0 = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128(p), 4), lo);
+    __m128i v1 = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128(p + 1), 4), lo);
+    __m128i v2 = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128(p + 2), 4), lo);
+    __m128i s0 = _mm_packus_epi16(v0, v1);  // samples 0-15
+    __m128i s1 = _mm_packus_epi16(v2, v2);  // samples 16-23
+    _mm_storeu_si128((__m128i *) (dest + i), _mm_shuffle_epi8(s0, shuf));
+    _mm_storeu_si128((__m128i *) (dest + i + 4),
+                     _mm_shuffle_epi8(_mm_alignr_epi8(s1, s0, 12), shuf));
+  }
+  rgb48_to_xrgb_c(dest + i, src + 6 * i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void swap_bytes_avx2(void *data, int32_t size, int64_t count) {
+  __m256i shuf;
+  switch (size) {
+  case 2:
+    shuf = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                            9, 8, 11, 10, 13, 12, 15, 14,
+                            1, 0, 3, 2, 5, 4, 7, 6,
+                            9, 8, 11, 10, 13, 12, 15, 14);
+    break;
+  case 4:
+    shuf = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                            11, 10, 9, 8, 15, 14, 13, 12,
+                            3, 2, 1, 0, 7, 6, 5, 4,
+                            11, 10, 9, 8, 15, 14, 13, 12);
+    break;
+  case 8:
+    shuf = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0,
+                            15, 14, 13, 12, 11, 10, 9, 8,
+                            7, 6, 5, 4, 3, 2, 1, 0,
+                            15, 14, 13, 12, 11, 10, 9, 8);
+    break;
+  default:
+    return;
+  }
+  uint8_t *p = data;
+  int64_t per_vector = 32 / size;
+  int64_t i = 0;
+  for (; i + per_vector <= count; i += per_vector) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (p + i * size));
+    _mm256_storeu_si256((__m256i *) (p + i * size),
+                        _mm256_shuffle_epi8(v, shuf));
+  }
+  swap_bytes_c(p + i * size, size, count - i);
+}
+
+#endif  // PIXEL_X86
+
+
+#ifdef PIXEL_NEON
+
+static void abgr_to_argb_neon(uint32_t *buf, int64_t count) {
+  int64_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v = vld4q_u8((const uint8_t *) (buf + i));
+    uint8x16_t r = v.val[0];
+    v.val[0] = v.val[2];
+    v.val[2] = r;
+    vst4q_u8((uint8_t *) (buf + i), v);
+  }
+  abgr_to_argb_c(buf + i, count - i);
+}
+
+static void rgb_to_argb_neon(uint32_t *dest,
+                             const int32_t *r, const int32_t *g,
+                             const int32_t *b,
+                             int64_t count) {
+  const uint32x4_t alpha = vdupq_n_u32(0xff000000);
+  const uint32x4_t lo = vdupq_n_u32(0xff);
+  int64_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint32x4_t vr = vandq_u32(vreinterpretq_u32_s32(vld1q_s32(r + i)), lo);
+    uint32x4_t vg = vandq_u32(vreinterpretq_u32_s32(vld1q_s32(g + i)), lo);
+    uint32x4_t vb = vandq_u32(vreinterpretq_u32_s32(vld1q_s32(b + i)), lo);
+    uint32x4_t v = vorrq_u32(vorrq_u32(alpha, vshlq_n_u32(vr, 16)),
+                             vorrq_u32(vshlq_n_u32(vg, 8), vb));
+    vst1q_u32(dest + i, v);
+  }
+  rgb_to_argb_c(dest + i, r + i, g + i, b + i, count - i);
+}
+
+// deinterleaving loads give the planes, in memory order B, G, R, A
+static void argb_to_packed_neon(uint8_t *dest, const uint32_t *src,
+                                int64_t count, bool bgr) {
+  int64_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v = vld4q_u8((const uint8_t *) (src + i));
+    if (vminvq_u8(v.val[3]) != 255) {
+      argb_to_packed_c(dest + 3 * i, src + i, 16, bgr);
+      continue;
+    }
+    uint8x16x3_t out;
+    out.val[0] = bgr ? v.val[0] : v.val[2];
+    out.val[1] = v.val[1];
+    out.val[2] = bgr ? v.val[2] : v.val[0];
+    vst3q_u8(dest + 3 * i, out);
+  }
+  argb_to_packed_c(dest + 3 * i, src + i, count - i, bgr);
+}
+
+static void argb_to_planar_neon(uint8_t *r, uint8_t *g, uint8_t *b,
+                                const uint32_t *src, int64_t count) {
+  int64_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x4_t v = vld4q_u8((const uint8_t *) (src + i));
+    if (vminvq_u8(v.val[3]) != 255) {
+      argb_to_planar_c(r + i, g + i, b + i, src + i, 16);
+      continue;
+    }
+    vst1q_u8(r + i, v.val[2]);
+    vst1q_u8(g + i, v.val[1]);
+    vst1q_u8(b + i, v.val[0]);
+  }
+  argb_to_planar_c(r + i, g + i, b + i, src + i, count - i);
+}
+
+// deinterleaving loads give the samples, narrowed by a shift
+static void rgb48_to_xrgb_neon(uint32_t *dest, const uint8_t *src,
+                               int64_t count) {
+  int64_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint16x8x3_t v = vld3q_u16((const uint16_t *) (src + 6 * i));
+    uint8x8x4_t out;
+    out.val[0] = vshrn_n_u16(v.val[2], 4);
+    out.val[1] = vshrn_n_u16(v.val[1], 4);
+    out.val[2] = vshrn_n_u16(v.val[0], 4);
+    out.val[3] = vdup_n_u8(0);
+    vst4_u8((uint8_t *) (dest + i), out);
+  }
+  rgb48_to_xrgb_c(dest + i, src + 6 * i, count - i);
+}
+
+static void swap_bytes_neon(void *data, int32_t size, int64_t count) {
+  uint8_t *p = data;
+  int64_t per_vector = 16 / size;
+  int64_t i = 0;
+  for (; i + per_vector <= count; i += per_vector) {
+    uint8x16_t v = vld1q_u8(p + i * size);
+    switch (size) {
+    case 2:
+      v = vrev16q_u8(v);
+      break;
+    case 4:
+      v = vrev32q_u8(v);
+      break;
+    case 8:
+      v = vrev64q_u8(v);
+      break;
+    }
+    vst1q_u8(p + i * size, v);
+  }
+  swap_bytes_c(p + i * size, size, count - i);
+}
+
+static void reduce_2x2_neon(uint32_t *dest, const uint32_t *row0,
+                            const uint32_t *row1, int64_t count) {
+  int64_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    // even and odd pixels of each row
+    uint32x4x2_t a = vld2q_u32(row0 + 2 * i);
+    uint32x4x2_t b = vld2q_u32(row1 + 2 * i);
+    uint8x16_t ae = vreinterpretq_u8_u32(a.val[0]);
+    uint8x16_t ao = vreinterpretq_u8_u32(a.val[1]);
+    uint8x16_t be = vreinterpretq_u8_u32(b.val[0]);
+    uint8x16_t bo = vreinterpretq_u8_u32(b.val[1]);
+    uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(ae), vget_low_u8(ao)),
+                              vaddl_u8(vget_low_u8(be), vget_low_u8(bo)));
+    uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(ae), vget_high_u8(ao)),
+                              vaddl_u8(vget_high_u8(be), vget_high_u8(bo)));
+    uint8x16_t v = vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2));
+    vst1q_u32(dest + i, vreinterpretq_u32_u8(v));
+  }
+  reduce_2x2_c(dest + i, row0 + 2 * i, row1 + 2 * i, count - i);
+}
+
+#endif  // PIXEL_NEON
+
+
+static gpointer init_kernels(gpointer data G_GNUC_UNUSED) {
+  kernels.abgr_to_argb = abgr_to_argb_c;
+  kernels.rgb_to_argb = rgb_to_argb_c;
+  kernels.ycbcr422_to_argb = ycbcr422_to_argb_c;
+  kernels.argb_to_packed = argb_to_packed_c;
+  kernels.argb_to_planar = argb_to_planar_c;
+  kernels.argb_to_planar_float = argb_to_planar_float_c;
+  kernels.rgb48_to_xrgb = rgb48_to_xrgb_c;
+  kernels.swap_bytes = swap_bytes_c;
+  kernels.reduce_2x2 = reduce_2x2_c;
+
+#ifdef PIXEL_X86
+  kernels.abgr_to_argb = abgr_to_argb_sse2;
+  kernels.reduce_2x2 = reduce_2x2_sse2;
+  kernels.rgb_to_argb = rgb_to_argb_sse2;
+  kernels.argb_to_planar = argb_to_planar_sse2;
+  kernels.argb_to_planar_float = argb_to_planar_float_sse2;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.abgr_to_argb = abgr_to_argb_avx2;
+    kernels.rgb_to_argb = rgb_to_argb_avx2;
+    kernels.ycbcr422_to_argb = ycbcr422_to_argb_avx2;
+    kernels.argb_to_packed = argb_to_packed_avx2;
+    kernels.argb_to_planar = argb_to_planar_avx2;
+    kernels.argb_to_planar_float = argb_to_planar_float_avx2;
+    kernels.rgb48_to_xrgb = rgb48_to_xrgb_avx2;
+    kernels.swap_bytes = swap_bytes_avx2;
+  }
+#endif
+
+#ifdef PIXEL_NEON
+  kernels.abgr_to_argb = abgr_to_argb_neon;
+  kernels.rgb_to_argb = rgb_to_argb_neon;
+  kernels.argb_to_packed = argb_to_packed_neon;
+  kernels.argb_to_planar = argb_to_planar_neon;
+  kernels.rgb48_to_xrgb = rgb48_to_xrgb_neon;
+  kernels.swap_bytes = swap_bytes_neon;
+  kernels.reduce_2x2 = reduce_2x2_neon;
+#endif
+
+  return NULL;
+}
+
+void _openslide_pixel_abgr_to_argb(uint32_t *buf, int64_t count) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.abgr_to_argb(buf, count);
+}
+
+void _openslide_pixel_rgb_to_argb(uint32_t *dest,
+                                  const int32_t *r, const int32_t *g,
+                                  const int32_t *b,
+                                  int64_t count) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.rgb_to_argb(dest, r, g, b, count);
+}
+
+void _openslide_pixel_ycbcr422_to_argb(uint32_t *dest,
+                                       const int32_t *y, const int32_t *cb,
+                                       const int32_t *cr,
+                                       int64_t count) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.ycbcr422_to_argb(dest, y, cb, cr, count);
+}
+
+void _openslide_pixel_argb_to_packed(uint8_t *dest, const uint32_t *src,
+                                     int64_t count, bool bgr) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.argb_to_packed(dest, src, count, bgr);
+}
+
+void _openslide_pixel_argb_to_planar(uint8_t *r, uint8_t *g, uint8_t *b,
+                                     const uint32_t *src, int64_t count) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.argb_to_planar(r, g, b, src, count);
+}
+
+void _openslide_pixel_argb_to_planar_float(float *r, float *g, float *b,
+                                           const uint32_t *src,
+                                           int64_t count,
+                                           const float *scale,
+                                           const float *offset) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.argb_to_planar_float(r, g, b, src, count, scale, offset);
+}
+
+void _openslide_pixel_rgb48_to_xrgb(uint32_t *dest, const uint8_t *src,
+                                    int64_t count) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.rgb48_to_xrgb(dest, src, count);
+}
+
+void _openslide_pixel_swap_bytes(void *data, int32_t size, int64_t count) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.swap_bytes(data, size, count);
+}
+
+void _openslide_pixel_reduce_2x2(uint32_t *dest, const uint32_t *row0,
+                                 const uint32_t *row1, int64_t count) {
+  g_once(&kernels_once, init_kernels, NULL);
+  kernels.reduce_2x2(dest, row0, row1, count);
+}
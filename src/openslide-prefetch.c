@@ -0,0 +1,170 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+
+// a viewer gives a hint per viewport; older ones are stale
+#define PREFETCH_QUEUE_MAX 16
+
+struct hint {
+  int id;
+  int64_t x;
+  int64_t y;
+  int32_t level;
+  int64_t w;
+  int64_t h;
+};
+
+struct _openslide_prefetch {
+  openslide_t *osr;
+  _openslide_prefetch_fn fn;
+
+  GMutex *lock;
+  GCond *cond;
+  GQueue *hints;
+  bool running;  // a task is queued or serving a hint
+  bool stop;
+};
+
+// hint ids tag urlio fetches, which are shared between slides
+static volatile gint last_id;
+
+static void hint_free(struct hint *hint) {
+  g_slice_free(struct hint, hint);
+}
+
+// serves one hint on a worker, then queues itself again for the next, so
+// reads waiting for the pool come first
+static void prefetch_task(void *data) {
+  struct _openslide_prefetch *prefetch = data;
+
+  g_mutex_lock(prefetch->lock);
+  struct hint *hint = prefetch->stop ? NULL :
+                      g_queue_pop_head(prefetch->hints);
+  g_mutex_unlock(prefetch->lock);
+
+  if (hint) {
+    prefetch->fn(prefetch->osr, hint->x, hint->y, hint->level,
+                 hint->w, hint->h, hint->id);
+    hint_free(hint);
+  }
+
+  g_mutex_lock(prefetch->lock);
+  if (!prefetch->stop && !g_queue_is_empty(prefetch->hints)) {
+    _openslide_work_submit(NULL, OPENSLIDE_WORK_PREFETCH,
+                           prefetch_task, prefetch);
+  } else {
+    prefetch->running = false;
+    g_cond_broadcast(prefetch->cond);
+  }
+  g_mutex_unlock(prefetch->lock);
+}
+
+struct _openslide_prefetch *_openslide_prefetch_create(openslide_t *osr,
+                                                       _openslide_prefetch_fn fn) {
+  struct _openslide_prefetch *prefetch =
+    g_slice_new0(struct _openslide_prefetch);
+  prefetch->osr = osr;
+  prefetch->fn = fn;
+  prefetch->lock = g_mutex_new();
+  prefetch->cond = g_cond_new();
+  prefetch->hints = g_queue_new();
+  return prefetch;
+}
+
+int _openslide_prefetch_give_hint(struct _openslide_prefetch *prefetch,
+                                  int64_t x, int64_t y,
+                                  int32_t level,
+                                  int64_t w, int64_t h) {
+  struct hint *hint = g_slice_new(struct hint);
+  hint->x = x;
+  hint->y = y;
+  hint->level = level;
+  hint->w = w;
+  hint->h = h;
+
+  g_mutex_lock(prefetch->lock);
+
+  // ids stay positive
+  int id = g_atomic_int_exchange_and_add(&last_id, 1) + 1;
+  if (id <= 0) {
+    g_atomic_int_set(&last_id, 1);
+    id = 1;
+  }
+  hint->id = id;
+
+  g_queue_push_tail(prefetch->hints, hint);
+  while (g_queue_get_length(prefetch->hints) > PREFETCH_QUEUE_MAX) {
+    hint_free(g_queue_pop_head(prefetch->hints));
+  }
+  if (!prefetch->running) {
+    prefetch->running = true;
+    _openslide_work_submit(NULL, OPENSLIDE_WORK_PREFETCH,
+                           prefetch_task, prefetch);
+  }
+  g_mutex_unlock(prefetch->lock);
+
+  return id;
+}
+
+void _openslide_prefetch_cancel_hint(struct _openslide_prefetch *prefetch,
+                                     int id) {
+  g_mutex_lock(prefetch->lock);
+  for (GList *link = prefetch->hints->head; link; link = link->next) {
+    struct hint *hint = link->data;
+    if (hint->id == id) {
+      g_queue_delete_link(prefetch->hints, link);
+      hint_free(hint);
+      break;
+    }
+  }
+  g_mutex_unlock(prefetch->lock);
+
+  // the hint may have been run already, leaving fetches behind
+  urlio_prefetch_cancel(id);
+}
+
+void _openslide_prefetch_destroy(struct _openslide_prefetch *prefetch) {
+  if (prefetch == NULL) {
+    return;
+  }
+
+  // wait for the queued task to run and stop
+  g_mutex_lock(prefetch->lock);
+  prefetch->stop = true;
+  while (prefetch->running) {
+    g_cond_wait(prefetch->cond, prefetch->lock);
+  }
+  g_mutex_unlock(prefetch->lock);
+
+  struct hint *hint;
+  while ((hint = g_queue_pop_head(prefetch->hints)) != NULL) {
+    hint_free(hint);
+  }
+  g_queue_free(prefetch->hints);
+  g_cond_free(prefetch->cond);
+  g_mutex_free(prefetch->lock);
+  g_slice_free(struct _openslide_prefetch, prefetch);
+}
@@ -70,13 +70,25 @@ struct _openslide {
   const char **property_names; // filled in automatically from hashtable
 
   // cache
-  struct _openslide_cache *cache;
+  struct _openslide_cache_binding *cache;
 
   // error handling, NULL if no error
   gpointer error; // must use g_atomic_pointer!
 
   // file/url name as cache id;
   const char *urlname;
+
+  // background prefetch of hinted regions
+  struct _openslide_prefetch *prefetch;
+
+  // synthesized levels after the stored ones, NULL if none
+  struct _openslide_pyramid *pyramid;
+
+  // counters of the reads of this object
+  uint64_t stats_id;
+
+  // the backend reads files besides the one opened
+  bool companion_files;
 };
 
 struct _openslide_level {
@@ -91,6 +103,8 @@ struct _openslide_level {
   int64_t tile_h;
 };
 
+struct _openslide_cache_entry;
+
 /* the function pointer structure for backends */
 struct _openslide_ops {
   bool (*paint_region)(openslide_t *osr, cairo_t *cr,
@@ -98,11 +112,48 @@ struct _openslide_ops {
 		       struct _openslide_level *level,
 		       int32_t w, int32_t h,
 		       GError **err);
+  // optional; start fetching the data of a region without decoding it,
+  // tagged with prefetch_id for urlio_prefetch_cancel()
+  bool (*prefetch_region)(openslide_t *osr,
+			  int64_t x, int64_t y,
+			  struct _openslide_level *level,
+			  int64_t w, int64_t h,
+			  int prefetch_id,
+			  GError **err);
+  // optional; read a stored tile without decoding it into a g_malloc
+  // buffer, setting *buf to NULL if it can't be passed through
+  bool (*read_raw_tile)(openslide_t *osr,
+			struct _openslide_level *level,
+			int64_t tile_col, int64_t tile_row,
+			void **buf, int32_t *len, const char **codec,
+			GError **err);
+  // optional; get a decoded tile of a tiled level through the cache, with
+  // the usual grid tile function contract
+  bool (*read_level_tile)(openslide_t *osr,
+			  struct _openslide_level *level,
+			  int64_t tile_col, int64_t tile_row,
+			  uint32_t **tiledata,
+			  struct _openslide_cache_entry **cache_entry,
+			  GError **err);
+  // optional; start fetching the data of tiles of a tiled level, given
+  // as column, row pairs
+  bool (*prefetch_tiles)(openslide_t *osr,
+			 struct _openslide_level *level,
+			 const int64_t *tiles, int64_t count,
+			 GError **err);
   void (*destroy)(openslide_t *osr);
 };
 
 struct _openslide_tifflike;
 
+/* What detection reads of a file, once, for every detector */
+struct _openslide_probe {
+  struct _openslide_tifflike *tl;  // NULL if not TIFF
+  const uint8_t *head;  // the first head_len bytes
+  int32_t head_len;
+  int64_t size;  // -1 if the file can't be opened
+};
+
 /* vendor detection and parsing */
 
 /*
@@ -122,11 +173,12 @@ struct _openslide_tifflike;
 struct _openslide_format {
   const char *name;
   const char *vendor;
-  bool (*detect)(const char *filename, struct _openslide_tifflike *tl,
+  bool (*detect)(const char *filename, struct _openslide_probe *probe,
                  GError **err);
   bool (*open)(openslide_t *osr, const char *filename,
                struct _openslide_tifflike *tl,
                struct _openslide_hash *quickhash1, GError **err);
+  bool companion_files;  // reads files besides the one opened
 };
 
 extern const struct _openslide_format _openslide_format_aperio;
@@ -178,6 +230,7 @@ bool _openslide_clip_tile(uint32_t *tiledata,
 
 // Grid helpers
 struct _openslide_grid;
+struct _openslide_cache_entry;
 
 typedef bool (*_openslide_grid_simple_read_fn)(openslide_t *osr,
                                                cairo_t *cr,
@@ -209,6 +262,25 @@ struct _openslide_grid *_openslide_grid_create_simple(openslide_t *osr,
                                                       int32_t tile_h,
                                                       _openslide_grid_simple_read_fn read_tile);
 
+// optional: get the ARGB data of a tile, tile_w x tile_h pixels, with a
+// cache entry reference to drop when done.  lets regions be copied into
+// plain destinations without cairo
+typedef bool (*_openslide_grid_simple_tile_fn)(openslide_t *osr,
+                                               struct _openslide_level *level,
+                                               int64_t tile_col, int64_t tile_row,
+                                               void *arg,
+                                               uint32_t **tiledata,
+                                               struct _openslide_cache_entry **cache_entry,
+                                               GError **err);
+
+void _openslide_grid_simple_set_tile_fn(struct _openslide_grid *grid,
+                                        _openslide_grid_simple_tile_fn get_tile);
+
+// a cleared ARGB image surface which grids may write into directly
+void _openslide_grid_set_direct_target(cairo_surface_t *surface);
+
+bool _openslide_grid_is_direct_target(cairo_t *cr);
+
 struct _openslide_grid *_openslide_grid_create_tilemap(openslide_t *osr,
                                                        double tile_advance_x,
                                                        double tile_advance_y,
@@ -221,9 +293,15 @@ void _openslide_grid_tilemap_add_tile(struct _openslide_grid *grid,
                                       double w, double h,
                                       void *data);
 
+void _openslide_grid_tilemap_finish_adding_tiles(struct _openslide_grid *grid);
+
+// append the data of the tiles painted for a region
+void _openslide_grid_tilemap_get_tiles(struct _openslide_grid *grid,
+                                       double x, double y,
+                                       int32_t w, int32_t h,
+                                       GPtrArray *tiles);
+
 struct _openslide_grid *_openslide_grid_create_range(openslide_t *osr,
-                                                     int typical_tile_width,
-                                                     int typical_tile_height,
                                                      _openslide_grid_range_read_fn read_tile,
                                                      GDestroyNotify destroy_tile);
 
@@ -256,24 +334,70 @@ void _openslide_set_bounds_props_from_grid(openslide_t *osr,
                                            struct _openslide_grid *grid);
 
 
+/* Tile buffers, recycled by size once the cache drops them */
+void *_openslide_buffer_alloc(gsize size);
+
+void *_openslide_buffer_alloc0(gsize size);
+
+void _openslide_buffer_free(gsize size, void *buf);
+
+// bytes of spare buffers kept for any thread, 0 for the default
+void _openslide_buffer_set_depot_limit(gsize limit);
+
+// free the spare buffers kept for any thread
+void _openslide_buffer_trim(void);
+
+
 /* Cache */
 #define _OPENSLIDE_USEFUL_CACHE_SIZE 1024*1024*32
 
 struct _openslide_cache_entry;
 
-// constructor/destructor
-struct _openslide_cache *_openslide_cache_create(int capacity_in_bytes);
+// constructor/destructor, refcounted since slides can share a cache
+struct _openslide_cache *_openslide_cache_create(uint64_t capacity_in_bytes);
+
+struct _openslide_cache *_openslide_cache_ref(struct _openslide_cache *cache);
+
+void _openslide_cache_release(struct _openslide_cache *cache);
 
-void _openslide_cache_destroy(struct _openslide_cache *cache);
+// binding of a slide to a cache, starting with a private one
+struct _openslide_cache_binding *_openslide_cache_binding_create(void);
+
+void _openslide_cache_binding_set(struct _openslide_cache_binding *cb,
+                                  struct _openslide_cache *cache);
+
+void _openslide_cache_binding_set_streaming(struct _openslide_cache_binding *cb,
+                                            bool streaming);
+
+void _openslide_cache_binding_destroy(struct _openslide_cache_binding *cb);
 
 // cache size
-int _openslide_cache_get_capacity(struct _openslide_cache *cache);
+uint64_t _openslide_cache_get_capacity(struct _openslide_cache *cache);
+
+// of the cache a slide is bound to
+uint64_t _openslide_cache_binding_get_capacity(struct _openslide_cache_binding *cb);
 
 void _openslide_cache_set_capacity(struct _openslide_cache *cache,
-				   int capacity_in_bytes);
+				   uint64_t capacity_in_bytes);
+
+// drop the least recently used fraction of the tiles of every cache
+void _openslide_cache_trim_all(double fraction);
+
+// counters
+struct _openslide_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t capacity;
+  uint64_t size;
+  uint64_t protected_size;
+};
+
+void _openslide_cache_get_stats(struct _openslide_cache *cache,
+                                struct _openslide_cache_stats *stats);
 
 // put and get
-void _openslide_cache_put(struct _openslide_cache *cache,
+void _openslide_cache_put(struct _openslide_cache_binding *cb,
 			  void *plane,  // coordinate plane (level or grid)
 			  int64_t x,
 			  int64_t y,
@@ -281,16 +405,113 @@ void _openslide_cache_put(struct _openslide_cache *cache,
 			  int size_in_bytes,
 			  struct _openslide_cache_entry **entry);
 
-void *_openslide_cache_get(struct _openslide_cache *cache,
+void *_openslide_cache_get(struct _openslide_cache_binding *cb,
 			   void *plane,
 			   int64_t x,
 			   int64_t y,
 			   struct _openslide_cache_entry **entry);
 
+// while set, hits of the calling thread don't promote entries; for reading
+// back tiles which were just inserted for one use
+void _openslide_cache_set_passive(bool passive);
+
+// whether a tile is cached, without counting a hit or a miss or making it
+// more recently used; for deciding what to fetch
+bool _openslide_cache_contains(struct _openslide_cache_binding *cb,
+			       void *plane,
+			       int64_t x,
+			       int64_t y);
+
 // value unref
 void _openslide_cache_entry_unref(struct _openslide_cache_entry *entry);
 
 
+/* Prefetch */
+// runs a hint on a worker, one hint of a slide at a time
+typedef void (*_openslide_prefetch_fn)(openslide_t *osr,
+				       int64_t x, int64_t y,
+				       int32_t level,
+				       int64_t w, int64_t h,
+				       int prefetch_id);
+
+struct _openslide_prefetch *_openslide_prefetch_create(openslide_t *osr,
+						       _openslide_prefetch_fn fn);
+
+// returns a positive id, unique in the process
+int _openslide_prefetch_give_hint(struct _openslide_prefetch *prefetch,
+				  int64_t x, int64_t y,
+				  int32_t level,
+				  int64_t w, int64_t h);
+
+void _openslide_prefetch_cancel_hint(struct _openslide_prefetch *prefetch,
+				     int id);
+
+// drops pending hints and waits for the running one
+void _openslide_prefetch_destroy(struct _openslide_prefetch *prefetch);
+
+
+/* Shared worker pool */
+enum _openslide_work_priority {
+  OPENSLIDE_WORK_INTERACTIVE = OPENSLIDE_TASK_INTERACTIVE,
+  OPENSLIDE_WORK_PREFETCH = OPENSLIDE_TASK_PREFETCH,
+  OPENSLIDE_WORK_BACKGROUND = OPENSLIDE_TASK_BACKGROUND,  // may block
+  OPENSLIDE_WORK_PRIORITIES
+};
+
+typedef void (*_openslide_work_fn)(void *data);
+
+// tasks someone waits for
+struct _openslide_work_group *_openslide_work_group_new(void);
+
+// run fn(data) on a worker, counted in group if it isn't NULL
+void _openslide_work_submit(struct _openslide_work_group *group,
+                            enum _openslide_work_priority priority,
+                            _openslide_work_fn fn, void *data);
+
+// wait for the tasks of a group, and free it; if help, run queued
+// interactive tasks meanwhile
+void _openslide_work_group_finish(struct _openslide_work_group *group,
+                                  bool help);
+
+int _openslide_work_get_threads(void);
+
+// 0 for the default
+void _openslide_work_set_threads(int threads);
+
+
+/* Synthesized pyramid levels */
+// add the levels built for this slide before, or start building them
+void _openslide_pyramid_attach(openslide_t *osr, const char *filename);
+
+
+/* Metadata snapshots */
+// detect and open the backend, up to the quickhash and vendor properties;
+// NULL if the file isn't a slide
+openslide_t *_openslide_open_native(const char *filename);
+
+// fill in a new osr from a snapshot of the unchanged file, with the backend
+// opened by the first read; false, leaving osr alone, if there is none
+bool _openslide_snapshot_load(openslide_t *osr, const char *filename);
+
+// keep what _openslide_open_native() found for later opens
+void _openslide_snapshot_save(openslide_t *osr, const char *filename);
+
+
+/* Memory budget */
+// the tile cache slides share under a budget, with a reference for the
+// caller; NULL without a budget
+struct _openslide_cache *_openslide_budget_get_tile_cache(void);
+
+void _openslide_budget_set(uint64_t bytes);
+
+uint64_t _openslide_budget_get(void);
+
+// now and then, move memory to the cache whose misses cost more
+void _openslide_budget_tick(void);
+
+void _openslide_budget_release(double fraction);
+
+
 /* Internal error propagation */
 enum OpenSlideError {
   // generic failure
@@ -313,12 +534,64 @@ enum _openslide_debug_flag {
   OPENSLIDE_DEBUG_JPEG_MARKERS,
   OPENSLIDE_DEBUG_PERFORMANCE,
   OPENSLIDE_DEBUG_TILES,
+  OPENSLIDE_DEBUG_URLIO,
+  OPENSLIDE_DEBUG_TRACE,
 };
 
 void _openslide_debug_init(void);
 
 bool _openslide_debug(enum _openslide_debug_flag flag);
 
+/* Trace spans, written as a Chrome trace at exit with OPENSLIDE_DEBUG=trace.
+   name must be a string constant; spans of a thread nest. */
+extern bool _openslide_tracing;
+
+void _openslide_trace_init(void);
+void _openslide_trace_push(const char *name);
+void _openslide_trace_pop(void);
+
+#define _openslide_trace_begin(name) \
+  do { if (G_UNLIKELY(_openslide_tracing)) _openslide_trace_push(name); } while (0)
+#define _openslide_trace_end() \
+  do { if (G_UNLIKELY(_openslide_tracing)) _openslide_trace_pop(); } while (0)
+
+/* Counters, for the process and for the slide the thread is reading */
+enum _openslide_stat {
+  OPENSLIDE_STAT_CACHE_HITS,
+  OPENSLIDE_STAT_CACHE_MISSES,
+  OPENSLIDE_STAT_CACHE_EVICTIONS,
+  OPENSLIDE_STAT_CACHE_INSERT_BYTES,
+  OPENSLIDE_STAT_DECODED_JPEG,
+  OPENSLIDE_STAT_DECODED_JP2K,
+  OPENSLIDE_STAT_DECODED_PNG,
+  OPENSLIDE_STAT_DECODED_LIBTIFF,
+  OPENSLIDE_STAT_SLOW_PATHS,
+  _OPENSLIDE_STAT_COUNT
+};
+
+enum _openslide_stat_timer {
+  OPENSLIDE_STAT_TIMER_DECODE,
+  OPENSLIDE_STAT_TIMER_COMPOSITE,
+  _OPENSLIDE_STAT_TIMER_COUNT
+};
+
+uint64_t _openslide_stats_id_new(void);
+
+// count into the slide of id on this thread, 0 for none; returns the
+// previous one, to be restored
+uint64_t _openslide_stats_set_current(uint64_t id);
+
+void _openslide_stats_add(enum _openslide_stat stat, uint64_t n);
+
+// start from g_get_monotonic_time()
+void _openslide_stats_add_time(enum _openslide_stat_timer timer,
+                               int64_t start);
+
+// id 0 for the process
+void _openslide_stats_collect(uint64_t id, struct openslide_stats *stats);
+
+void _openslide_stats_forget(uint64_t id);
+
 #define _openslide_performance_warn(...) \
       _openslide_performance_warn_once(NULL, __VA_ARGS__)
 
@@ -328,6 +601,7 @@ void _openslide_performance_warn_once(gint *warned_flag,
 
 // private properties, for now
 #define _OPENSLIDE_PROPERTY_NAME_LEVEL_COUNT "openslide.level-count"
+#define _OPENSLIDE_PROPERTY_NAME_OPEN_ROUND_TRIPS "openslide.remote.open-round-trips"
 #define _OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_WIDTH "openslide.level[%d].width"
 #define _OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_HEIGHT "openslide.level[%d].height"
 #define _OPENSLIDE_PROPERTY_NAME_TEMPLATE_LEVEL_DOWNSAMPLE "openslide.level[%d].downsample"
@@ -345,18 +619,48 @@ extern const int32_t _openslide_G_Cb[256];
 extern const int32_t _openslide_G_Cr[256];
 extern const int16_t _openslide_B_Cb[256];
 
-// deprecated prefetch stuff (maybe we'll undeprecate it someday),
-// still needs these declarations for ABI compat
-// TODO: remove if soname bump
-#undef openslide_give_prefetch_hint
-OPENSLIDE_PUBLIC()
-int openslide_give_prefetch_hint(openslide_t *osr,
-				 int64_t x, int64_t y,
-				 int32_t level,
-				 int64_t w, int64_t h);
-#undef openslide_cancel_prefetch_hint
-OPENSLIDE_PUBLIC()
-void openslide_cancel_prefetch_hint(openslide_t *osr, int prefetch_id);
+/* Pixel conversion, vectorized where the CPU allows */
+// TIFFRGBAImage ABGR -> ARGB, in place
+void _openslide_pixel_abgr_to_argb(uint32_t *buf, int64_t count);
+
+// planar 8-bit RGB samples, as stored by OpenJPEG, -> ARGB
+void _openslide_pixel_rgb_to_argb(uint32_t *dest,
+                                  const int32_t *r, const int32_t *g,
+                                  const int32_t *b,
+                                  int64_t count);
+
+// planar YCbCr with chroma halved horizontally -> ARGB
+void _openslide_pixel_ycbcr422_to_argb(uint32_t *dest,
+                                       const int32_t *y, const int32_t *cb,
+                                       const int32_t *cr,
+                                       int64_t count);
+
+// premultiplied ARGB -> packed 8-bit RGB, or BGR
+void _openslide_pixel_argb_to_packed(uint8_t *dest, const uint32_t *src,
+                                     int64_t count, bool bgr);
+
+// premultiplied ARGB -> 8-bit RGB planes
+void _openslide_pixel_argb_to_planar(uint8_t *r, uint8_t *g, uint8_t *b,
+                                     const uint32_t *src, int64_t count);
+
+// premultiplied ARGB -> float RGB planes of sample * scale + offset
+void _openslide_pixel_argb_to_planar_float(float *r, float *g, float *b,
+                                           const uint32_t *src,
+                                           int64_t count,
+                                           const float *scale,
+                                           const float *offset);
+
+// packed 16-bit little-endian RGB, as stored by Hamamatsu NGR -> xRGB of
+// bits 4-11 of each sample, leaving alpha 0
+void _openslide_pixel_rgb48_to_xrgb(uint32_t *dest, const uint8_t *src,
+                                    int64_t count);
+
+// reverse the bytes of each 2-, 4- or 8-byte value, in place
+void _openslide_pixel_swap_bytes(void *data, int32_t size, int64_t count);
+
+// 2x2 box average of two rows of 2 * count ARGB pixels
+void _openslide_pixel_reduce_2x2(uint32_t *dest, const uint32_t *row0,
+                                 const uint32_t *row1, int64_t count);
 
 /* Prevent use of dangerous functions and functions with mandatory wrappers.
    Every @p replacement must be unique to avoid conflicting-type errors. */
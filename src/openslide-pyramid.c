@@ -0,0 +1,599 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/*
+ * A slide whose smallest stored level is still large gets synthesized
+ * levels, each a quarter the size of the one above.  They are built once,
+ * as a background task with a slide of its own, from the smallest stored
+ * level, and kept in the on-disk cache under the slide's quickhash.  Later
+ * opens map the file and serve the levels after the stored ones, wrapping
+ * the backend's ops.
+ */
+
+#define PYRAMID_ENV_VAR "OPENSLIDE_PYRAMID"
+#define PYRAMID_SUBDIR "pyramid"
+#define PYRAMID_MAGIC "OSPYRMD1"
+
+// levels are added while the smallest is larger than this
+#define PYRAMID_MIN_DIMENSION 1024
+#define PYRAMID_LEVELS_MAX 16
+
+// source pixels on a side read at a time while building, a multiple of 4
+#define PYRAMID_BLOCK 4096
+
+// level data offsets in the file
+#define PYRAMID_ALIGN 4096
+
+// tile geometry reported for synthesized levels of tiled slides
+#define PYRAMID_TILE_SIZE 256
+
+struct pyramid_file_header {
+  char magic[8];
+  int64_t base_w;  // of level 0, to catch a stale file
+  int64_t base_h;
+  int32_t level_count;
+  int32_t reserved;
+  struct {
+    int64_t w;
+    int64_t h;
+    uint64_t offset;  // of ARGB rows
+  } levels[PYRAMID_LEVELS_MAX];
+};
+
+struct pyramid_level {
+  struct _openslide_level base;
+  const uint32_t *pixels;
+};
+
+struct _openslide_pyramid {
+  // the backend's, restored before it is destroyed
+  const struct _openslide_ops *native_ops;
+  struct _openslide_level **native_levels;
+  int32_t native_level_count;
+
+  struct _openslide_ops ops;
+  struct pyramid_level *levels;
+  int32_t level_count;
+
+  void *map;
+  gsize map_len;
+};
+
+#ifdef HAVE_MMAP
+
+// quickhashes being built in this process
+static GMutex building_lock;
+static GHashTable *building;
+
+struct build_job {
+  char *filename;
+  char *quickhash;
+  char *path;
+};
+
+static bool pyramid_enabled(void) {
+  const char *env = g_getenv(PYRAMID_ENV_VAR);
+  return env && *env && strcmp(env, "0");
+}
+
+static char *get_path(const char *quickhash) {
+  char *dir = urlio_get_disk_cache_dir();
+  if (dir == NULL) {
+    return NULL;
+  }
+  char *path = g_strdup_printf("%s" G_DIR_SEPARATOR_S PYRAMID_SUBDIR
+                               G_DIR_SEPARATOR_S "%s.pyramid",
+                               dir, quickhash);
+  g_free(dir);
+  return path;
+}
+
+// dimensions of the levels to synthesize below a w x h level
+static int32_t plan_levels(int64_t w, int64_t h,
+                           struct pyramid_file_header *hdr) {
+  int32_t count = 0;
+  while (MAX(w, h) > PYRAMID_MIN_DIMENSION && count < PYRAMID_LEVELS_MAX) {
+    w = (w + 3) / 4;
+    h = (h + 3) / 4;
+    hdr->levels[count].w = w;
+    hdr->levels[count].h = h;
+    count++;
+  }
+  return count;
+}
+
+static struct pyramid_level *get_level(struct _openslide_pyramid *pyr,
+                                       struct _openslide_level *level) {
+  struct pyramid_level *l = (struct pyramid_level *) level;
+  if (l >= pyr->levels && l < pyr->levels + pyr->level_count) {
+    return l;
+  }
+  return NULL;
+}
+
+static bool paint_region(openslide_t *osr, cairo_t *cr,
+                         int64_t x, int64_t y,
+                         struct _openslide_level *level,
+                         int32_t w, int32_t h,
+                         GError **err) {
+  struct _openslide_pyramid *pyr = osr->pyramid;
+  struct pyramid_level *l = get_level(pyr, level);
+  if (l == NULL) {
+    return pyr->native_ops->paint_region(osr, cr, x, y, level, w, h, err);
+  }
+
+  // the stored pixels under the region
+  double lx = x / l->base.downsample;
+  double ly = y / l->base.downsample;
+  int64_t x0 = MAX(0, (int64_t) floor(lx));
+  int64_t y0 = MAX(0, (int64_t) floor(ly));
+  int64_t x1 = MIN(l->base.w, (int64_t) ceil(lx + w));
+  int64_t y1 = MIN(l->base.h, (int64_t) ceil(ly + h));
+  if (x1 <= x0 || y1 <= y0) {
+    return true;
+  }
+
+  // painting only reads the mapping
+  cairo_surface_t *surface =
+    cairo_image_surface_create_for_data((unsigned char *) (l->pixels +
+                                                           y0 * l->base.w + x0),
+                                        CAIRO_FORMAT_ARGB32,
+                                        x1 - x0, y1 - y0,
+                                        l->base.w * 4);
+  cairo_set_source_surface(cr, surface, x0 - lx, y0 - ly);
+  cairo_surface_destroy(surface);
+  cairo_paint(cr);
+  return true;
+}
+
+static bool prefetch_region(openslide_t *osr,
+                            int64_t x, int64_t y,
+                            struct _openslide_level *level,
+                            int64_t w, int64_t h,
+                            int prefetch_id,
+                            GError **err) {
+  struct _openslide_pyramid *pyr = osr->pyramid;
+  if (get_level(pyr, level)) {
+    // already mapped
+    return true;
+  }
+  return pyr->native_ops->prefetch_region(osr, x, y, level, w, h,
+                                          prefetch_id, err);
+}
+
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int32_t *len, const char **codec,
+                          GError **err) {
+  struct _openslide_pyramid *pyr = osr->pyramid;
+  if (get_level(pyr, level)) {
+    // nothing stored to pass through
+    *buf = NULL;
+    return true;
+  }
+  return pyr->native_ops->read_raw_tile(osr, level, tile_col, tile_row,
+                                        buf, len, codec, err);
+}
+
+static bool read_level_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            uint32_t **tiledata,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
+  struct _openslide_pyramid *pyr = osr->pyramid;
+  struct pyramid_level *l = get_level(pyr, level);
+  if (l == NULL) {
+    return pyr->native_ops->read_level_tile(osr, level, tile_col, tile_row,
+                                            tiledata, cache_entry, err);
+  }
+
+  uint32_t *tile = _openslide_cache_get(osr->cache, level, tile_col, tile_row,
+                                        cache_entry);
+  if (tile == NULL) {
+    // copy it out of the mapping, transparent past the edges
+    int64_t size = PYRAMID_TILE_SIZE * PYRAMID_TILE_SIZE * 4;
+    tile = _openslide_buffer_alloc0(size);
+    int64_t x0 = tile_col * PYRAMID_TILE_SIZE;
+    int64_t y0 = tile_row * PYRAMID_TILE_SIZE;
+    int64_t cols = MIN(PYRAMID_TILE_SIZE, l->base.w - x0);
+    int64_t rows = MIN(PYRAMID_TILE_SIZE, l->base.h - y0);
+    for (int64_t r = 0; r < rows; r++) {
+      memcpy(tile + r * PYRAMID_TILE_SIZE,
+             l->pixels + (y0 + r) * l->base.w + x0, cols * 4);
+    }
+    _openslide_cache_put(osr->cache, level, tile_col, tile_row,
+                         tile, size, cache_entry);
+  }
+  *tiledata = tile;
+  return true;
+}
+
+static bool prefetch_tiles(openslide_t *osr,
+                           struct _openslide_level *level,
+                           const int64_t *tiles, int64_t count,
+                           GError **err) {
+  struct _openslide_pyramid *pyr = osr->pyramid;
+  if (get_level(pyr, level)) {
+    return true;
+  }
+  return pyr->native_ops->prefetch_tiles(osr, level, tiles, count, err);
+}
+
+static void destroy(openslide_t *osr) {
+  struct _openslide_pyramid *pyr = osr->pyramid;
+
+  // hand the backend back its own levels
+  g_free(osr->levels);
+  osr->ops = pyr->native_ops;
+  osr->levels = pyr->native_levels;
+  osr->level_count = pyr->native_level_count;
+  osr->pyramid = NULL;
+
+  munmap(pyr->map, pyr->map_len);
+  g_free(pyr->levels);
+  g_slice_free(struct _openslide_pyramid, pyr);
+
+  osr->ops->destroy(osr);
+}
+
+// map a built file, if it matches the slide
+static bool load(openslide_t *osr, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct pyramid_file_header)) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  // check it against what would be built now
+  const struct pyramid_file_header *hdr = map;
+  struct _openslide_level *l0 = osr->levels[0];
+  struct _openslide_level *last = osr->levels[osr->level_count - 1];
+  struct pyramid_file_header plan;
+  int32_t count = plan_levels(last->w, last->h, &plan);
+  bool valid = !memcmp(hdr->magic, PYRAMID_MAGIC, sizeof(hdr->magic)) &&
+               hdr->base_w == l0->w && hdr->base_h == l0->h &&
+               hdr->level_count == count;
+  for (int32_t i = 0; valid && i < count; i++) {
+    valid = hdr->levels[i].w == plan.levels[i].w &&
+            hdr->levels[i].h == plan.levels[i].h &&
+            hdr->levels[i].offset % PYRAMID_ALIGN == 0 &&
+            hdr->levels[i].offset + hdr->levels[i].w * hdr->levels[i].h * 4 <=
+            (uint64_t) st.st_size;
+  }
+  if (!valid) {
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  struct _openslide_pyramid *pyr = g_slice_new0(struct _openslide_pyramid);
+  pyr->native_ops = osr->ops;
+  pyr->native_levels = osr->levels;
+  pyr->native_level_count = osr->level_count;
+  pyr->map = map;
+  pyr->map_len = st.st_size;
+
+  pyr->level_count = count;
+  pyr->levels = g_new0(struct pyramid_level, count);
+  bool geometry = l0->tile_w > 0 && l0->tile_h > 0;
+  for (int32_t i = 0; i < count; i++) {
+    struct pyramid_level *l = &pyr->levels[i];
+    l->base.w = hdr->levels[i].w;
+    l->base.h = hdr->levels[i].h;
+    l->base.downsample = (((double) l0->h / (double) l->base.h) +
+                          ((double) l0->w / (double) l->base.w)) / 2.0;
+    if (geometry) {
+      l->base.tile_w = PYRAMID_TILE_SIZE;
+      l->base.tile_h = PYRAMID_TILE_SIZE;
+    }
+    l->pixels = (const uint32_t *) ((const char *) map +
+                                    hdr->levels[i].offset);
+  }
+
+  // optional ops only where the backend has them
+  pyr->ops.paint_region = paint_region;
+  pyr->ops.destroy = destroy;
+  if (pyr->native_ops->prefetch_region) {
+    pyr->ops.prefetch_region = prefetch_region;
+  }
+  if (pyr->native_ops->read_raw_tile) {
+    pyr->ops.read_raw_tile = read_raw_tile;
+  }
+  if (pyr->native_ops->read_level_tile) {
+    pyr->ops.read_level_tile = read_level_tile;
+  }
+  if (pyr->native_ops->prefetch_tiles) {
+    pyr->ops.prefetch_tiles = prefetch_tiles;
+  }
+
+  osr->levels = g_new(struct _openslide_level *,
+                      pyr->native_level_count + count);
+  memcpy(osr->levels, pyr->native_levels,
+         pyr->native_level_count * sizeof(*osr->levels));
+  for (int32_t i = 0; i < count; i++) {
+    osr->levels[pyr->native_level_count + i] = &pyr->levels[i].base;
+  }
+  osr->level_count += count;
+  osr->ops = &pyr->ops;
+  osr->pyramid = pyr;
+  return true;
+}
+
+// reduce a sw x sh level, from the slide or from pixels, into dest
+static bool reduce_level(openslide_t *osr, int32_t level, double ds,
+                         const uint32_t *pixels, int64_t sw, int64_t sh,
+                         uint32_t *dest, int64_t dw,
+                         GError **err) {
+  uint32_t *src = g_malloc(PYRAMID_BLOCK * PYRAMID_BLOCK * 4);
+  uint32_t *half = g_malloc(PYRAMID_BLOCK / 2 * PYRAMID_BLOCK / 2 * 4);
+  bool success = true;
+
+  for (int64_t y0 = 0; success && y0 < sh; y0 += PYRAMID_BLOCK) {
+    for (int64_t x0 = 0; x0 < sw; x0 += PYRAMID_BLOCK) {
+      int64_t bw = MIN(PYRAMID_BLOCK, sw - x0);
+      int64_t bh = MIN(PYRAMID_BLOCK, sh - y0);
+      // padded to whole output pixels
+      int64_t pw = (bw + 3) & ~3;
+      int64_t ph = (bh + 3) & ~3;
+
+      if (pixels) {
+        for (int64_t r = 0; r < bh; r++) {
+          memcpy(src + r * pw, pixels + (y0 + r) * sw + x0, bw * 4);
+        }
+      } else {
+        // decoded in parallel for a block this size; spread out the rows
+        openslide_read_region(osr, src, x0 * ds, y0 * ds, level, bw, bh);
+        const char *error = openslide_get_error(osr);
+        if (error) {
+          g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                      "%s", error);
+          success = false;
+          break;
+        }
+        for (int64_t r = bh - 1; r > 0; r--) {
+          memmove(src + r * pw, src + r * bw, bw * 4);
+        }
+      }
+
+      // repeat the right and bottom edges into the padding
+      for (int64_t r = 0; r < bh; r++) {
+        for (int64_t c = bw; c < pw; c++) {
+          src[r * pw + c] = src[r * pw + bw - 1];
+        }
+      }
+      for (int64_t r = bh; r < ph; r++) {
+        memcpy(src + r * pw, src + (bh - 1) * pw, pw * 4);
+      }
+
+      // two halvings
+      for (int64_t r = 0; r < ph / 2; r++) {
+        _openslide_pixel_reduce_2x2(half + r * (pw / 2),
+                                    src + 2 * r * pw,
+                                    src + (2 * r + 1) * pw,
+                                    pw / 2);
+      }
+      for (int64_t r = 0; r < ph / 4; r++) {
+        _openslide_pixel_reduce_2x2(dest + (y0 / 4 + r) * dw + x0 / 4,
+                                    half + 2 * r * (pw / 2),
+                                    half + (2 * r + 1) * (pw / 2),
+                                    pw / 4);
+      }
+    }
+  }
+
+  g_free(src);
+  g_free(half);
+  return success;
+}
+
+static bool build(const char *filename, const char *path, GError **err) {
+  openslide_t *osr = openslide_open(filename);
+  if (osr == NULL || openslide_get_error(osr)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Couldn't reopen %s", filename);
+    if (osr) {
+      openslide_close(osr);
+    }
+    return false;
+  }
+
+  int32_t level = openslide_get_level_count(osr) - 1;
+  double ds = openslide_get_level_downsample(osr, level);
+  int64_t w, h;
+  openslide_get_level_dimensions(osr, level, &w, &h);
+
+  // lay out the file
+  struct pyramid_file_header hdr = {{0}};
+  memcpy(hdr.magic, PYRAMID_MAGIC, sizeof(hdr.magic));
+  openslide_get_level0_dimensions(osr, &hdr.base_w, &hdr.base_h);
+  hdr.level_count = plan_levels(w, h, &hdr);
+  uint64_t size = PYRAMID_ALIGN;
+  for (int32_t i = 0; i < hdr.level_count; i++) {
+    hdr.levels[i].offset = size;
+    size += hdr.levels[i].w * hdr.levels[i].h * 4;
+    size = (size + PYRAMID_ALIGN - 1) / PYRAMID_ALIGN * PYRAMID_ALIGN;
+  }
+
+  // charged to the disk cache like its blocks
+  if (!urlio_disk_reserve(size)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "%s would be larger than the disk cache", path);
+    openslide_close(osr);
+    return false;
+  }
+
+  // written under a temporary name, then renamed into place
+  char *dir = g_path_get_dirname(path);
+  g_mkdir_with_parents(dir, 0755);
+  g_free(dir);
+  char *tmp = g_strdup_printf("%s.%d.tmp", path, (int) getpid());
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  void *map = MAP_FAILED;
+  if (fd != -1 && !ftruncate(fd, size)) {
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (map == MAP_FAILED) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Couldn't create %s", tmp);
+    g_unlink(tmp);
+    g_free(tmp);
+    openslide_close(osr);
+    return false;
+  }
+
+  // each level from the one above
+  bool success = true;
+  const uint32_t *pixels = NULL;
+  for (int32_t i = 0; success && i < hdr.level_count; i++) {
+    uint32_t *dest = (uint32_t *) ((char *) map + hdr.levels[i].offset);
+    success = reduce_level(osr, level, ds, pixels, w, h,
+                           dest, hdr.levels[i].w, err);
+    pixels = dest;
+    w = hdr.levels[i].w;
+    h = hdr.levels[i].h;
+  }
+  openslide_close(osr);
+
+  if (success) {
+    memcpy(map, &hdr, sizeof(hdr));
+    success = !msync(map, size, MS_SYNC) && !g_rename(tmp, path);
+    if (!success) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Couldn't write %s", path);
+    }
+  }
+  munmap(map, size);
+  if (!success) {
+    g_unlink(tmp);
+  }
+  g_free(tmp);
+  return success;
+}
+
+// a background task, since it reads the whole slide
+static void build_task(void *data) {
+  struct build_job *job = data;
+  GError *tmp_err = NULL;
+
+  GTimer *timer = g_timer_new();
+  if (!build(job->filename, job->path, &tmp_err)) {
+    if (_openslide_debug(OPENSLIDE_DEBUG_PERFORMANCE)) {
+      g_message("pyramid: %s", tmp_err->message);
+    }
+    g_clear_error(&tmp_err);
+  } else if (_openslide_debug(OPENSLIDE_DEBUG_PERFORMANCE)) {
+    g_message("pyramid: built %s in %.1f s", job->path,
+              g_timer_elapsed(timer, NULL));
+  }
+  g_timer_destroy(timer);
+
+  g_mutex_lock(&building_lock);
+  g_hash_table_remove(building, job->quickhash);
+  g_mutex_unlock(&building_lock);
+
+  g_free(job->filename);
+  g_free(job->quickhash);
+  g_free(job->path);
+  g_slice_free(struct build_job, job);
+}
+
+static void start_build(const char *filename, const char *quickhash,
+                        const char *path) {
+  g_mutex_lock(&building_lock);
+  if (building == NULL) {
+    building = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  }
+  // also stops the builder's own open from starting another
+  if (g_hash_table_lookup(building, quickhash)) {
+    g_mutex_unlock(&building_lock);
+    return;
+  }
+  g_hash_table_insert(building, g_strdup(quickhash), GINT_TO_POINTER(1));
+  g_mutex_unlock(&building_lock);
+
+  struct build_job *job = g_slice_new0(struct build_job);
+  job->filename = g_strdup(filename);
+  job->quickhash = g_strdup(quickhash);
+  job->path = g_strdup(path);
+  _openslide_work_submit(NULL, OPENSLIDE_WORK_BACKGROUND, build_task, job);
+}
+
+void _openslide_pyramid_attach(openslide_t *osr, const char *filename) {
+  if (!pyramid_enabled() || osr->level_count == 0) {
+    return;
+  }
+  const char *quickhash = g_hash_table_lookup(osr->properties,
+                                              OPENSLIDE_PROPERTY_NAME_QUICKHASH1);
+  if (quickhash == NULL) {
+    return;
+  }
+  struct _openslide_level *last = osr->levels[osr->level_count - 1];
+  if (MAX(last->w, last->h) <= PYRAMID_MIN_DIMENSION) {
+    return;
+  }
+
+  char *path = get_path(quickhash);
+  if (path == NULL) {
+    return;
+  }
+  if (!load(osr, path)) {
+    start_build(filename, quickhash, path);
+  }
+  g_free(path);
+}
+
+#else
+
+void _openslide_pyramid_attach(openslide_t *osr G_GNUC_UNUSED,
+                               const char *filename G_GNUC_UNUSED) {
+}
+
+#endif
@@ -0,0 +1,572 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * What an open found, the properties, level geometry and associated image
+ * dimensions, is kept in the on-disk cache under the name of the file,
+ * with the version of the file it came from.  A later open of the same
+ * version maps it and answers everything but pixels from it, which costs
+ * the one request that learns the version of a remote file; the backend
+ * is opened by the first read, on whichever thread makes it, and the reads
+ * are passed to it.
+ */
+
+#define SNAPSHOT_ENV_VAR "OPENSLIDE_SNAPSHOT"
+#define SNAPSHOT_SUBDIR "snapshot"
+#define SNAPSHOT_MAGIC "OSSNAPS1"
+
+// limits of a file that is believed
+#define SNAPSHOT_LEVELS_MAX 256
+#define SNAPSHOT_ITEMS_MAX (1 << 20)
+
+// optional ops of the backend
+enum snapshot_op {
+  SNAPSHOT_OP_PREFETCH_REGION = 1 << 0,
+  SNAPSHOT_OP_READ_RAW_TILE = 1 << 1,
+  SNAPSHOT_OP_READ_LEVEL_TILE = 1 << 2,
+  SNAPSHOT_OP_PREFETCH_TILES = 1 << 3,
+};
+
+struct snapshot {
+  char *filename;
+  struct _openslide_ops ops;
+  struct _openslide_level *levels;
+  int32_t level_count;
+
+  // the backend, opened once by the first read
+  GOnce once;
+  openslide_t *real;
+  char *error;  // why it couldn't be opened
+};
+
+struct snapshot_image {
+  struct _openslide_associated_image base;
+  openslide_t *osr;
+  char *name;
+};
+
+static bool snapshot_enabled(void) {
+  const char *env = g_getenv(SNAPSHOT_ENV_VAR);
+  return env && *env && strcmp(env, "0");
+}
+
+static char *get_path(const char *filename) {
+  char *dir = urlio_get_disk_cache_dir();
+  if (dir == NULL) {
+    return NULL;
+  }
+  char *key = g_compute_checksum_for_string(G_CHECKSUM_SHA256, filename, -1);
+  char *path = g_strdup_printf("%s" G_DIR_SEPARATOR_S SNAPSHOT_SUBDIR
+                               G_DIR_SEPARATOR_S "%s.snapshot", dir, key);
+  g_free(key);
+  g_free(dir);
+  return path;
+}
+
+// the version of the file: what the server validates a remote one with, or
+// the modification time of a local one; with the size.  NULL if it has none.
+static char *get_version(const char *filename) {
+  URLIO_FILE *f = urlio_fopen(filename, "rb");
+  if (f == NULL) {
+    return NULL;
+  }
+  char *version = NULL;
+  char *validator = urlio_get_validator(f);
+  if (validator) {
+    version = g_strdup_printf("%s %"PRId64, validator,
+                              (int64_t) urlio_fsize(f));
+  } else if (f->type == CFTYPE_FILE) {
+    struct stat st;
+    if (!g_stat(filename, &st)) {
+      version = g_strdup_printf("mtime %"PRId64" %"PRId64,
+                                (int64_t) st.st_mtime, (int64_t) st.st_size);
+    }
+  }
+  g_free(validator);
+  urlio_fclose(f);
+  return version;
+}
+
+/* the file, native byte order like pyramid files */
+
+static void put_u32(GString *buf, uint32_t val) {
+  g_string_append_len(buf, (const char *) &val, sizeof(val));
+}
+
+static void put_i64(GString *buf, int64_t val) {
+  g_string_append_len(buf, (const char *) &val, sizeof(val));
+}
+
+static void put_double(GString *buf, double val) {
+  g_string_append_len(buf, (const char *) &val, sizeof(val));
+}
+
+static void put_string(GString *buf, const char *str) {
+  uint32_t len = strlen(str);
+  put_u32(buf, len);
+  g_string_append_len(buf, str, len);
+}
+
+struct reader {
+  const char *pos;
+  const char *end;
+  bool ok;  // nothing was read past the end
+};
+
+static void get_bytes(struct reader *r, void *dest, size_t len) {
+  if (!r->ok || (size_t) (r->end - r->pos) < len) {
+    r->ok = false;
+    memset(dest, 0, len);
+    return;
+  }
+  memcpy(dest, r->pos, len);
+  r->pos += len;
+}
+
+static uint32_t get_u32(struct reader *r) {
+  uint32_t val;
+  get_bytes(r, &val, sizeof(val));
+  return val;
+}
+
+static int64_t get_i64(struct reader *r) {
+  int64_t val;
+  get_bytes(r, &val, sizeof(val));
+  return val;
+}
+
+static double get_double(struct reader *r) {
+  double val;
+  get_bytes(r, &val, sizeof(val));
+  return val;
+}
+
+// g_malloc'd, NULL past the end
+static char *get_string(struct reader *r) {
+  uint32_t len = get_u32(r);
+  if (!r->ok || (size_t) (r->end - r->pos) < len) {
+    r->ok = false;
+    return NULL;
+  }
+  char *str = g_strndup(r->pos, len);
+  r->pos += len;
+  return str;
+}
+
+static void add_property(gpointer key, gpointer value, gpointer data) {
+  GString *buf = data;
+  put_string(buf, key);
+  put_string(buf, value);
+}
+
+static void add_associated_image(gpointer key, gpointer value,
+                                 gpointer data) {
+  struct _openslide_associated_image *img = value;
+  GString *buf = data;
+  put_string(buf, key);
+  put_i64(buf, img->w);
+  put_i64(buf, img->h);
+}
+
+void _openslide_snapshot_save(openslide_t *osr, const char *filename) {
+  // the version is of the one file, a rewritten companion would go unnoticed
+  if (!snapshot_enabled() || osr->companion_files) {
+    return;
+  }
+  char *path = get_path(filename);
+  if (path == NULL) {
+    return;
+  }
+  char *version = get_version(filename);
+  if (version == NULL) {
+    // nothing to tell a changed file by
+    g_free(path);
+    return;
+  }
+
+  uint32_t ops = 0;
+  if (osr->ops->prefetch_region) {
+    ops |= SNAPSHOT_OP_PREFETCH_REGION;
+  }
+  if (osr->ops->read_raw_tile) {
+    ops |= SNAPSHOT_OP_READ_RAW_TILE;
+  }
+  if (osr->ops->read_level_tile) {
+    ops |= SNAPSHOT_OP_READ_LEVEL_TILE;
+  }
+  if (osr->ops->prefetch_tiles) {
+    ops |= SNAPSHOT_OP_PREFETCH_TILES;
+  }
+
+  GString *buf = g_string_new(NULL);
+  g_string_append_len(buf, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+  put_string(buf, filename);
+  put_string(buf, version);
+  put_u32(buf, ops);
+  put_u32(buf, osr->level_count);
+  for (int32_t i = 0; i < osr->level_count; i++) {
+    struct _openslide_level *l = osr->levels[i];
+    put_double(buf, l->downsample);
+    put_i64(buf, l->w);
+    put_i64(buf, l->h);
+    put_i64(buf, l->tile_w);
+    put_i64(buf, l->tile_h);
+  }
+  put_u32(buf, g_hash_table_size(osr->properties));
+  g_hash_table_foreach(osr->properties, add_property, buf);
+  put_u32(buf, g_hash_table_size(osr->associated_images));
+  g_hash_table_foreach(osr->associated_images, add_associated_image, buf);
+
+  // renamed into place, so no open maps half of one
+  char *dir = g_path_get_dirname(path);
+  g_mkdir_with_parents(dir, 0755);
+  g_free(dir);
+  GError *tmp_err = NULL;
+  if (!g_file_set_contents(path, buf->str, buf->len, &tmp_err)) {
+    g_warning("Couldn't write snapshot: %s", tmp_err->message);
+    g_error_free(tmp_err);
+  }
+
+  g_string_free(buf, TRUE);
+  g_free(version);
+  g_free(path);
+}
+
+/* opens from a snapshot */
+
+static gpointer open_real(gpointer data) {
+  openslide_t *osr = data;
+  struct snapshot *snap = osr->data;
+
+  openslide_t *real = _openslide_open_native(snap->filename);
+  if (real == NULL) {
+    snap->error = g_strdup_printf("Couldn't reopen %s", snap->filename);
+    return NULL;
+  }
+  const char *err = openslide_get_error(real);
+  if (err) {
+    snap->error = g_strdup(err);
+    openslide_close(real);
+    return NULL;
+  }
+  bool same = real->level_count == snap->level_count;
+  for (int32_t i = 0; same && i < snap->level_count; i++) {
+    same = real->levels[i]->w == snap->levels[i].w &&
+           real->levels[i]->h == snap->levels[i].h;
+  }
+  if (!same) {
+    snap->error = g_strdup_printf("%s changed since its snapshot",
+                                  snap->filename);
+    openslide_close(real);
+    return NULL;
+  }
+
+  // tiles are cached for the slide the application has
+  real->cache = osr->cache;
+  snap->real = real;
+  return real;
+}
+
+static openslide_t *get_real(openslide_t *osr, GError **err) {
+  struct snapshot *snap = osr->data;
+  g_once(&snap->once, open_real, osr);
+  if (snap->real == NULL) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "%s", snap->error);
+  }
+  return snap->real;
+}
+
+// the backend's level for one of ours
+static struct _openslide_level *get_level(openslide_t *osr,
+                                          openslide_t *real,
+                                          struct _openslide_level *level) {
+  struct snapshot *snap = osr->data;
+  return real->levels[level - snap->levels];
+}
+
+static bool paint_region(openslide_t *osr, cairo_t *cr,
+                         int64_t x, int64_t y,
+                         struct _openslide_level *level,
+                         int32_t w, int32_t h,
+                         GError **err) {
+  openslide_t *real = get_real(osr, err);
+  if (real == NULL) {
+    return false;
+  }
+  return real->ops->paint_region(real, cr, x, y,
+                                 get_level(osr, real, level), w, h, err);
+}
+
+static bool prefetch_region(openslide_t *osr,
+                            int64_t x, int64_t y,
+                            struct _openslide_level *level,
+                            int64_t w, int64_t h,
+                            int prefetch_id,
+                            GError **err) {
+  openslide_t *real = get_real(osr, err);
+  if (real == NULL) {
+    return false;
+  }
+  return real->ops->prefetch_region(real, x, y, get_level(osr, real, level),
+                                    w, h, prefetch_id, err);
+}
+
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int32_t *len, const char **codec,
+                          GError **err) {
+  openslide_t *real = get_real(osr, err);
+  if (real == NULL) {
+    return false;
+  }
+  return real->ops->read_raw_tile(real, get_level(osr, real, level),
+                                  tile_col, tile_row, buf, len, codec, err);
+}
+
+static bool read_level_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            uint32_t **tiledata,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
+  openslide_t *real = get_real(osr, err);
+  if (real == NULL) {
+    return false;
+  }
+  return real->ops->read_level_tile(real, get_level(osr, real, level),
+                                    tile_col, tile_row,
+                                    tiledata, cache_entry, err);
+}
+
+static bool prefetch_tiles(openslide_t *osr,
+                           struct _openslide_level *level,
+                           const int64_t *tiles, int64_t count,
+                           GError **err) {
+  openslide_t *real = get_real(osr, err);
+  if (real == NULL) {
+    return false;
+  }
+  return real->ops->prefetch_tiles(real, get_level(osr, real, level),
+                                   tiles, count, err);
+}
+
+static void destroy(openslide_t *osr) {
+  struct snapshot *snap = osr->data;
+  if (snap->real) {
+    // the cache is ours
+    snap->real->cache = NULL;
+    openslide_close(snap->real);
+  }
+  g_free(osr->levels);
+  g_free(snap->levels);
+  g_free(snap->error);
+  g_free(snap->filename);
+  g_slice_free(struct snapshot, snap);
+}
+
+static bool get_associated_image_data(struct _openslide_associated_image *_img,
+                                      uint32_t *dest,
+                                      GError **err) {
+  struct snapshot_image *img = (struct snapshot_image *) _img;
+  openslide_t *real = get_real(img->osr, err);
+  if (real == NULL) {
+    return false;
+  }
+  struct _openslide_associated_image *real_img =
+    g_hash_table_lookup(real->associated_images, img->name);
+  if (real_img == NULL ||
+      real_img->w != img->base.w || real_img->h != img->base.h) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Associated image %s changed since the snapshot", img->name);
+    return false;
+  }
+  return real_img->ops->get_argb_data(real_img, dest, err);
+}
+
+static void destroy_associated_image(struct _openslide_associated_image *_img) {
+  struct snapshot_image *img = (struct snapshot_image *) _img;
+  g_free(img->name);
+  g_slice_free(struct snapshot_image, img);
+}
+
+static const struct _openslide_associated_image_ops snapshot_associated_ops = {
+  .get_argb_data = get_associated_image_data,
+  .destroy = destroy_associated_image,
+};
+
+struct snapshot_item {
+  char *name;
+  char *value;  // property
+  int64_t w;  // associated image
+  int64_t h;
+};
+
+static void read_items(struct reader *r, GArray *items, bool images) {
+  uint32_t count = get_u32(r);
+  if (count > SNAPSHOT_ITEMS_MAX) {
+    r->ok = false;
+  }
+  for (uint32_t i = 0; r->ok && i < count; i++) {
+    struct snapshot_item item = { .name = get_string(r) };
+    if (images) {
+      item.w = get_i64(r);
+      item.h = get_i64(r);
+    } else {
+      item.value = get_string(r);
+    }
+    g_array_append_val(items, item);
+  }
+}
+
+static void free_items(GArray *items) {
+  for (guint i = 0; i < items->len; i++) {
+    struct snapshot_item *item = &g_array_index(items, struct snapshot_item, i);
+    g_free(item->name);
+    g_free(item->value);
+  }
+  g_array_free(items, TRUE);
+}
+
+bool _openslide_snapshot_load(openslide_t *osr, const char *filename) {
+  if (!snapshot_enabled()) {
+    return false;
+  }
+  char *path = get_path(filename);
+  if (path == NULL) {
+    return false;
+  }
+  GMappedFile *map = g_mapped_file_new(path, FALSE, NULL);
+  g_free(path);
+  if (map == NULL) {
+    return false;
+  }
+
+  _openslide_trace_begin("load snapshot");
+  struct reader r = {
+    .pos = g_mapped_file_get_contents(map),
+    .end = g_mapped_file_get_contents(map) + g_mapped_file_get_length(map),
+    .ok = true,
+  };
+  char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+  get_bytes(&r, magic, sizeof(magic));
+  char *url = get_string(&r);
+  char *version = get_string(&r);
+  uint32_t ops = get_u32(&r);
+  uint32_t level_count = get_u32(&r);
+  bool valid = r.ok && !memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) &&
+               !strcmp(url, filename) &&
+               level_count > 0 && level_count <= SNAPSHOT_LEVELS_MAX;
+
+  struct _openslide_level *levels = NULL;
+  GArray *properties = g_array_new(FALSE, FALSE, sizeof(struct snapshot_item));
+  GArray *images = g_array_new(FALSE, FALSE, sizeof(struct snapshot_item));
+  if (valid) {
+    levels = g_new0(struct _openslide_level, level_count);
+    for (uint32_t i = 0; i < level_count; i++) {
+      levels[i].downsample = get_double(&r);
+      levels[i].w = get_i64(&r);
+      levels[i].h = get_i64(&r);
+      levels[i].tile_w = get_i64(&r);
+      levels[i].tile_h = get_i64(&r);
+    }
+    read_items(&r, properties, false);
+    read_items(&r, images, true);
+    valid = r.ok;
+  }
+  g_mapped_file_unref(map);
+
+  // and last, the round trip: is it still the file the snapshot is of
+  char *current = valid ? get_version(filename) : NULL;
+  valid = current && !strcmp(current, version);
+  g_free(current);
+  g_free(version);
+  g_free(url);
+  _openslide_trace_end();
+  if (!valid) {
+    g_free(levels);
+    free_items(properties);
+    free_items(images);
+    return false;
+  }
+
+  struct snapshot *snap = g_slice_new0(struct snapshot);
+  snap->filename = g_strdup(filename);
+  snap->levels = levels;
+  snap->level_count = level_count;
+
+  // optional ops only where the backend has them
+  snap->ops.paint_region = paint_region;
+  snap->ops.destroy = destroy;
+  if (ops & SNAPSHOT_OP_PREFETCH_REGION) {
+    snap->ops.prefetch_region = prefetch_region;
+  }
+  if (ops & SNAPSHOT_OP_READ_RAW_TILE) {
+    snap->ops.read_raw_tile = read_raw_tile;
+  }
+  if (ops & SNAPSHOT_OP_READ_LEVEL_TILE) {
+    snap->ops.read_level_tile = read_level_tile;
+  }
+  if (ops & SNAPSHOT_OP_PREFETCH_TILES) {
+    snap->ops.prefetch_tiles = prefetch_tiles;
+  }
+
+  osr->levels = g_new(struct _openslide_level *, level_count);
+  for (uint32_t i = 0; i < level_count; i++) {
+    osr->levels[i] = &levels[i];
+  }
+  osr->level_count = level_count;
+
+  // the strings go to the tables
+  for (guint i = 0; i < properties->len; i++) {
+    struct snapshot_item *item =
+      &g_array_index(properties, struct snapshot_item, i);
+    g_hash_table_insert(osr->properties, item->name, item->value);
+  }
+  g_array_free(properties, TRUE);
+  for (guint i = 0; i < images->len; i++) {
+    struct snapshot_item *item =
+      &g_array_index(images, struct snapshot_item, i);
+    struct snapshot_image *img = g_slice_new0(struct snapshot_image);
+    img->base.ops = &snapshot_associated_ops;
+    img->base.w = item->w;
+    img->base.h = item->h;
+    img->osr = osr;
+    img->name = g_strdup(item->name);
+    g_hash_table_insert(osr->associated_images, item->name, img);
+  }
+  g_array_free(images, TRUE);
+
+  osr->data = snap;
+  osr->ops = &snap->ops;
+  return true;
+}
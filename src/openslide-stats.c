@@ -0,0 +1,252 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+#include <string.h>
+
+/*
+ * Counters of the library, for the process and per slide.  Each thread
+ * counts into blocks of its own, so counting takes no lock and contends
+ * with nothing; collecting sums the blocks of all threads.  The blocks of a
+ * thread which exits go to the next new thread, so the sums never drop.
+ */
+
+struct counters {
+  uint64_t counts[_OPENSLIDE_STAT_COUNT];
+  uint64_t time_us[_OPENSLIDE_STAT_TIMER_COUNT];
+  uint64_t histogram[_OPENSLIDE_STAT_TIMER_COUNT][OPENSLIDE_STATS_TIME_BUCKETS];
+};
+
+struct thread_stats {
+  // for the table, held by the owner to look up slides and by collectors
+  GMutex *lock;
+  bool live;
+
+  struct counters global;
+  GHashTable *slides;  // stats id -> struct counters
+
+  // the slide being read by the thread, 0 for none
+  uint64_t current_id;
+  uint64_t last_id;
+  struct counters *last;
+};
+
+static GPrivate *stats_key;
+static GOnce stats_once = G_ONCE_INIT;
+
+// registry, under stats_lock
+static GMutex stats_lock;
+static GSList *stats_threads;
+static uint64_t next_stats_id = 1;
+
+static void counters_free(gpointer data) {
+  g_slice_free(struct counters, data);
+}
+
+// thread exit
+static void retire_thread(gpointer data) {
+  struct thread_stats *ts = data;
+  g_mutex_lock(&stats_lock);
+  ts->live = false;
+  ts->current_id = 0;
+  g_mutex_unlock(&stats_lock);
+}
+
+static gpointer init_stats(gpointer arg G_GNUC_UNUSED) {
+  stats_key = g_private_new(retire_thread);
+  return NULL;
+}
+
+static struct thread_stats *get_thread_stats(void) {
+  g_once(&stats_once, init_stats, NULL);
+  struct thread_stats *ts = g_private_get(stats_key);
+  if (ts) {
+    return ts;
+  }
+
+  g_mutex_lock(&stats_lock);
+  for (GSList *l = stats_threads; l; l = l->next) {
+    struct thread_stats *cur = l->data;
+    if (!cur->live) {
+      ts = cur;
+      break;
+    }
+  }
+  if (ts == NULL) {
+    ts = g_slice_new0(struct thread_stats);
+    ts->lock = g_mutex_new();
+    ts->slides = g_hash_table_new_full(_openslide_int64_hash,
+                                       _openslide_int64_equal,
+                                       _openslide_int64_free,
+                                       counters_free);
+    stats_threads = g_slist_prepend(stats_threads, ts);
+  }
+  ts->live = true;
+  ts->last_id = 0;
+  ts->last = NULL;
+  g_mutex_unlock(&stats_lock);
+
+  g_private_set(stats_key, ts);
+  return ts;
+}
+
+// the thread's block for the slide being read, or NULL
+static struct counters *get_slide_counters(struct thread_stats *ts) {
+  uint64_t id = ts->current_id;
+  if (id == 0) {
+    return NULL;
+  }
+  if (id == ts->last_id) {
+    return ts->last;
+  }
+
+  // only when the slide changes, and uncontended
+  g_mutex_lock(ts->lock);
+  struct counters *c = g_hash_table_lookup(ts->slides, &id);
+  if (c == NULL) {
+    c = g_slice_new0(struct counters);
+    int64_t *key = g_slice_new(int64_t);
+    *key = id;
+    g_hash_table_insert(ts->slides, key, c);
+  }
+  g_mutex_unlock(ts->lock);
+  ts->last_id = id;
+  ts->last = c;
+  return c;
+}
+
+uint64_t _openslide_stats_id_new(void) {
+  g_mutex_lock(&stats_lock);
+  uint64_t id = next_stats_id++;
+  g_mutex_unlock(&stats_lock);
+  return id;
+}
+
+uint64_t _openslide_stats_set_current(uint64_t id) {
+  struct thread_stats *ts = get_thread_stats();
+  uint64_t prev = ts->current_id;
+  ts->current_id = id;
+  return prev;
+}
+
+void _openslide_stats_add(enum _openslide_stat stat, uint64_t n) {
+  struct thread_stats *ts = get_thread_stats();
+  ts->global.counts[stat] += n;
+  struct counters *c = get_slide_counters(ts);
+  if (c) {
+    c->counts[stat] += n;
+  }
+}
+
+static int time_bucket(int64_t us) {
+  if (us <= 0) {
+    return 0;
+  }
+  return MIN(g_bit_storage(us), OPENSLIDE_STATS_TIME_BUCKETS - 1);
+}
+
+void _openslide_stats_add_time(enum _openslide_stat_timer timer,
+                               int64_t start) {
+  int64_t us = MAX(g_get_monotonic_time() - start, 0);
+  int bucket = time_bucket(us);
+  struct thread_stats *ts = get_thread_stats();
+  ts->global.time_us[timer] += us;
+  ts->global.histogram[timer][bucket]++;
+  struct counters *c = get_slide_counters(ts);
+  if (c) {
+    c->time_us[timer] += us;
+    c->histogram[timer][bucket]++;
+  }
+}
+
+static void sum_counters(struct counters *sum, const struct counters *c) {
+  for (int i = 0; i < _OPENSLIDE_STAT_COUNT; i++) {
+    sum->counts[i] += c->counts[i];
+  }
+  for (int t = 0; t < _OPENSLIDE_STAT_TIMER_COUNT; t++) {
+    sum->time_us[t] += c->time_us[t];
+    for (int b = 0; b < OPENSLIDE_STATS_TIME_BUCKETS; b++) {
+      sum->histogram[t][b] += c->histogram[t][b];
+    }
+  }
+}
+
+void _openslide_stats_collect(uint64_t id, struct openslide_stats *stats) {
+  struct counters sum;
+  memset(&sum, 0, sizeof(sum));
+
+  g_once(&stats_once, init_stats, NULL);
+  g_mutex_lock(&stats_lock);
+  for (GSList *l = stats_threads; l; l = l->next) {
+    struct thread_stats *ts = l->data;
+    if (id == 0) {
+      // other threads go on counting meanwhile; the sums are a snapshot
+      // good to a few events
+      sum_counters(&sum, &ts->global);
+      continue;
+    }
+    g_mutex_lock(ts->lock);
+    struct counters *c = g_hash_table_lookup(ts->slides, &id);
+    if (c) {
+      sum_counters(&sum, c);
+    }
+    g_mutex_unlock(ts->lock);
+  }
+  g_mutex_unlock(&stats_lock);
+
+  memset(stats, 0, sizeof(*stats));
+  stats->tile_cache_hits = sum.counts[OPENSLIDE_STAT_CACHE_HITS];
+  stats->tile_cache_misses = sum.counts[OPENSLIDE_STAT_CACHE_MISSES];
+  stats->tile_cache_evictions = sum.counts[OPENSLIDE_STAT_CACHE_EVICTIONS];
+  stats->tile_cache_insert_bytes =
+    sum.counts[OPENSLIDE_STAT_CACHE_INSERT_BYTES];
+  stats->tiles_decoded_jpeg = sum.counts[OPENSLIDE_STAT_DECODED_JPEG];
+  stats->tiles_decoded_jp2k = sum.counts[OPENSLIDE_STAT_DECODED_JP2K];
+  stats->tiles_decoded_png = sum.counts[OPENSLIDE_STAT_DECODED_PNG];
+  stats->tiles_decoded_libtiff = sum.counts[OPENSLIDE_STAT_DECODED_LIBTIFF];
+  stats->slow_path_reads = sum.counts[OPENSLIDE_STAT_SLOW_PATHS];
+  stats->decode_us = sum.time_us[OPENSLIDE_STAT_TIMER_DECODE];
+  memcpy(stats->decode_histogram,
+         sum.histogram[OPENSLIDE_STAT_TIMER_DECODE],
+         sizeof(stats->decode_histogram));
+  stats->composite_us = sum.time_us[OPENSLIDE_STAT_TIMER_COMPOSITE];
+  memcpy(stats->composite_histogram,
+         sum.histogram[OPENSLIDE_STAT_TIMER_COMPOSITE],
+         sizeof(stats->composite_histogram));
+}
+
+// the slide is closed, nothing counts into id anymore; ids aren't reused,
+// so a thread's last block is never looked at again
+void _openslide_stats_forget(uint64_t id) {
+  g_once(&stats_once, init_stats, NULL);
+  g_mutex_lock(&stats_lock);
+  for (GSList *l = stats_threads; l; l = l->next) {
+    struct thread_stats *ts = l->data;
+    g_mutex_lock(ts->lock);
+    g_hash_table_remove(ts->slides, &id);
+    g_mutex_unlock(ts->lock);
+  }
+  g_mutex_unlock(&stats_lock);
+}
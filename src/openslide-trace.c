@@ -0,0 +1,193 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * Spans of the stages of reads, with OPENSLIDE_DEBUG=trace.  Each thread
+ * records complete events into chunks of its own, without locking, and
+ * publishes its count after each one; at exit all of them are written as
+ * a Chrome trace, which chrome://tracing and Perfetto load.  Disabled, a
+ * span is a test of _openslide_tracing.
+ */
+
+#define TRACE_FILE_ENV_VAR "OPENSLIDE_TRACE_FILE"
+
+// spans open at once in a thread; deeper ones aren't recorded
+#define TRACE_DEPTH 32
+
+// events of a thread, the later ones are dropped
+#define TRACE_CHUNK_EVENTS 4096
+#define TRACE_CHUNKS 256
+
+struct trace_event {
+  const char *name;
+  gint64 start;  // us since the trace began
+  gint64 dur;
+};
+
+struct trace_thread {
+  int tid;
+  struct trace_event *chunks[TRACE_CHUNKS];
+  volatile gint count;  // published events
+  int dropped;
+
+  // open spans
+  int depth;
+  const char *names[TRACE_DEPTH];
+  gint64 starts[TRACE_DEPTH];
+};
+
+bool _openslide_tracing;
+
+static GPrivate *trace_key;
+static gint64 trace_epoch;
+
+// registry, under trace_lock
+static GMutex trace_lock;
+static GSList *trace_threads;
+static int trace_next_tid = 1;
+
+static struct trace_thread *get_trace_thread(void) {
+  struct trace_thread *thread = g_private_get(trace_key);
+  if (thread == NULL) {
+    // kept until exit, with the events
+    thread = g_slice_new0(struct trace_thread);
+    g_mutex_lock(&trace_lock);
+    thread->tid = trace_next_tid++;
+    trace_threads = g_slist_prepend(trace_threads, thread);
+    g_mutex_unlock(&trace_lock);
+    g_private_set(trace_key, thread);
+  }
+  return thread;
+}
+
+void _openslide_trace_push(const char *name) {
+  struct trace_thread *thread = get_trace_thread();
+  if (thread->depth < TRACE_DEPTH) {
+    thread->names[thread->depth] = name;
+    thread->starts[thread->depth] = g_get_monotonic_time() - trace_epoch;
+  }
+  thread->depth++;
+}
+
+void _openslide_trace_pop(void) {
+  struct trace_thread *thread = get_trace_thread();
+  g_return_if_fail(thread->depth > 0);
+  if (--thread->depth >= TRACE_DEPTH) {
+    return;
+  }
+
+  int count = thread->count;
+  int chunk = count / TRACE_CHUNK_EVENTS;
+  if (chunk >= TRACE_CHUNKS) {
+    thread->dropped++;
+    return;
+  }
+  if (thread->chunks[chunk] == NULL) {
+    thread->chunks[chunk] = g_new(struct trace_event, TRACE_CHUNK_EVENTS);
+  }
+  struct trace_event *event =
+    &thread->chunks[chunk][count % TRACE_CHUNK_EVENTS];
+  event->name = thread->names[thread->depth];
+  event->start = thread->starts[thread->depth];
+  event->dur = g_get_monotonic_time() - trace_epoch - event->start;
+  g_atomic_int_set(&thread->count, count + 1);
+}
+
+// urlio's spans, from a layer which doesn't know about ours
+static void urlio_span(const char *name, gboolean begin) {
+  if (begin) {
+    _openslide_trace_push(name);
+  } else {
+    _openslide_trace_pop();
+  }
+}
+
+static void trace_flush(void) {
+  GString *json = g_string_new("{\"traceEvents\": [\n");
+  bool first = true;
+  int64_t dropped = 0;
+  g_mutex_lock(&trace_lock);
+  for (GSList *l = trace_threads; l; l = l->next) {
+    struct trace_thread *thread = l->data;
+    g_string_append_printf(json, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+                           "\"pid\": 1, \"tid\": %d, "
+                           "\"args\": {\"name\": \"thread %d\"}}",
+                           first ? "" : ",\n", thread->tid, thread->tid);
+    first = false;
+
+    int count = g_atomic_int_get(&thread->count);
+    for (int i = 0; i < count; i++) {
+      const struct trace_event *event =
+        &thread->chunks[i / TRACE_CHUNK_EVENTS][i % TRACE_CHUNK_EVENTS];
+      g_string_append_printf(json, ",\n{\"name\": \"%s\", \"ph\": \"X\", "
+                             "\"pid\": 1, \"tid\": %d, "
+                             "\"ts\": %" G_GINT64_FORMAT ", "
+                             "\"dur\": %" G_GINT64_FORMAT "}",
+                             event->name, thread->tid,
+                             event->start, event->dur);
+    }
+    dropped += thread->dropped;
+  }
+  g_mutex_unlock(&trace_lock);
+  g_string_append(json, "\n]}\n");
+
+  const char *path = g_getenv(TRACE_FILE_ENV_VAR);
+  char *default_path = NULL;
+  if (path == NULL || *path == 0) {
+    char *name = g_strdup_printf("openslide-trace-%lu.json",
+                                 (unsigned long) getpid());
+    default_path = g_build_filename(g_get_tmp_dir(), name, NULL);
+    g_free(name);
+    path = default_path;
+  }
+
+  GError *tmp_err = NULL;
+  if (g_file_set_contents(path, json->str, json->len, &tmp_err)) {
+    g_message("Trace written to %s", path);
+    if (dropped) {
+      g_message("%" PRId64 " trace events dropped", dropped);
+    }
+  } else {
+    g_warning("Couldn't write trace: %s", tmp_err->message);
+    g_error_free(tmp_err);
+  }
+  g_free(default_path);
+  g_string_free(json, TRUE);
+}
+
+void _openslide_trace_init(void) {
+  if (!_openslide_debug(OPENSLIDE_DEBUG_TRACE)) {
+    return;
+  }
+  trace_key = g_private_new(NULL);
+  trace_epoch = g_get_monotonic_time();
+  urlio_set_span_hook(urlio_span);
+  atexit(trace_flush);
+  _openslide_tracing = true;
+}
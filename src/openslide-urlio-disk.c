@@ -0,0 +1,423 @@
+/*
+ *  OpenRemoteSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *
+ *  All rights reserved.
+ *
+ *  OpenRemoteSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-urlio.h"
+#include "openslide-urlio-disk.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define DISK_CHUNK_SIZE (CACHE_BLOCK_SIZE)
+
+struct fcurl_disk {
+	guint64 size; /* size of the stream */
+	guint64 chunk_count;
+
+	int data_fd;
+	const char *data; /* read-only mapping of the sparse data file */
+
+	int map_fd;
+	volatile guint32 *map; /* shared mapping of the bitmap */
+	size_t map_size;
+};
+
+/* configuration, guarded by g_disk_lock */
+static char *g_disk_dir = NULL;
+static guint64 g_disk_max_size = 0;
+static gboolean g_disk_configured = FALSE;
+
+static GMutex g_disk_lock;
+
+static void init_disk_config(void) {
+	const char *env;
+
+	if (g_disk_configured)
+		return;
+	g_disk_configured = TRUE;
+
+	env = g_getenv(DISK_CACHE_DIR_ENV_VAR);
+	if (env && *env)
+		g_disk_dir = g_strdup(env);
+
+	g_disk_max_size = DISK_CACHE_DEFAULT_SIZE;
+	env = g_getenv(DISK_CACHE_SIZE_ENV_VAR);
+	if (env) {
+		guint64 max_size = g_ascii_strtoull(env, NULL, 10);
+		if (max_size)
+			g_disk_max_size = max_size;
+	}
+}
+
+void urlio_set_disk_cache(const char *dir, guint64 max_size) {
+	g_mutex_lock(&g_disk_lock);
+	g_disk_configured = TRUE;
+	g_free(g_disk_dir);
+	g_disk_dir = (dir && *dir) ? g_strdup(dir) : NULL;
+	g_disk_max_size = max_size ? max_size : DISK_CACHE_DEFAULT_SIZE;
+	g_mutex_unlock(&g_disk_lock);
+}
+
+char *urlio_get_disk_cache_dir(void) {
+	char *dir;
+
+	g_mutex_lock(&g_disk_lock);
+	init_disk_config();
+	dir = g_strdup(g_disk_dir);
+	g_mutex_unlock(&g_disk_lock);
+	return dir;
+}
+
+#ifdef HAVE_MMAP
+
+struct disk_entry {
+	char *map_path;
+	char *data_path;
+	guint64 usage;
+	time_t mtime;
+};
+
+static gint compare_entry_mtime(gconstpointer a, gconstpointer b) {
+	const struct disk_entry *ea = *(const struct disk_entry * const *) a;
+	const struct disk_entry *eb = *(const struct disk_entry * const *) b;
+
+	if (ea->mtime < eb->mtime)
+		return -1;
+	return ea->mtime > eb->mtime;
+}
+
+/* files of the library kept in subdirectories of the store, which count
+ * against its size and are dropped like its entries */
+static const char *g_disk_subdirs[] = { "pyramid", "snapshot" };
+
+static struct disk_entry *new_entry(char *map_path, char *data_path) {
+	struct disk_entry *entry = g_slice_new0(struct disk_entry);
+	struct stat st;
+
+	entry->map_path = map_path;
+	entry->data_path = data_path;
+	if (!stat(entry->map_path, &st)) {
+		entry->mtime = st.st_mtime;
+		entry->usage += (guint64) st.st_blocks * 512;
+	}
+	if (entry->data_path && !stat(entry->data_path, &st))
+		entry->usage += (guint64) st.st_blocks * 512;
+	return entry;
+}
+
+/* add the files of a subdirectory, each an entry of its own; the ones
+ * still being written count, but can't be dropped */
+static void add_subdir(const char *dir, const char *subdir,
+		GPtrArray *entries, guint64 *total) {
+	char *path = g_build_filename(dir, subdir, NULL);
+	GDir *d = g_dir_open(path, 0, NULL);
+	const char *name;
+
+	while (d && (name = g_dir_read_name(d))) {
+		struct disk_entry *entry = new_entry(
+				g_build_filename(path, name, NULL), NULL);
+
+		*total += entry->usage;
+		if (g_str_has_suffix(name, ".tmp")) {
+			g_free(entry->map_path);
+			g_slice_free(struct disk_entry, entry);
+			continue;
+		}
+		g_ptr_array_add(entries, entry);
+	}
+	if (d)
+		g_dir_close(d);
+	g_free(path);
+}
+
+/* drop the least recently opened entries until the directory fits the size
+ * limit; processes still mapping a dropped entry keep their inode */
+static void trim_dir(const char *dir, guint64 max_size, const char *keep) {
+	GDir *d = g_dir_open(dir, 0, NULL);
+	GPtrArray *entries;
+	const char *name;
+	guint64 total = 0;
+
+	if (!d)
+		return;
+
+	entries = g_ptr_array_new();
+	while ((name = g_dir_read_name(d))) {
+		struct disk_entry *entry;
+		char *base;
+		char *data_path;
+
+		if (!g_str_has_suffix(name, ".map"))
+			continue;
+
+		base = g_strndup(name, strlen(name) - strlen(".map"));
+		data_path = g_strdup_printf("%s" G_DIR_SEPARATOR_S "%s.data",
+				dir, base);
+		g_free(base);
+		entry = new_entry(g_build_filename(dir, name, NULL), data_path);
+		total += entry->usage;
+
+		g_ptr_array_add(entries, entry);
+	}
+	g_dir_close(d);
+	for (guint i = 0; i < G_N_ELEMENTS(g_disk_subdirs); i++)
+		add_subdir(dir, g_disk_subdirs[i], entries, &total);
+
+	g_ptr_array_sort(entries, compare_entry_mtime);
+
+	for (guint i = 0; i < entries->len; i++) {
+		struct disk_entry *entry = entries->pdata[i];
+
+		if (total > max_size && (!keep || strcmp(entry->map_path, keep))) {
+			g_unlink(entry->map_path);
+			if (entry->data_path)
+				g_unlink(entry->data_path);
+			total -= entry->usage;
+		}
+		g_free(entry->map_path);
+		g_free(entry->data_path);
+		g_slice_free(struct disk_entry, entry);
+	}
+	g_ptr_array_free(entries, TRUE);
+}
+
+gboolean urlio_disk_reserve(guint64 size) {
+	char *dir;
+	guint64 max_size;
+
+	g_mutex_lock(&g_disk_lock);
+	init_disk_config();
+	dir = g_strdup(g_disk_dir);
+	max_size = g_disk_max_size;
+	g_mutex_unlock(&g_disk_lock);
+
+	if (!dir || size > max_size) {
+		g_free(dir);
+		return FALSE;
+	}
+	trim_dir(dir, max_size - size, NULL);
+	g_free(dir);
+	return TRUE;
+}
+
+static int open_sized(const char *path, guint64 size) {
+	struct stat st;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+	if (fd == -1)
+		return -1;
+
+	/* grow to size, leaving a hole; a concurrent creator does the same */
+	if (fstat(fd, &st) || ((guint64) st.st_size != size
+			&& ftruncate(fd, size))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+URLIO_DISK *urlio_disk_open(const char *url, const char *validator,
+		guint64 size) {
+	URLIO_DISK *disk;
+	char *dir;
+	guint64 max_size;
+	char *key;
+	char *hash;
+	char *map_path;
+	char *data_path;
+
+	if (!validator || !size)
+		return NULL;
+
+	g_mutex_lock(&g_disk_lock);
+	init_disk_config();
+	dir = g_strdup(g_disk_dir);
+	max_size = g_disk_max_size;
+	g_mutex_unlock(&g_disk_lock);
+
+	if (!dir)
+		return NULL;
+	if (g_mkdir_with_parents(dir, 0755)) {
+		g_free(dir);
+		return NULL;
+	}
+
+	/* the chunk size is part of the key, the bitmap depends on it */
+	key = g_strdup_printf("%s\n%s\n%" G_GUINT64_FORMAT "\n%d", url, validator,
+			size, DISK_CHUNK_SIZE);
+	hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+	map_path = g_strdup_printf("%s" G_DIR_SEPARATOR_S "%s.map", dir, hash);
+	data_path = g_strdup_printf("%s" G_DIR_SEPARATOR_S "%s.data", dir, hash);
+	g_free(key);
+	g_free(hash);
+
+	disk = g_slice_new0(URLIO_DISK);
+	disk->size = size;
+	disk->chunk_count = (size + DISK_CHUNK_SIZE - 1) / DISK_CHUNK_SIZE;
+	disk->map_size = ((disk->chunk_count + 31) / 32) * sizeof(guint32);
+	disk->data_fd = open_sized(data_path, size);
+	disk->map_fd = open_sized(map_path, disk->map_size);
+
+	if (disk->data_fd != -1 && disk->map_fd != -1) {
+		void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, disk->data_fd, 0);
+		void *map = mmap(NULL, disk->map_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, disk->map_fd, 0);
+
+		if (data != MAP_FAILED)
+			disk->data = data;
+		if (map != MAP_FAILED)
+			disk->map = map;
+	}
+
+	if (!disk->data || !disk->map) {
+		urlio_disk_close(disk);
+		disk = NULL;
+	} else {
+		/* mark the entry recently used, then make room for it */
+		utimes(map_path, NULL);
+		trim_dir(dir, max_size, map_path);
+	}
+
+	g_free(map_path);
+	g_free(data_path);
+	g_free(dir);
+
+	return disk;
+}
+
+void urlio_disk_close(URLIO_DISK *disk) {
+	if (!disk)
+		return;
+
+	if (disk->data)
+		munmap((void *) disk->data, disk->size);
+	if (disk->map)
+		munmap((void *) disk->map, disk->map_size);
+	if (disk->data_fd != -1)
+		close(disk->data_fd);
+	if (disk->map_fd != -1)
+		close(disk->map_fd);
+	g_slice_free(URLIO_DISK, disk);
+}
+
+static gboolean chunk_present(URLIO_DISK *disk, guint64 chunk) {
+	return (g_atomic_int_get((volatile gint *) &disk->map[chunk / 32])
+			>> (chunk % 32)) & 1;
+}
+
+gboolean urlio_disk_has(URLIO_DISK *disk, guint64 start, size_t len) {
+	if (!disk || !len || start + len > disk->size)
+		return FALSE;
+
+	for (guint64 c = start / DISK_CHUNK_SIZE;
+			c <= (start + len - 1) / DISK_CHUNK_SIZE; c++) {
+		if (!chunk_present(disk, c))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+gboolean urlio_disk_read(URLIO_DISK *disk, void *dest, guint64 start,
+		size_t len) {
+	if (!urlio_disk_has(disk, start, len))
+		return FALSE;
+
+	memcpy(dest, disk->data + start, len);
+	return TRUE;
+}
+
+void urlio_disk_write(URLIO_DISK *disk, const void *src, guint64 start,
+		size_t len) {
+	guint64 end = start + len;
+	guint64 first;
+
+	if (!disk || !len || end > disk->size)
+		return;
+
+	/* only whole chunks are recorded, the last one may end with the stream */
+	first = (start + DISK_CHUNK_SIZE - 1) / DISK_CHUNK_SIZE;
+	for (guint64 c = first; c < disk->chunk_count; c++) {
+		guint64 chunk_start = c * DISK_CHUNK_SIZE;
+		size_t chunk_len = MIN(DISK_CHUNK_SIZE, disk->size - chunk_start);
+		const char *p = (const char *) src + (chunk_start - start);
+		size_t written = 0;
+
+		if (chunk_start + chunk_len > end)
+			break;
+		if (chunk_present(disk, c))
+			continue;
+
+		while (written < chunk_len) {
+			ssize_t ret = pwrite(disk->data_fd, p + written,
+					chunk_len - written, chunk_start + written);
+			if (ret <= 0)
+				return;
+			written += ret;
+		}
+
+		/* publish the chunk only once its data is in the file */
+		g_atomic_int_or((volatile guint *) &disk->map[c / 32],
+				1U << (c % 32));
+	}
+}
+
+#else
+
+URLIO_DISK *urlio_disk_open(const char *url G_GNUC_UNUSED,
+		const char *validator G_GNUC_UNUSED, guint64 size G_GNUC_UNUSED) {
+	return NULL;
+}
+
+void urlio_disk_close(URLIO_DISK *disk G_GNUC_UNUSED) {
+}
+
+gboolean urlio_disk_reserve(guint64 size G_GNUC_UNUSED) {
+	return FALSE;
+}
+
+gboolean urlio_disk_has(URLIO_DISK *disk G_GNUC_UNUSED,
+		guint64 start G_GNUC_UNUSED, size_t len G_GNUC_UNUSED) {
+	return FALSE;
+}
+
+gboolean urlio_disk_read(URLIO_DISK *disk G_GNUC_UNUSED,
+		void *dest G_GNUC_UNUSED, guint64 start G_GNUC_UNUSED,
+		size_t len G_GNUC_UNUSED) {
+	return FALSE;
+}
+
+void urlio_disk_write(URLIO_DISK *disk G_GNUC_UNUSED,
+		const void *src G_GNUC_UNUSED, guint64 start G_GNUC_UNUSED,
+		size_t len G_GNUC_UNUSED) {
+}
+
+#endif
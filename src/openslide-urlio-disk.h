@@ -0,0 +1,55 @@
+/*
+ *  OpenRemoteSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *
+ *  All rights reserved.
+ *
+ *  OpenRemoteSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __OPENSLIDE_URLIO_DISK_H__
+#define __OPENSLIDE_URLIO_DISK_H__
+
+#define DISK_CACHE_DIR_ENV_VAR "OPENSLIDE_URLIO_DISK_CACHE"
+#define DISK_CACHE_SIZE_ENV_VAR "OPENSLIDE_URLIO_DISK_CACHE_SIZE"
+#define DISK_CACHE_DEFAULT_SIZE 16ULL*1024*1024*1024
+
+#include <glib.h>
+
+/* A disk-backed store of the bulks of one remote stream: a sparse file the
+ * size of the stream plus a bitmap with one bit per sub-block of
+ * CACHE_BLOCK_SIZE bytes, both memory-mapped and shared by all the
+ * processes using the same cache directory. Entries are keyed by url, size
+ * and ETag/Last-Modified, so a changed stream never hits stale data. */
+typedef struct fcurl_disk URLIO_DISK;
+
+/* NULL when the disk cache is disabled or the stream has no validator */
+URLIO_DISK *urlio_disk_open(const char *url, const char *validator,
+		guint64 size);
+void urlio_disk_close(URLIO_DISK *disk);
+
+/* copy [start, start + len) into dest if all its sub-blocks are stored */
+gboolean urlio_disk_read(URLIO_DISK *disk, void *dest, guint64 start,
+		size_t len);
+
+/* whether all the sub-blocks of [start, start + len) are stored */
+gboolean urlio_disk_has(URLIO_DISK *disk, guint64 start, size_t len);
+
+/* store [start, start + len); only whole sub-blocks are recorded */
+void urlio_disk_write(URLIO_DISK *disk, const void *src, guint64 start,
+		size_t len);
+
+#endif // __OPENSLIDE_URLIO_DISK_H__
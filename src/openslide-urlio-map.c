@@ -0,0 +1,205 @@
+/*
+ *  OpenRemoteSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *
+ *  All rights reserved.
+ *
+ *  OpenRemoteSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include "openslide-urlio-map.h"
+
+#include <glib.h>
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_MMAP
+
+struct fcurl_map {
+	char *key;
+	const char *data;
+	guint64 size;
+
+	int refcount; /* handles and views, guarded by g_map_lock */
+	GList *idle_link; /* in g_map_idle while unreferenced */
+};
+
+/* key -> URLIO_MAP, and the unreferenced ones, most recently used first;
+ * guarded by g_map_lock */
+static GHashTable *g_map_table = NULL;
+static GQueue g_map_idle = G_QUEUE_INIT;
+static GMutex g_map_lock;
+
+static void map_free(URLIO_MAP *map) {
+	munmap((void *) map->data, map->size);
+	g_free(map->key);
+	g_slice_free(URLIO_MAP, map);
+}
+
+URLIO_MAP *urlio_map_open(const char *path) {
+	URLIO_MAP *map;
+	struct stat st;
+	char *key;
+	void *data;
+	int fd;
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return NULL;
+	key = g_strdup_printf("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%"
+			G_GUINT64_FORMAT ":%" G_GINT64_FORMAT, (guint64) st.st_dev,
+			(guint64) st.st_ino, (guint64) st.st_size, (gint64) st.st_mtime);
+
+	g_mutex_lock(&g_map_lock);
+	if (!g_map_table)
+		g_map_table = g_hash_table_new(g_str_hash, g_str_equal);
+	map = g_hash_table_lookup(g_map_table, key);
+	if (map) {
+		if (map->idle_link) {
+			g_queue_delete_link(&g_map_idle, map->idle_link);
+			map->idle_link = NULL;
+		}
+		map->refcount++;
+		g_mutex_unlock(&g_map_lock);
+		g_free(key);
+		return map;
+	}
+	g_mutex_unlock(&g_map_lock);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		g_free(key);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		g_free(key);
+		return NULL;
+	}
+	/* tiles are read in any order; sequential readers ask for their
+	 * readahead themselves */
+	madvise(data, st.st_size, MADV_RANDOM);
+
+	map = g_slice_new0(URLIO_MAP);
+	map->key = key;
+	map->data = data;
+	map->size = st.st_size;
+	map->refcount = 1;
+
+	g_mutex_lock(&g_map_lock);
+	if (g_hash_table_lookup(g_map_table, key)) {
+		/* raced with another open, use the first mapping */
+		URLIO_MAP *first = g_hash_table_lookup(g_map_table, key);
+
+		if (first->idle_link) {
+			g_queue_delete_link(&g_map_idle, first->idle_link);
+			first->idle_link = NULL;
+		}
+		first->refcount++;
+		g_mutex_unlock(&g_map_lock);
+		map_free(map);
+		return first;
+	}
+	g_hash_table_insert(g_map_table, map->key, map);
+	g_mutex_unlock(&g_map_lock);
+
+	return map;
+}
+
+URLIO_MAP *urlio_map_ref(URLIO_MAP *map) {
+	g_mutex_lock(&g_map_lock);
+	map->refcount++;
+	g_mutex_unlock(&g_map_lock);
+	return map;
+}
+
+void urlio_map_unref(URLIO_MAP *map) {
+	URLIO_MAP *dropped = NULL;
+
+	if (!map)
+		return;
+
+	g_mutex_lock(&g_map_lock);
+	if (--map->refcount == 0) {
+		/* keep it for the next open of the file, handles come and go */
+		g_queue_push_head(&g_map_idle, map);
+		map->idle_link = g_queue_peek_head_link(&g_map_idle);
+		if (g_queue_get_length(&g_map_idle) > MAP_IDLE_MAX) {
+			dropped = g_queue_pop_tail(&g_map_idle);
+			dropped->idle_link = NULL;
+			g_hash_table_remove(g_map_table, dropped->key);
+		}
+	}
+	g_mutex_unlock(&g_map_lock);
+
+	if (dropped)
+		map_free(dropped);
+}
+
+const char *urlio_map_data(URLIO_MAP *map) {
+	return map->data;
+}
+
+guint64 urlio_map_size(URLIO_MAP *map) {
+	return map->size;
+}
+
+void urlio_map_willneed(URLIO_MAP *map, guint64 offset, guint64 len) {
+	long page = sysconf(_SC_PAGESIZE);
+	guint64 start;
+
+	if (offset >= map->size || !len)
+		return;
+	len = MIN(len, map->size - offset);
+	start = offset - offset % page;
+	madvise((void *) (map->data + start), offset + len - start,
+			MADV_WILLNEED);
+}
+
+#else
+
+URLIO_MAP *urlio_map_open(const char *path G_GNUC_UNUSED) {
+	return NULL;
+}
+
+URLIO_MAP *urlio_map_ref(URLIO_MAP *map) {
+	return map;
+}
+
+void urlio_map_unref(URLIO_MAP *map G_GNUC_UNUSED) {
+}
+
+const char *urlio_map_data(URLIO_MAP *map G_GNUC_UNUSED) {
+	return NULL;
+}
+
+guint64 urlio_map_size(URLIO_MAP *map G_GNUC_UNUSED) {
+	return 0;
+}
+
+void urlio_map_willneed(URLIO_MAP *map G_GNUC_UNUSED,
+		guint64 offset G_GNUC_UNUSED, guint64 len G_GNUC_UNUSED) {
+}
+
+#endif
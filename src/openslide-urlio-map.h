@@ -0,0 +1,46 @@
+/*
+ *  OpenRemoteSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *
+ *  All rights reserved.
+ *
+ *  OpenRemoteSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __OPENSLIDE_URLIO_MAP_H__
+#define __OPENSLIDE_URLIO_MAP_H__
+
+#define MAP_IDLE_MAX 16 /* unused mappings kept for the next open */
+
+#include <glib.h>
+
+/* A read-only mapping of a whole local file, shared by all the handles of
+ * the file; mappings are keyed by device, inode, size and mtime, so a file
+ * replaced on disk gets a new one. The file must not shrink while mapped. */
+typedef struct fcurl_map URLIO_MAP;
+
+/* a new reference on the mapping of path, NULL if it can't be mapped */
+URLIO_MAP *urlio_map_open(const char *path);
+URLIO_MAP *urlio_map_ref(URLIO_MAP *map);
+void urlio_map_unref(URLIO_MAP *map);
+
+const char *urlio_map_data(URLIO_MAP *map);
+guint64 urlio_map_size(URLIO_MAP *map);
+
+/* tell the kernel [offset, offset + len) is wanted soon */
+void urlio_map_willneed(URLIO_MAP *map, guint64 offset, guint64 len);
+
+#endif // __OPENSLIDE_URLIO_MAP_H__
@@ -20,62 +20,297 @@
  *
  */
 
+#include <config.h>
+
 #include "openslide-urlio.h"
+#include "openslide-urlio-disk.h"
+#include "openslide-urlio-map.h"
 
 #include <glib.h>
 
-static URLIO_CACHE **g_cache_list = NULL;
-static int g_cache_count = 0;
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_PREAD
+#include <unistd.h>
+#endif
 
-static URLIO_CONN **g_urlio_list = NULL;
-static int g_urlio_count = 0;
+/* url -> URLIO_CACHE, the blocks of all caches share one LRU list and one
+ * byte cap; everything here is guarded by g_cache_lock */
+static GHashTable *g_cache_table = NULL;
+static GQueue g_cache_lru = G_QUEUE_INIT;
+static size_t g_cache_total_size = 0;
+static size_t g_cache_capacity = 0;
+
+/* largest hole between two wanted ranges fetched as one, in bytes */
+static guint64 g_range_gap = 0;
+
+/* log transfers, from OPENSLIDE_DEBUG=urlio */
+static gboolean g_trace = FALSE;
+static urlio_span_fn g_span_hook;
+
+#define SPAN_BEGIN(name) \
+	do { if (G_UNLIKELY(g_span_hook)) g_span_hook(name, TRUE); } while (0)
+#define SPAN_END(name) \
+	do { if (G_UNLIKELY(g_span_hook)) g_span_hook(name, FALSE); } while (0)
+
+/* url -> URLIO_CONN of the remote streams opened, and the urls being
+ * probed, whose openers wait on g_urlio_cond; under g_urlio_lock, which
+ * is only held to look them up, never during a transfer */
+static GHashTable *g_urlio_table = NULL;
+static GHashTable *g_urlio_probing = NULL;
+static GMutex g_urlio_lock;
+static GCond g_urlio_cond;
 
 static GMutex g_cache_lock;
 
-void urlio_initial(void) {
-#ifdef URLIO_VERBOSE
-	printf("initial\n");
+#define BULK_SIZE ((guint64) (CACHE_BLOCK_SIZE))
+/* most bulks fetched by one io slot */
+#define SLOT_BULKS ((CACHE_BULK_SIZE_PER_THREAD) / (CACHE_BLOCK_SIZE))
+
+#ifndef HAVE_PREAD
+static GMutex g_pread_lock;
 #endif
 
-	g_thread_init(NULL);
-	curl_global_init(CURL_GLOBAL_ALL);
+/* URLIO_INTERRUPT of the reads of each thread */
+static GPrivate g_interrupt = G_PRIVATE_INIT(NULL);
 
-	return;
+const URLIO_INTERRUPT *urlio_set_interrupt(const URLIO_INTERRUPT *interrupt) {
+	const URLIO_INTERRUPT *old = g_private_get(&g_interrupt);
+
+	g_private_set(&g_interrupt, (gpointer) interrupt);
+	return old;
 }
 
-void urlio_release(void) {
-#ifdef URLIO_VERBOSE
-	printf("release\n");
-#endif
+const URLIO_INTERRUPT *urlio_get_interrupt(void) {
+	return g_private_get(&g_interrupt);
+}
+
+gboolean urlio_interrupted(const URLIO_INTERRUPT *interrupt) {
+	if (!interrupt)
+		return FALSE;
+	if (interrupt->cancelled && g_atomic_int_get(interrupt->cancelled))
+		return TRUE;
+	return interrupt->deadline && g_get_monotonic_time() >= interrupt->deadline;
+}
+
+/* g_cond_wait() for a reader with an interrupt, waking up to check it;
+ * FALSE once it fired */
+static gboolean interruptible_wait(GCond *cond, GMutex *mutex,
+		const URLIO_INTERRUPT *interrupt) {
+	gint64 end;
+
+	if (!interrupt) {
+		g_cond_wait(cond, mutex);
+		return TRUE;
+	}
+	if (urlio_interrupted(interrupt))
+		return FALSE;
+	end = g_get_monotonic_time() + INTERRUPT_POLL * 1000;
+	if (interrupt->deadline)
+		end = MIN(end, interrupt->deadline);
+	g_cond_wait_until(cond, mutex, end);
+	return TRUE;
+}
+
+static void reactor_start(void);
+
+static void block_unref(URLIO_BLOCK *block) {
+	if (g_atomic_int_dec_and_test(&block->refcount)) {
+		free(block->data);
+		g_slice_free(URLIO_BLOCK, block);
+	}
+}
+
+/* drop a block from its cache, readers holding a reference keep it alive */
+static void evict_block(URLIO_BLOCK *block) {
+	g_queue_delete_link(&g_cache_lru, block->lru_link);
+	block->lru_link = NULL;
+	g_hash_table_remove(block->cache->bulks, &block->id);
+	g_cache_total_size -= block->size;
+	block_unref(block);
+}
+
+/* drop the least recently used blocks until limit bytes are left */
+static void evict_to(size_t limit, URLIO_BLOCK *keep) {
+	while (g_cache_total_size > limit) {
+		URLIO_BLOCK *block = g_queue_peek_tail(&g_cache_lru);
+
+		if (!block || block == keep)
+			break;
+		evict_block(block);
+	}
+}
+
+static void possibly_evict(URLIO_BLOCK *keep) {
+	evict_to(g_cache_capacity, keep);
+}
+
+static URLIO_CACHE *get_cache(const char *url) {
+	URLIO_CACHE *cache;
+
+	if (!g_cache_table)
+		g_cache_table = g_hash_table_new(g_str_hash, g_str_equal);
+
+	cache = g_hash_table_lookup(g_cache_table, url);
+	if (!cache) {
+		cache = g_slice_new0(URLIO_CACHE);
+		cache->url = g_strdup(url);
+		cache->bulks = g_hash_table_new(g_int64_hash, g_int64_equal);
+		cache->fetches = g_hash_table_new(g_int64_hash, g_int64_equal);
+		g_hash_table_insert(g_cache_table, cache->url, cache);
+	}
+	return cache;
+}
+
+/* look up a bulk and take a reference on it, marking it recently used */
+static URLIO_BLOCK *get_block(URLIO_CACHE *cache, guint64 id) {
+	URLIO_BLOCK *block = g_hash_table_lookup(cache->bulks, &id);
+
+	if (block) {
+		g_queue_unlink(&g_cache_lru, block->lru_link);
+		g_queue_push_head_link(&g_cache_lru, block->lru_link);
+		g_atomic_int_inc(&block->refcount);
+	}
+	return block;
+}
+
+/* index a freshly fetched bulk, replacing a shorter one with the same id;
+ * the caller's reference is kept */
+static void put_block(URLIO_CACHE *cache, URLIO_BLOCK *block) {
+	URLIO_BLOCK *old = g_hash_table_lookup(cache->bulks, &block->id);
+
+	if (old)
+		evict_block(old);
+
+	block->cache = cache;
+	block->refcount = 2;
+	g_queue_push_head(&g_cache_lru, block);
+	block->lru_link = g_queue_peek_head_link(&g_cache_lru);
+	g_hash_table_insert(cache->bulks, &block->id, block);
+	g_cache_total_size += block->size;
+
+	possibly_evict(block);
+}
+
+static void init_cache_capacity(void) {
+	const char *env;
+
+	if (g_cache_capacity)
+		return;
+
+	g_cache_capacity = CACHE_DEFAULT_CAPACITY;
+	env = g_getenv(CACHE_CAPACITY_ENV_VAR);
+	if (env) {
+		guint64 capacity = g_ascii_strtoull(env, NULL, 10);
+		if (capacity)
+			g_cache_capacity = capacity;
+	}
+}
+
+size_t urlio_get_cache_capacity(void) {
+	size_t capacity;
+
+	g_mutex_lock(&g_cache_lock);
+	init_cache_capacity();
+	capacity = g_cache_capacity;
+	g_mutex_unlock(&g_cache_lock);
+
+	return capacity;
+}
+
+void urlio_set_cache_capacity(size_t capacity) {
+	g_mutex_lock(&g_cache_lock);
+	g_cache_capacity = capacity ? capacity : CACHE_DEFAULT_CAPACITY;
+	possibly_evict(NULL);
+	g_mutex_unlock(&g_cache_lock);
+}
+
+size_t urlio_get_cache_size(void) {
+	size_t size;
+
+	g_mutex_lock(&g_cache_lock);
+	size = g_cache_total_size;
+	g_mutex_unlock(&g_cache_lock);
+
+	return size;
+}
+
+void urlio_trim_cache(double fraction) {
+	g_mutex_lock(&g_cache_lock);
+	evict_to(g_cache_total_size * (1 - CLAMP(fraction, 0, 1)), NULL);
+	g_mutex_unlock(&g_cache_lock);
+}
+
+static void init_range_gap(void) {
+	const char *env;
+
+	if (g_range_gap)
+		return;
 
-	curl_global_cleanup();
+	g_range_gap = RANGE_GAP_DEFAULT;
+	env = g_getenv(RANGE_GAP_ENV_VAR);
+	if (env) {
+		guint64 gap = g_ascii_strtoull(env, NULL, 10);
+		if (gap)
+			g_range_gap = gap;
+	}
+}
+
+guint64 urlio_get_range_gap(void) {
+	guint64 gap;
+
+	g_mutex_lock(&g_cache_lock);
+	init_range_gap();
+	gap = g_range_gap;
+	g_mutex_unlock(&g_cache_lock);
+
+	return gap;
+}
+
+void urlio_set_range_gap(guint64 gap) {
+	g_mutex_lock(&g_cache_lock);
+	g_range_gap = gap ? gap : RANGE_GAP_DEFAULT;
+	g_mutex_unlock(&g_cache_lock);
+}
+
+void urlio_set_trace(gboolean trace) {
+	g_trace = trace;
+}
+
+void urlio_set_span_hook(urlio_span_fn fn) {
+	g_span_hook = fn;
+}
+
+void urlio_initial(void) {
+	g_thread_init(NULL);
+	reactor_start();
+
+	g_mutex_lock(&g_cache_lock);
+	init_cache_capacity();
+	g_mutex_unlock(&g_cache_lock);
 
 	return;
 }
 
-int urlio_ferror(URLIO_FILE *file) {
-	int ret = 0;
+void urlio_release(void) {
+	/* curl stays initialized for the reactor, which lives as long as the
+	 * process */
 
-	switch (file->type) {
-	case CFTYPE_FILE:
-		ret = ferror(file->handle.file);
-		break;
+	return;
+}
 
-	case CFTYPE_CURL:
-		for (int t = 0; t < THREAD_NUM; t++) {
-			if ((file->handle.conn->io[t].buffer_pos == 0)
-					&& (!file->handle.conn->still_running)) {
-				ret = 1;
-				break;
-			}
-		}
-		break;
-	default: /* unknown or supported type - oh dear */
-		ret = -1;
-		errno = EBADF;
-		break;
+/* copy the next len bytes of a range into the blocks of an io slot */
+static void io_store(URLIO_IO *io, const char *src, size_t len) {
+	while (len) {
+		URLIO_BLOCK *block = io->blocks[io->buffer_pos / BULK_SIZE];
+		size_t off = io->buffer_pos % BULK_SIZE;
+		size_t n = MIN(len, block->size - off);
+
+		memcpy(block->data + off, src, n);
+		io->buffer_pos += n;
+		src += n;
+		len -= n;
 	}
-	return ret;
 }
 
 /* curl calls this routine to get more data */
@@ -87,6 +322,15 @@ static size_t write_callback(char *buffer, size_t size, size_t nitems,
 	URLIO_IO *io = (URLIO_IO *) userp;
 	size *= nitems;
 
+	if (io->blocks) {
+		/* into the blocks, nothing beyond the range fits; data past it
+		 * means the server ignored the range, so stop the transfer */
+		size_t n = MIN(size, io->limit - io->buffer_pos);
+
+		io_store(io, buffer, n);
+		return n < size ? 0 : size;
+	}
+
 	rembuff = io->buffer_len - io->buffer_pos; /* remaining space in buffer */
 
 	if (size > rembuff) {
@@ -105,837 +349,2593 @@ static size_t write_callback(char *buffer, size_t size, size_t nitems,
 	memcpy(&io->buffer[io->buffer_pos], buffer, size);
 	io->buffer_pos += size;
 
+	/* more than we asked for, the server ignored the range: abort the
+	 * rest of the transfer */
+	if (io->limit && io->buffer_pos > io->limit)
+		return 0;
+
 	return size;
 }
 
-/* use to attempt to fill the read buffer up to requested number of bytes */
-static int fill_buffer(URLIO_CONN *conn, size_t want, int thread_index) {
-	fd_set fdread;
-	fd_set fdwrite;
-	fd_set fdexcep;
-	struct timeval timeout;
-	int rc;
-	CURLMcode mc; /* curl_multi_fdset() return code */
-
-	/* only attempt to fill buffer if transactions still running and buffer
-	 * doesn't exceed required size already
-	 */
-	if ((!conn->still_running) || (conn->io[thread_index].buffer_pos > want))
-		return 0;
-
-	/* attempt to fill buffer */
-	do {
-		int maxfd = -1;
-		long curl_timeo = -1;
+/* the reactor: one thread per process owning the multi handle, so that the
+ * transfers of all streams share one event loop; submitters queue their
+ * io slots and sleep until the reactor reports them completed */
+static CURLM *g_reactor_multi = NULL;
+static GQueue g_reactor_queue = G_QUEUE_INIT; /* io slots to add */
+static GMutex g_reactor_lock;
+
+static GTimer *g_reactor_clock = NULL;
+static GQueue g_reactor_hedging = G_QUEUE_INIT; /* slots which may hedge */
+static GQueue g_reactor_interrupts = G_QUEUE_INIT; /* slots which may abort */
+
+static void complete_io(URLIO_IO *io, CURLcode result) {
+	if (io->xfer->interrupt)
+		g_queue_remove(&g_reactor_interrupts, io);
+
+	g_mutex_lock(&g_reactor_lock);
+	io->result = result;
+	io->latency = g_timer_elapsed(g_reactor_clock, NULL) - io->started;
+	if (--io->xfer->pending == 0)
+		g_cond_broadcast(io->xfer->cond);
+	g_mutex_unlock(&g_reactor_lock);
+}
 
-		FD_ZERO(&fdread);
-		FD_ZERO(&fdwrite);
-		FD_ZERO(&fdexcep);
+static gboolean io_served(URLIO_IO *io, CURLcode result) {
+	/* the write callback stops a transfer going past the limit */
+	return result == CURLE_OK || (io->limit && io->buffer_pos >= io->limit);
+}
 
-		/* set a suitable timeout to fail on */
-		timeout.tv_sec = 60; /* 1 minute */
-		timeout.tv_usec = 0;
+static gboolean acquire_hedge_stream(const char *host);
+static void release_hedge_stream(const char *host);
 
-		curl_multi_timeout(conn->multi_handle, &curl_timeo);
-		if (curl_timeo >= 0) {
-			timeout.tv_sec = curl_timeo / 1000;
-			if (timeout.tv_sec > 1)
-				timeout.tv_sec = 1;
-			else
-				timeout.tv_usec = (curl_timeo % 1000) * 1000;
-		}
+static void drop_hedge(URLIO_IO *hedge) {
+	release_hedge_stream(hedge->xfer->host);
+	if (hedge->in_flight)
+		curl_multi_remove_handle(g_reactor_multi, hedge->curl);
+	curl_easy_cleanup(hedge->curl);
+	free(hedge->buffer);
+	g_slice_free(URLIO_IO, hedge);
+}
 
-		/* get file descriptors from the transfers */
-		mc = curl_multi_fdset(conn->multi_handle, &fdread, &fdwrite, &fdexcep,
-				&maxfd);
+/* send a duplicate of a slot running late, if a stream is free for it */
+static void start_hedge(URLIO_IO *io, double now) {
+	URLIO_IO *hedge;
+
+	if (!acquire_hedge_stream(io->xfer->host))
+		return;
+	hedge = g_slice_new0(URLIO_IO);
+	hedge->curl = curl_easy_duphandle(io->curl);
+	if (!hedge->curl) {
+		g_slice_free(URLIO_IO, hedge);
+		release_hedge_stream(io->xfer->host);
+		return;
+	}
+	hedge->limit = io->limit;
+	hedge->xfer = io->xfer;
+	hedge->primary = io;
+	hedge->started = now;
+	curl_easy_setopt(hedge->curl, CURLOPT_WRITEDATA, hedge);
+	curl_easy_setopt(hedge->curl, CURLOPT_PRIVATE, hedge);
+	curl_multi_add_handle(g_reactor_multi, hedge->curl);
+	hedge->in_flight = TRUE;
+	io->hedge = hedge;
+	io->xfer->hedges++;
+}
 
-		if (mc != CURLM_OK) {
-			fprintf(stderr, "curl_multi_fdset() failed, code %d.\n", mc);
-			break;
+/* one of the requests of a slot is over; the slot completes with the first
+ * of them to serve it, or with the last one when neither does */
+static void finish_request(URLIO_IO *io, CURLcode result) {
+	URLIO_IO *primary = io->primary ? io->primary : io;
+	URLIO_IO *hedge = primary->hedge;
+	gboolean served;
+
+	curl_easy_getinfo(io->curl, CURLINFO_RESPONSE_CODE, &io->response_code);
+	served = io_served(io, result);
+	io->in_flight = FALSE;
+	g_queue_remove(&g_reactor_hedging, primary);
+
+	if (io == hedge) {
+		gboolean primary_over = !primary->in_flight;
+
+		if (served) {
+			/* the duplicate won, its data becomes the slot's */
+			if (primary->in_flight)
+				curl_multi_remove_handle(g_reactor_multi, primary->curl);
+			primary->in_flight = FALSE;
+			if (primary->blocks) {
+				primary->buffer_pos = 0;
+				io_store(primary, hedge->buffer,
+						MIN(hedge->buffer_pos, primary->limit));
+			} else {
+				free(primary->buffer);
+				primary->buffer = hedge->buffer;
+				primary->buffer_len = hedge->buffer_len;
+				primary->buffer_pos = hedge->buffer_pos;
+				hedge->buffer = NULL;
+			}
+			primary->response_code = hedge->response_code;
+			primary->xfer->hedge_wins++;
 		}
+		primary->hedge = NULL;
+		drop_hedge(hedge);
+		if (served)
+			complete_io(primary, CURLE_OK);
+		else if (primary_over)
+			complete_io(primary, primary->result);
+		return;
+	}
 
-		/* On success the value of maxfd is guaranteed to be >= -1. We call
-		 select(maxfd + 1, ...); specially in case of (maxfd == -1) there are
-		 no fds ready yet so we call select(0, ...) --or Sleep() on Windows--
-		 to sleep 100ms, which is the minimum suggested value in the
-		 curl_multi_fdset() doc. */
-
-		if (maxfd == -1) {
-#ifdef _WIN32
-			Sleep(100);
-			rc = 0;
-#else
-			/* Portable sleep for platforms other than Windows. */
-			struct timeval wait = { 0, 100 * 1000 }; /* 100ms */
-			rc = select(0, NULL, NULL, NULL, &wait);
-#endif
-		} else {
-			/* Note that on some platforms 'timeout' may be modified by select().
-			 If you need access to the original value save a copy beforehand. */
-			rc = select(maxfd + 1, &fdread, &fdwrite, &fdexcep, &timeout);
-		}
+	if (!served && hedge) {
+		/* the duplicate may still make it */
+		io->result = result;
+		return;
+	}
+	if (hedge) {
+		primary->hedge = NULL;
+		drop_hedge(hedge);
+	}
+	complete_io(io, result);
+}
 
-		switch (rc) {
-		case -1:
-			/* select error */
-			break;
+/* give up a slot whose submitter was interrupted, with its duplicate */
+static void abort_io(URLIO_IO *io) {
+	if (io->hedge) {
+		drop_hedge(io->hedge);
+		io->hedge = NULL;
+	}
+	if (io->in_flight)
+		curl_multi_remove_handle(g_reactor_multi, io->curl);
+	io->in_flight = FALSE;
+	g_queue_remove(&g_reactor_hedging, io);
+	complete_io(io, CURLE_ABORTED_BY_CALLBACK);
+}
 
-		case 0:
-		default:
-			/* timeout or readable/writable sockets */
-			curl_multi_perform(conn->multi_handle, &conn->still_running);
-			break;
+static gpointer reactor_main(gpointer data G_GNUC_UNUSED) {
+	for (;;) {
+		URLIO_IO *io;
+		CURLMsg *msg;
+		int running;
+		int left;
+		double now;
+		int timeout = REACTOR_POLL_TIMEOUT;
+
+		/* the multi handle is only touched from this thread */
+		g_mutex_lock(&g_reactor_lock);
+		now = g_timer_elapsed(g_reactor_clock, NULL);
+		while ((io = g_queue_pop_head(&g_reactor_queue))) {
+			io->started = now;
+			io->in_flight = TRUE;
+			curl_multi_add_handle(g_reactor_multi, io->curl);
+			if (io->hedge_after > 0)
+				g_queue_push_tail(&g_reactor_hedging, io);
+			if (io->xfer->interrupt)
+				g_queue_push_tail(&g_reactor_interrupts, io);
 		}
-	} while (conn->still_running && (conn->io[thread_index].buffer_pos < want));
-	return 1;
-}
+		g_mutex_unlock(&g_reactor_lock);
 
-/* use to remove want bytes from the front of a files buffer */
-static int use_buffer(URLIO_CONN *conn, size_t want, int thread_index) {
-	/* sort out buffer */
-	if ((conn->io[thread_index].buffer_pos - want) <= 0) {
-		/* ditch buffer - write will recreate */
-		free(conn->io[thread_index].buffer);
-		conn->io[thread_index].buffer = NULL;
-		conn->io[thread_index].buffer_pos = 0;
-		conn->io[thread_index].buffer_len = 0;
-	} else {
-		/* move rest down make it available for later */
-		memmove(conn->io[thread_index].buffer,
-				&conn->io[thread_index].buffer[want],
-				(conn->io[thread_index].buffer_pos - want));
+		curl_multi_perform(g_reactor_multi, &running);
 
-		conn->io[thread_index].buffer_pos -= want;
-	}
-	return 0;
-}
+		while ((msg = curl_multi_info_read(g_reactor_multi, &left))) {
+			CURL *curl = msg->easy_handle;
+			CURLcode result = msg->data.result;
 
-static size_t download(void *ptr, size_t pos, size_t wanted, URLIO_CONN *conn) {
-	int wanted_bulk_count = (((pos % (CACHE_BULK_SIZE)) + wanted - 1)
-			/ (CACHE_BULK_SIZE)) + 1;
-	size_t wanted_bulk_id = (pos / (CACHE_BULK_SIZE)) * (CACHE_BULK_SIZE);
-	size_t residual = wanted;
-	size_t copied = 0L;
-	size_t want_per_thread[THREAD_NUM];
-	size_t want_total;
+			if (msg->msg != CURLMSG_DONE)
+				continue;
 
-	for (int i = 0; i < wanted_bulk_count; i++) {
-		int wanted_cache_index = -1;
-		int wanted_bulk_index = -1;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &io);
+			curl_multi_remove_handle(g_reactor_multi, curl);
+			finish_request(io, result);
+		}
 
-		for (int j = 0; j < g_cache_count; j++) {
-			if (!strcmp(g_cache_list[j]->url, conn->url)) {
-				wanted_cache_index = j;
-				break;
+		/* hedge the slots running late, and wake up for the next one */
+		now = g_timer_elapsed(g_reactor_clock, NULL);
+		for (GList *l = g_reactor_hedging.head; l;) {
+			GList *next = l->next;
+			double late;
+
+			io = l->data;
+			late = now - io->started - io->hedge_after;
+			if (late >= 0) {
+				start_hedge(io, now);
+				g_queue_delete_link(&g_reactor_hedging, l);
+			} else {
+				timeout = MIN(timeout, (int) (-late * 1000) + 1);
 			}
+			l = next;
 		}
 
-		if (wanted_cache_index != -1) {
-			for (int j = 0; j < g_cache_list[wanted_cache_index]->bulk_count;
-					j++) {
-				if (g_cache_list[wanted_cache_index]->bulk_id_list[j]
-						== wanted_bulk_id) {
-					printf("download: cache hit bulk id %zu\n", wanted_bulk_id);
-					wanted_bulk_index = j;
-					break;
-				}
+		/* abort the slots of interrupted submitters, and wake up at the
+		 * next deadline */
+		for (GList *l = g_reactor_interrupts.head; l;) {
+			GList *next = l->next;
+			const URLIO_INTERRUPT *interrupt;
+
+			io = l->data;
+			interrupt = io->xfer->interrupt;
+			if (urlio_interrupted(interrupt)) {
+				abort_io(io);
+			} else if (interrupt->deadline) {
+				gint64 left = interrupt->deadline - g_get_monotonic_time();
+				timeout = MIN(timeout, (int) (left / 1000) + 1);
 			}
+			l = next;
 		}
 
-		if (wanted_bulk_index == -1) { /* missed bulk */
-			printf("download: cache is missed\n");
-
-			g_mutex_lock(&g_cache_lock);
-
-			for (int t = 0; t < THREAD_NUM; t++) {
-				if (pos + t * (CACHE_BULK_SIZE_PER_THREAD) > conn->size)
-					break;
-				/* close the stream */
-				/* make sure the easy handle is not in the multi handle anymore */
-				curl_multi_remove_handle(conn->multi_handle, conn->io[t].curl);
-
-				/* cleanup */
-				curl_easy_cleanup(conn->io[t].curl);
-
-				/* reopen the stream and resume at a specific pos */
-				conn->io[t].curl = curl_easy_init();
-
-				curl_easy_setopt(conn->io[t].curl, CURLOPT_URL, conn->url);
-				curl_easy_setopt(conn->io[t].curl, CURLOPT_WRITEDATA,
-						&(conn->io[t]));
-				curl_easy_setopt(conn->io[t].curl, CURLOPT_VERBOSE,
-						CURL_VERBOSE);
-				curl_easy_setopt(conn->io[t].curl, CURLOPT_WRITEFUNCTION,
-						write_callback);
-				curl_easy_setopt(conn->io[t].curl, CURLOPT_RESUME_FROM_LARGE,
-						wanted_bulk_id+t*(CACHE_BULK_SIZE_PER_THREAD)); /* bulk id represents the pointer of the head of a bulk*/
-
-//			/* This tests if multi_handle has been initialzed. It should always be initialized.*/
-//			if (!urlio->multi_handle)
-//				urlio->multi_handle = curl_multi_init();
-
-				curl_multi_add_handle(conn->multi_handle, conn->io[t].curl);
-			}
-			/* lets start the fetch */
-			curl_multi_perform(conn->multi_handle, &conn->still_running);
+		/* sleeps until a socket is ready, a timeout of curl expires or a
+		 * submitter wakes us up */
+		curl_multi_poll(g_reactor_multi, NULL, 0, timeout, NULL);
+	}
 
-			for (int t = 0; t < THREAD_NUM; t++) {
-				if (pos + t * (CACHE_BULK_SIZE_PER_THREAD) > conn->size)
-					break;
-				if ((conn->io[t].buffer_pos == 0) && (!conn->still_running)) {
-					/* if still_running is 0 now, we should return NULL */
+	return NULL;
+}
 
-					for (int q = 0; q < THREAD_NUM; q++) {
-						if (pos + q * (CACHE_BULK_SIZE_PER_THREAD) > conn->size)
-							break;
+/* DNS, TLS sessions and connections shared by all easy handles; the share
+ * is used from the reactor and from threads setting handles up */
+static CURLSH *g_share = NULL;
+static GMutex g_share_locks[CURL_LOCK_DATA_LAST];
 
-						/* make sure the easy handle is not in the multi handle anymore */
-						curl_multi_remove_handle(conn->multi_handle,
-								conn->io[q].curl);
+static void share_lock(CURL *curl G_GNUC_UNUSED, curl_lock_data data,
+		curl_lock_access access G_GNUC_UNUSED, void *userp G_GNUC_UNUSED) {
+	g_mutex_lock(&g_share_locks[data]);
+}
 
-						/* cleanup */
-						curl_easy_cleanup(conn->io[q].curl);
-					}
+static void share_unlock(CURL *curl G_GNUC_UNUSED, curl_lock_data data,
+		void *userp G_GNUC_UNUSED) {
+	g_mutex_unlock(&g_share_locks[data]);
+}
 
-					g_mutex_unlock(&g_cache_lock);
-					return 0L;
-				}
-			}
+static gpointer reactor_init(gpointer data G_GNUC_UNUSED) {
+	curl_global_init(CURL_GLOBAL_ALL);
 
-			/* check if there's data in the buffer - if not fill either error or
-			 * EOF */
-			for (int t = 0; t < THREAD_NUM; t++) {
-				if (pos + t * (CACHE_BULK_SIZE_PER_THREAD) > conn->size)
-					break;
-
-				if (conn->io[t].buffer_pos) {
-					/* halt transaction */
-					curl_multi_remove_handle(conn->multi_handle,
-							conn->io[t].curl);
-
-					/* restart */
-					curl_multi_add_handle(conn->multi_handle, conn->io[t].curl);
-
-					/* ditch buffer - write will recreate - resets stream pos*/
-					free(conn->io[t].buffer);
-					conn->io[t].buffer = NULL;
-					conn->io[t].buffer_pos = 0L;
-					conn->io[t].buffer_len = 0L;
-				}
-			}
+	g_share = curl_share_init();
+	curl_share_setopt(g_share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(g_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+	g_reactor_clock = g_timer_new();
+	g_reactor_multi = curl_multi_init();
+	/* ranges of one host go over one HTTP/2 connection when possible */
+	curl_multi_setopt(g_reactor_multi, CURLMOPT_PIPELINING,
+			(long) CURLPIPE_MULTIPLEX);
+	if (g_thread_create(reactor_main, NULL, FALSE, NULL) == NULL)
+		fprintf(stderr, "could not start the urlio reactor\n");
+	return NULL;
+}
 
-			/* This paragraph reads want of data from the stream */
+static void reactor_start(void) {
+	static GOnce reactor_once = G_ONCE_INIT;
+	g_once(&reactor_once, reactor_init, NULL);
+}
 
-			for (int t = 0; t < THREAD_NUM; t++) {
-				if (pos + t * (CACHE_BULK_SIZE_PER_THREAD) > conn->size)
-					break;
+void urlio_wake(void) {
+	if (g_reactor_multi)
+		curl_multi_wakeup(g_reactor_multi);
+}
 
-				want_per_thread[t] = (CACHE_BULK_SIZE_PER_THREAD);
+/* run the first count io slots of xfer and wait until all are over */
+static void reactor_run(URLIO_TRANSFER *xfer, int count) {
+	reactor_start();
+
+	xfer->cond = g_cond_new();
+	xfer->pending = count;
+
+	g_mutex_lock(&g_reactor_lock);
+	for (int t = 0; t < count; t++) {
+		xfer->io[t].xfer = xfer;
+		xfer->io[t].result = CURLE_OK;
+		xfer->io[t].response_code = 0;
+		xfer->io[t].hedge = NULL;
+		curl_easy_setopt(xfer->io[t].curl, CURLOPT_PRIVATE, &xfer->io[t]);
+		g_queue_push_tail(&g_reactor_queue, &xfer->io[t]);
+	}
+	g_mutex_unlock(&g_reactor_lock);
 
-				fill_buffer(conn, want_per_thread[t], t);
+	curl_multi_wakeup(g_reactor_multi);
 
-				/* check if there's data in the buffer - if not fill_buffer()
-				 * either error or EOF */
-				if (!conn->io[t].buffer_pos) {
-					g_mutex_unlock(&g_cache_lock);
-					return 0L;
-				}
+	g_mutex_lock(&g_reactor_lock);
+	while (xfer->pending)
+		g_cond_wait(xfer->cond, &g_reactor_lock);
+	g_mutex_unlock(&g_reactor_lock);
 
-				/* ensure only available data is considered */
-				if (conn->io[t].buffer_pos < want_per_thread[t])
-					want_per_thread[t] = conn->io[t].buffer_pos;
+	g_cond_free(xfer->cond);
+	xfer->cond = NULL;
+}
 
-			}
+/* deadline of a range and hedging, guarded by g_timeout_lock */
+static guint g_timeout_ms = 0;
+static gboolean g_hedge = FALSE;
+static GMutex g_timeout_lock;
 
-			want_total = 0L;
-			for (int t = 0; t < THREAD_NUM; t++) {
-				if (pos + t * (CACHE_BULK_SIZE_PER_THREAD) > conn->size)
-					break;
+static void init_timeouts(void) {
+	const char *env;
 
-				want_total += want_per_thread[t];
-			}
+	if (g_timeout_ms)
+		return;
 
-			/* Expand cache memory */
-			if (wanted_cache_index == -1) {
-				if (!g_cache_list)
-					g_cache_list = (URLIO_CACHE**) malloc(sizeof(URLIO_CACHE*));
-				else
-					g_cache_list = (URLIO_CACHE**) realloc(g_cache_list,
-							(g_cache_count + 1) * sizeof(URLIO_CACHE*));
-				g_cache_list[g_cache_count] = (URLIO_CACHE*) calloc(1,
-						sizeof(URLIO_CACHE));
-				g_cache_list[g_cache_count]->url = (char*) malloc(
-						(strlen(conn->url) + 1) * sizeof(char));
-				strcpy(g_cache_list[g_cache_count]->url, conn->url);
-				wanted_cache_index = g_cache_count;
-				g_cache_count++;
-			}
+	g_timeout_ms = REQUEST_TIMEOUT_DEFAULT;
+	env = g_getenv(REQUEST_TIMEOUT_ENV_VAR);
+	if (env) {
+		guint timeout = strtoul(env, NULL, 10);
+		if (timeout)
+			g_timeout_ms = timeout;
+	}
 
-			/* Expand cache memory */
-			if (g_cache_list[wanted_cache_index]->bulk_count == 0) {
-				g_cache_list[wanted_cache_index]->bulk_list = (char**) malloc(
-						sizeof(char*));
-				g_cache_list[wanted_cache_index]->bulk_id_list =
-						(size_t*) malloc(sizeof(size_t));
-				g_cache_list[wanted_cache_index]->bulk_size_list =
-						(size_t*) malloc(sizeof(size_t));
-				g_cache_list[wanted_cache_index]->bulk_list[g_cache_list[wanted_cache_index]->bulk_count] =
-						(char*) malloc(want_total * sizeof(char));
-			} else {
-				g_cache_list[wanted_cache_index]->bulk_list = (char**) realloc(
-						g_cache_list[wanted_cache_index]->bulk_list,
-						(g_cache_list[wanted_cache_index]->bulk_count + 1)
-								* sizeof(char*));
-				g_cache_list[wanted_cache_index]->bulk_id_list =
-						(size_t*) realloc(
-								g_cache_list[wanted_cache_index]->bulk_id_list,
-								(g_cache_list[wanted_cache_index]->bulk_count
-										+ 1) * sizeof(size_t));
-				g_cache_list[wanted_cache_index]->bulk_size_list =
-						(size_t*) realloc(
-								g_cache_list[wanted_cache_index]->bulk_size_list,
-								(g_cache_list[wanted_cache_index]->bulk_count
-										+ 1) * sizeof(size_t));
-				g_cache_list[wanted_cache_index]->bulk_list[g_cache_list[wanted_cache_index]->bulk_count] =
-						(char*) malloc(want_total * sizeof(char));
-			}
+	env = g_getenv(HEDGE_ENV_VAR);
+	g_hedge = env && *env && strcmp(env, "0");
+}
 
-			for (int t = 0; t < THREAD_NUM; t++) {
-				if (pos + t * (CACHE_BULK_SIZE_PER_THREAD) > conn->size)
-					break;
-				/* xfer data to caller */
-				memcpy(
-						g_cache_list[wanted_cache_index]->bulk_list[g_cache_list[wanted_cache_index]->bulk_count]
-								+ t * (CACHE_BULK_SIZE_PER_THREAD),
-						conn->io[t].buffer, want_per_thread[t]);
-			}
-			g_cache_list[wanted_cache_index]->bulk_size_list[g_cache_list[wanted_cache_index]->bulk_count] =
-					want_total;
-			g_cache_list[wanted_cache_index]->bulk_id_list[g_cache_list[wanted_cache_index]->bulk_count] =
-					wanted_bulk_id;
-
-			for (int t = 0; t < THREAD_NUM; t++) {
-				if (pos + t * (CACHE_BULK_SIZE_PER_THREAD) > conn->size)
-					break;
-				use_buffer(conn, want_per_thread[t], t);
-			}
-			wanted_bulk_index = g_cache_list[wanted_cache_index]->bulk_count;
+void urlio_set_timeouts(guint timeout_ms, gboolean hedge) {
+	g_mutex_lock(&g_timeout_lock);
+	g_timeout_ms = timeout_ms ? timeout_ms : REQUEST_TIMEOUT_DEFAULT;
+	g_hedge = hedge;
+	g_mutex_unlock(&g_timeout_lock);
+}
 
-			g_cache_list[wanted_cache_index]->bulk_count++;
+static guint get_timeout(gboolean *hedge) {
+	guint timeout;
 
-			printf("download: obtained bulk id %zu\n", wanted_bulk_id);
+	g_mutex_lock(&g_timeout_lock);
+	init_timeouts();
+	timeout = g_timeout_ms;
+	if (hedge)
+		*hedge = g_hedge;
+	g_mutex_unlock(&g_timeout_lock);
 
-			g_mutex_unlock(&g_cache_lock);
-		}
+	return timeout;
+}
 
-		size_t copy_ptr = (i == 0) ? pos % (CACHE_BULK_SIZE) : 0;
-		size_t copy_size =
-				(residual
-						< g_cache_list[wanted_cache_index]->bulk_size_list[wanted_bulk_index]
-								- copy_ptr) ?
-						residual :
-						(g_cache_list[wanted_cache_index]->bulk_size_list[wanted_bulk_index]
-								- copy_ptr);
-		size_t ptr_ptr = wanted - residual;
+/* set up an easy handle for one io slot of a transfer of conn */
+static void setup_io(URLIO_CONN *conn, URLIO_IO *io) {
+	curl_easy_setopt(io->curl, CURLOPT_URL, conn->fetch_url);
+	curl_easy_setopt(io->curl, CURLOPT_WRITEDATA, io);
+	curl_easy_setopt(io->curl, CURLOPT_VERBOSE, CURL_VERBOSE);
+	curl_easy_setopt(io->curl, CURLOPT_WRITEFUNCTION, write_callback);
+	curl_easy_setopt(io->curl, CURLOPT_NOSIGNAL, 1L);
+	/* fail transfers which stall, rather than waiting forever */
+	curl_easy_setopt(io->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(io->curl, CURLOPT_LOW_SPEED_TIME, (long) STALL_TIMEOUT);
+	curl_easy_setopt(io->curl, CURLOPT_TIMEOUT_MS, (long) get_timeout(NULL));
+
+	/* a pooled handle may come from another backend */
+	curl_easy_setopt(io->curl, CURLOPT_USERNAME, NULL);
+	curl_easy_setopt(io->curl, CURLOPT_PASSWORD, NULL);
+#if LIBCURL_VERSION_NUM >= 0x074b00
+	curl_easy_setopt(io->curl, CURLOPT_AWS_SIGV4, NULL);
+#endif
+	if (conn->backend->authorize)
+		conn->backend->authorize(conn, io);
+	curl_easy_setopt(io->curl, CURLOPT_HTTPHEADER, io->headers);
+}
 
-		memcpy((char*) ptr + ptr_ptr,
-				&g_cache_list[wanted_cache_index]->bulk_list[wanted_bulk_index][copy_ptr],
-				copy_size);
+/* easy handles are kept for reuse by any stream, guarded by g_handle_lock */
+static GQueue g_idle_handles = G_QUEUE_INIT;
+static GMutex g_handle_lock;
+
+/* take an easy handle of the stream, reusing an idle one and its
+ * connection when there is one */
+static CURL *get_handle(void) {
+	CURL *curl;
+
+	/* for the share */
+	reactor_start();
+
+	g_mutex_lock(&g_handle_lock);
+	curl = g_queue_pop_head(&g_idle_handles);
+	g_mutex_unlock(&g_handle_lock);
+
+	if (!curl) {
+		curl = curl_easy_init();
+		curl_easy_setopt(curl, CURLOPT_SHARE, g_share);
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+				(long) CURL_HTTP_VERSION_2TLS);
+		/* wait for a connection to multiplex on rather than opening more */
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	}
+	return curl;
+}
 
-		copied += copy_size;
-		residual -= copy_size;
-		wanted_bulk_id += CACHE_BULK_SIZE;
+static void put_handle(CURL *curl) {
+	g_mutex_lock(&g_handle_lock);
+	if (g_queue_get_length(&g_idle_handles) < HANDLE_POOL_MAX) {
+		g_queue_push_head(&g_idle_handles, curl);
+		curl = NULL;
 	}
+	g_mutex_unlock(&g_handle_lock);
 
-	return copied;
+	if (curl)
+		curl_easy_cleanup(curl);
 }
 
-URLIO_FILE *urlio_fopen(const char *url, const char *operation) {
-	/* this code could check for URLs or types in the 'url' and
-	 basically use the real fopen() for standard files */
-
-	URLIO_FILE *file = NULL;
-	URLIO_CONN *conn = NULL;
-	(void) operation;
-	const size_t want = 1;
-	double dSize;
+/* give back the handle of an io slot once its requests are over */
+static void put_io_handle(URLIO_IO *io) {
+	curl_easy_setopt(io->curl, CURLOPT_RANGE, NULL);
+	curl_easy_setopt(io->curl, CURLOPT_HTTPHEADER, NULL);
+	curl_slist_free_all(io->headers);
+	io->headers = NULL;
+	put_handle(io->curl);
+}
 
-#ifdef URLIO_VERBOSE
-	printf("fopen: %s\n", url);
-#endif
+/* ditch the buffer of an io slot */
+static void reset_io(URLIO_TRANSFER *xfer, int thread_index) {
+	URLIO_IO *io = &xfer->io[thread_index];
 
-	file = (URLIO_FILE*) calloc(1, sizeof(URLIO_FILE));
-	if (!file)
-		return NULL;
+	free(io->buffer);
+	io->buffer = NULL;
+	io->buffer_pos = 0;
+	io->buffer_len = 0;
+}
 
-	file->handle.file = fopen(url, operation);
-	if (file->handle.file) {
-		file->type = CFTYPE_FILE; /* marked as FILE */
+static void fetch_unref(URLIO_FETCH *fetch) {
+	if (--fetch->refcount == 0) {
+		g_cond_free(fetch->cond);
+		g_slice_free(URLIO_FETCH, fetch);
+	}
+}
 
-		file->url = (char*) malloc((strlen(url) + 1) * sizeof(char));
-		strcpy(file->url, url);
-		file->pos = 0;
-		fseek(file->handle.file, 0, SEEK_END);
-		file->handle.conn->size = ftell(file->handle.file);
-		fseek(file->handle.file, 0, SEEK_SET);
-	} else {
-		file->type = CFTYPE_CURL; /* marked as URL */
+static void maybe_mirror(URLIO_CONN *conn);
+
+/* account for a completed transfer of count io slots */
+static void count_transfer(URLIO_CONN *conn, URLIO_TRANSFER *xfer, int count,
+		GTimer *timer) {
+	double ms = g_timer_elapsed(timer, NULL) * 1000;
+	guint64 bytes = 0;
+	int bucket = 0;
+
+	for (int t = 0; t < count; t++)
+		bytes += xfer->io[t].buffer_pos;
+	while (bucket < URLIO_LATENCY_BUCKETS - 1 && ms >= (1 << bucket))
+		bucket++;
+
+	g_mutex_lock(conn->lock);
+	conn->stats.requests += count;
+	conn->stats.round_trips++;
+	conn->stats.bytes_fetched += bytes;
+	conn->stats.latency[bucket]++;
+	conn->stats.hedges += xfer->hedges;
+	conn->stats.hedge_wins += xfer->hedge_wins;
+	g_mutex_unlock(conn->lock);
+
+	if (g_trace)
+		g_message("urlio: %s: %d range(s), %" G_GUINT64_FORMAT
+				" bytes in %.1f ms", conn->url, count, bytes, ms);
+
+	maybe_mirror(conn);
+}
 
-		int wanted_urlio_index = -1;
+static void count_blocks(URLIO_CONN *conn, int hits, int waits, int misses,
+		int disk_hits) {
+	g_mutex_lock(conn->lock);
+	conn->stats.block_hits += hits;
+	conn->stats.block_waits += waits;
+	conn->stats.block_misses += misses;
+	conn->stats.disk_hits += disk_hits;
+	g_mutex_unlock(conn->lock);
+}
 
-		for (int i = 0; i < g_urlio_count; i++) {
-			if (!strcmp(g_urlio_list[i]->url, url)) {
-				printf("stream exists, reuse it\n");
-				wanted_urlio_index = i;
-				break;
-			}
-		}
+/* parallel ranges in flight, per host and in the whole process; a fetch
+ * takes what is free of both limits, at least one stream, and waits when
+ * there is none; everything here is guarded by g_stream_lock */
+struct host_streams {
+	int active; /* ranges in flight */
+	int limit; /* most ranges in flight */
+
+	/* autotuning: throughput of the current window of transfers, compared
+	 * with the previous one to pick the direction of the next step */
+	GTimer *window;
+	guint64 window_bytes;
+	int window_transfers;
+	double last_rate;
+	int step;
+};
+
+static GHashTable *g_hosts = NULL; /* host -> struct host_streams */
+static int g_streams_active = 0;
+static int g_streams_limit = 0;
+static int g_host_streams_limit = 0;
+static gboolean g_autotune = FALSE;
+
+static GMutex g_stream_lock;
+static GCond g_stream_cond;
+
+static void init_concurrency(void) {
+	const char *env;
+
+	if (g_streams_limit)
+		return;
+
+	g_host_streams_limit = THREAD_NUM;
+	env = g_getenv(HOST_STREAMS_ENV_VAR);
+	if (env) {
+		int limit = atoi(env);
+		if (limit > 0)
+			g_host_streams_limit = MIN(limit, HOST_STREAMS_MAX);
+	}
 
-		if (wanted_urlio_index == -1) {
-			conn = (URLIO_CONN*) calloc(1, sizeof(URLIO_CONN));
-			conn->io[0].curl = curl_easy_init();
+	g_streams_limit = STREAMS_DEFAULT;
+	env = g_getenv(STREAMS_ENV_VAR);
+	if (env) {
+		int limit = atoi(env);
+		if (limit > 0)
+			g_streams_limit = limit;
+	}
 
-			curl_easy_setopt(conn->io[0].curl, CURLOPT_URL, url);
-			curl_easy_setopt(conn->io[0].curl, CURLOPT_WRITEDATA,
-					&(conn->io[0]));
-			curl_easy_setopt(conn->io[0].curl, CURLOPT_VERBOSE, CURL_VERBOSE);
-			curl_easy_setopt(conn->io[0].curl, CURLOPT_WRITEFUNCTION,
-					write_callback);
+	env = g_getenv(AUTOTUNE_ENV_VAR);
+	g_autotune = env && *env && strcmp(env, "0");
+}
 
-			conn->multi_handle = curl_multi_init();
-			curl_multi_add_handle(conn->multi_handle, conn->io[0].curl);
+static struct host_streams *get_host(const char *host) {
+	struct host_streams *h;
 
-			/* lets start the fetch */
-			curl_multi_perform(conn->multi_handle, &conn->still_running);
+	if (!g_hosts)
+		g_hosts = g_hash_table_new(g_str_hash, g_str_equal);
 
-			if ((conn->io[0].buffer_pos == 0) && (!conn->still_running)) {
-				/* if still_running is 0 now, we should return NULL */
+	h = g_hash_table_lookup(g_hosts, host);
+	if (!h) {
+		h = g_slice_new0(struct host_streams);
+		h->limit = g_host_streams_limit;
+		h->step = 2;
+		g_hash_table_insert(g_hosts, g_strdup(host), h);
+	}
+	return h;
+}
 
-				/* make sure the easy handle is not in the multi handle anymore */
-				curl_multi_remove_handle(conn->multi_handle, conn->io[0].curl);
+/* take up to want streams for a fetch of conn, at least one, or none if
+ * the reader was interrupted while waiting for them */
+static int acquire_streams(URLIO_CONN *conn, int want) {
+	const URLIO_INTERRUPT *interrupt = urlio_get_interrupt();
+	struct host_streams *h;
+	gboolean waited = FALSE;
+	int n;
+
+	g_mutex_lock(&g_stream_lock);
+	init_concurrency();
+	h = get_host(conn->host);
+	while (h->active >= h->limit || g_streams_active >= g_streams_limit) {
+		waited = TRUE;
+		if (!interruptible_wait(&g_stream_cond, &g_stream_lock,
+				interrupt)) {
+			g_mutex_unlock(&g_stream_lock);
+			return 0;
+		}
+	}
+	n = MIN(want, h->limit - h->active);
+	n = MIN(n, g_streams_limit - g_streams_active);
+	h->active += n;
+	g_streams_active += n;
+	g_mutex_unlock(&g_stream_lock);
+
+	if (waited) {
+		g_mutex_lock(conn->lock);
+		conn->stats.stream_waits++;
+		g_mutex_unlock(conn->lock);
+	}
+	return n;
+}
 
-				/* cleanup */
-				curl_easy_cleanup(conn->io[0].curl);
+/* take one stream for background work, only if the host has nothing else
+ * in flight */
+static gboolean acquire_idle_stream(URLIO_CONN *conn) {
+	struct host_streams *h;
+	gboolean ok;
+
+	g_mutex_lock(&g_stream_lock);
+	init_concurrency();
+	h = get_host(conn->host);
+	ok = h->active == 0 && g_streams_active < g_streams_limit;
+	if (ok) {
+		h->active++;
+		g_streams_active++;
+	}
+	g_mutex_unlock(&g_stream_lock);
 
-				free(file);
-				free(conn);
+	return ok;
+}
 
-				file = NULL;
-			} else {
-				for (int retry = 0; retry < RETRY_TIMES; retry++) {
-					fill_buffer(conn, want, 0);
-
-					/* check if there's data in the buffer - if not fill either error or
-					 * EOF */
-					if (conn->io[0].buffer_pos) {
-						use_buffer(conn, want, 0);
-						curl_easy_getinfo(conn->io[0].curl,
-								CURLINFO_CONTENT_LENGTH_DOWNLOAD, &dSize);
-						conn->size = (long) dSize;
-
-#ifdef URLIO_VERBOSE
-						printf("stream opened, length: %zu\n", conn->size);
-#endif
+/* hill climbing on the throughput of the host: keep stepping while it
+ * improves, turn around when it drops; called with g_stream_lock held */
+static void tune_host(struct host_streams *h, guint64 bytes,
+		gboolean throttled) {
+	double rate;
+
+	if (throttled) {
+		/* the server asks us to slow down, start over from half */
+		h->limit = MAX(1, h->limit / 2);
+		h->step = 2;
+		h->last_rate = 0;
+		h->window_bytes = 0;
+		h->window_transfers = 0;
+		return;
+	}
 
-						break;
-					}
+	if (!h->window)
+		h->window = g_timer_new();
+	if (!h->window_transfers)
+		g_timer_start(h->window);
+	h->window_bytes += bytes;
+	if (++h->window_transfers < TUNE_WINDOW)
+		return;
+
+	rate = h->window_bytes / MAX(g_timer_elapsed(h->window, NULL), 1e-3);
+	if (rate < h->last_rate * 0.9)
+		h->step = -h->step;
+	h->limit = CLAMP(h->limit + h->step, 1, HOST_STREAMS_MAX);
+	h->last_rate = rate;
+	h->window_bytes = 0;
+	h->window_transfers = 0;
+}
 
-					/* halt transaction */
-					curl_multi_remove_handle(conn->multi_handle,
-							conn->io[0].curl);
+/* give back the n streams of a transfer of conn which moved bytes */
+static void release_streams(URLIO_CONN *conn, int n, guint64 bytes,
+		gboolean throttled) {
+	struct host_streams *h;
+
+	g_mutex_lock(&g_stream_lock);
+	h = get_host(conn->host);
+	h->active -= n;
+	g_streams_active -= n;
+	if (g_autotune && (bytes || throttled))
+		tune_host(h, bytes, throttled);
+	g_cond_broadcast(&g_stream_cond);
+	g_mutex_unlock(&g_stream_lock);
+
+	if (throttled) {
+		g_mutex_lock(conn->lock);
+		conn->stats.throttled++;
+		g_mutex_unlock(conn->lock);
+	}
+}
 
-					/* restart */
-					curl_multi_add_handle(conn->multi_handle, conn->io[0].curl);
+/* take a stream for a duplicate, from the reactor thread, which can't wait
+ * for one */
+static gboolean acquire_hedge_stream(const char *host) {
+	struct host_streams *h;
+	gboolean ok;
+
+	g_mutex_lock(&g_stream_lock);
+	h = get_host(host);
+	ok = h->active < h->limit && g_streams_active < g_streams_limit;
+	if (ok) {
+		h->active++;
+		g_streams_active++;
+	}
+	g_mutex_unlock(&g_stream_lock);
 
-					/* ditch buffer - write will recreate - resets stream pos*/
-					free(conn->io[0].buffer);
-					conn->io[0].buffer = NULL;
-					conn->io[0].buffer_pos = 0;
-					conn->io[0].buffer_len = 0;
-				}
+	return ok;
+}
 
-				/* check if there's data in the buffer - if not fill either error or
-				 * EOF */
-				if (conn->io[0].buffer_pos) {
-					/* halt transaction */
-					curl_multi_remove_handle(conn->multi_handle,
-							conn->io[0].curl);
-
-					/* restart */
-					curl_multi_add_handle(conn->multi_handle, conn->io[0].curl);
-
-					/* ditch buffer - write will recreate - resets stream pos*/
-					free(conn->io[0].buffer);
-					conn->io[0].buffer = NULL;
-					conn->io[0].buffer_pos = 0;
-					conn->io[0].buffer_len = 0;
-				} else {
-					/* make sure the easy handle is not in the multi handle anymore */
-					curl_multi_remove_handle(conn->multi_handle,
-							conn->io[0].curl);
+static void release_hedge_stream(const char *host) {
+	struct host_streams *h;
 
-					/* cleanup */
-					curl_easy_cleanup(conn->io[0].curl);
+	g_mutex_lock(&g_stream_lock);
+	h = get_host(host);
+	h->active--;
+	g_streams_active--;
+	g_cond_broadcast(&g_stream_cond);
+	g_mutex_unlock(&g_stream_lock);
+}
 
-					free(file);
-					free(conn);
+void urlio_set_concurrency(int per_host, int global, gboolean autotune) {
+	GHashTableIter iter;
+	gpointer value;
+
+	g_mutex_lock(&g_stream_lock);
+	init_concurrency();
+	if (per_host > 0)
+		g_host_streams_limit = MIN(per_host, HOST_STREAMS_MAX);
+	if (global > 0)
+		g_streams_limit = global;
+	g_autotune = autotune;
+
+	/* known hosts start over from the new limit */
+	if (g_hosts) {
+		g_hash_table_iter_init(&iter, g_hosts);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			struct host_streams *h = value;
+
+			h->limit = g_host_streams_limit;
+			h->step = 2;
+			h->last_rate = 0;
+			h->window_bytes = 0;
+			h->window_transfers = 0;
+		}
+	}
+	g_cond_broadcast(&g_stream_cond);
+	g_mutex_unlock(&g_stream_lock);
+}
 
-					file = NULL;
-				}
-			}
+void urlio_get_concurrency(int *per_host, int *global, gboolean *autotune) {
+	g_mutex_lock(&g_stream_lock);
+	init_concurrency();
+	if (per_host)
+		*per_host = g_host_streams_limit;
+	if (global)
+		*global = g_streams_limit;
+	if (autotune)
+		*autotune = g_autotune;
+	g_mutex_unlock(&g_stream_lock);
+}
 
-			conn->url = (char*) malloc((strlen(url) + 1) * sizeof(char));
-			strcpy(conn->url, url);
+/* one io slot of a fetch: a contiguous run of claimed bulks */
+struct bulk_run {
+	guint64 start; /* offset of the first bulk */
+	int count; /* number of bulks */
+};
 
-			if (g_urlio_count == 0)
-				g_urlio_list = (URLIO_CONN**) malloc(sizeof(URLIO_CONN*));
-			else
-				g_urlio_list = (URLIO_CONN**) realloc(g_urlio_list,
-						(g_urlio_count + 1) * sizeof(URLIO_CONN*));
-			g_urlio_list[g_urlio_count] = conn;
+static size_t bulk_size_at(URLIO_CONN *conn, guint64 id) {
+	return MIN(BULK_SIZE, conn->size - id);
+}
 
-			wanted_urlio_index = g_urlio_count;
-			g_urlio_count++;
+/* blocks for the bulks of a run, for curl to write into; FALSE if memory
+ * is short, the run then goes through the io buffer */
+static gboolean alloc_blocks(URLIO_CONN *conn, struct bulk_run *run,
+		URLIO_BLOCK **blocks) {
+	for (int b = 0; b < run->count; b++) {
+		URLIO_BLOCK *block = g_slice_new0(URLIO_BLOCK);
+
+		block->id = run->start + b * BULK_SIZE;
+		block->size = bulk_size_at(conn, block->id);
+		block->data = (char*) malloc(block->size);
+		if (!block->data) {
+			g_slice_free(URLIO_BLOCK, block);
+			while (b--) {
+				free(blocks[b]->data);
+				g_slice_free(URLIO_BLOCK, blocks[b]);
+				blocks[b] = NULL;
+			}
+			return FALSE;
 		}
-
-		file->handle.conn = g_urlio_list[wanted_urlio_index];
+		blocks[b] = block;
 	}
+	return TRUE;
+}
 
-	if (file) {
-		file->url = (char*) malloc((strlen(url) + 1) * sizeof(char));
-		strcpy(file->url, url);
-		file->pos = 0;
-	}
+static gint compare_double(gconstpointer a, gconstpointer b) {
+	double da = *(const double *) a;
+	double db = *(const double *) b;
 
-	return file;
+	return (da > db) - (da < db);
 }
 
-int urlio_fclose(URLIO_FILE *file) {
-#ifdef URLIO_VERBOSE
-	printf("fclose: %s\n", file->url);
-#endif
-	int ret = 0; /* default is good return */
+/* seconds after which a range of conn is hedged, 0 for never: the 95th
+ * percentile of the latencies of its recent ranges */
+static double hedge_delay(URLIO_CONN *conn) {
+	double sorted[HEDGE_SAMPLES];
+	gboolean hedge;
+	int n;
 
-	switch (file->type) {
-	case CFTYPE_FILE:
-		ret = fclose(file->handle.file); /* passthrough */
-		break;
+	get_timeout(&hedge);
+	if (!hedge)
+		return 0;
 
-	case CFTYPE_CURL:
-		/* make sure the easy handle is not in the multi handle anymore */
-		// curl_multi_remove_handle(file->handle.urlio->multi_handle, file->handle.curl);
-		/* cleanup */
-		// curl_easy_cleanup(file->handle.curl);
-		break;
+	g_mutex_lock(conn->lock);
+	n = conn->sample_count;
+	memcpy(sorted, conn->samples, n * sizeof(sorted[0]));
+	g_mutex_unlock(conn->lock);
 
-	default: /* unknown or supported type - oh dear */
-		ret = EOF;
-		errno = EBADF;
-		break;
-	}
+	if (n < HEDGE_MIN_SAMPLES)
+		return 0;
+	qsort(sorted, n, sizeof(sorted[0]), compare_double);
+	return MAX(sorted[n * 95 / 100], HEDGE_MIN_DELAY / 1000.0);
+}
 
-	// free(file->handle.urlio->buffer);/* free any allocated buffer space */
-	free(file->url);
-	free(file);
+static void add_sample(URLIO_CONN *conn, double latency) {
+	g_mutex_lock(conn->lock);
+	conn->samples[conn->sample_next] = latency;
+	conn->sample_next = (conn->sample_next + 1) % HEDGE_SAMPLES;
+	conn->sample_count = MIN(conn->sample_count + 1, HEDGE_SAMPLES);
+	g_mutex_unlock(conn->lock);
+}
 
-	return ret;
+/* whether a failed range is worth asking again; the server does not change
+ * its mind about a client error */
+static gboolean retryable(URLIO_IO *io) {
+	long code = io->response_code;
+
+	return code < 400 || code >= 500 || code == 408 || code == 429;
 }
 
-int urlio_feof(URLIO_FILE *file) {
-#ifdef URLIO_VERBOSE
-	printf("feof: %s\n", file->url);
-#endif
+/* fetch up to URLIO_MAX_SLOTS runs as parallel ranges over count streams
+ * taken by the caller, given back here; ranges which fail are requested
+ * again, RETRY_TIMES at most, after a backoff doubling from BACKOFF_BASE.
+ * Each successfully fetched bulk gets a new block in blocks[], indexed by
+ * its rank in the runs. */
+static void fetch_runs(URLIO_CONN *conn, struct bulk_run *runs, int count,
+		URLIO_BLOCK **blocks) {
+	int rank[URLIO_MAX_SLOTS]; /* in blocks[] of the head of each run */
+	int todo[URLIO_MAX_SLOTS]; /* runs still to fetch */
+	int todo_count = count;
+	guint64 bytes = 0;
+	gboolean throttled = FALSE;
+	double hedge_after = hedge_delay(conn);
+
+	for (int t = 0; t < count; t++) {
+		rank[t] = t ? rank[t - 1] + runs[t - 1].count : 0;
+		todo[t] = t;
+	}
 
-	int ret = 0;
+	for (int attempt = 0; todo_count; attempt++) {
+		URLIO_TRANSFER xfer;
+		GTimer *timer;
+		int failed = 0;
+		int timeouts = 0;
+		int interrupts = 0;
+		gboolean interrupted;
+
+		memset(&xfer, 0, sizeof(xfer));
+		xfer.interrupt = urlio_get_interrupt();
+		xfer.host = conn->host;
+
+		for (int t = 0; t < todo_count; t++) {
+			struct bulk_run *run = &runs[todo[t]];
+			guint64 last = run->start + (run->count - 1) * BULK_SIZE;
+			guint64 range_end = last + bulk_size_at(conn, last) - 1;
+			char range[64];
+
+			xfer.io[t].curl = get_handle();
+			/* also stops servers which ignore the range from sending it all */
+			xfer.io[t].limit = range_end + 1 - run->start;
+			xfer.io[t].hedge_after = hedge_after;
+			if (alloc_blocks(conn, run, &blocks[rank[todo[t]]]))
+				xfer.io[t].blocks = &blocks[rank[todo[t]]];
+
+			snprintf(range, sizeof(range), "%" G_GUINT64_FORMAT "-%"
+					G_GUINT64_FORMAT, run->start, range_end);
+
+			setup_io(conn, &xfer.io[t]);
+			curl_easy_setopt(xfer.io[t].curl, CURLOPT_RANGE, range);
+		}
 
-	switch (file->type) {
-	case CFTYPE_FILE:
-		ret = feof(file->handle.file);
-		break;
+		timer = g_timer_new();
+		SPAN_BEGIN("urlio transfer");
+		reactor_run(&xfer, todo_count);
+		SPAN_END("urlio transfer");
+		count_transfer(conn, &xfer, todo_count, timer);
+		g_timer_destroy(timer);
+		/* an interrupted reader retries nothing */
+		interrupted = urlio_interrupted(xfer.interrupt);
+
+		for (int t = 0; t < todo_count; t++) {
+			URLIO_IO *io = &xfer.io[t];
+			struct bulk_run *run = &runs[todo[t]];
+			long response_code = io->response_code;
+			gboolean ok;
+
+			/* a server which ignores the range answers 200 with the whole
+			 * stream, which is only usable when the range starts at 0 */
+			ok = io->buffer_pos >= io->limit
+					&& (response_code == 206 || run->start == 0);
+			bytes += io->buffer_pos;
+			if (response_code == 429 || response_code == 503)
+				throttled = TRUE;
+			if (io->result == CURLE_OPERATION_TIMEDOUT)
+				timeouts++;
+			if (io->result == CURLE_ABORTED_BY_CALLBACK)
+				interrupts++;
+
+			if (ok) {
+				add_sample(conn, io->latency);
+			} else if (!interrupted && attempt + 1 < RETRY_TIMES
+					&& retryable(io)) {
+				todo[failed++] = todo[t];
+			}
 
-	case CFTYPE_CURL:
-		for (int t = 0; t < THREAD_NUM; t++) {
-			if ((file->handle.conn->io[t].buffer_pos == 0)
-					&& (!file->handle.conn->still_running)) {
-				ret = 1;
+			for (int b = 0; io->blocks && b < run->count; b++) {
+				URLIO_BLOCK *block = io->blocks[b];
 
-				break;
+				if (ok) {
+					urlio_disk_write(conn->disk, block->data, block->id,
+							block->size);
+				} else {
+					free(block->data);
+					g_slice_free(URLIO_BLOCK, block);
+					io->blocks[b] = NULL;
+				}
+			}
+			for (int b = 0; ok && !io->blocks && b < run->count; b++) {
+				guint64 id = run->start + b * BULK_SIZE;
+				URLIO_BLOCK *block;
+
+				/* xfer data to the cache */
+				block = g_slice_new0(URLIO_BLOCK);
+				block->id = id;
+				block->size = bulk_size_at(conn, id);
+				block->data = (char*) malloc(block->size);
+				if (!block->data) {
+					g_slice_free(URLIO_BLOCK, block);
+					continue;
+				}
+				memcpy(block->data, io->buffer + (id - run->start),
+						block->size);
+				urlio_disk_write(conn->disk, block->data, id, block->size);
+				blocks[rank[todo[t]] + b] = block;
 			}
-		}
 
-		break;
+			/* keep the handle for the next fetch */
+			reset_io(&xfer, t);
+			put_io_handle(io);
+		}
 
-	default: /* unknown or supported type - oh dear */
-		ret = -1;
-		errno = EBADF;
-		break;
+		g_mutex_lock(conn->lock);
+		conn->stats.retries += failed;
+		conn->stats.timeouts += timeouts;
+		conn->stats.interrupts += interrupts;
+		g_mutex_unlock(conn->lock);
+
+		todo_count = failed;
+		if (todo_count) {
+			/* with jitter, so that the retries of many readers spread */
+			guint backoff = BACKOFF_BASE << attempt;
+			g_usleep((backoff + g_random_int_range(0, backoff)) * 1000);
+		}
 	}
-	return ret;
+
+	release_streams(conn, count, bytes, throttled);
 }
 
-size_t urlio_fread(void *ptr, size_t size, size_t nmemb, URLIO_FILE *file) {
-	size_t wanted;
+/* index a claimed bulk, or NULL if its fetch failed, and wake its waiters;
+ * called with g_cache_lock held */
+static void complete_fetch(URLIO_CACHE *cache, guint64 id, URLIO_BLOCK *block) {
+	URLIO_FETCH *fetch = g_hash_table_lookup(cache->fetches, &id);
 
-	switch (file->type) {
-	case CFTYPE_FILE:
-#ifdef URLIO_VERBOSE
+	if (block)
+		put_block(cache, block);
 
-		printf("fread: reading %lu byte(s) from position %ld\n", size * nmemb,
-				ftell(file->handle.file));
-#endif
+	g_hash_table_remove(cache->fetches, &id);
+	fetch->done = TRUE;
+	fetch->ok = block != NULL;
+	g_cond_broadcast(fetch->cond);
+	fetch_unref(fetch);
+}
 
-		wanted = fread(ptr, size, nmemb, file->handle.file);
-		file->pos += wanted * size;
-		break;
+/* fetch the claimed bulks ids[0..n), sorted by offset, from the disk store or
+ * else the network; index them, release their claims and return a new
+ * reference on each of them, or NULL in blocks[] for those which failed.
+ * Bulks are published as each transfer completes, so that readers waiting
+ * on the first ones go on while the later ones are still in flight. */
+static void fetch_claimed(URLIO_CONN *conn, URLIO_CACHE *cache,
+		const guint64 *ids, int n, URLIO_BLOCK **blocks) {
+	struct bulk_run *runs = g_new(struct bulk_run, n);
+	int *run_rank = g_new(int, n); /* rank in blocks[] of the head of a run */
+	int run_count = 0;
+	int disk_hits = 0;
+
+	/* disk first, then gather what remains into runs */
+	for (int i = 0; i < n; i++) {
+		URLIO_BLOCK *block = NULL;
+		size_t size = bulk_size_at(conn, ids[i]);
+		char *data = (char*) malloc(size);
+
+		blocks[i] = NULL;
+		if (data && urlio_disk_read(conn->disk, data, ids[i], size)) {
+			block = g_slice_new0(URLIO_BLOCK);
+			block->id = ids[i];
+			block->size = size;
+			block->data = data;
+			blocks[i] = block;
+			disk_hits++;
+			continue;
+		}
+		free(data);
 
-	case CFTYPE_CURL:
-#ifdef URLIO_VERBOSE
-		printf("fread: reading %lu byte(s) from position %ld\n", size * nmemb,
-				file->pos);
-#endif
-		wanted = size * nmemb;
-		int copied = download(ptr, file->pos, wanted, file->handle.conn);
-		file->pos += copied;
-		wanted = copied / size;
-		break;
+		if (run_count && runs[run_count - 1].count < SLOT_BULKS
+				&& run_rank[run_count - 1] + runs[run_count - 1].count == i
+				&& runs[run_count - 1].start
+						+ runs[run_count - 1].count * BULK_SIZE == ids[i]) {
+			runs[run_count - 1].count++;
+		} else {
+			runs[run_count].start = ids[i];
+			runs[run_count].count = 1;
+			run_rank[run_count] = i;
+			run_count++;
+		}
+	}
 
-	default: /* unknown or supported type - oh dear */
-		wanted = 0L;
-		errno = EBADF;
-		break;
+	g_mutex_lock(&g_cache_lock);
+	for (int i = 0; i < n; i++) {
+		if (blocks[i])
+			complete_fetch(cache, ids[i], blocks[i]);
 	}
+	g_mutex_unlock(&g_cache_lock);
+	count_blocks(conn, 0, 0, 0, disk_hits);
+
+	/* issue the runs as many at a time as there are streams free; when
+	 * there are fewer runs than streams, split the longest ones so that
+	 * the streams are used */
+	for (int r = 0; r < run_count;) {
+		struct bulk_run slots[URLIO_MAX_SLOTS];
+		int slot_rank[URLIO_MAX_SLOTS];
+		int slot_count = 0;
+		URLIO_BLOCK *fetched[URLIO_MAX_SLOTS * SLOT_BULKS];
+		int fetched_count = 0;
+		int remaining = 0;
+		int streams;
+
+		for (int q = r; q < run_count; q++)
+			remaining += runs[q].count;
+		streams = acquire_streams(conn, MIN(remaining, URLIO_MAX_SLOTS));
+		if (!streams) {
+			/* interrupted: whoever waits on the rest fetches them */
+			g_mutex_lock(&g_cache_lock);
+			for (; r < run_count; r++) {
+				for (int b = 0; b < runs[r].count; b++)
+					complete_fetch(cache, ids[run_rank[r] + b], NULL);
+			}
+			g_mutex_unlock(&g_cache_lock);
+			break;
+		}
 
-#ifdef URLIO_VERBOSE
-	printf("data: ");
+		for (; r < run_count && slot_count < streams; r++) {
+			slots[slot_count] = runs[r];
+			slot_rank[slot_count] = run_rank[r];
+			slot_count++;
+		}
+		for (;;) {
+			int longest = 0;
 
-	for (size_t i = 0; i < (wanted * size > READ_LOG_LENGTH ?
-	READ_LOG_LENGTH :
-																wanted * size);
-			i++)
-		printf("0x%02hX ", (unsigned char) *((char*) ptr + i));
+			for (int s = 1; s < slot_count; s++) {
+				if (slots[s].count > slots[longest].count)
+					longest = s;
+			}
+			if (slot_count == streams || slots[longest].count < 2)
+				break;
 
-	printf("\n");
-#endif
+			/* keep the slots sorted by rank, the split half goes right
+			 * after its origin */
+			memmove(&slots[longest + 2], &slots[longest + 1],
+					(slot_count - longest - 1) * sizeof(slots[0]));
+			memmove(&slot_rank[longest + 2], &slot_rank[longest + 1],
+					(slot_count - longest - 1) * sizeof(slot_rank[0]));
+			slots[longest + 1].count = slots[longest].count / 2;
+			slots[longest].count -= slots[longest + 1].count;
+			slots[longest + 1].start = slots[longest].start
+					+ slots[longest].count * BULK_SIZE;
+			slot_rank[longest + 1] = slot_rank[longest] + slots[longest].count;
+			slot_count++;
+		}
+
+		/* give back what the runs could not use */
+		if (slot_count < streams)
+			release_streams(conn, streams - slot_count, 0, FALSE);
+
+		memset(fetched, 0, sizeof(fetched));
+		fetch_runs(conn, slots, slot_count, fetched);
+
+		g_mutex_lock(&g_cache_lock);
+		for (int s = 0; s < slot_count; s++) {
+			for (int b = 0; b < slots[s].count; b++) {
+				int rank = slot_rank[s] + b;
 
-	return wanted;
+				blocks[rank] = fetched[fetched_count++];
+				complete_fetch(cache, ids[rank], blocks[rank]);
+			}
+		}
+		g_mutex_unlock(&g_cache_lock);
+	}
+
+	g_free(run_rank);
+	g_free(runs);
 }
 
-char *urlio_fgets(char *ptr, size_t size, URLIO_FILE *file) {
-	size_t wanted = size - 1; /* always need to leave room for zero termination */
-	size_t loop;
-	char *buf;
-	size_t copied;
+/* claim a bulk nobody holds or fetches, the caller must fetch it */
+static void claim_bulk(URLIO_CACHE *cache, guint64 id) {
+	URLIO_FETCH *fetch = g_slice_new0(URLIO_FETCH);
 
-#ifdef URLIO_VERBOSE
-	printf("fgets: from position %ld read %zu byte(s)\n", file->pos, size);
-#endif
+	fetch->id = id;
+	fetch->refcount = 1;
+	fetch->cond = g_cond_new();
+	g_hash_table_insert(cache->fetches, &fetch->id, fetch);
+}
 
-	switch (file->type) {
-	case CFTYPE_FILE:
-		ptr = fgets(ptr, (int) size, file->handle.file);
-		file->pos += size;
-		break;
+static void prefetch_claimed(URLIO_CONN *conn, URLIO_CACHE *cache,
+		guint64 *ids, int count, int tag);
+
+/* take a reference on each of the blocks covering [pos, pos + len), which
+ * the caller checked is within the stream, fetching the missing bulks;
+ * bulks in flight elsewhere are waited for. Returns the *count blocks, NULL
+ * for those whose fetch failed; *retry is set if one of the fetches waited
+ * for was given up rather than failed, or its block evicted meanwhile.
+ * The readahead bytes after the range are fetched along with a miss, or in
+ * the background when the range needs no fetch. */
+static URLIO_BLOCK **cache_blocks(URLIO_CONN *conn, guint64 pos, size_t len,
+		guint64 readahead, gboolean *retry, int *count) {
+	const URLIO_INTERRUPT *interrupt = urlio_get_interrupt();
+	URLIO_CACHE *cache;
+	guint64 first;
+	int n;
+	URLIO_BLOCK **blocks;
+	URLIO_FETCH **waits;
+	guint64 *claimed;
+	int *claimed_index;
+	URLIO_BLOCK **claimed_blocks;
+	int claimed_count = 0;
+	int ahead_count = 0;
+	int ahead_n;
+	int hits = 0;
+	int waits_count = 0;
+
+	readahead = MIN(readahead, conn->size - pos - len);
+
+	first = pos / BULK_SIZE;
+	n = (pos + len - 1) / BULK_SIZE - first + 1;
+	ahead_n = readahead ? (pos + len + readahead - 1) / BULK_SIZE - first + 1
+			- n : 0;
+	blocks = g_new0(URLIO_BLOCK *, n);
+	waits = g_new0(URLIO_FETCH *, n);
+	claimed = g_new(guint64, n + ahead_n);
+	claimed_index = g_new(int, n);
+	claimed_blocks = g_new(URLIO_BLOCK *, n + ahead_n);
+
+	if (!g_mutex_trylock(&g_cache_lock)) {
+		SPAN_BEGIN("urlio cache lock");
+		g_mutex_lock(&g_cache_lock);
+		SPAN_END("urlio cache lock");
+	}
+	cache = get_cache(conn->url);
+	for (int i = 0; i < n; i++) {
+		guint64 id = (first + i) * BULK_SIZE;
+		URLIO_FETCH *fetch;
+
+		blocks[i] = get_block(cache, id);
+		if (blocks[i]) {
+			hits++;
+			continue;
+		}
+
+		fetch = g_hash_table_lookup(cache->fetches, &id);
+		if (fetch) {
+			/* somebody is fetching this bulk already: wait for it */
+			fetch->refcount++;
+			waits[i] = fetch;
+			waits_count++;
+		} else {
+			claim_bulk(cache, id);
+			claimed[claimed_count] = id;
+			claimed_index[claimed_count] = i;
+			claimed_count++;
+		}
+	}
+	/* what the reader is expected to want next, after the claims so that
+	 * the ids stay sorted */
+	for (int i = n; i < n + ahead_n; i++) {
+		guint64 id = (first + i) * BULK_SIZE;
+
+		if (g_hash_table_lookup(cache->bulks, &id)
+				|| g_hash_table_lookup(cache->fetches, &id))
+			continue;
+		claim_bulk(cache, id);
+		claimed[claimed_count + ahead_count] = id;
+		ahead_count++;
+	}
+	g_mutex_unlock(&g_cache_lock);
+	count_blocks(conn, hits, waits_count, claimed_count, 0);
+
+	if (claimed_count) {
+		/* without the lock, so that other bulks are served meanwhile */
+		SPAN_BEGIN("urlio fetch");
+		fetch_claimed(conn, cache, claimed, claimed_count + ahead_count,
+				claimed_blocks);
+		SPAN_END("urlio fetch");
+		for (int c = 0; c < claimed_count; c++)
+			blocks[claimed_index[c]] = claimed_blocks[c];
+		for (int c = claimed_count; c < claimed_count + ahead_count; c++) {
+			if (claimed_blocks[c])
+				block_unref(claimed_blocks[c]);
+		}
+	} else if (ahead_count) {
+		prefetch_claimed(conn, cache, g_memdup(claimed,
+				ahead_count * sizeof(guint64)), ahead_count, 0);
+	}
+
+	if (waits_count)
+		SPAN_BEGIN("urlio wait");
+	g_mutex_lock(&g_cache_lock);
+	for (int i = 0; i < n; i++) {
+		if (!waits[i])
+			continue;
+		while (!waits[i]->done
+				&& interruptible_wait(waits[i]->cond, &g_cache_lock,
+						interrupt))
+			;
+		if (!waits[i]->done) {
+			/* interrupted, the fetch goes on for the others */
+			fetch_unref(waits[i]);
+			continue;
+		}
+		if (!waits[i]->ok)
+			*retry = TRUE;
+		fetch_unref(waits[i]);
+		blocks[i] = get_block(cache, (first + i) * BULK_SIZE);
+		/* fetched, but evicted before we got here */
+		if (!blocks[i])
+			*retry = TRUE;
+	}
+	g_mutex_unlock(&g_cache_lock);
+	if (waits_count)
+		SPAN_END("urlio wait");
+
+	g_free(claimed_blocks);
+	g_free(claimed_index);
+	g_free(claimed);
+	g_free(waits);
+
+	*count = n;
+	return blocks;
+}
+
+/* copy what the cache can give of [pos, pos + len) into ptr. Returns the
+ * number of bytes copied from pos on, short if a fetch failed; *retry as
+ * for cache_blocks(). */
+static size_t cache_range(URLIO_CONN *conn, char *ptr, guint64 pos,
+		size_t len, guint64 readahead, gboolean *retry) {
+	URLIO_BLOCK **blocks;
+	guint64 first = pos / BULK_SIZE;
+	size_t copied = 0;
+	int n;
+
+	if (pos >= conn->size || !len)
+		return 0;
+	len = MIN(len, conn->size - pos);
+	blocks = cache_blocks(conn, pos, len, readahead, retry, &n);
+
+	/* xfer data to caller, the references keep the blocks alive even if
+	 * they are evicted meanwhile */
+	for (int i = 0; i < n; i++) {
+		guint64 id = (first + i) * BULK_SIZE;
+		size_t copy_ptr = (i == 0) ? pos - id : 0;
+		size_t copy_size;
+
+		if (!blocks[i])
+			break;
+		copy_size = MIN(blocks[i]->size - copy_ptr, len - copied);
+		memcpy(ptr + copied, blocks[i]->data + copy_ptr, copy_size);
+		copied += copy_size;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (blocks[i])
+			block_unref(blocks[i]);
+	}
+	g_free(blocks);
+
+	return copied;
+}
+
+/* classify a read at pos of len bytes and return how many bytes to read
+ * ahead; for strided reads *stride_next is set to the start of the next
+ * stride instead. The caller serializes the reads of access. */
+static guint64 classify_read(URLIO_ACCESS *access, guint64 pos, size_t len,
+		guint64 *stride_next) {
+	gint64 delta = (gint64) (pos - access->last_pos);
+	guint64 readahead = 0;
+
+	*stride_next = 0;
+	if (access->streak && pos >= access->last_end
+			&& pos <= access->last_end + BULK_SIZE) {
+		/* reading on: double the readahead while it keeps up */
+		if (access->pattern != URLIO_PATTERN_SEQUENTIAL) {
+			access->pattern = URLIO_PATTERN_SEQUENTIAL;
+			access->readahead = 0;
+		}
+		access->readahead = CLAMP(access->readahead * 2, READAHEAD_MIN,
+				READAHEAD_MAX);
+		readahead = access->readahead;
+	} else if (access->streak && delta && delta == access->stride) {
+		access->pattern = URLIO_PATTERN_STRIDED;
+		access->readahead = 0;
+		*stride_next = pos + delta;
+	} else {
+		access->pattern = URLIO_PATTERN_RANDOM;
+		access->readahead = 0;
+	}
+	access->stride = delta;
+	access->last_pos = pos;
+	access->last_end = pos + len;
+	access->streak = 1;
+
+	return readahead;
+}
+
+/* classify a read of a remote handle and return how many bytes to read
+ * ahead; strided reads get their next stride prefetched instead */
+static guint64 observe_read(URLIO_FILE *file, guint64 pos, size_t len) {
+	URLIO_CONN *conn = file->handle.conn;
+	guint64 readahead;
+	guint64 stride_next;
+
+	g_mutex_lock(conn->lock);
+	readahead = classify_read(&file->access, pos, len, &stride_next);
+	conn->stats.pattern_reads[file->access.pattern]++;
+	conn->stats.readahead_bytes += readahead;
+	g_mutex_unlock(conn->lock);
+
+	if (stride_next)
+		urlio_prefetch(file, stride_next, len, 0);
+
+	return readahead;
+}
+
+/* the access patterns of mapped files, guarded by g_map_access_lock */
+static GMutex g_map_access_lock;
+
+/* the same for a mapped file, whose readahead is a hint to the kernel;
+ * a sequential reader is hinted again once it went through half of it */
+static void observe_map_read(URLIO_FILE *file, guint64 pos, size_t len) {
+	URLIO_ACCESS *access = &file->access;
+	guint64 readahead;
+	guint64 stride_next;
+	guint64 advise_from = 0;
+
+	g_mutex_lock(&g_map_access_lock);
+	readahead = classify_read(access, pos, len, &stride_next);
+	if (readahead && pos + len + readahead / 2 > access->advised) {
+		advise_from = MAX(pos + len, access->advised);
+		access->advised = pos + len + readahead;
+	}
+	g_mutex_unlock(&g_map_access_lock);
+
+	if (advise_from)
+		urlio_map_willneed(file->map, advise_from,
+				pos + len + readahead - advise_from);
+	if (stride_next)
+		urlio_map_willneed(file->map, stride_next, len);
+}
+
+/* copy up to len bytes at pos of a mapped file */
+static size_t map_read(URLIO_FILE *file, void *ptr, guint64 pos, size_t len) {
+	guint64 size = urlio_map_size(file->map);
+
+	if (pos >= size)
+		return 0;
+	len = MIN(len, size - pos);
+	memcpy(ptr, urlio_map_data(file->map) + pos, len);
+	return len;
+}
+
+static size_t download(URLIO_FILE *file, void *ptr, size_t pos,
+		size_t wanted) {
+	URLIO_CONN *conn = file->handle.conn;
+	guint64 readahead;
+	size_t copied = 0;
+
+	/* a mirrored stream is read like a local file */
+	if (g_atomic_int_get(&conn->mirrored) && pos < conn->size) {
+		size_t len = MIN(wanted, conn->size - pos);
+
+		if (urlio_disk_read(conn->disk, ptr, pos, len)) {
+			g_mutex_lock(conn->lock);
+			conn->stats.bytes_served += len;
+			g_mutex_unlock(conn->lock);
+			return len;
+		}
+	}
+
+	readahead = observe_read(file, pos, wanted);
+
+	/* a bulk waited for may be evicted before we get to it, or its fetch
+	 * cancelled: look again, unless the reader was interrupted */
+	while (copied < wanted) {
+		gboolean retry = FALSE;
+		size_t got = cache_range(conn, (char*) ptr + copied, pos + copied,
+				wanted - copied, readahead, &retry);
+		copied += got;
+		if ((!got && !retry) || urlio_interrupted(urlio_get_interrupt()))
+			break;
+	}
+
+	g_mutex_lock(conn->lock);
+	conn->stats.bytes_served += copied;
+	g_mutex_unlock(conn->lock);
+
+	return copied;
+}
+
+/* lend a range within one block of a remote stream */
+static URLIO_VIEW *remote_view(URLIO_FILE *file, guint64 offset, size_t len) {
+	URLIO_CONN *conn = file->handle.conn;
+	URLIO_VIEW *view;
+	URLIO_BLOCK *block = NULL;
+	guint64 readahead;
+
+	if (!len || offset + len > conn->size
+			|| offset / BULK_SIZE != (offset + len - 1) / BULK_SIZE)
+		return NULL;
+
+	/* as in download(), a bulk waited for may be gone */
+	readahead = observe_read(file, offset, len);
+	for (;;) {
+		gboolean retry = FALSE;
+		URLIO_BLOCK **blocks;
+		int n;
+
+		blocks = cache_blocks(conn, offset, len, readahead, &retry, &n);
+		block = blocks[0];
+		g_free(blocks);
+		if (block || !retry || urlio_interrupted(urlio_get_interrupt()))
+			break;
+	}
+	if (!block)
+		return NULL;
+
+	view = g_slice_new0(URLIO_VIEW);
+	view->block = block;
+	view->data = block->data + (offset - block->id);
+	view->len = len;
+	g_mutex_lock(conn->lock);
+	conn->stats.bytes_served += len;
+	g_mutex_unlock(conn->lock);
+	return view;
+}
+
+URLIO_VIEW *urlio_read_view(URLIO_FILE *file, guint64 offset, size_t len) {
+	URLIO_VIEW *view = NULL;
+
+	if (file->backend->view)
+		view = file->backend->view(file, offset, len);
+	if (view)
+		return view;
+
+	/* a copy */
+	view = g_slice_new0(URLIO_VIEW);
+	view->copy = g_malloc(MAX(len, 1));
+	if (len && urlio_pread(file, view->copy, len, offset) != len) {
+		g_free(view->copy);
+		g_slice_free(URLIO_VIEW, view);
+		return NULL;
+	}
+	view->data = view->copy;
+	view->len = len;
+	return view;
+}
+
+void urlio_view_release(URLIO_VIEW *view) {
+	if (!view)
+		return;
+	if (view->block)
+		block_unref(view->block);
+	urlio_map_unref(view->map);
+	g_free(view->copy);
+	g_slice_free(URLIO_VIEW, view);
+}
+
+/* prefetching: claims are taken by the caller, the fetches run on a small
+ * pool of threads so that the caller doesn't wait.  The pool is urlio's own
+ * rather than the library's work pool: its jobs block on transfers, and the
+ * work pool, or an executor of the application, is sized for processors */
+struct prefetch_job {
+	URLIO_CONN *conn;
+	URLIO_CACHE *cache;
+	guint64 *ids;
+	int count;
+	int tag;
+	gboolean cancelled;
+};
+
+/* jobs not started yet, guarded by g_cache_lock */
+static GQueue g_prefetch_jobs = G_QUEUE_INIT;
+
+/* give up claims without fetching; readers waiting on them fetch themselves */
+static void release_claims(URLIO_CACHE *cache, const guint64 *ids, int n) {
+	g_mutex_lock(&g_cache_lock);
+	for (int i = 0; i < n; i++)
+		complete_fetch(cache, ids[i], NULL);
+	g_mutex_unlock(&g_cache_lock);
+}
+
+static void prefetch_job_run(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+	struct prefetch_job *job = data;
+	URLIO_BLOCK **blocks;
+	gboolean cancelled;
+
+	g_mutex_lock(&g_cache_lock);
+	g_queue_remove(&g_prefetch_jobs, job);
+	cancelled = job->cancelled;
+	g_mutex_unlock(&g_cache_lock);
+
+	if (cancelled) {
+		release_claims(job->cache, job->ids, job->count);
+		g_free(job->ids);
+		g_slice_free(struct prefetch_job, job);
+		return;
+	}
+
+	blocks = g_new(URLIO_BLOCK *, job->count);
+	fetch_claimed(job->conn, job->cache, job->ids, job->count, blocks);
+	for (int i = 0; i < job->count; i++) {
+		if (blocks[i])
+			block_unref(blocks[i]);
+	}
+
+	g_free(blocks);
+	g_free(job->ids);
+	g_slice_free(struct prefetch_job, job);
+}
+
+static gpointer prefetch_pool_init(gpointer data G_GNUC_UNUSED) {
+	return g_thread_pool_new(prefetch_job_run, NULL, PREFETCH_THREADS, FALSE,
+			NULL);
+}
+
+/* fetch claimed bulks in the background, taking ownership of ids */
+static void prefetch_claimed(URLIO_CONN *conn, URLIO_CACHE *cache,
+		guint64 *ids, int count, int tag) {
+	static GOnce pool_once = G_ONCE_INIT;
+	struct prefetch_job *job;
+	GThreadPool *pool;
+
+	if (!count) {
+		g_free(ids);
+		return;
+	}
+
+	job = g_slice_new0(struct prefetch_job);
+	job->conn = conn;
+	job->cache = cache;
+	job->ids = ids;
+	job->count = count;
+	job->tag = tag;
+
+	g_mutex_lock(&g_cache_lock);
+	g_queue_push_tail(&g_prefetch_jobs, job);
+	g_mutex_unlock(&g_cache_lock);
+
+	pool = g_once(&pool_once, prefetch_pool_init, NULL);
+	g_thread_pool_push(pool, job, NULL);
+}
+
+void urlio_prefetch(URLIO_FILE *file, guint64 offset, guint64 len, int tag) {
+	URLIO_CONN *conn;
+	URLIO_CACHE *cache;
+	guint64 *ids;
+	int count = 0;
+	guint64 first;
+	guint64 last;
+
+	if (file->type != CFTYPE_CURL || !len)
+		return;
+	conn = file->handle.conn;
+	if (offset >= conn->size)
+		return;
+	len = MIN(len, conn->size - offset);
+
+	first = offset / BULK_SIZE;
+	last = (offset + len - 1) / BULK_SIZE;
+
+	ids = g_new(guint64, last - first + 1);
+
+	g_mutex_lock(&g_cache_lock);
+	cache = get_cache(conn->url);
+	for (guint64 b = first; b <= last; b++) {
+		guint64 id = b * BULK_SIZE;
+
+		/* present or in flight already */
+		if (g_hash_table_lookup(cache->bulks, &id)
+				|| g_hash_table_lookup(cache->fetches, &id))
+			continue;
+		claim_bulk(cache, id);
+		ids[count++] = id;
+	}
+	g_mutex_unlock(&g_cache_lock);
+
+	prefetch_claimed(conn, cache, ids, count, tag);
+}
+
+static gint compare_guint64(gconstpointer a, gconstpointer b) {
+	guint64 ia = *(const guint64 *) a;
+	guint64 ib = *(const guint64 *) b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+void urlio_fetch_ranges(URLIO_FILE *file, const guint64 *offsets,
+		const guint64 *lens, int n) {
+	URLIO_CONN *conn;
+	URLIO_CACHE *cache;
+	GArray *wanted;
+	GArray *ids;
+	URLIO_BLOCK **blocks;
+
+	if (file->type != CFTYPE_CURL)
+		return;
+	conn = file->handle.conn;
+
+	/* bulks of all the ranges, sorted and unique */
+	wanted = g_array_new(FALSE, FALSE, sizeof(guint64));
+	for (int i = 0; i < n; i++) {
+		guint64 end;
+
+		if (!lens[i] || offsets[i] >= conn->size)
+			continue;
+		end = MIN(offsets[i] + lens[i], conn->size);
+		for (guint64 id = offsets[i] / BULK_SIZE * BULK_SIZE; id < end;
+				id += BULK_SIZE)
+			g_array_append_val(wanted, id);
+	}
+	g_array_sort(wanted, compare_guint64);
+
+	ids = g_array_new(FALSE, FALSE, sizeof(guint64));
+	g_mutex_lock(&g_cache_lock);
+	cache = get_cache(conn->url);
+	for (guint i = 0; i < wanted->len; i++) {
+		guint64 id = g_array_index(wanted, guint64, i);
+
+		if (i && id == g_array_index(wanted, guint64, i - 1))
+			continue;
+		/* present or in flight already */
+		if (g_hash_table_lookup(cache->bulks, &id)
+				|| g_hash_table_lookup(cache->fetches, &id))
+			continue;
+		claim_bulk(cache, id);
+		g_array_append_val(ids, id);
+	}
+	g_mutex_unlock(&g_cache_lock);
+
+	if (ids->len) {
+		blocks = g_new(URLIO_BLOCK *, ids->len);
+		fetch_claimed(conn, cache, (guint64 *) ids->data, ids->len, blocks);
+		for (guint i = 0; i < ids->len; i++) {
+			if (blocks[i])
+				block_unref(blocks[i]);
+		}
+		g_free(blocks);
+	}
+
+	g_array_free(ids, TRUE);
+	g_array_free(wanted, TRUE);
+}
+
+/* the stream opened for url, or NULL */
+static URLIO_CONN *find_conn(const char *url) {
+	URLIO_CONN *conn = NULL;
+
+	g_mutex_lock(&g_urlio_lock);
+	if (g_urlio_table)
+		conn = g_hash_table_lookup(g_urlio_table, url);
+	g_mutex_unlock(&g_urlio_lock);
+	return conn;
+}
+
+gboolean urlio_get_stats(const char *url, URLIO_STATS *stats) {
+	URLIO_CONN *conn = find_conn(url);
+
+	if (!conn)
+		return FALSE;
+	g_mutex_lock(conn->lock);
+	*stats = conn->stats;
+	g_mutex_unlock(conn->lock);
+	return TRUE;
+}
+
+void urlio_get_total_stats(URLIO_STATS *stats) {
+	GHashTableIter iter;
+	gpointer value;
+
+	memset(stats, 0, sizeof(*stats));
+	g_mutex_lock(&g_urlio_lock);
+	if (g_urlio_table)
+		g_hash_table_iter_init(&iter, g_urlio_table);
+	while (g_urlio_table && g_hash_table_iter_next(&iter, NULL, &value)) {
+		URLIO_CONN *conn = value;
+		guint64 *sum = (guint64*) stats;
+		const guint64 *cur = (const guint64*) &conn->stats;
+
+		/* every counter is a guint64 */
+		g_mutex_lock(conn->lock);
+		for (size_t j = 0; j < sizeof(*stats) / sizeof(guint64); j++)
+			sum[j] += cur[j];
+		g_mutex_unlock(conn->lock);
+	}
+	g_mutex_unlock(&g_urlio_lock);
+}
+
+gint urlio_get_round_trips(const char *url) {
+	URLIO_STATS stats;
+
+	if (!urlio_get_stats(url, &stats))
+		return -1;
+	return stats.round_trips;
+}
+
+void urlio_prefetch_cancel(int tag) {
+	g_mutex_lock(&g_cache_lock);
+	for (GList *link = g_prefetch_jobs.head; link; link = link->next) {
+		struct prefetch_job *job = link->data;
+
+		if (job->tag == tag)
+			job->cancelled = TRUE;
+	}
+	g_mutex_unlock(&g_cache_lock);
+}
+
+/* mirroring: hot streams are copied whole to the disk store by one
+ * background thread, a slot at a time and only while their host is idle,
+ * after which they are read from disk alone */
+enum {
+	MIRROR_NONE, MIRROR_QUEUED, MIRROR_DONE
+};
+
+/* thresholds, a negative fraction until configured, and the streams to
+ * mirror; guarded by g_mirror_lock */
+static double g_mirror_fraction = -1;
+static double g_mirror_rate = 0;
+static GQueue g_mirror_queue = G_QUEUE_INIT;
+static gboolean g_mirror_started = FALSE;
+static GMutex g_mirror_lock;
+static GCond g_mirror_cond;
+
+static void init_mirror(void) {
+	const char *env;
+
+	if (g_mirror_fraction >= 0)
+		return;
+
+	g_mirror_fraction = 0;
+	env = g_getenv(MIRROR_ENV_VAR);
+	if (env)
+		g_mirror_fraction = MAX(g_ascii_strtod(env, NULL), 0);
+	env = g_getenv(MIRROR_RATE_ENV_VAR);
+	if (env)
+		g_mirror_rate = MAX(g_ascii_strtod(env, NULL), 0);
+}
+
+void urlio_set_mirror(double fraction, double rate) {
+	g_mutex_lock(&g_mirror_lock);
+	g_mirror_fraction = MAX(fraction, 0);
+	g_mirror_rate = MAX(rate, 0);
+	g_mutex_unlock(&g_mirror_lock);
+}
+
+static void mirror_conn(URLIO_CONN *conn) {
+	const guint64 chunk = SLOT_BULKS * BULK_SIZE;
+
+	for (guint64 start = 0; start < conn->size; start += chunk) {
+		struct bulk_run run;
+		URLIO_BLOCK *blocks[SLOT_BULKS];
+		size_t len = MIN(chunk, conn->size - start);
+		gboolean ok = TRUE;
+
+		if (urlio_disk_has(conn->disk, start, len))
+			continue;
+
+		/* foreground reads of the host go first */
+		while (!acquire_idle_stream(conn))
+			g_usleep(MIRROR_PAUSE * 1000);
+
+		run.start = start;
+		run.count = (len + BULK_SIZE - 1) / BULK_SIZE;
+		memset(blocks, 0, sizeof(blocks));
+		fetch_runs(conn, &run, 1, blocks);
+
+		/* the data is on disk now, the memory cache is left alone */
+		for (int b = 0; b < run.count; b++) {
+			if (!blocks[b]) {
+				ok = FALSE;
+				continue;
+			}
+			free(blocks[b]->data);
+			g_slice_free(URLIO_BLOCK, blocks[b]);
+		}
+		if (!ok)
+			return;
+
+		g_mutex_lock(conn->lock);
+		conn->stats.mirror_bytes += len;
+		g_mutex_unlock(conn->lock);
+	}
+
+	if (urlio_disk_has(conn->disk, 0, conn->size)) {
+		g_atomic_int_set(&conn->mirrored, 1);
+		if (g_trace)
+			g_message("urlio: %s: mirrored to disk", conn->url);
+	}
+}
+
+static gpointer mirror_main(gpointer data G_GNUC_UNUSED) {
+	for (;;) {
+		URLIO_CONN *conn;
+
+		g_mutex_lock(&g_mirror_lock);
+		while (!(conn = g_queue_pop_head(&g_mirror_queue)))
+			g_cond_wait(&g_mirror_cond, &g_mirror_lock);
+		g_mutex_unlock(&g_mirror_lock);
+
+		mirror_conn(conn);
+
+		g_mutex_lock(&g_mirror_lock);
+		conn->mirror = MIRROR_DONE;
+		g_mutex_unlock(&g_mirror_lock);
+	}
+
+	return NULL;
+}
+
+/* queue conn for mirroring once it turned hot */
+static void maybe_mirror(URLIO_CONN *conn) {
+	guint64 fetched;
+	guint64 requests;
+	double elapsed;
+	gboolean hot;
+
+	if (!conn->disk || conn->mirror != MIRROR_NONE)
+		return;
+
+	g_mutex_lock(conn->lock);
+	fetched = conn->stats.bytes_fetched;
+	requests = conn->stats.requests;
+	g_mutex_unlock(conn->lock);
+	elapsed = g_timer_elapsed(conn->opened, NULL);
+
+	g_mutex_lock(&g_mirror_lock);
+	init_mirror();
+	hot = (g_mirror_fraction && fetched >= g_mirror_fraction * conn->size)
+			|| (g_mirror_rate && elapsed >= 1
+					&& requests / elapsed >= g_mirror_rate);
+	if (hot && conn->mirror == MIRROR_NONE) {
+		conn->mirror = MIRROR_QUEUED;
+		g_queue_push_tail(&g_mirror_queue, conn);
+		g_cond_signal(&g_mirror_cond);
+		if (!g_mirror_started) {
+			g_mirror_started = TRUE;
+			if (g_thread_create(mirror_main, NULL, FALSE, NULL) == NULL)
+				fprintf(stderr, "could not start the urlio mirror\n");
+		}
+	}
+	g_mutex_unlock(&g_mirror_lock);
+}
 
-//	case CFTYPE_CURL:
-//		fill_buffer(file, want);
-//
-//		/* check if there's data in the buffer - if not fill either error or
-//		 * EOF */
-//		if (!file->handle.urlio->buffer_pos)
-//			return NULL;
-//
-//		/* ensure only available data is considered */
-//		if (file->handle.urlio->buffer_pos < want)
-//			want = file->handle.urlio->buffer_pos;
-//
-//		/*buffer contains data */
-//		/* look for newline or eof */
-//		for (loop = 0; loop < want; loop++) {
-//			if (file->handle.urlio->buffer[loop] == '\n') {
-//				want = loop + 1;/* include newline */
-//				break;
-//			}
-//		}
-//
-//		/* xfer data to caller */
-//		memcpy(ptr, file->handle.urlio->buffer, want);
-//		ptr[want] = 0; /* always null terminate */
-//
-//		use_buffer(file, want);
-//		file->pos += size;
-	case CFTYPE_CURL:
-		buf = (char*) malloc(size * sizeof(char));
-		copied = download(buf, file->pos, wanted, file->handle.conn);
-
-		for (loop = 0; loop < copied; loop++) {
-			if (buf[loop] == '\n') {
-				copied = loop + 1;/* include newline */
+/* curl calls this routine for each header of the size probe */
+static size_t header_callback(char *buffer, size_t size, size_t nitems,
+		void *userp) {
+	URLIO_CONN *conn = (URLIO_CONN *) userp;
+	size_t len = size * nitems;
+	const char *names[] = { "ETag:", "Last-Modified:" };
+	const char *range_name = "Content-Range:";
+
+	/* "bytes 0-1048575/<size>"; a size of "*", unknown, leaves it 0 */
+	if (len > strlen(range_name)
+			&& !g_ascii_strncasecmp(buffer, range_name, strlen(range_name))) {
+		char *value = g_strndup(buffer, len);
+		char *slash = strchr(value, '/');
+
+		if (slash && g_ascii_isdigit(slash[1]))
+			conn->size = g_ascii_strtoull(slash + 1, NULL, 10);
+		g_free(value);
+		return len;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		size_t name_len = strlen(names[i]);
+
+		/* a strong ETag wins over Last-Modified */
+		if (conn->validator && i == 1)
+			break;
+		if (len > name_len && !g_ascii_strncasecmp(buffer, names[i], name_len)) {
+			char *value = g_strndup(buffer + name_len, len - name_len);
+
+			g_strstrip(value);
+			if (*value) {
+				g_free(conn->validator);
+				conn->validator = value;
+			} else {
+				g_free(value);
+			}
+			break;
+		}
+	}
+
+	return len;
+}
+
+/* the host part of url, which stream limits are counted by; the whole url
+ * when it has none, such as a file: url */
+static char *url_host(const char *url) {
+	CURLU *u = curl_url();
+	char *host = NULL;
+	char *ret;
+
+	if (u && !curl_url_set(u, CURLUPART_URL, url, 0))
+		curl_url_get(u, CURLUPART_HOST, &host, 0);
+	ret = g_strdup(host ? host : url);
+	curl_free(host);
+	curl_url_cleanup(u);
+	return ret;
+}
+
+/* the size of the stream from a HEAD request without the probe's range, for
+ * a server whose answer to the probe didn't tell; -1 if unknown */
+static curl_off_t head_size(URLIO_CONN *conn, URLIO_TRANSFER *xfer,
+		const char *range, GTimer *timer) {
+	URLIO_IO *io = &xfer->io[0];
+	curl_off_t length = -1;
+	char *buffer = io->buffer;
+	size_t buffer_len = io->buffer_len;
+	size_t buffer_pos = io->buffer_pos;
+	size_t limit = io->limit;
+
+	/* keep the head of the GET */
+	io->buffer = NULL;
+	io->buffer_len = 0;
+	io->buffer_pos = 0;
+	io->limit = 0;
+	curl_easy_setopt(io->curl, CURLOPT_RANGE, NULL);
+	curl_easy_setopt(io->curl, CURLOPT_NOBODY, 1L);
+
+	g_timer_start(timer);
+	reactor_run(xfer, 1);
+	count_transfer(conn, xfer, 1, timer);
+	if (io->result == CURLE_OK)
+		curl_easy_getinfo(io->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+				&length);
+
+	curl_easy_setopt(io->curl, CURLOPT_NOBODY, 0L);
+	curl_easy_setopt(io->curl, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(io->curl, CURLOPT_RANGE, range);
+	free(io->buffer);
+	io->buffer = buffer;
+	io->buffer_len = buffer_len;
+	io->buffer_pos = buffer_pos;
+	io->limit = limit;
+
+	return length;
+}
+
+/* GET the head of the stream to learn its length and validator; the head,
+ * where most formats keep their header, is returned in *head so that the
+ * first reads need no other round trip */
+static int probe_size(URLIO_CONN *conn, char **head, size_t *head_len) {
+	URLIO_TRANSFER xfer;
+	GTimer *timer = g_timer_new();
+	char range[64];
+	int ok = 0;
+
+	*head = NULL;
+	*head_len = 0;
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.io[0].curl = get_handle();
+	/* a server ignoring the range sends it all, keep only the head */
+	xfer.io[0].limit = BOOTSTRAP_HEAD_SIZE;
+	snprintf(range, sizeof(range), "0-%d", BOOTSTRAP_HEAD_SIZE - 1);
+
+	setup_io(conn, &xfer.io[0]);
+	curl_easy_setopt(xfer.io[0].curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(xfer.io[0].curl, CURLOPT_HEADERFUNCTION, header_callback);
+	curl_easy_setopt(xfer.io[0].curl, CURLOPT_HEADERDATA, conn);
+
+	for (int retry = 0; retry < RETRY_TIMES && !ok; retry++) {
+		long response_code = 0;
+
+		conn->size = 0;
+		acquire_streams(conn, 1);
+		g_timer_start(timer);
+		reactor_run(&xfer, 1);
+		count_transfer(conn, &xfer, 1, timer);
+
+		/* check if there's data in the buffer - if not either error or
+		 * EOF */
+		response_code = xfer.io[0].response_code;
+		release_streams(conn, 1, xfer.io[0].buffer_pos,
+				response_code == 429 || response_code == 503);
+		if (xfer.io[0].buffer_pos && response_code != 206) {
+			/* no range support, the length is that of the whole body */
+			curl_off_t length = -1;
+
+			curl_easy_getinfo(xfer.io[0].curl,
+					CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+			if (length <= 0)
+				length = head_size(conn, &xfer, range, timer);
+			conn->size = length > 0 ? (size_t) length : 0;
+		} else if (xfer.io[0].buffer_pos && !conn->size) {
+			/* a Content-Range size of "*": the server doesn't know it */
+			curl_off_t length = head_size(conn, &xfer, range, timer);
+
+			conn->size = length > 0 ? (size_t) length : 0;
+			if (!conn->size) {
+				/* nothing to retry for */
+				reset_io(&xfer, 0);
 				break;
 			}
 		}
+		if (xfer.io[0].buffer_pos && conn->size) {
+			ok = 1;
+			*head_len = MIN(xfer.io[0].buffer_pos, conn->size);
+			*head = xfer.io[0].buffer;
+			xfer.io[0].buffer = NULL;
+		}
 
-		memcpy(ptr, buf, copied);
-		free(buf);
+		reset_io(&xfer, 0);
 
-		break;
+		if (!ok && !retryable(&xfer.io[0]))
+			break;
+		if (!ok && retry + 1 < RETRY_TIMES) {
+			guint backoff = BACKOFF_BASE << retry;
+			g_usleep((backoff + g_random_int_range(0, backoff)) * 1000);
+		}
+	}
 
-	default: /* unknown or supported type - oh dear */
-		ptr = NULL;
-		errno = EBADF;
-		break;
+	/* the handle is reused for ranges, which must not touch the validator */
+	curl_easy_setopt(xfer.io[0].curl, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(xfer.io[0].curl, CURLOPT_HEADERDATA, NULL);
+	put_io_handle(&xfer.io[0]);
+	g_timer_destroy(timer);
+
+	return ok;
+}
+
+/* index the whole bulks of the head fetched by the probe */
+static void seed_head(URLIO_CONN *conn, const char *head, size_t head_len) {
+	URLIO_CACHE *cache;
+
+	urlio_disk_write(conn->disk, head, 0, head_len);
+
+	g_mutex_lock(&g_cache_lock);
+	cache = get_cache(conn->url);
+	for (guint64 id = 0; id < head_len; id += BULK_SIZE) {
+		size_t size = bulk_size_at(conn, id);
+		URLIO_BLOCK *block;
+
+		if (id + size > head_len)
+			break;
+		if (g_hash_table_lookup(cache->bulks, &id)
+				|| g_hash_table_lookup(cache->fetches, &id))
+			continue;
+
+		block = g_slice_new0(URLIO_BLOCK);
+		block->id = id;
+		block->size = size;
+		block->data = (char*) malloc(size);
+		if (!block->data) {
+			g_slice_free(URLIO_BLOCK, block);
+			break;
+		}
+		memcpy(block->data, head + id, size);
+		put_block(cache, block);
+		block_unref(block);
 	}
+	g_mutex_unlock(&g_cache_lock);
+}
 
-#ifdef URLIO_VERBOSE
-	printf("data: ");
+static void conn_free(URLIO_CONN *conn) {
+	g_mutex_free(conn->lock);
+	urlio_disk_close(conn->disk);
+	g_free(conn->validator);
+	g_free(conn->host);
+	if (conn->opened)
+		g_timer_destroy(conn->opened);
+	g_free(conn->fetch_url);
+	free(conn->url);
+	free(conn);
+}
 
-	for (size_t i = 0L; i < (size > READ_LOG_LENGTH ? READ_LOG_LENGTH : size);
-			i++)
-		printf("0x%02hX ", (unsigned char) ptr[i]);
+/* local files: mapped when possible, else read with pread on a FILE */
+static gboolean map_open(URLIO_FILE *file, const char *path,
+		const char *operation) {
+	/* only files being read are mapped */
+	if (strpbrk(operation, "wa+"))
+		return FALSE;
+	file->map = urlio_map_open(path);
+	return file->map != NULL;
+}
 
-	printf("\n");
-#endif
+static void map_close(URLIO_FILE *file) {
+	urlio_map_unref(file->map);
+}
 
-	return ptr; /*success */
+static size_t map_pread(URLIO_FILE *file, void *buf, size_t len,
+		guint64 offset) {
+	observe_map_read(file, offset, len);
+	return map_read(file, buf, offset, len);
+}
 
+static gint64 map_size(URLIO_FILE *file) {
+	return urlio_map_size(file->map);
 }
 
-void urlio_rewind(URLIO_FILE *file) {
-	switch (file->type) {
-	case CFTYPE_FILE:
-#ifdef URLIO_VERBOSE
-		printf("rewind: from position %ld\n", ftell(file->handle.file));
-#endif
+static URLIO_VIEW *map_view(URLIO_FILE *file, guint64 offset, size_t len) {
+	URLIO_VIEW *view;
 
-		rewind(file->handle.file); /* passthrough */
-		file->pos = 0L;
+	if (offset + len > urlio_map_size(file->map))
+		return NULL;
+	observe_map_read(file, offset, len);
 
-		break;
+	view = g_slice_new0(URLIO_VIEW);
+	view->map = urlio_map_ref(file->map);
+	view->data = urlio_map_data(file->map) + offset;
+	view->len = len;
+	return view;
+}
+
+static gboolean stdio_open(URLIO_FILE *file, const char *path,
+		const char *operation) {
+	file->handle.file = fopen(path, operation);
+	return file->handle.file != NULL;
+}
 
-	case CFTYPE_CURL:
-#ifdef URLIO_VERBOSE
-		printf("rewind: from position %ld\n", file->pos);
+static void stdio_close(URLIO_FILE *file) {
+	fclose(file->handle.file);
+}
+
+static size_t stdio_pread(URLIO_FILE *file, void *buf, size_t len,
+		guint64 offset) {
+	size_t copied = 0;
+
+#ifdef HAVE_PREAD
+	while (copied < len) {
+		ssize_t ret = pread(fileno(file->handle.file), (char*) buf + copied,
+				len - copied, offset + copied);
+		if (ret < 0)
+			file->error = 1;
+		if (ret <= 0)
+			break;
+		copied += ret;
+	}
+#else
+	/* emulate, FILE positions are not used otherwise */
+	g_mutex_lock(&g_pread_lock);
+	if (!fseek(file->handle.file, offset, SEEK_SET))
+		copied = fread(buf, 1, len, file->handle.file);
+	if (ferror(file->handle.file))
+		file->error = 1;
+	g_mutex_unlock(&g_pread_lock);
 #endif
-		file->pos = 0L;
-		break;
 
-	default: /* unknown or supported type - oh dear */
-		break;
+	return copied;
+}
+
+static gint64 stdio_size(URLIO_FILE *file) {
+	struct stat st;
+
+	if (fstat(fileno(file->handle.file), &st))
+		return -1;
+	return st.st_size;
+}
+
+/* remote streams, through the block cache */
+static gboolean remote_open(URLIO_FILE *file, const char *url,
+		const char *operation G_GNUC_UNUSED) {
+	URLIO_CONN *conn;
+	char *head;
+	size_t head_len;
+
+	/* opens of other urls probe meanwhile, those of this one wait */
+	g_mutex_lock(&g_urlio_lock);
+	if (!g_urlio_table) {
+		g_urlio_table = g_hash_table_new(g_str_hash, g_str_equal);
+		g_urlio_probing = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, NULL);
 	}
+	while (!(conn = g_hash_table_lookup(g_urlio_table, url)) &&
+			g_hash_table_lookup(g_urlio_probing, url))
+		g_cond_wait(&g_urlio_cond, &g_urlio_lock);
+	if (conn) {
+		g_mutex_unlock(&g_urlio_lock);
+		file->handle.conn = conn;
+		return TRUE;
+	}
+	g_hash_table_insert(g_urlio_probing, g_strdup(url), GINT_TO_POINTER(1));
+	g_mutex_unlock(&g_urlio_lock);
+
+	conn = (URLIO_CONN*) calloc(1, sizeof(URLIO_CONN));
+	conn->url = (char*) malloc((strlen(url) + 1) * sizeof(char));
+	strcpy(conn->url, url);
+	conn->backend = file->backend;
+	conn->fetch_url = conn->backend->resolve
+			? conn->backend->resolve(url) : g_strdup(url);
+	conn->host = url_host(conn->fetch_url);
+	conn->lock = g_mutex_new();
+	conn->opened = g_timer_new();
+
+	if (probe_size(conn, &head, &head_len)) {
+		conn->disk = urlio_disk_open(conn->url, conn->validator,
+				conn->size);
+		seed_head(conn, head, head_len);
+		free(head);
+
+		if (g_trace)
+			g_message("urlio: %s: opened through %s, %zu bytes, validator %s",
+					url, conn->backend->name, conn->size,
+					conn->validator ? conn->validator : "none");
+	} else {
+		conn_free(conn);
+		conn = NULL;
+	}
+
+	/* a failed probe lets the next opener try again */
+	g_mutex_lock(&g_urlio_lock);
+	if (conn)
+		g_hash_table_insert(g_urlio_table, conn->url, conn);
+	g_hash_table_remove(g_urlio_probing, url);
+	g_cond_broadcast(&g_urlio_cond);
+	g_mutex_unlock(&g_urlio_lock);
+
+	if (!conn)
+		return FALSE;
+	file->handle.conn = conn;
+	return TRUE;
 }
 
-int urlio_fgetc(URLIO_FILE *file) {
-	// const size_t want = 1;
-	int c;
-	char b;
-
-	switch (file->type) {
-	case CFTYPE_FILE:
-#ifdef URLIO_VERBOSE
-		printf("fgetc: from position %ld read 1 byte\n",
-				ftell(file->handle.file));
-#endif
+static void remote_close(URLIO_FILE *file G_GNUC_UNUSED) {
+	/* the stream stays open for the next handle */
+}
 
-		c = fgetc(file->handle.file);
-		file->pos++;
+static size_t remote_pread(URLIO_FILE *file, void *buf, size_t len,
+		guint64 offset) {
+	size_t copied = download(file, buf, offset, len);
 
-		break;
+	if (copied < len && offset + copied < file->handle.conn->size)
+		file->error = 1;
+	return copied;
+}
 
-	case CFTYPE_CURL:
-#ifdef URLIO_VERBOSE
-		printf("fgetc: from position %ld read 1 byte\n", file->pos);
-#endif
-		download(&b, file->pos, 1, file->handle.conn);
-		c = (int) b;
+static gint64 remote_size(URLIO_FILE *file) {
+	return file->handle.conn->size;
+}
 
-		file->pos++;
+/* credential providers by scheme; guarded by g_credentials_lock */
+struct credentials_provider {
+	urlio_credentials_fn fn;
+	gpointer user_data;
+};
 
-		break;
+static GHashTable *g_credentials = NULL;
+static GMutex g_credentials_lock;
 
-	default: /* unknown or supported type - oh dear */
-		c = EOF;
-		errno = EBADF;
-		break;
+void urlio_set_credentials(const char *scheme, urlio_credentials_fn fn,
+		gpointer user_data) {
+	struct credentials_provider *provider = NULL;
+
+	if (fn) {
+		provider = g_slice_new(struct credentials_provider);
+		provider->fn = fn;
+		provider->user_data = user_data;
 	}
 
-#ifdef URLIO_VERBOSE
-	printf("data: 0x%02hX", (unsigned char) c);
-#endif
+	g_mutex_lock(&g_credentials_lock);
+	if (!g_credentials)
+		g_credentials = g_hash_table_new(g_str_hash, g_str_equal);
+	/* a replaced provider may be in use by a request being set up, it is
+	 * kept; there are only ever a few */
+	if (provider)
+		g_hash_table_insert(g_credentials, g_strdup(scheme), provider);
+	else
+		g_hash_table_remove(g_credentials, scheme);
+	g_mutex_unlock(&g_credentials_lock);
+}
 
-	return c;/*success */
+static gboolean env_credentials(const char *id_var, const char *secret_var,
+		const char *token_var, URLIO_CREDENTIALS *creds) {
+	const char *id = id_var ? g_getenv(id_var) : NULL;
+	const char *secret = secret_var ? g_getenv(secret_var) : NULL;
+	const char *token = g_getenv(token_var);
+
+	if (id_var && (!id || !secret))
+		return FALSE;
+	if (!id_var && !token)
+		return FALSE;
+	creds->id = g_strdup(id);
+	creds->secret = g_strdup(secret);
+	creds->token = g_strdup(token);
+	return TRUE;
 }
 
-long int urlio_ftell(URLIO_FILE *file) {
-	long int p;
+/* the credentials for a request of conn, from its provider or else from
+ * the environment; read again for every request */
+static gboolean get_credentials(URLIO_CONN *conn, URLIO_CREDENTIALS *creds) {
+	struct credentials_provider *provider = NULL;
 
-	switch (file->type) {
-	case CFTYPE_FILE:
-		p = ftell(file->handle.file);
+	memset(creds, 0, sizeof(*creds));
 
-#ifdef URLIO_VERBOSE
-		printf("ftell: current position %ld\n", p);
-#endif
+	g_mutex_lock(&g_credentials_lock);
+	if (g_credentials)
+		provider = g_hash_table_lookup(g_credentials, conn->backend->name);
+	g_mutex_unlock(&g_credentials_lock);
 
-		break;
+	if (provider)
+		return provider->fn(conn->url, creds, provider->user_data);
+	if (!strcmp(conn->backend->name, "s3"))
+		return env_credentials("AWS_ACCESS_KEY_ID", "AWS_SECRET_ACCESS_KEY",
+				"AWS_SESSION_TOKEN", creds);
+	return env_credentials(NULL, NULL, "GOOGLE_OAUTH_ACCESS_TOKEN", creds);
+}
 
-	case CFTYPE_CURL:
-		p = file->pos;
+static void free_credentials(URLIO_CREDENTIALS *creds) {
+	g_free(creds->id);
+	g_free(creds->secret);
+	g_free(creds->token);
+}
 
-#ifdef URLIO_VERBOSE
-		printf("ftell: current position %ld\n", p);
+static const char *s3_region(void) {
+	const char *region = g_getenv("AWS_REGION");
+
+	if (!region || !*region)
+		region = g_getenv("AWS_DEFAULT_REGION");
+	return region && *region ? region : S3_DEFAULT_REGION;
+}
+
+/* s3://bucket/key: virtual hosted on AWS, path style on a custom endpoint
+ * such as MinIO */
+static char *s3_resolve(const char *url) {
+	const char *bucket = url + strlen("s3://");
+	const char *key = strchr(bucket, '/');
+	const char *endpoint = g_getenv("AWS_ENDPOINT_URL");
+	char *bucket_name;
+	char *ret;
+
+	if (!key)
+		key = "/";
+	bucket_name = g_strndup(bucket, key - bucket);
+	if (endpoint && *endpoint)
+		ret = g_strdup_printf("%s/%s%s", endpoint, bucket_name, key);
+	else
+		ret = g_strdup_printf("https://%s.s3.%s.amazonaws.com%s", bucket_name,
+				s3_region(), key);
+	g_free(bucket_name);
+	return ret;
+}
+
+static void s3_authorize(URLIO_CONN *conn, URLIO_IO *io) {
+	URLIO_CREDENTIALS creds;
+
+	if (!get_credentials(conn, &creds))
+		return;
+
+#if LIBCURL_VERSION_NUM >= 0x074b00
+	char *sigv4 = g_strdup_printf("aws:amz:%s:s3", s3_region());
+
+	/* curl signs every request, ranges included */
+	curl_easy_setopt(io->curl, CURLOPT_AWS_SIGV4, sigv4);
+	curl_easy_setopt(io->curl, CURLOPT_USERNAME, creds.id);
+	curl_easy_setopt(io->curl, CURLOPT_PASSWORD, creds.secret);
+	g_free(sigv4);
+	if (creds.token) {
+		char *header = g_strdup_printf("x-amz-security-token: %s",
+				creds.token);
+		io->headers = curl_slist_append(io->headers, header);
+		g_free(header);
+	}
+#else
+	/* without request signing only public or presigned objects can be
+	 * read */
+	(void) io;
 #endif
-		break;
 
-	default: /* unknown or supported type - oh dear */
-		p = -1;
-		errno = EBADF;
-		break;
+	free_credentials(&creds);
+}
+
+/* gs://bucket/object through the XML API */
+static char *gs_resolve(const char *url) {
+	return g_strdup_printf("%s/%s", GCS_ENDPOINT, url + strlen("gs://"));
+}
+
+static void gs_authorize(URLIO_CONN *conn, URLIO_IO *io) {
+	URLIO_CREDENTIALS creds;
+
+	if (!get_credentials(conn, &creds))
+		return;
+	if (creds.token) {
+		char *header = g_strdup_printf("Authorization: Bearer %s",
+				creds.token);
+		io->headers = curl_slist_append(io->headers, header);
+		g_free(header);
+	}
+	free_credentials(&creds);
+}
+
+static const URLIO_BACKEND map_backend = {
+	.name = "file",
+	.type = CFTYPE_FILE,
+	.open = map_open,
+	.close = map_close,
+	.pread = map_pread,
+	.size = map_size,
+	.view = map_view,
+};
+
+static const URLIO_BACKEND stdio_backend = {
+	.name = "file",
+	.type = CFTYPE_FILE,
+	.open = stdio_open,
+	.close = stdio_close,
+	.pread = stdio_pread,
+	.size = stdio_size,
+};
+
+static const URLIO_BACKEND http_backend = {
+	.name = "http",
+	.type = CFTYPE_CURL,
+	.open = remote_open,
+	.close = remote_close,
+	.pread = remote_pread,
+	.size = remote_size,
+	.view = remote_view,
+};
+
+static const URLIO_BACKEND s3_backend = {
+	.name = "s3",
+	.type = CFTYPE_CURL,
+	.open = remote_open,
+	.close = remote_close,
+	.pread = remote_pread,
+	.size = remote_size,
+	.view = remote_view,
+	.resolve = s3_resolve,
+	.authorize = s3_authorize,
+};
+
+static const URLIO_BACKEND gs_backend = {
+	.name = "gs",
+	.type = CFTYPE_CURL,
+	.open = remote_open,
+	.close = remote_close,
+	.pread = remote_pread,
+	.size = remote_size,
+	.view = remote_view,
+	.resolve = gs_resolve,
+	.authorize = gs_authorize,
+};
+
+/* the backends a url can be opened with, in order of preference; *path is
+ * set to what they open, a g_malloc'd local path or the url itself */
+static const URLIO_BACKEND * const *select_backends(const char *url,
+		char **path) {
+	static const URLIO_BACKEND * const local[] = { &map_backend,
+			&stdio_backend, NULL };
+	static const URLIO_BACKEND * const http[] = { &http_backend, NULL };
+	static const URLIO_BACKEND * const s3[] = { &s3_backend, NULL };
+	static const URLIO_BACKEND * const gs[] = { &gs_backend, NULL };
+	const URLIO_BACKEND * const *ret = http;
+	char *scheme = g_uri_parse_scheme(url);
+
+	*path = NULL;
+	/* no scheme, or a drive letter */
+	if (!scheme || strlen(scheme) < 2) {
+		*path = g_strdup(url);
+		ret = local;
+	} else if (!g_ascii_strcasecmp(scheme, "file")) {
+		*path = g_filename_from_uri(url, NULL, NULL);
+		ret = local;
+	} else if (!g_ascii_strcasecmp(scheme, "s3")) {
+		ret = s3;
+	} else if (!g_ascii_strcasecmp(scheme, "gs")) {
+		ret = gs;
+	}
+	g_free(scheme);
+
+	/* anything else goes to curl, which knows more schemes than http */
+	if (!*path)
+		*path = g_strdup(url);
+	return ret;
+}
+
+URLIO_FILE *urlio_fopen(const char *url, const char *operation) {
+	const URLIO_BACKEND * const *backends;
+	URLIO_FILE *file;
+	char *path;
+
+	file = (URLIO_FILE*) calloc(1, sizeof(URLIO_FILE));
+	if (!file)
+		return NULL;
+
+	backends = select_backends(url, &path);
+	for (; *backends; backends++) {
+		file->backend = *backends;
+		if (file->backend->open(file, path, operation))
+			break;
 	}
+	g_free(path);
+	if (!*backends) {
+		free(file);
+		return NULL;
+	}
+	file->type = file->backend->type;
+
+	file->url = (char*) malloc((strlen(url) + 1) * sizeof(char));
+	strcpy(file->url, url);
+	file->pos = 0;
 
-	return p; /*success */
+	return file;
+}
+
+int urlio_fclose(URLIO_FILE *file) {
+	file->backend->close(file);
+	free(file->url);
+	free(file);
+
+	return 0;
+}
+
+int urlio_ferror(URLIO_FILE *file) {
+	return file->error;
+}
+
+int urlio_feof(URLIO_FILE *file) {
+	return (gint64) file->pos >= file->backend->size(file);
+}
+
+size_t urlio_fread(void *ptr, size_t size, size_t nmemb, URLIO_FILE *file) {
+	size_t copied;
+
+	if (!size)
+		return 0;
+	copied = file->backend->pread(file, ptr, size * nmemb, file->pos);
+	file->pos += copied;
+	return copied / size;
+}
+
+char *urlio_fgets(char *ptr, size_t size, URLIO_FILE *file) {
+	size_t wanted = size - 1; /* always need to leave room for zero termination */
+	size_t copied;
+	char *nl;
+
+	if (!size)
+		return NULL;
+	copied = file->backend->pread(file, ptr, wanted, file->pos);
+	if (!copied)
+		return NULL;
+
+	nl = memchr(ptr, '\n', copied);
+	if (nl)
+		copied = nl - ptr + 1; /* include newline */
+	ptr[copied] = 0;
+	file->pos += copied;
+
+	return ptr; /*success */
+}
+
+void urlio_rewind(URLIO_FILE *file) {
+	file->pos = 0L;
+}
+
+int urlio_fgetc(URLIO_FILE *file) {
+	unsigned char c;
+
+	if (file->backend->pread(file, &c, 1, file->pos) != 1)
+		return EOF;
+	file->pos++;
+	return c;
+}
+
+long int urlio_ftell(URLIO_FILE *file) {
+	return file->pos;
 }
 
 int urlio_fseek(URLIO_FILE *file, long int offset, int whence) {
+	gint64 pos;
+
 	switch (whence) {
 	case SEEK_SET:
-#ifdef URLIO_VERBOSE
-		printf("fseek: seek to offset %ld from head\n", offset);
-#endif
-		file->pos = offset;
-
+		pos = offset;
 		break;
 	case SEEK_CUR:
-#ifdef URLIO_VERBOSE
-		printf("fseek: seek to offset %ld from position %ld\n", offset,
-				file->pos);
-#endif
-		file->pos = file->pos + offset;
+		pos = file->pos + offset;
 		break;
 	case SEEK_END:
-#ifdef URLIO_VERBOSE
-		printf("fseek: seek to offset %ld from tail\n", offset);
-#endif
-		file->pos = file->handle.conn->size + offset + 1;
+		pos = file->backend->size(file) + offset;
 		break;
 	default: /* unknown or supported type - oh dear */
-		errno = EBADF;
+		errno = EINVAL;
 		return -1;
-		break;
 	}
 
-	switch (file->type) {
-	case CFTYPE_FILE:
-		return (fseek(file->handle.file, offset, whence));
-		break;
-
-	case CFTYPE_CURL:
-		return 0;
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	file->pos = pos;
+	return 0;
+}
 
-		break;
+size_t urlio_pread(URLIO_FILE *file, void *buf, size_t len, guint64 offset) {
+	return file->backend->pread(file, buf, len, offset);
+}
 
-	default: /* unknown or supported type - oh dear */
-		errno = EBADF;
-		return 0;
-		break;
-	}
+gint64 urlio_fsize(URLIO_FILE *file) {
+	return file->backend->size(file);
 }
 
+char *urlio_get_validator(URLIO_FILE *file) {
+	if (file->type != CFTYPE_CURL)
+		return NULL;
+	return g_strdup(file->handle.conn->validator);
+}
@@ -23,13 +23,44 @@
 #ifndef __OPENSLIDE_URLIO_H__
 #define __OPENSLIDE_URLIO_H__
 
-#define URLIO_VERBOSE 1
 #define CURL_VERBOSE 0
-#define RETRY_TIMES 3
-#define READ_LOG_LENGTH 8
-#define THREAD_NUM 8
-#define CACHE_BULK_SIZE_PER_THREAD 1024*1024
+#define RETRY_TIMES 3 /* attempts of a failed range */
+#define BACKOFF_BASE 100 /* ms before the first retry, doubling after */
+#define REQUEST_TIMEOUT_DEFAULT 30000 /* ms a range may take in all */
+#define REQUEST_TIMEOUT_ENV_VAR "OPENSLIDE_URLIO_TIMEOUT"
+#define HEDGE_ENV_VAR "OPENSLIDE_URLIO_HEDGE"
+#define HEDGE_SAMPLES 64 /* range latencies the hedging delay comes from */
+#define HEDGE_MIN_SAMPLES 20 /* no hedging before that many were seen */
+#define HEDGE_MIN_DELAY 10 /* ms */
+#define STALL_TIMEOUT 60 /* seconds without data before a transfer fails */
+#define REACTOR_POLL_TIMEOUT 1000 /* ms */
+#define INTERRUPT_POLL 50 /* ms a waiting reader goes without checking its interrupt */
+#define THREAD_NUM 8 /* default parallel ranges per host */
+#define URLIO_MAX_SLOTS 32 /* most parallel ranges of one transfer */
+#define HOST_STREAMS_MAX 64 /* ceiling of the tuned per host limit */
+#define STREAMS_DEFAULT 64 /* default parallel ranges of the process */
+#define TUNE_WINDOW 16 /* transfers between two tuning steps */
+#define HOST_STREAMS_ENV_VAR "OPENSLIDE_URLIO_HOST_STREAMS"
+#define STREAMS_ENV_VAR "OPENSLIDE_URLIO_STREAMS"
+#define AUTOTUNE_ENV_VAR "OPENSLIDE_URLIO_AUTOTUNE"
+#define CACHE_BLOCK_SIZE 64*1024 /* size of the cached blocks, the least fetch */
+#define CACHE_BULK_SIZE_PER_THREAD 1024*1024 /* most bytes per io slot */
 #define CACHE_BULK_SIZE THREAD_NUM*CACHE_BULK_SIZE_PER_THREAD
+#define READAHEAD_MIN 256*1024 /* first readahead of a sequential reader */
+#define READAHEAD_MAX CACHE_BULK_SIZE
+#define PREFETCH_THREADS 4
+#define HANDLE_POOL_MAX 64 /* idle easy handles kept for reuse */
+#define CACHE_DEFAULT_CAPACITY 256*1024*1024
+#define CACHE_CAPACITY_ENV_VAR "OPENSLIDE_URLIO_CACHE_SIZE"
+#define BOOTSTRAP_HEAD_SIZE 1024*1024 /* fetched along with the size probe */
+#define BOOTSTRAP_TAIL_SIZE 4*1024*1024 /* fetched when IFDs are at the end */
+#define RANGE_GAP_DEFAULT 64*1024
+#define RANGE_GAP_ENV_VAR "OPENSLIDE_URLIO_RANGE_GAP"
+#define MIRROR_ENV_VAR "OPENSLIDE_URLIO_MIRROR"
+#define MIRROR_RATE_ENV_VAR "OPENSLIDE_URLIO_MIRROR_RATE"
+#define MIRROR_PAUSE 50 /* ms the mirror waits for the host to be idle */
+#define S3_DEFAULT_REGION "us-east-1"
+#define GCS_ENDPOINT "https://storage.googleapis.com"
 
 #include <stdio.h>
 #include <string.h>
@@ -40,32 +71,138 @@
 #include <errno.h>
 
 #include <curl/curl.h>
+#include <glib.h>
 
 enum fcurl_type_e {
 	CFTYPE_NONE = 0, CFTYPE_FILE = 1, CFTYPE_CURL = 2
 };
 
+struct fcurl_transfer;
+
+/* what makes the fetches of a reader give up: *cancelled turning nonzero,
+ * or g_get_monotonic_time() passing deadline */
+struct fcurl_interrupt {
+	const volatile gint *cancelled; /* NULL for never */
+	gint64 deadline; /* 0 for never */
+};
+
+typedef struct fcurl_interrupt URLIO_INTERRUPT;
+
 struct fcurl_io {
 	CURL *curl;
 	char *buffer; /* buffer to store cached data*/
 	size_t buffer_len; /* currently allocated buffers length */
 	size_t buffer_pos; /* end of data in buffer*/
+	size_t limit; /* stop the transfer once this much is buffered, 0 for none */
+	/* when set, the data goes straight into these consecutive blocks of
+	 * the range rather than into buffer */
+	struct fcurl_block **blocks;
+	struct curl_slist *headers; /* of the request, added by the backend */
+
+	CURLcode result; /* set by the reactor once the transfer is over */
+	long response_code; /* of whichever request served the slot */
+	double latency; /* seconds from start to completion */
+	struct fcurl_transfer *xfer; /* transfer this io belongs to */
+
+	/* hedging, touched by the reactor thread only */
+	double hedge_after; /* seconds before a duplicate is sent, 0 for never */
+	double started; /* on the reactor clock */
+	gboolean in_flight; /* the handle is in the multi */
+	struct fcurl_io *hedge; /* duplicate racing this slot */
+	struct fcurl_io *primary; /* for a duplicate, the slot it races */
 };
 
 typedef struct fcurl_io URLIO_IO;
 
+/* the state of one fetch; its easy handles are driven by the reactor thread,
+ * the submitter sleeps until all of them completed */
+struct fcurl_transfer {
+	URLIO_IO io[URLIO_MAX_SLOTS];
+	int pending; /* io slots still in flight, guarded by the reactor lock */
+	int hedges; /* duplicates sent, read once pending dropped to 0 */
+	int hedge_wins; /* duplicates which finished first */
+	const URLIO_INTERRUPT *interrupt; /* of the submitter, NULL for none */
+	const char *host; /* whose streams the duplicates take */
+
+	GCond *cond; /* signalled when pending drops to 0 */
+};
+
+typedef struct fcurl_transfer URLIO_TRANSFER;
+
+#define URLIO_LATENCY_BUCKETS 16
+
+/* how a handle is being read, deciding its readahead */
+enum urlio_pattern {
+	URLIO_PATTERN_RANDOM, /* no readahead, fetch the least block */
+	URLIO_PATTERN_SEQUENTIAL, /* growing readahead */
+	URLIO_PATTERN_STRIDED, /* the next stride is prefetched */
+	URLIO_PATTERN_COUNT
+};
+
+struct fcurl_access {
+	guint64 last_pos;
+	guint64 last_end;
+	gint64 stride; /* between the last two reads */
+	int streak; /* reads observed, capped at 1 */
+	enum urlio_pattern pattern;
+	guint64 readahead;
+	guint64 advised; /* end of the last readahead hint of a mapped file */
+};
+
+typedef struct fcurl_access URLIO_ACCESS;
+
+/* counters of a remote stream since it was first opened */
+struct fcurl_stats {
+	guint64 requests; /* ranges requested */
+	guint64 round_trips; /* transfers, whose ranges run in parallel */
+	guint64 bytes_fetched; /* from the network */
+	guint64 bytes_served; /* to readers */
+	guint64 block_hits; /* found in the block cache */
+	guint64 block_waits; /* found in flight for another reader */
+	guint64 block_misses; /* fetched for the reader */
+	guint64 disk_hits; /* fetched from the disk store */
+	/* transfers taking less than 2^i ms, the last bucket takes the rest */
+	guint64 latency[URLIO_LATENCY_BUCKETS];
+	guint64 pattern_reads[URLIO_PATTERN_COUNT]; /* reads by access pattern */
+	guint64 readahead_bytes; /* asked for beyond what readers wanted */
+	guint64 stream_waits; /* fetches which waited for a stream limit */
+	guint64 throttled; /* responses 429 or 503 */
+	guint64 retries; /* ranges requested again after a failure */
+	guint64 hedges; /* duplicate requests sent for slow ranges */
+	guint64 hedge_wins; /* duplicates which finished first */
+	guint64 timeouts; /* ranges which missed their deadline */
+	guint64 interrupts; /* ranges given up by an interrupted reader */
+	guint64 mirror_bytes; /* fetched by the background mirror */
+};
+
+typedef struct fcurl_stats URLIO_STATS;
+
+struct fcurl_backend;
+
 struct fcurl_conn {
 	char *url; /* url */
+	char *fetch_url; /* what is requested for it, as the backend resolved it */
+	char *host; /* whose stream limit applies */
+	const struct fcurl_backend *backend;
 
-	CURL *curl;
-	// char *buffer; /* buffer to store cached data*/
-	// size_t buffer_len; /* currently allocated buffers length */
-	// size_t buffer_pos; /* end of data in buffer*/
-	URLIO_IO io[THREAD_NUM];
-	int still_running; /* Is background url fetch still in progress */
 	size_t size; /* size of the stream  */
 
-	CURLM *multi_handle;
+	char *validator; /* ETag or Last-Modified, NULL if the server sent none */
+	struct fcurl_disk *disk; /* on-disk bulk store, NULL if disabled */
+
+	GMutex *lock; /* guards stats and the latency samples */
+
+	struct fcurl_stats stats;
+
+	/* mirroring of the whole stream to the disk store */
+	GTimer *opened; /* for the request rate */
+	int mirror; /* MIRROR_*, guarded by the mirror lock */
+	volatile gint mirrored; /* all of the stream is on disk */
+
+	/* latencies of the last ranges, in seconds, for the hedging delay */
+	double samples[HEDGE_SAMPLES];
+	int sample_count;
+	int sample_next;
 };
 
 typedef struct fcurl_conn URLIO_CONN;
@@ -74,6 +211,7 @@ struct fcurl_file {
 	char *url; /* url */
 
 	enum fcurl_type_e type; /* type of handle */
+	const struct fcurl_backend *backend; /* chosen by the scheme of url */
 
 	union {
 		URLIO_CONN *conn;
@@ -87,27 +225,153 @@ struct fcurl_file {
 //	size_t size; /* size of the stream  */
 
 	size_t pos; /* pos of the stream  */
+	int error; /* a remote read failed */
+	struct fcurl_map *map; /* of a local file, which then has no FILE */
+	URLIO_ACCESS access; /* pattern of the reads, guarded by the conn lock */
 
 	// CURLM *multi_handle;
 };
 
+typedef struct fcurl_cache URLIO_CACHE;
+
+struct fcurl_block {
+	URLIO_CACHE *cache; /* cache of the stream this bulk belongs to */
+	guint64 id; /* offset of the head of the bulk, also its hash key */
+
+	char *data;
+	size_t size; /* CACHE_BLOCK_SIZE, less for the last bulk */
+
+	volatile gint refcount; /* one for the cache, one for each reader */
+	GList *lru_link; /* NULL once evicted */
+};
+
+/* a bulk being fetched; readers wanting it wait for the one fetch */
+struct fcurl_fetch {
+	guint64 id;
+	gboolean done;
+	gboolean ok;
+
+	int refcount; /* the fetcher and the waiters, guarded by the cache lock */
+	GCond *cond;
+};
+
+typedef struct fcurl_fetch URLIO_FETCH;
+
 struct fcurl_cache {
 	char *url; /* url */
 
-	char **bulk_list;
-	size_t *bulk_id_list;
-	size_t *bulk_size_list;
-	int bulk_count;
+	GHashTable *bulks; /* guint64 bulk id -> URLIO_BLOCK */
+	GHashTable *fetches; /* guint64 bulk id -> URLIO_FETCH in flight */
 };
 
+typedef struct fcurl_block URLIO_BLOCK;
 typedef struct fcurl_file URLIO_FILE;
-typedef struct fcurl_cache URLIO_CACHE;
+
+/* bytes of a stream lent to a reader: a reference on the cached block
+ * holding them or on the mapping of a local file, else a copy */
+struct fcurl_view {
+	const char *data;
+	size_t len;
+
+	URLIO_BLOCK *block;
+	struct fcurl_map *map;
+	char *copy;
+};
+
+typedef struct fcurl_view URLIO_VIEW;
+
+/* a way to reach streams, picked by the scheme of their url: local paths
+ * and file: urls, http(s):, s3: and gs:. The sequential functions work on
+ * file->pos through pread. */
+struct fcurl_backend {
+	const char *name;
+	enum fcurl_type_e type;
+
+	/* FALSE if url can't be opened this way */
+	gboolean (*open)(URLIO_FILE *file, const char *url, const char *operation);
+	void (*close)(URLIO_FILE *file);
+	/* short at the end of the stream or on error */
+	size_t (*pread)(URLIO_FILE *file, void *buf, size_t len, guint64 offset);
+	gint64 (*size)(URLIO_FILE *file);
+	/* NULL if the bytes can't be lent, they are copied then */
+	URLIO_VIEW *(*view)(URLIO_FILE *file, guint64 offset, size_t len);
+
+	/* remote backends: the url to request for the one opened, g_malloc'd,
+	 * and credentials for each request, called as its handle is set up */
+	char *(*resolve)(const char *url);
+	void (*authorize)(URLIO_CONN *conn, URLIO_IO *io);
+};
+
+typedef struct fcurl_backend URLIO_BACKEND;
+
+/* credentials of an object store, g_malloc'd strings or NULL */
+struct fcurl_credentials {
+	char *id; /* access key id */
+	char *secret; /* secret access key */
+	char *token; /* session or bearer token */
+};
+
+typedef struct fcurl_credentials URLIO_CREDENTIALS;
+
+/* fills creds for a request of url, FALSE for an anonymous request */
+typedef gboolean (*urlio_credentials_fn)(const char *url,
+		URLIO_CREDENTIALS *creds, gpointer user_data);
 
 /* exported functions */
 void urlio_initial(void);
 void urlio_release(void);
 int urlio_ferror(URLIO_FILE *file);
 
+/* byte cap of the block cache shared by all remote streams */
+size_t urlio_get_cache_capacity(void);
+void urlio_set_cache_capacity(size_t capacity);
+
+/* bytes in the block cache, and dropping the least recently used fraction
+ * of them */
+size_t urlio_get_cache_size(void);
+void urlio_trim_cache(double fraction);
+
+/* largest hole between two wanted ranges which are still fetched as one
+ * request, wasting the hole rather than a round trip */
+guint64 urlio_get_range_gap(void);
+void urlio_set_range_gap(guint64 gap);
+
+/* parallel ranges allowed per host and in the whole process, 0 keeps the
+ * current value; with autotune the per host limits follow the measured
+ * throughput, starting from per_host, and halve when the server throttles */
+void urlio_set_concurrency(int per_host, int global, gboolean autotune);
+void urlio_get_concurrency(int *per_host, int *global, gboolean *autotune);
+
+/* deadline of one range in ms, 0 for the default; failed ranges are retried
+ * RETRY_TIMES with exponential backoff. With hedging a range still running
+ * after the 95th percentile of the recent range latencies of its stream is
+ * requested again, and the first of the two to finish is used. */
+void urlio_set_timeouts(guint timeout_ms, gboolean hedge);
+
+/* copy a remote stream to the disk store in the background, while its host
+ * is otherwise idle, once the fraction of it fetched or its request rate per
+ * second reach these thresholds; 0 disables either. Needs the disk store. */
+void urlio_set_mirror(double fraction, double rate);
+
+/* provider of the credentials of the "s3" or "gs" backend, asked before
+ * every request so that rotated credentials apply to open slides; NULL
+ * restores the default, which reads AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY
+ * and AWS_SESSION_TOKEN, or GOOGLE_OAUTH_ACCESS_TOKEN */
+void urlio_set_credentials(const char *scheme, urlio_credentials_fn fn,
+		gpointer user_data);
+
+/* directory and byte limit of the on-disk bulk store shared across
+ * processes; a NULL dir disables it */
+void urlio_set_disk_cache(const char *dir, guint64 max_size);
+
+/* a copy of the directory of the on-disk store, or NULL if it is disabled */
+char *urlio_get_disk_cache_dir(void);
+
+/* make room in the on-disk store for a file of size bytes about to be
+ * written under its directory, dropping the least recently used entries;
+ * FALSE if the store is disabled or can't hold that much */
+gboolean urlio_disk_reserve(guint64 size);
+
 URLIO_FILE *urlio_fopen(const char *url, const char *operation);
 int urlio_fclose(URLIO_FILE *file);
 int urlio_feof(URLIO_FILE *file);
@@ -119,4 +383,61 @@ int urlio_fgetc(URLIO_FILE *file);
 long int urlio_ftell(URLIO_FILE *file);
 int urlio_fseek(URLIO_FILE *file, long int offset, int whence);
 
+/* positional reads, which don't use or move the position of the stream and
+ * may be issued on one handle from several threads at once */
+size_t urlio_pread(URLIO_FILE *file, void *buf, size_t len, guint64 offset);
+gint64 urlio_fsize(URLIO_FILE *file);
+
+/* the ETag or Last-Modified of a remote stream, g_malloc'd; NULL for local
+ * files and servers which send neither */
+char *urlio_get_validator(URLIO_FILE *file);
+
+/* [offset, offset + len) of a stream without copying it out of the block
+ * cache when it lies within one block; positional like urlio_pread().
+ * NULL if it can't be read in full. */
+URLIO_VIEW *urlio_read_view(URLIO_FILE *file, guint64 offset, size_t len);
+void urlio_view_release(URLIO_VIEW *view);
+
+/* start fetching [offset, offset + len) of a remote stream into the block
+ * cache in the background; a no-op for local files */
+void urlio_prefetch(URLIO_FILE *file, guint64 offset, guint64 len, int tag);
+
+/* drop the prefetches given tag which have not started yet */
+void urlio_prefetch_cancel(int tag);
+
+/* fetch the missing parts of n ranges of a remote stream into the block
+ * cache, in as few round trips as possible; a no-op for local files */
+void urlio_fetch_ranges(URLIO_FILE *file, const guint64 *offsets,
+		const guint64 *lens, int n);
+
+/* round trips issued so far for an opened url, -1 if it's not remote */
+gint urlio_get_round_trips(const char *url);
+
+/* copy the counters of an opened remote url, FALSE if there is none */
+gboolean urlio_get_stats(const char *url, URLIO_STATS *stats);
+
+/* the counters of all opened remote urls, summed */
+void urlio_get_total_stats(URLIO_STATS *stats);
+
+/* make the reads of the calling thread give up once interrupt fires: their
+ * transfers are aborted and waits for other readers' fetches abandoned, so
+ * that they come up short. interrupt must live until it is replaced; NULL
+ * for none. Returns the previous one. */
+const URLIO_INTERRUPT *urlio_set_interrupt(const URLIO_INTERRUPT *interrupt);
+const URLIO_INTERRUPT *urlio_get_interrupt(void);
+gboolean urlio_interrupted(const URLIO_INTERRUPT *interrupt);
+
+/* have the transfers of an interrupt just cancelled aborted right away,
+ * rather than at the next poll of the reactor */
+void urlio_wake(void);
+
+/* log every transfer with g_message() */
+void urlio_set_trace(gboolean trace);
+
+/* called on the reading thread as each stage of a read begins and ends:
+ * contention for the block cache, fetches, their transfers and waits for
+ * other readers' fetches. NULL for none. */
+typedef void (*urlio_span_fn)(const char *name, gboolean begin);
+void urlio_set_span_hook(urlio_span_fn fn);
+
 #endif // __OPENSLIDE_URLIO_H__
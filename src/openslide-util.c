@@ -54,6 +54,8 @@ static const struct debug_option {
   {"performance", OPENSLIDE_DEBUG_PERFORMANCE,
    "log conditions causing poor performance"},
   {"tiles", OPENSLIDE_DEBUG_TILES, "render tile outlines"},
+  {"urlio", OPENSLIDE_DEBUG_URLIO, "log remote transfers"},
+  {"trace", OPENSLIDE_DEBUG_TRACE, "write a Chrome trace of read stages"},
   {NULL, 0, NULL}
 };
 
@@ -330,31 +332,24 @@ void _openslide_set_bounds_props_from_grid(openslide_t *osr,
 bool _openslide_clip_tile(uint32_t *tiledata,
                           int64_t tile_w, int64_t tile_h,
                           int64_t clip_w, int64_t clip_h,
-                          GError **err) {
+                          GError **err G_GNUC_UNUSED) {
   if (clip_w >= tile_w && clip_h >= tile_h) {
     return true;
   }
+  clip_w = CLAMP(clip_w, 0, tile_w);
+  clip_h = CLAMP(clip_h, 0, tile_h);
+
+  // clear the right edge, then the rows below
+  if (clip_w < tile_w) {
+    for (int64_t y = 0; y < clip_h; y++) {
+      memset(tiledata + y * tile_w + clip_w, 0,
+             (tile_w - clip_w) * sizeof(*tiledata));
+    }
+  }
+  memset(tiledata + clip_h * tile_w, 0,
+         (tile_h - clip_h) * tile_w * sizeof(*tiledata));
 
-  cairo_surface_t *surface =
-    cairo_image_surface_create_for_data((unsigned char *) tiledata,
-                                        CAIRO_FORMAT_ARGB32,
-                                        tile_w, tile_h,
-                                        tile_w * 4);
-  cairo_t *cr = cairo_create(surface);
-  cairo_surface_destroy(surface);
-
-  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-
-  cairo_rectangle(cr, clip_w, 0, tile_w - clip_w, tile_h);
-  cairo_fill(cr);
-
-  cairo_rectangle(cr, 0, clip_h, tile_w, tile_h - clip_h);
-  cairo_fill(cr);
-
-  bool success = _openslide_check_cairo_status(cr, err);
-  cairo_destroy(cr);
-
-  return success;
+  return true;
 }
 
 // note: g_getenv() is not reentrant
@@ -385,6 +380,9 @@ void _openslide_debug_init(void) {
     }
   }
   g_strfreev(keywords);
+
+  urlio_set_trace(_openslide_debug(OPENSLIDE_DEBUG_URLIO));
+  _openslide_trace_init();
 }
 
 bool _openslide_debug(enum _openslide_debug_flag flag) {
@@ -393,6 +391,8 @@ bool _openslide_debug(enum _openslide_debug_flag flag) {
 
 void _openslide_performance_warn_once(gint *warned_flag,
                                       const char *str, ...) {
+  // counted every time, logged once
+  _openslide_stats_add(OPENSLIDE_STAT_SLOW_PATHS, 1);
   if (_openslide_debug(OPENSLIDE_DEBUG_PERFORMANCE)) {
     if (warned_flag == NULL ||
         g_atomic_int_compare_and_exchange(warned_flag, 0, 1)) {
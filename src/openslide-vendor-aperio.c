@@ -50,13 +50,26 @@ struct aperio_ops_data {
   struct _openslide_tiffcache *tc;
 };
 
+// zero-length tiles of a TIFF level, and the tiles concatenating them,
+// worked out from TileByteCounts when the level is first read
+struct missing_tiles {
+  const struct _openslide_tiff_level *tiffl;
+  struct missing_tiles *prev;  // of the previous TIFF level
+  GMutex *lock;
+  volatile gint ready;
+  uint32_t *bits;  // one per tile, once ready
+};
+
 struct level {
   struct _openslide_level base;
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
   struct level *prev;
-  GHashTable *missing_tiles;
+  struct missing_tiles *missing_tiles;  // shared with reduced levels
   uint16_t compression;
+
+  // > 0 for levels decoded from tiffl at a lower JP2K resolution
+  int reduce;
 };
 
 static void destroy_data(struct aperio_ops_data *data,
@@ -69,8 +82,11 @@ static void destroy_data(struct aperio_ops_data *data,
   if (levels) {
     for (int32_t i = 0; i < level_count; i++) {
       if (levels[i]) {
-        if (levels[i]->missing_tiles) {
-          g_hash_table_destroy(levels[i]->missing_tiles);
+        struct missing_tiles *mt = levels[i]->missing_tiles;
+        if (mt && !levels[i]->reduce) {
+          g_mutex_free(mt->lock);
+          g_free(mt->bits);
+          g_slice_free(struct missing_tiles, mt);
         }
         _openslide_grid_destroy(levels[i]->grid);
         g_slice_free(struct level, levels[i]);
@@ -86,6 +102,88 @@ static void destroy(openslide_t *osr) {
   destroy_data(data, levels, osr->level_count);
 }
 
+static bool init_missing_tiles(struct missing_tiles *mt,
+                               TIFF *tiff,
+                               GError **err) {
+  if (g_atomic_int_get(&mt->ready)) {
+    return true;
+  }
+  if (mt->prev && !init_missing_tiles(mt->prev, tiff, err)) {
+    return false;
+  }
+
+  bool success = true;
+  g_mutex_lock(mt->lock);
+  if (!mt->ready) {
+    const struct _openslide_tiff_level *tiffl = mt->tiffl;
+    int64_t count = tiffl->tiles_across * tiffl->tiles_down;
+
+    // some Aperio slides have some zero-length tiles, apparently due to
+    // an encoder bug
+    uint32_t *bits = g_new0(uint32_t, (count + 31) / 32);
+    for (int64_t tile_no = 0; tile_no < count; tile_no++) {
+      uint64_t size;
+      if (!_openslide_tiff_get_tile_size(tiffl, tiff,
+                                         tile_no % tiffl->tiles_across,
+                                         tile_no / tiffl->tiles_across,
+                                         &size, err)) {
+        g_free(bits);
+        success = false;
+        goto DONE;
+      }
+      if (size == 0) {
+        bits[tile_no / 32] |= 1U << (tile_no % 32);
+      }
+    }
+
+    // tiles concatenating a missing tile are sometimes corrupt, so we mark
+    // them missing too
+    if (mt->prev) {
+      const struct _openslide_tiff_level *prev_tiffl = mt->prev->tiffl;
+      int64_t tile_concat_x = round((double) prev_tiffl->tiles_across /
+                                    tiffl->tiles_across);
+      int64_t tile_concat_y = round((double) prev_tiffl->tiles_down /
+                                    tiffl->tiles_down);
+      int64_t prev_count = prev_tiffl->tiles_across * prev_tiffl->tiles_down;
+      for (int64_t word = 0; word < (prev_count + 31) / 32; word++) {
+        uint32_t prev_bits = mt->prev->bits[word];
+        while (prev_bits) {
+          int64_t prev_tile_no = word * 32 + __builtin_ctz(prev_bits);
+          prev_bits &= prev_bits - 1;
+          int64_t col = prev_tile_no % prev_tiffl->tiles_across /
+                        tile_concat_x;
+          int64_t row = prev_tile_no / prev_tiffl->tiles_across /
+                        tile_concat_y;
+          int64_t tile_no = row * tiffl->tiles_across + col;
+          if (col < tiffl->tiles_across && tile_no < count) {
+            bits[tile_no / 32] |= 1U << (tile_no % 32);
+          }
+        }
+      }
+    }
+
+    mt->bits = bits;
+    g_atomic_int_set(&mt->ready, 1);
+  }
+DONE:
+  g_mutex_unlock(mt->lock);
+  return success;
+}
+
+static bool is_missing_tile(struct level *l,
+                            TIFF *tiff,
+                            int64_t tile_col, int64_t tile_row,
+                            bool *missing,
+                            GError **err) {
+  struct missing_tiles *mt = l->missing_tiles;
+  if (!init_missing_tiles(mt, tiff, err)) {
+    return false;
+  }
+  int64_t tile_no = tile_row * l->tiffl.tiles_across + tile_col;
+  *missing = (mt->bits[tile_no / 32] >> (tile_no % 32)) & 1;
+  return true;
+}
+
 static bool render_missing_tile(struct level *l,
                                 TIFF *tiff,
                                 uint32_t *dest,
@@ -93,8 +191,8 @@ static bool render_missing_tile(struct level *l,
                                 GError **err) {
   bool success = true;
 
-  int64_t tw = l->tiffl.tile_w;
-  int64_t th = l->tiffl.tile_h;
+  int64_t tw = l->tiffl.tile_w >> l->reduce;
+  int64_t th = l->tiffl.tile_h >> l->reduce;
 
   // always fill with transparent (needed for SATURATE)
   memset(dest, 0, tw * th * 4);
@@ -141,8 +239,11 @@ static bool decode_tile(struct level *l,
   struct _openslide_tiff_level *tiffl = &l->tiffl;
 
   // check for missing tile
-  int64_t tile_no = tile_row * tiffl->tiles_across + tile_col;
-  if (g_hash_table_lookup_extended(l->missing_tiles, &tile_no, NULL, NULL)) {
+  bool missing;
+  if (!is_missing_tile(l, tiff, tile_col, tile_row, &missing, err)) {
+    return false;
+  }
+  if (missing) {
     //g_debug("missing tile in level %p: (%"PRId64", %"PRId64")", (void *) l, tile_col, tile_row);
     return render_missing_tile(l, tiff, dest,
                                tile_col, tile_row, err);
@@ -159,47 +260,50 @@ static bool decode_tile(struct level *l,
     break;
   default:
     // not for us? fallback
+    g_assert(l->reduce == 0);
     return _openslide_tiff_read_tile(tiffl, tiff, dest,
                                      tile_col, tile_row,
                                      err);
   }
 
   // read raw tile
-  void *buf;
-  int32_t buflen;
-  if (!_openslide_tiff_read_tile_data(tiffl, tiff,
-                                      &buf, &buflen,
+  URLIO_VIEW *view;
+  if (!_openslide_tiff_read_tile_view(tiffl, tiff, &view,
                                       tile_col, tile_row,
                                       err)) {
     return false;  // ok, haven't allocated anything yet
   }
 
-  // decompress
-  bool success = _openslide_jp2k_decode_buffer(dest,
-                                               tiffl->tile_w, tiffl->tile_h,
-                                               buf, buflen,
-                                               space,
-                                               err);
+  // decompress; OpenJPEG CVE-2013-6045 breakage is reported here, on the
+  // first read (see openslide-decode-jp2k.c)
+  bool success = _openslide_jp2k_decode_buffer_reduced(dest,
+                                                       tiffl->tile_w,
+                                                       tiffl->tile_h,
+                                                       view->data, view->len,
+                                                       space,
+                                                       l->reduce,
+                                                       err);
 
   // clean up
-  g_free(buf);
+  urlio_view_release(view);
 
   return success;
 }
 
-static bool read_tile(openslide_t *osr,
-		      cairo_t *cr,
-		      struct _openslide_level *level,
-		      int64_t tile_col, int64_t tile_row,
-		      void *arg,
-		      GError **err) {
+static bool get_tile(openslide_t *osr,
+                     struct _openslide_level *level,
+                     int64_t tile_col, int64_t tile_row,
+                     void *arg,
+                     uint32_t **_tiledata,
+                     struct _openslide_cache_entry **_cache_entry,
+                     GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
   TIFF *tiff = arg;
 
   // tile size
-  int64_t tw = tiffl->tile_w;
-  int64_t th = tiffl->tile_h;
+  int64_t tw = tiffl->tile_w >> l->reduce;
+  int64_t th = tiffl->tile_h >> l->reduce;
 
   // cache
   struct _openslide_cache_entry *cache_entry;
@@ -207,17 +311,18 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!decode_tile(l, tiff, tiledata, tile_col, tile_row, err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
     // clip, if necessary
-    if (!_openslide_tiff_clip_tile(tiffl, tiledata,
-                                   tile_col, tile_row,
-                                   err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+    if (!_openslide_clip_tile(tiledata, tw, th,
+                              l->base.w - tile_col * tw,
+                              l->base.h - tile_row * th,
+                              err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -227,6 +332,30 @@ static bool read_tile(openslide_t *osr,
 			 &cache_entry);
   }
 
+  *_tiledata = tiledata;
+  *_cache_entry = cache_entry;
+  return true;
+}
+
+static bool read_tile(openslide_t *osr,
+		      cairo_t *cr,
+		      struct _openslide_level *level,
+		      int64_t tile_col, int64_t tile_row,
+		      void *arg,
+		      GError **err) {
+  struct level *l = (struct level *) level;
+
+  // tile size
+  int64_t tw = l->tiffl.tile_w >> l->reduce;
+  int64_t th = l->tiffl.tile_h >> l->reduce;
+
+  uint32_t *tiledata;
+  struct _openslide_cache_entry *cache_entry;
+  if (!get_tile(osr, level, tile_col, tile_row, arg,
+                &tiledata, &cache_entry, err)) {
+    return false;
+  }
+
   // draw it
   cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
 								 CAIRO_FORMAT_ARGB32,
@@ -255,6 +384,13 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
     return false;
   }
 
+  // request the tiles all at once rather than one by one
+  int64_t scale = 1 << l->reduce;
+  _openslide_tiff_fetch_region(&l->tiffl, tiff, osr->cache, level,
+                               x / l->base.downsample * scale,
+                               y / l->base.downsample * scale,
+                               w * scale, h * scale, 0, NULL);
+
   bool success = _openslide_grid_paint_region(l->grid, cr, tiff,
                                               x / l->base.downsample,
                                               y / l->base.downsample,
@@ -265,13 +401,136 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool prefetch_region(openslide_t *osr,
+                            int64_t x, int64_t y,
+                            struct _openslide_level *level,
+                            int64_t w, int64_t h,
+                            int prefetch_id,
+                            GError **err) {
+  struct aperio_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+
+  int64_t scale = 1 << l->reduce;
+  bool success = _openslide_tiff_fetch_region(&l->tiffl, tiff,
+                                              osr->cache, level,
+                                              x / l->base.downsample * scale,
+                                              y / l->base.downsample * scale,
+                                              w * scale, h * scale,
+                                              prefetch_id, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int32_t *len, const char **codec,
+                          GError **err) {
+  struct aperio_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+  bool jp2k = l->compression == APERIO_COMPRESSION_JP2K_YCBCR ||
+              l->compression == APERIO_COMPRESSION_JP2K_RGB;
+
+  // only stored tiles, and not the missing ones we synthesize
+  *buf = NULL;
+  if (l->reduce || (!jp2k && !tiffl->tile_read_direct)) {
+    return true;
+  }
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool missing = false;
+  if (!is_missing_tile(l, tiff, tile_col, tile_row, &missing, err)) {
+    _openslide_tiffcache_put(data->tc, tiff);
+    return false;
+  }
+  if (missing) {
+    _openslide_tiffcache_put(data->tc, tiff);
+    return true;
+  }
+
+  bool success;
+  if (jp2k) {
+    // the tiles are bare codestreams
+    URLIO_VIEW *view;
+    success = _openslide_tiff_read_tile_view(tiffl, tiff, &view,
+                                             tile_col, tile_row, err);
+    if (success) {
+      *buf = g_memdup(view->data, view->len);
+      *len = view->len;
+      urlio_view_release(view);
+    }
+    *codec = OPENSLIDE_TILE_CODEC_JP2K;
+  } else {
+    success = _openslide_tiff_read_raw_jpeg_tile(tiffl, tiff, buf, len,
+                                                 tile_col, tile_row, err);
+    *codec = OPENSLIDE_TILE_CODEC_JPEG;
+  }
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
+static bool read_level_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            uint32_t **tiledata,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
+  struct aperio_ops_data *data = osr->data;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool success = get_tile(osr, level, tile_col, tile_row, tiff,
+                          tiledata, cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
+static bool prefetch_tiles(openslide_t *osr,
+                           struct _openslide_level *level,
+                           const int64_t *tiles, int64_t count,
+                           GError **err) {
+  struct aperio_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool success = _openslide_tiff_fetch_tiles(&l->tiffl, tiff,
+                                             osr->cache, level,
+                                             tiles, count, 0, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
 static const struct _openslide_ops aperio_ops = {
   .paint_region = paint_region,
+  .prefetch_region = prefetch_region,
+  .read_raw_tile = read_raw_tile,
+  .read_level_tile = read_level_tile,
+  .prefetch_tiles = prefetch_tiles,
   .destroy = destroy,
 };
 
 static bool aperio_detect(const char *filename G_GNUC_UNUSED,
-                          struct _openslide_tifflike *tl, GError **err) {
+                          struct _openslide_probe *probe, GError **err) {
+  struct _openslide_tifflike *tl = probe->tl;
+
   // ensure we have a TIFF
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -381,51 +640,65 @@ static bool add_associated_image(openslide_t *osr,
   return result;
 }
 
-static void propagate_missing_tile(void *key, void *value G_GNUC_UNUSED,
-                                   void *data) {
-  const int64_t *tile_no = key;
-  struct level *next_l = data;
-  struct level *l = next_l->prev;
-  struct _openslide_tiff_level *tiffl = &l->tiffl;
-  struct _openslide_tiff_level *next_tiffl = &next_l->tiffl;
-
-  int64_t tile_col = *tile_no % tiffl->tiles_across;
-  int64_t tile_row = *tile_no / tiffl->tiles_across;
-
-  int64_t tile_concat_x = round((double) tiffl->tiles_across /
-                                next_tiffl->tiles_across);
-  int64_t tile_concat_y = round((double) tiffl->tiles_down /
-                                next_tiffl->tiles_down);
-
-  int64_t next_tile_col = tile_col / tile_concat_x;
-  int64_t next_tile_row = tile_row / tile_concat_y;
-
-  //g_debug("propagating %p (%"PRId64", %"PRId64") to %p (%"PRId64", %"PRId64")", (void *) l, tile_col, tile_row, (void *) next_l, next_tile_col, next_tile_row);
+// Fill gaps in a JP2K pyramid with levels decoded from the next larger
+// level at its lower wavelet resolutions, 1/2 to 1/8 of its size, which
+// OpenJPEG decodes without the finer subbands.
+static void add_reduced_levels(openslide_t *osr,
+                               struct level ***_levels,
+                               int32_t *_level_count) {
+  struct level **levels = *_levels;
+  int32_t level_count = *_level_count;
+  GPtrArray *expanded = g_ptr_array_new();
+
+  for (int32_t i = 0; i < level_count; i++) {
+    struct level *l = levels[i];
+    struct level *next_l = i + 1 < level_count ? levels[i + 1] : NULL;
+    if (expanded->len) {
+      l->prev = expanded->pdata[expanded->len - 1];
+    }
+    g_ptr_array_add(expanded, l);
 
-  int64_t *next_tile_no = g_new(int64_t, 1);
-  *next_tile_no = next_tile_row * next_tiffl->tiles_across + next_tile_col;
-  g_hash_table_insert(next_l->missing_tiles, next_tile_no, NULL);
-}
+    if (l->compression != APERIO_COMPRESSION_JP2K_YCBCR &&
+        l->compression != APERIO_COMPRESSION_JP2K_RGB) {
+      continue;
+    }
+    for (int reduce = 1; reduce <= 3; reduce++) {
+      // reduced tiles must keep whole, evenly subsampled chroma, and the
+      // level must be larger than the next stored one
+      if ((l->tiffl.tile_w % (2 << reduce)) ||
+          (l->tiffl.tile_h % (2 << reduce))) {
+        continue;
+      }
+      int64_t w = l->base.w >> reduce;
+      int64_t h = l->base.h >> reduce;
+      if (!w || !h || (next_l && w <= next_l->base.w)) {
+        continue;
+      }
 
-// check for OpenJPEG CVE-2013-6045 breakage
-// (see openslide-decode-jp2k.c)
-static bool test_tile_decoding(struct level *l,
-                               TIFF *tiff,
-                               GError **err) {
-  // only for JP2K slides.
-  // shouldn't affect RGB, but check anyway out of caution
-  if (l->compression != APERIO_COMPRESSION_JP2K_YCBCR &&
-      l->compression != APERIO_COMPRESSION_JP2K_RGB) {
-    return true;
+      struct level *r_l = g_slice_new0(struct level);
+      r_l->tiffl = l->tiffl;
+      r_l->compression = l->compression;
+      r_l->missing_tiles = l->missing_tiles;
+      r_l->reduce = reduce;
+      r_l->prev = expanded->pdata[expanded->len - 1];
+      r_l->base.w = w;
+      r_l->base.h = h;
+      r_l->base.tile_w = l->tiffl.tile_w >> reduce;
+      r_l->base.tile_h = l->tiffl.tile_h >> reduce;
+      r_l->grid = _openslide_grid_create_simple(osr,
+                                                l->tiffl.tiles_across,
+                                                l->tiffl.tiles_down,
+                                                r_l->base.tile_w,
+                                                r_l->base.tile_h,
+                                                read_tile);
+      _openslide_grid_simple_set_tile_fn(r_l->grid, get_tile);
+      g_ptr_array_add(expanded, r_l);
+    }
   }
 
-  int64_t tw = l->tiffl.tile_w;
-  int64_t th = l->tiffl.tile_h;
-
-  uint32_t *dest = g_slice_alloc(tw * th * 4);
-  bool ok = decode_tile(l, tiff, dest, 0, 0, err);
-  g_slice_free1(tw * th * 4, dest);
-  return ok;
+  g_free(levels);
+  *_level_count = expanded->len;
+  *_levels = (struct level **) g_ptr_array_free(expanded, false);
 }
 
 static bool aperio_open(openslide_t *osr,
@@ -437,7 +710,7 @@ static bool aperio_open(openslide_t *osr,
   int32_t level_count = 0;
 
   // open TIFF
-  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename);
+  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename, tl);
   TIFF *tiff = _openslide_tiffcache_get(tc, err);
   if (!tiff) {
     goto FAIL;
@@ -529,6 +802,7 @@ static bool aperio_open(openslide_t *osr,
                                               tiffl->tile_w,
                                               tiffl->tile_h,
                                               read_tile);
+      _openslide_grid_simple_set_tile_fn(l->grid, get_tile);
 
       // get compression
       if (!TIFFGetField(tiff, TIFFTAG_COMPRESSION, &l->compression)) {
@@ -537,24 +811,11 @@ static bool aperio_open(openslide_t *osr,
         goto FAIL;
       }
 
-      // some Aperio slides have some zero-length tiles, apparently due to
-      // an encoder bug
-      toff_t *tile_sizes;
-      if (!TIFFGetField(tiff, TIFFTAG_TILEBYTECOUNTS, &tile_sizes)) {
-        g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                    "Cannot get tile sizes");
-        goto FAIL;
-      }
-      l->missing_tiles = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                                               g_free, NULL);
-      for (ttile_t tile_no = 0;
-           tile_no < tiffl->tiles_across * tiffl->tiles_down; tile_no++) {
-        if (tile_sizes[tile_no] == 0) {
-          int64_t *p_tile_no = g_new(int64_t, 1);
-          *p_tile_no = tile_no;
-          g_hash_table_insert(l->missing_tiles, p_tile_no, NULL);
-        }
-      }
+      struct missing_tiles *mt = g_slice_new0(struct missing_tiles);
+      mt->tiffl = tiffl;
+      mt->prev = l->prev ? l->prev->missing_tiles : NULL;
+      mt->lock = g_mutex_new();
+      l->missing_tiles = mt;
     } else {
       // associated image
       const char *name = (dir == 1) ? "thumbnail" : NULL;
@@ -565,18 +826,6 @@ static bool aperio_open(openslide_t *osr,
     }
   } while (TIFFReadDirectory(tiff));
 
-  // tiles concatenating a missing tile are sometimes corrupt, so we mark
-  // them missing too
-  for (i = 0; i < level_count - 1; i++) {
-    g_hash_table_foreach(levels[i]->missing_tiles, propagate_missing_tile,
-                         levels[i + 1]);
-  }
-
-  // check for OpenJPEG CVE-2013-6045 breakage
-  if (!test_tile_decoding(levels[0], tiff, err)) {
-    goto FAIL;
-  }
-
   // read properties
   if (!_openslide_tiff_set_dir(tiff, 0, err)) {
     goto FAIL;
@@ -599,6 +848,9 @@ static bool aperio_open(openslide_t *osr,
     goto FAIL;
   }
 
+  // synthesize intermediate levels
+  add_reduced_levels(osr, &levels, &level_count);
+
   // store osr data
   g_assert(osr->data == NULL);
   g_assert(osr->levels == NULL);
@@ -46,6 +46,9 @@ struct level {
   struct _openslide_level base;
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
+
+  // > 1 for levels decoded from tiffl at reduced size by libjpeg
+  int scale_denom;
 };
 
 static void destroy(openslide_t *osr) {
@@ -61,19 +64,33 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
-static bool read_tile(openslide_t *osr,
-                      cairo_t *cr,
-                      struct _openslide_level *level,
-                      int64_t tile_col, int64_t tile_row,
-                      void *arg,
-                      GError **err) {
+// indexed levels are read without a TIFF handle
+static bool get_tiff(struct generic_tiff_ops_data *data,
+                     struct level *l,
+                     TIFF **tiff,
+                     GError **err) {
+  *tiff = NULL;
+  if (_openslide_tiff_level_is_indexed(&l->tiffl)) {
+    return true;
+  }
+  *tiff = _openslide_tiffcache_get(data->tc, err);
+  return *tiff != NULL;
+}
+
+static bool get_tile(openslide_t *osr,
+                     struct _openslide_level *level,
+                     int64_t tile_col, int64_t tile_row,
+                     void *arg,
+                     uint32_t **_tiledata,
+                     struct _openslide_cache_entry **_cache_entry,
+                     GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
   TIFF *tiff = arg;
 
   // tile size
-  int64_t tw = tiffl->tile_w;
-  int64_t th = tiffl->tile_h;
+  int64_t tw = tiffl->tile_w / l->scale_denom;
+  int64_t th = tiffl->tile_h / l->scale_denom;
 
   // cache
   struct _openslide_cache_entry *cache_entry;
@@ -81,19 +98,21 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
-    if (!_openslide_tiff_read_tile(tiffl, tiff,
-                                   tiledata, tile_col, tile_row,
-                                   err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
+    if (!_openslide_tiff_read_tile_scaled(tiffl, tiff,
+                                          tiledata, tile_col, tile_row,
+                                          l->scale_denom,
+                                          err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
     // clip, if necessary
-    if (!_openslide_tiff_clip_tile(tiffl, tiledata,
-                                   tile_col, tile_row,
-                                   err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+    if (!_openslide_clip_tile(tiledata, tw, th,
+                              l->base.w - tile_col * tw,
+                              l->base.h - tile_row * th,
+                              err)) {
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -103,6 +122,30 @@ static bool read_tile(openslide_t *osr,
                          &cache_entry);
   }
 
+  *_tiledata = tiledata;
+  *_cache_entry = cache_entry;
+  return true;
+}
+
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct level *l = (struct level *) level;
+
+  // tile size
+  int64_t tw = l->tiffl.tile_w / l->scale_denom;
+  int64_t th = l->tiffl.tile_h / l->scale_denom;
+
+  uint32_t *tiledata;
+  struct _openslide_cache_entry *cache_entry;
+  if (!get_tile(osr, level, tile_col, tile_row, arg,
+                &tiledata, &cache_entry, err)) {
+    return false;
+  }
+
   // draw it
   cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
                                                                  CAIRO_FORMAT_ARGB32,
@@ -126,11 +169,18 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   struct generic_tiff_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
 
-  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
-  if (tiff == NULL) {
+  TIFF *tiff;
+  if (!get_tiff(data, l, &tiff, err)) {
     return false;
   }
 
+  // request the tiles all at once rather than one by one
+  _openslide_tiff_fetch_region(&l->tiffl, tiff, osr->cache, level,
+                               x / l->base.downsample * l->scale_denom,
+                               y / l->base.downsample * l->scale_denom,
+                               w * l->scale_denom, h * l->scale_denom,
+                               0, NULL);
+
   bool success = _openslide_grid_paint_region(l->grid, cr, tiff,
                                               x / l->base.downsample,
                                               y / l->base.downsample,
@@ -141,14 +191,113 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool prefetch_region(openslide_t *osr,
+                            int64_t x, int64_t y,
+                            struct _openslide_level *level,
+                            int64_t w, int64_t h,
+                            int prefetch_id,
+                            GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff;
+  if (!get_tiff(data, l, &tiff, err)) {
+    return false;
+  }
+
+  bool success = _openslide_tiff_fetch_region(&l->tiffl, tiff,
+                                              osr->cache, level,
+                                              x / l->base.downsample * l->scale_denom,
+                                              y / l->base.downsample * l->scale_denom,
+                                              w * l->scale_denom,
+                                              h * l->scale_denom,
+                                              prefetch_id, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
+static bool read_raw_tile(openslide_t *osr,
+                          struct _openslide_level *level,
+                          int64_t tile_col, int64_t tile_row,
+                          void **buf, int32_t *len, const char **codec,
+                          GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  // only stored JPEG tiles
+  if (l->scale_denom != 1 || !l->tiffl.tile_read_direct) {
+    *buf = NULL;
+    return true;
+  }
+
+  TIFF *tiff;
+  if (!get_tiff(data, l, &tiff, err)) {
+    return false;
+  }
+  bool success = _openslide_tiff_read_raw_jpeg_tile(&l->tiffl, tiff,
+                                                    buf, len,
+                                                    tile_col, tile_row,
+                                                    err);
+  _openslide_tiffcache_put(data->tc, tiff);
+  *codec = OPENSLIDE_TILE_CODEC_JPEG;
+
+  return success;
+}
+
+static bool read_level_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            uint32_t **tiledata,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff;
+  if (!get_tiff(data, l, &tiff, err)) {
+    return false;
+  }
+  bool success = get_tile(osr, level, tile_col, tile_row, tiff,
+                          tiledata, cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
+static bool prefetch_tiles(openslide_t *osr,
+                           struct _openslide_level *level,
+                           const int64_t *tiles, int64_t count,
+                           GError **err) {
+  struct generic_tiff_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff;
+  if (!get_tiff(data, l, &tiff, err)) {
+    return false;
+  }
+  bool success = _openslide_tiff_fetch_tiles(&l->tiffl, tiff,
+                                             osr->cache, level,
+                                             tiles, count, 0, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
 static const struct _openslide_ops generic_tiff_ops = {
   .paint_region = paint_region,
+  .prefetch_region = prefetch_region,
+  .read_raw_tile = read_raw_tile,
+  .read_level_tile = read_level_tile,
+  .prefetch_tiles = prefetch_tiles,
   .destroy = destroy,
 };
 
 static bool generic_tiff_detect(const char *filename G_GNUC_UNUSED,
-                                struct _openslide_tifflike *tl,
+                                struct _openslide_probe *probe,
                                 GError **err) {
+  struct _openslide_tifflike *tl = probe->tl;
+
   // ensure we have a TIFF
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -179,6 +328,57 @@ static int width_compare(gconstpointer a, gconstpointer b) {
   }
 }
 
+// Fill gaps in the pyramid with levels decoded from the next larger JPEG
+// level at 1/2, 1/4 and 1/8 scale, which libjpeg does for a fraction of
+// the cost of a full decode.  Each has its own cache plane.
+static void add_scaled_levels(openslide_t *osr, GPtrArray *level_array) {
+  GPtrArray *stored = g_ptr_array_sized_new(level_array->len);
+  for (guint i = 0; i < level_array->len; i++) {
+    g_ptr_array_add(stored, level_array->pdata[i]);
+  }
+  g_ptr_array_set_size(level_array, 0);
+
+  for (guint i = 0; i < stored->len; i++) {
+    struct level *l = stored->pdata[i];
+    struct level *next_l = i + 1 < stored->len ? stored->pdata[i + 1] : NULL;
+    g_ptr_array_add(level_array, l);
+
+    if (!l->tiffl.tile_read_direct) {
+      continue;
+    }
+    for (int scale_denom = 2; scale_denom <= 8; scale_denom <<= 1) {
+      // tiles must divide evenly, and the level must be larger than the
+      // next stored one
+      if ((l->tiffl.tile_w % scale_denom) ||
+          (l->tiffl.tile_h % scale_denom)) {
+        continue;
+      }
+      int64_t w = l->base.w / scale_denom;
+      int64_t h = l->base.h / scale_denom;
+      if (!w || !h || (next_l && w <= next_l->base.w)) {
+        continue;
+      }
+
+      struct level *sd_l = g_slice_new0(struct level);
+      sd_l->tiffl = l->tiffl;
+      sd_l->scale_denom = scale_denom;
+      sd_l->base.w = w;
+      sd_l->base.h = h;
+      sd_l->base.tile_w = l->tiffl.tile_w / scale_denom;
+      sd_l->base.tile_h = l->tiffl.tile_h / scale_denom;
+      sd_l->grid = _openslide_grid_create_simple(osr,
+                                                 l->tiffl.tiles_across,
+                                                 l->tiffl.tiles_down,
+                                                 sd_l->base.tile_w,
+                                                 sd_l->base.tile_h,
+                                                 read_tile);
+      _openslide_grid_simple_set_tile_fn(sd_l->grid, get_tile);
+      g_ptr_array_add(level_array, sd_l);
+    }
+  }
+  g_ptr_array_free(stored, true);
+}
+
 static bool generic_tiff_open(openslide_t *osr,
                               const char *filename,
                               struct _openslide_tifflike *tl,
@@ -187,7 +387,7 @@ static bool generic_tiff_open(openslide_t *osr,
   GPtrArray *level_array = g_ptr_array_new();
 
   // open TIFF
-  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename);
+  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename, tl);
   TIFF *tiff = _openslide_tiffcache_get(tc, err);
   if (!tiff) {
     goto FAIL;
@@ -227,6 +427,7 @@ static bool generic_tiff_open(openslide_t *osr,
 
     // create level
     struct level *l = g_slice_new0(struct level);
+    l->scale_denom = 1;
     struct _openslide_tiff_level *tiffl = &l->tiffl;
     if (!_openslide_tiff_level_init(tiff,
                                     TIFFCurrentDirectory(tiff),
@@ -242,6 +443,7 @@ static bool generic_tiff_open(openslide_t *osr,
                                             tiffl->tile_w,
                                             tiffl->tile_h,
                                             read_tile);
+    _openslide_grid_simple_set_tile_fn(l->grid, get_tile);
 
     // add to array
     g_ptr_array_add(level_array, l);
@@ -259,6 +461,9 @@ static bool generic_tiff_open(openslide_t *osr,
     goto FAIL;
   }
 
+  // synthesize intermediate levels
+  add_scaled_levels(osr, level_array);
+
   // unwrap level array
   int32_t level_count = level_array->len;
   struct level **levels =
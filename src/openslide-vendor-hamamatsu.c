@@ -59,6 +59,13 @@
 #include "openslide-hash.h"
 
 #define NGR_TILE_HEIGHT 64
+// largest read of an NGR column stripe
+#define NGR_READ_MAX (16 << 20)
+
+// restart marker scan
+#define RESTART_MARKER_READAHEAD (8 << 20)
+#define MCU_CACHE_DIR_ENV_VAR "OPENSLIDE_MCU_CACHE_DIR"
+static const char MCU_CACHE_MAGIC[8] = "OSMCUST1";
 
 // VMS/VMU
 static const char GROUP_VMS[] = "Virtual Microscope Specimen";
@@ -113,6 +120,7 @@ struct jpeg {
   int32_t tile_count;
   int64_t *mcu_starts;
   int64_t *unreliable_mcu_starts;
+  GMutex *mcu_starts_mutex;
 
   int64_t sof_position;
   int64_t header_stop_position;
@@ -138,16 +146,20 @@ struct hamamatsu_jpeg_ops_data {
   int32_t jpeg_count;
   struct jpeg **all_jpegs;
 
-  // thread stuff, for background search of restart markers
+  // sidecar holding the MCU starts, NULL if not cached
+  char *mcu_cache_path;
+
+  // background search of restart markers, one task per JPEG
   GTimer *restart_marker_timer;
-  GMutex *restart_marker_mutex;
-  GThread *restart_marker_thread;
+  struct _openslide_work_group *restart_marker_group;
+  volatile gint restart_marker_pending;
 
   GCond *restart_marker_cond;
   GMutex *restart_marker_cond_mutex;
   uint32_t restart_marker_users;
   bool restart_marker_thread_throttle;
   bool restart_marker_thread_stop;
+  bool restart_marker_thread_failed;
   GError *restart_marker_thread_error;
 };
 
@@ -156,6 +168,7 @@ struct ngr_level {
   struct _openslide_grid *grid;
 
   char *filename;
+  URLIO_FILE *f;  // shared by all readers, through urlio_pread
 
   int64_t start_in_file;
 
@@ -288,6 +301,9 @@ static void jpeg_destroy_data(int32_t num_jpegs, struct jpeg **jpegs,
     g_free(jpeg->filename);
     g_free(jpeg->mcu_starts);
     g_free(jpeg->unreliable_mcu_starts);
+    if (jpeg->mcu_starts_mutex) {
+      g_mutex_free(jpeg->mcu_starts_mutex);
+    }
     g_slice_free(struct jpeg, jpeg);
   }
 
@@ -517,14 +533,13 @@ static bool _compute_mcu_start(struct jpeg *jpeg,
   return true;
 }
 
-static bool compute_mcu_start(openslide_t *osr,
+static bool compute_mcu_start(openslide_t *osr G_GNUC_UNUSED,
 			      struct jpeg *jpeg,
 			      URLIO_FILE *f,
 			      int64_t tileno,
 			      int64_t *start_position,
 			      int64_t *stop_position,
 			      GError **err) {
-  struct hamamatsu_jpeg_ops_data *data = osr->data;
   bool success = false;
 
   if (tileno < 0 || tileno >= jpeg->tile_count) {
@@ -533,7 +548,7 @@ static bool compute_mcu_start(openslide_t *osr,
     return false;
   }
 
-  g_mutex_lock(data->restart_marker_mutex);
+  g_mutex_lock(jpeg->mcu_starts_mutex);
 
   if (!_compute_mcu_start(jpeg, f, tileno, err)) {
     goto OUT;
@@ -562,7 +577,7 @@ static bool compute_mcu_start(openslide_t *osr,
   success = true;
 
 OUT:
-  g_mutex_unlock(data->restart_marker_mutex);
+  g_mutex_unlock(jpeg->mcu_starts_mutex);
   return success;
 }
 
@@ -691,13 +706,13 @@ static bool read_jpeg_tile(openslide_t *osr,
                                             &cache_entry);
 
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!read_from_jpeg(osr,
                         jp, tileno,
                         l->scale_denom,
                         tiledata, tw, th,
                         err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -759,7 +774,7 @@ static bool jpeg_paint_region(openslide_t *osr, cairo_t *cr,
   if (!--data->restart_marker_users) {
     g_timer_start(data->restart_marker_timer);
     //  g_debug("telling thread to awaken");
-    g_cond_signal(data->restart_marker_cond);
+    g_cond_broadcast(data->restart_marker_cond);
   }
   g_mutex_unlock(data->restart_marker_cond_mutex);
 
@@ -769,14 +784,14 @@ static bool jpeg_paint_region(openslide_t *osr, cairo_t *cr,
 static void jpeg_do_destroy(openslide_t *osr) {
   struct hamamatsu_jpeg_ops_data *data = osr->data;
 
-  // tell the thread to finish and wait
+  // tell the scans to finish and wait
   g_mutex_lock(data->restart_marker_cond_mutex);
   g_warn_if_fail(data->restart_marker_users == 0);
   data->restart_marker_thread_stop = true;
-  g_cond_signal(data->restart_marker_cond);
+  g_cond_broadcast(data->restart_marker_cond);
   g_mutex_unlock(data->restart_marker_cond_mutex);
-  if (data->restart_marker_thread) {
-    g_thread_join(data->restart_marker_thread);
+  if (data->restart_marker_group) {
+    _openslide_work_group_finish(data->restart_marker_group, false);
   }
 
   // jpegs and levels
@@ -789,10 +804,10 @@ static void jpeg_do_destroy(openslide_t *osr) {
     g_error_free(data->restart_marker_thread_error);
   }
   g_mutex_unlock(data->restart_marker_cond_mutex);
-  g_mutex_free(data->restart_marker_mutex);
   g_timer_destroy(data->restart_marker_timer);
   g_cond_free(data->restart_marker_cond);
   g_mutex_free(data->restart_marker_cond_mutex);
+  g_free(data->mcu_cache_path);
 
   // the structure
   g_slice_free(struct hamamatsu_jpeg_ops_data, data);
@@ -804,15 +819,23 @@ static const struct _openslide_ops hamamatsu_jpeg_ops = {
 };
 
 static bool hamamatsu_vms_vmu_detect(const char *filename,
-                                     struct _openslide_tifflike *tl,
+                                     struct _openslide_probe *probe,
                                      GError **err) {
   // reject TIFFs
-  if (tl) {
+  if (probe->tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Is a TIFF file");
     return false;
   }
 
+  // reject what can't be a key file without reading it again
+  if (probe->size > KEY_FILE_MAX_SIZE ||
+      memchr(probe->head, 0, probe->head_len)) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Not a key file");
+    return false;
+  }
+
   // try to parse key file
   GKeyFile *key_file = _openslide_read_key_file(filename, KEY_FILE_MAX_SIZE,
                                                 G_KEY_FILE_NONE, err);
@@ -902,20 +925,174 @@ static bool verify_mcu_starts(int32_t num_jpegs, struct jpeg **jpegs,
   return true;
 }
 
-static gpointer restart_marker_thread_func(gpointer d) {
-  openslide_t *osr = d;
-  struct hamamatsu_jpeg_ops_data *data = osr->data;
+// the first MCU start is filled in on demand, from the header
+static bool mcu_starts_complete(const struct jpeg *jp) {
+  for (int32_t i = 1; i < jp->tile_count; i++) {
+    if (jp->mcu_starts[i] == -1) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  int32_t current_jpeg = 0;
-  int32_t current_mcu_start = 0;
+// the sidecar is keyed by the quickhash and the JPEG sizes, since the
+// quickhash doesn't cover the JPEGs themselves
+static char *get_mcu_cache_path(struct _openslide_hash *quickhash1,
+                                int32_t num_jpegs, struct jpeg **jpegs) {
+  const char *env = g_getenv(MCU_CACHE_DIR_ENV_VAR);
+  if (env && !*env) {
+    // disabled
+    return NULL;
+  }
+  char *hash_str = _openslide_hash_copy_string(quickhash1);
+  if (hash_str == NULL) {
+    return NULL;
+  }
 
-  URLIO_FILE *current_file = NULL;
+  GString *key = g_string_new(hash_str);
+  for (int32_t i = 0; i < num_jpegs; i++) {
+    g_string_append_printf(key, "\n%d %"PRId64,
+                           jpegs[i]->tile_count, jpegs[i]->end_in_file);
+  }
+  char *name = g_compute_checksum_for_string(G_CHECKSUM_SHA256,
+                                             key->str, key->len);
+  char *path;
+  if (env) {
+    path = g_strdup_printf("%s" G_DIR_SEPARATOR_S "%s.mcu", env, name);
+  } else {
+    path = g_strdup_printf("%s" G_DIR_SEPARATOR_S "openslide"
+                           G_DIR_SEPARATOR_S "mcu-starts"
+                           G_DIR_SEPARATOR_S "%s.mcu",
+                           g_get_user_cache_dir(), name);
+  }
+  g_free(name);
+  g_string_free(key, true);
+  g_free(hash_str);
+  return path;
+}
 
-  GError *tmp_err = NULL;
+// fill in the MCU starts from the sidecar, all or nothing; tables which
+// don't fit the JPEGs are ignored
+static bool load_mcu_starts(struct hamamatsu_jpeg_ops_data *data) {
+  char *buf;
+  gsize len;
+  if (!g_file_get_contents(data->mcu_cache_path, &buf, &len, NULL)) {
+    return false;
+  }
 
-  while(current_jpeg < data->jpeg_count) {
-    g_mutex_lock(data->restart_marker_cond_mutex);
+  bool success = false;
+  const char *p = buf;
+  const char *end = buf + len;
+  uint32_t u32;
+  uint64_t u64;
+
+  if (len < sizeof(MCU_CACHE_MAGIC) + sizeof(u32) ||
+      memcmp(p, MCU_CACHE_MAGIC, sizeof(MCU_CACHE_MAGIC))) {
+    goto DONE;
+  }
+  p += sizeof(MCU_CACHE_MAGIC);
+  memcpy(&u32, p, sizeof(u32));
+  p += sizeof(u32);
+  if ((int32_t) GUINT32_FROM_LE(u32) != data->jpeg_count) {
+    goto DONE;
+  }
+
+  // validate everything before touching the JPEGs
+  const char *tables = p;
+  for (int32_t i = 0; i < data->jpeg_count; i++) {
+    struct jpeg *jp = data->all_jpegs[i];
+    if (end - p < (ptrdiff_t) (sizeof(u32) + sizeof(u64))) {
+      goto DONE;
+    }
+    memcpy(&u32, p, sizeof(u32));
+    p += sizeof(u32);
+    memcpy(&u64, p, sizeof(u64));
+    p += sizeof(u64);
+    if ((int32_t) GUINT32_FROM_LE(u32) != jp->tile_count ||
+        (int64_t) GUINT64_FROM_LE(u64) != jp->end_in_file ||
+        (end - p) / (ptrdiff_t) sizeof(u64) < jp->tile_count) {
+      goto DONE;
+    }
+    int64_t prev = -1;
+    for (int32_t j = 0; j < jp->tile_count; j++) {
+      memcpy(&u64, p, sizeof(u64));
+      p += sizeof(u64);
+      int64_t start = GUINT64_FROM_LE(u64);
+      if (start <= prev || start >= jp->end_in_file) {
+        goto DONE;
+      }
+      prev = start;
+    }
+  }
+  if (p != end) {
+    goto DONE;
+  }
+
+  p = tables;
+  for (int32_t i = 0; i < data->jpeg_count; i++) {
+    struct jpeg *jp = data->all_jpegs[i];
+    p += sizeof(u32) + sizeof(u64);
+    for (int32_t j = 0; j < jp->tile_count; j++) {
+      memcpy(&u64, p, sizeof(u64));
+      p += sizeof(u64);
+      jp->mcu_starts[j] = GUINT64_FROM_LE(u64);
+    }
+  }
+  success = true;
+
+DONE:
+  g_free(buf);
+  return success;
+}
 
+// write the sidecar once every MCU start is known; failure is harmless
+static void save_mcu_starts(struct hamamatsu_jpeg_ops_data *data) {
+  GByteArray *buf = g_byte_array_new();
+  uint32_t u32;
+  uint64_t u64;
+
+  g_byte_array_append(buf, (const guint8 *) MCU_CACHE_MAGIC,
+                      sizeof(MCU_CACHE_MAGIC));
+  u32 = GUINT32_TO_LE(data->jpeg_count);
+  g_byte_array_append(buf, (const guint8 *) &u32, sizeof(u32));
+  for (int32_t i = 0; i < data->jpeg_count; i++) {
+    struct jpeg *jp = data->all_jpegs[i];
+    g_mutex_lock(jp->mcu_starts_mutex);
+    if (!mcu_starts_complete(jp)) {
+      g_mutex_unlock(jp->mcu_starts_mutex);
+      goto DONE;
+    }
+    u32 = GUINT32_TO_LE(jp->tile_count);
+    g_byte_array_append(buf, (const guint8 *) &u32, sizeof(u32));
+    u64 = GUINT64_TO_LE(jp->end_in_file);
+    g_byte_array_append(buf, (const guint8 *) &u64, sizeof(u64));
+    for (int32_t j = 0; j < jp->tile_count; j++) {
+      int64_t start = jp->mcu_starts[j];
+      if (start == -1) {
+        start = jp->header_stop_position;
+      }
+      u64 = GUINT64_TO_LE(start);
+      g_byte_array_append(buf, (const guint8 *) &u64, sizeof(u64));
+    }
+    g_mutex_unlock(jp->mcu_starts_mutex);
+  }
+
+  char *dir = g_path_get_dirname(data->mcu_cache_path);
+  if (!g_mkdir_with_parents(dir, 0755)) {
+    // written to a temporary file and renamed into place
+    g_file_set_contents(data->mcu_cache_path,
+                        (const gchar *) buf->data, buf->len, NULL);
+  }
+  g_free(dir);
+
+DONE:
+  g_byte_array_free(buf, true);
+}
+
+// wait until the scan may proceed; false if it should stop
+static bool restart_marker_wait(struct hamamatsu_jpeg_ops_data *data) {
+  g_mutex_lock(data->restart_marker_cond_mutex);
+  while (true) {
     // should we pause?
     while (data->restart_marker_users && !data->restart_marker_thread_stop) {
       //      g_debug("thread paused");
@@ -925,10 +1102,11 @@ static gpointer restart_marker_thread_func(gpointer d) {
     }
 
     // should we stop?
-    if (data->restart_marker_thread_stop) {
+    if (data->restart_marker_thread_stop ||
+        data->restart_marker_thread_failed) {
       //      g_debug("thread stopping");
       g_mutex_unlock(data->restart_marker_cond_mutex);
-      break;
+      return false;
     }
 
     // should we sleep?
@@ -947,55 +1125,127 @@ static gpointer restart_marker_thread_func(gpointer d) {
 			data->restart_marker_cond_mutex,
 			&abstime);
       //      g_debug("running again");
-      g_mutex_unlock(data->restart_marker_cond_mutex);
       continue;
     }
 
     // we are finally able to run
     g_mutex_unlock(data->restart_marker_cond_mutex);
+    return true;
+  }
+}
 
-    //g_debug("current_jpeg: %d, current_mcu_start: %d",
-    //        current_jpeg, current_mcu_start);
+struct restart_marker_task {
+  openslide_t *osr;
+  struct jpeg *jp;
+};
 
-    struct jpeg *jp = data->all_jpegs[current_jpeg];
-    if (jp->tile_count > 1) {
-      if (current_file == NULL) {
-	current_file = _openslide_fopen(jp->filename, "rb", &tmp_err);
-	if (current_file == NULL) {
-	  //g_debug("restart_marker_thread_func urlio_fopen failed");
-	  break;
-	}
-      }
+// remember the result for next time
+static void restart_marker_done(struct hamamatsu_jpeg_ops_data *data) {
+  g_mutex_lock(data->restart_marker_cond_mutex);
+  bool finished = !data->restart_marker_thread_stop &&
+                  !data->restart_marker_thread_failed;
+  g_mutex_unlock(data->restart_marker_cond_mutex);
+  if (finished && data->mcu_cache_path) {
+    save_mcu_starts(data);
+  }
+}
+
+// scan one JPEG, as a background task with its own handle
+static void restart_marker_scan_jpeg(void *d) {
+  struct restart_marker_task *task = d;
+  struct jpeg *jp = task->jp;
+  openslide_t *osr = task->osr;
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+  g_slice_free(struct restart_marker_task, task);
 
-      if (!compute_mcu_start(osr, jp, current_file, current_mcu_start,
-                             NULL, NULL, &tmp_err)) {
-        //g_debug("restart_marker_thread_func compute_mcu_start failed");
-        urlio_fclose(current_file);
+  URLIO_FILE *f = NULL;
+  int64_t fetched = jp->start_in_file;
+
+  GError *tmp_err = NULL;
+
+  for (int32_t tileno = 0; tileno < jp->tile_count; tileno++) {
+    if (!restart_marker_wait(data)) {
+      break;
+    }
+
+    if (f == NULL) {
+      f = _openslide_fopen(jp->filename, "rb", &tmp_err);
+      if (f == NULL) {
         break;
       }
+    }
 
-      current_mcu_start++;
-      if (current_mcu_start >= jp->tile_count) {
-	current_mcu_start = 0;
-	current_jpeg++;
-	urlio_fclose(current_file);
-	current_file = NULL;
-      }
-    } else {
-      current_jpeg++;
+    if (!compute_mcu_start(osr, jp, f, tileno, NULL, NULL, &tmp_err)) {
+      break;
+    }
+
+    // keep a ranged read ahead of a remote scan, rather than letting it
+    // fault in one block at a time; a no-op for local files
+    g_mutex_lock(jp->mcu_starts_mutex);
+    int64_t pos = jp->mcu_starts[tileno];
+    g_mutex_unlock(jp->mcu_starts_mutex);
+    if (pos + RESTART_MARKER_READAHEAD / 2 > fetched &&
+        fetched < jp->end_in_file) {
+      guint64 offset = fetched;
+      guint64 len = MIN(RESTART_MARKER_READAHEAD, jp->end_in_file - fetched);
+      urlio_fetch_ranges(f, &offset, &len, 1);
+      fetched += len;
     }
   }
 
+  if (f) {
+    urlio_fclose(f);
+  }
+
   // store error, if any
   if (tmp_err) {
-    //g_debug("restart_marker_thread_func failed: %s", tmp_err->message);
     g_mutex_lock(data->restart_marker_cond_mutex);
-    data->restart_marker_thread_error = tmp_err;
+    data->restart_marker_thread_failed = true;
+    if (data->restart_marker_thread_error == NULL) {
+      data->restart_marker_thread_error = tmp_err;
+    } else {
+      g_error_free(tmp_err);
+    }
     g_mutex_unlock(data->restart_marker_cond_mutex);
   }
 
-  //  g_debug("restart_marker_thread_func done!");
-  return NULL;
+  // the last scan to finish
+  if (g_atomic_int_dec_and_test(&data->restart_marker_pending)) {
+    restart_marker_done(data);
+  }
+}
+
+// the JPEGs are independent, so scan several at once; the pool bounds
+// how many background tasks run
+static void restart_marker_start(openslide_t *osr) {
+  struct hamamatsu_jpeg_ops_data *data = osr->data;
+
+  int32_t count = 0;
+  for (int32_t i = 0; i < data->jpeg_count; i++) {
+    if (data->all_jpegs[i]->tile_count > 1) {
+      count++;
+    }
+  }
+  data->restart_marker_group = _openslide_work_group_new();
+  if (count == 0) {
+    restart_marker_done(data);
+    return;
+  }
+
+  // count them all first, so no early finisher sees zero
+  g_atomic_int_set(&data->restart_marker_pending, count);
+  for (int32_t i = 0; i < data->jpeg_count; i++) {
+    struct jpeg *jp = data->all_jpegs[i];
+    if (jp->tile_count > 1) {
+      struct restart_marker_task *task =
+        g_slice_new(struct restart_marker_task);
+      task->osr = osr;
+      task->jp = jp;
+      _openslide_work_submit(data->restart_marker_group,
+                             OPENSLIDE_WORK_BACKGROUND,
+                             restart_marker_scan_jpeg, task);
+    }
+  }
 }
 
 // if !use_jpeg_dimensions, use *w and *h instead of setting them
@@ -1312,6 +1562,7 @@ static bool init_jpeg_ops(openslide_t *osr,
                           int32_t level_count, struct jpeg_level **levels,
                           int32_t num_jpegs, struct jpeg **jpegs,
                           bool background_thread,
+                          struct _openslide_hash *quickhash1,
                           GError **err) {
   // allocate private data
   g_assert(osr->data == NULL);
@@ -1320,6 +1571,17 @@ static bool init_jpeg_ops(openslide_t *osr,
   data->jpeg_count = num_jpegs;
   data->all_jpegs = jpegs;
   osr->data = data;
+  for (int32_t i = 0; i < num_jpegs; i++) {
+    jpegs[i]->mcu_starts_mutex = g_mutex_new();
+  }
+
+  // MCU starts found by an earlier scan make the scan unnecessary
+  if (background_thread) {
+    data->mcu_cache_path = get_mcu_cache_path(quickhash1, num_jpegs, jpegs);
+    if (data->mcu_cache_path && load_mcu_starts(data)) {
+      background_thread = false;
+    }
+  }
 
   // create scale_denom levels
   create_scaled_jpeg_levels(osr, &level_count, &levels);
@@ -1329,29 +1591,24 @@ static bool init_jpeg_ops(openslide_t *osr,
   osr->level_count = level_count;
   osr->levels = (struct _openslide_level **) levels;
 
-  // init background thread for finding restart markers
+  // init background tasks for finding restart markers
   data->restart_marker_timer = g_timer_new();
-  data->restart_marker_mutex = g_mutex_new();
   data->restart_marker_cond = g_cond_new();
   data->restart_marker_cond_mutex = g_mutex_new();
   data->restart_marker_thread_throttle =
     !_openslide_debug(OPENSLIDE_DEBUG_JPEG_MARKERS);
   if (background_thread) {
-    data->restart_marker_thread = g_thread_create(restart_marker_thread_func,
-                                                  osr,
-                                                  TRUE,
-                                                  NULL);
+    restart_marker_start(osr);
   }
 
   // for debugging
   if (_openslide_debug(OPENSLIDE_DEBUG_JPEG_MARKERS)) {
-    // run background thread to completion
-    if (background_thread) {
-      g_thread_join(data->restart_marker_thread);
-      data->restart_marker_thread = NULL;
-    } else {
-      restart_marker_thread_func(osr);
+    // run background tasks to completion
+    if (!background_thread) {
+      restart_marker_start(osr);
     }
+    _openslide_work_group_finish(data->restart_marker_group, false);
+    data->restart_marker_group = NULL;
 
     // check for errors
     g_mutex_lock(data->restart_marker_cond_mutex);
@@ -1426,6 +1683,7 @@ static bool hamamatsu_vms_part2(openslide_t *osr,
 				int num_jpegs, char **image_filenames,
 				int num_jpeg_cols, int num_jpeg_rows,
 				URLIO_FILE *optimisation_file,
+				struct _openslide_hash *quickhash1,
 				GError **err) {
   struct jpeg_level **levels = NULL;
   int32_t level_count = 0;
@@ -1573,7 +1831,7 @@ static bool hamamatsu_vms_part2(openslide_t *osr,
   return init_jpeg_ops(osr,
                        level_count, levels,
                        num_jpegs, jpegs,
-                       true, err);
+                       true, quickhash1, err);
 
 FAIL:
   jpeg_destroy_data(num_jpegs, jpegs, level_count, levels);
@@ -1584,12 +1842,76 @@ static void ngr_destroy(openslide_t *osr) {
   for (int i = 0; i < osr->level_count; i++) {
     struct ngr_level *l = (struct ngr_level *) osr->levels[i];
     g_free(l->filename);
+    if (l->f) {
+      urlio_fclose(l->f);
+    }
     _openslide_grid_destroy(l->grid);
     g_slice_free(struct ngr_level, l);
   }
   g_free(osr->levels);
 }
 
+static int64_t ngr_tile_offset(struct ngr_level *l,
+                               int64_t tile_x, int64_t tile_y) {
+  return l->start_in_file +
+    (tile_y * NGR_TILE_HEIGHT * l->column_width * 6) +
+    (tile_x * l->base.h * l->column_width * 6);
+}
+
+static int64_t ngr_tile_height(struct ngr_level *l, int64_t tile_y) {
+  return MIN(NGR_TILE_HEIGHT, l->base.h - tile_y * NGR_TILE_HEIGHT);
+}
+
+// decode count tiles down a column from one read of the stripe, and put
+// them in the cache; the entry of the first is returned if asked for
+static bool ngr_read_tiles(openslide_t *osr,
+                           struct ngr_level *l,
+                           int64_t tile_x, int64_t tile_y, int64_t count,
+                           uint32_t **first_tiledata,
+                           struct _openslide_cache_entry **first_entry,
+                           GError **err) {
+  int64_t tw = l->column_width;
+  int64_t start = ngr_tile_offset(l, tile_x, tile_y);
+  int64_t end = ngr_tile_offset(l, tile_x, tile_y + count - 1) +
+    tw * ngr_tile_height(l, tile_y + count - 1) * 6;
+
+  // a view of the mapping or block cache when possible, else a copy
+  URLIO_VIEW *view = urlio_read_view(l->f, start, end - start);
+  if (view == NULL) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Cannot read file %s", l->filename);
+    return false;
+  }
+
+  for (int64_t i = 0; i < count; i++) {
+    int64_t th = ngr_tile_height(l, tile_y + i);
+    int tilesize = tw * th * 4;
+    uint32_t *tiledata = _openslide_buffer_alloc(tilesize);
+    const uint8_t *src = (const uint8_t *) view->data +
+      (ngr_tile_offset(l, tile_x, tile_y + i) - start);
+
+    // scale down from 12 bits to 8-bit xRGB
+    _openslide_pixel_rgb48_to_xrgb(tiledata, src, tw * th);
+
+    // put it in the cache
+    struct _openslide_cache_entry *cache_entry;
+    _openslide_cache_put(osr->cache, (struct _openslide_level *) l,
+                         tile_x, tile_y + i,
+                         tiledata,
+                         tilesize,
+                         &cache_entry);
+    if (i == 0 && first_entry) {
+      *first_tiledata = tiledata;
+      *first_entry = cache_entry;
+    } else {
+      _openslide_cache_entry_unref(cache_entry);
+    }
+  }
+
+  urlio_view_release(view);
+  return true;
+}
+
 static bool ngr_read_tile(openslide_t *osr,
                           cairo_t *cr,
                           struct _openslide_level *level,
@@ -1599,61 +1921,18 @@ static bool ngr_read_tile(openslide_t *osr,
   struct ngr_level *l = (struct ngr_level *) level;
 
   int64_t tw = l->column_width;
-  int64_t th = MIN(NGR_TILE_HEIGHT, l->base.h - tile_y * NGR_TILE_HEIGHT);
-  int tilesize = tw * th * 4;
+  int64_t th = ngr_tile_height(l, tile_y);
   struct _openslide_cache_entry *cache_entry;
   // look up tile in cache
   uint32_t *tiledata = _openslide_cache_get(osr->cache, level, tile_x, tile_y,
                                             &cache_entry);
 
   if (!tiledata) {
-    // read the tile data
-    URLIO_FILE *f = _openslide_fopen(l->filename, "rb", err);
-    if (!f) {
-      return false;
-    }
-
-    // compute offset to read
-    int64_t offset = l->start_in_file +
-      (tile_y * NGR_TILE_HEIGHT * l->column_width * 6) +
-      (tile_x * l->base.h * l->column_width * 6);
-    //g_debug("tile_x: %"PRId64", tile_y: %"PRId64", seeking to %"PRId64, tile_x, tile_y, offset);
-    if (urlio_fseek(f, offset, SEEK_SET)) {
-      _openslide_io_error(err, "Couldn't seek to tile offset");
-      urlio_fclose(f);
-      return false;
-    }
-
-    // alloc and read
-    int buf_size = tw * th * 6;
-    uint16_t *buf = g_slice_alloc(buf_size);
-
-    if (urlio_fread(buf, buf_size, 1, f) != 1) {
-      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                  "Cannot read file %s", l->filename);
-      urlio_fclose(f);
-      g_slice_free1(buf_size, buf);
+    // not read ahead by paint_region
+    if (!ngr_read_tiles(osr, l, tile_x, tile_y, 1,
+                        &tiledata, &cache_entry, err)) {
       return false;
     }
-    urlio_fclose(f);
-
-    // got the data, now convert to 8-bit xRGB
-    tiledata = g_slice_alloc(tilesize);
-    for (int i = 0; i < tw * th; i++) {
-      // scale down from 12 bits
-      uint8_t r = GINT16_FROM_LE(buf[(i * 3)]) >> 4;
-      uint8_t g = GINT16_FROM_LE(buf[(i * 3) + 1]) >> 4;
-      uint8_t b = GINT16_FROM_LE(buf[(i * 3) + 2]) >> 4;
-
-      tiledata[i] = (r << 16) | (g << 8) | b;
-    }
-    g_slice_free1(buf_size, buf);
-
-    // put it in the cache
-    _openslide_cache_put(osr->cache, level, tile_x, tile_y,
-                         tiledata,
-                         tilesize,
-                         &cache_entry);
   }
 
   // draw it
@@ -1671,22 +1950,119 @@ static bool ngr_read_tile(openslide_t *osr,
   return true;
 }
 
-static bool ngr_paint_region(openslide_t *osr G_GNUC_UNUSED, cairo_t *cr,
+// tile range of a region in level coordinates
+static void ngr_region_tiles(struct ngr_level *l,
+                             double x, double y, int64_t w, int64_t h,
+                             int64_t *col0, int64_t *col1,
+                             int64_t *row0, int64_t *row1) {
+  int64_t cols = l->base.w / l->column_width;
+  int64_t rows = (l->base.h + NGR_TILE_HEIGHT - 1) / NGR_TILE_HEIGHT;
+  *col0 = CLAMP((int64_t) x / l->column_width, 0, cols);
+  *col1 = CLAMP(((int64_t) x + w + l->column_width - 1) / l->column_width,
+                0, cols);
+  *row0 = CLAMP((int64_t) y / NGR_TILE_HEIGHT, 0, rows);
+  *row1 = CLAMP(((int64_t) y + h + NGR_TILE_HEIGHT - 1) / NGR_TILE_HEIGHT,
+                0, rows);
+}
+
+// decode the missing tiles of a region a run of rows at a time, so that
+// each column stripe is read in few requests, in the order of the file
+static bool ngr_read_region_tiles(openslide_t *osr, struct ngr_level *l,
+                                  int64_t col0, int64_t col1,
+                                  int64_t row0, int64_t row1,
+                                  GError **err) {
+  // don't decode more at once than the cache keeps
+  int64_t tile_bytes = l->column_width * NGR_TILE_HEIGHT * 4;
+  int64_t max_run = MIN(NGR_READ_MAX / (tile_bytes * 6 / 4),
+                        (int64_t) _openslide_cache_binding_get_capacity(osr->cache) /
+                        (4 * tile_bytes));
+  max_run = MAX(max_run, 1);
+
+  for (int64_t col = col0; col < col1; col++) {
+    int64_t run_start = -1;
+    for (int64_t row = row0; row <= row1; row++) {
+      bool missing = false;
+      if (row < row1) {
+        missing = !_openslide_cache_contains(osr->cache,
+                                             (struct _openslide_level *) l,
+                                             col, row);
+      }
+      if (missing && run_start == -1) {
+        run_start = row;
+      }
+      if (run_start != -1 &&
+          (!missing || row + 1 - run_start >= max_run)) {
+        int64_t run_end = missing ? row + 1 : row;
+        if (!ngr_read_tiles(osr, l, col, run_start, run_end - run_start,
+                            NULL, NULL, err)) {
+          return false;
+        }
+        run_start = -1;
+      }
+    }
+  }
+  return true;
+}
+
+static bool ngr_paint_region(openslide_t *osr, cairo_t *cr,
                              int64_t x, int64_t y,
                              struct _openslide_level *level,
                              int32_t w, int32_t h,
                              GError **err) {
   struct ngr_level *l = (struct ngr_level *) level;
+  double lx = x / level->downsample;
+  double ly = y / level->downsample;
+
+  int64_t col0, col1, row0, row1;
+  ngr_region_tiles(l, lx, ly, w, h, &col0, &col1, &row0, &row1);
+  if (!ngr_read_region_tiles(osr, l, col0, col1, row0, row1, err)) {
+    return false;
+  }
+
+  // sweeps go across or down the columns; fetch the same rows of the next
+  // stripe, or the next rows of this one
+  if (col1 > col0 && row1 > row0) {
+    int64_t len = ngr_tile_offset(l, 0, row1) - ngr_tile_offset(l, 0, row0);
+    if (col1 < l->base.w / l->column_width) {
+      urlio_prefetch(l->f, ngr_tile_offset(l, col1, row0), len, 0);
+    }
+    int64_t stripe_end = ngr_tile_offset(l, col1 - 1, 0) +
+      l->column_width * l->base.h * 6;
+    int64_t next = ngr_tile_offset(l, col1 - 1, row1);
+    if (next < stripe_end) {
+      urlio_prefetch(l->f, next, MIN(len, stripe_end - next), 0);
+    }
+  }
 
   return _openslide_grid_paint_region(l->grid, cr, NULL,
-                                      x / level->downsample,
-                                      y / level->downsample,
+                                      lx, ly,
                                       level, w, h,
                                       err);
 }
 
+static bool ngr_prefetch_region(openslide_t *osr G_GNUC_UNUSED,
+                                int64_t x, int64_t y,
+                                struct _openslide_level *level,
+                                int64_t w, int64_t h,
+                                int prefetch_id,
+                                GError **err G_GNUC_UNUSED) {
+  struct ngr_level *l = (struct ngr_level *) level;
+
+  int64_t col0, col1, row0, row1;
+  ngr_region_tiles(l, x / level->downsample, y / level->downsample, w, h,
+                   &col0, &col1, &row0, &row1);
+  for (int64_t col = col0; col < col1 && row1 > row0; col++) {
+    int64_t start = ngr_tile_offset(l, col, row0);
+    int64_t end = ngr_tile_offset(l, col, row1 - 1) +
+      l->column_width * ngr_tile_height(l, row1 - 1) * 6;
+    urlio_prefetch(l->f, start, end - start, prefetch_id);
+  }
+  return true;
+}
+
 static const struct _openslide_ops ngr_ops = {
   .paint_region = ngr_paint_region,
+  .prefetch_region = ngr_prefetch_region,
   .destroy = ngr_destroy,
 };
 
@@ -1722,19 +2098,19 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
     if ((f = _openslide_fopen(l->filename, "rb", err)) == NULL) {
       goto FAIL;
     }
+    // kept for reading tiles
+    l->f = f;
 
     // validate magic
     if ((urlio_fgetc(f) != 'G') || (urlio_fgetc(f) != 'N')) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Bad magic on NGR file, level %d", i);
-      urlio_fclose(f);
       goto FAIL;
     }
 
     // read w, h, column width, headersize
     if (urlio_fseek(f, 4, SEEK_SET)) {
       _openslide_io_error(err, "Couldn't seek to NGR header");
-      urlio_fclose(f);
       goto FAIL;
     }
     l->base.w = read_le_int32_from_file(f);
@@ -1743,7 +2119,6 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
 
     if (urlio_fseek(f, 24, SEEK_SET)) {
       _openslide_io_error(err, "Couldn't seek within NGR header");
-      urlio_fclose(f);
       goto FAIL;
     }
     l->start_in_file = read_le_int32_from_file(f);
@@ -1753,7 +2128,6 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
 	(l->column_width <= 0) || (l->start_in_file <= 0)) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Couldn't read header, level %d", i);
-      urlio_fclose(f);
       goto FAIL;
     }
 
@@ -1762,7 +2136,6 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Width %"PRId64" not multiple of column width %d",
                   l->base.w, l->column_width);
-      urlio_fclose(f);
       goto FAIL;
     }
 
@@ -1777,8 +2150,6 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
     // tile size hints
     l->base.tile_w = l->column_width;
     l->base.tile_h = NGR_TILE_HEIGHT;
-
-    urlio_fclose(f);
   }
 
   // set osr data
@@ -1794,6 +2165,9 @@ static bool hamamatsu_vmu_part2(openslide_t *osr,
   for (int i = 0; i < num_levels; i++) {
     _openslide_grid_destroy(levels[i]->grid);
     g_free(levels[i]->filename);
+    if (levels[i]->f) {
+      urlio_fclose(levels[i]->f);
+    }
     g_slice_free(struct ngr_level, levels[i]);
   }
   g_free(levels);
@@ -2042,6 +2416,7 @@ static bool hamamatsu_vms_vmu_open(openslide_t *osr, const char *filename,
 				  num_images, image_filenames,
 				  num_cols, num_rows,
 				  optimisation_file,
+				  quickhash1,
 				  err);
 
     // clean up
@@ -2102,11 +2477,14 @@ const struct _openslide_format _openslide_format_hamamatsu_vms_vmu = {
   .vendor = "hamamatsu",
   .detect = hamamatsu_vms_vmu_detect,
   .open = hamamatsu_vms_vmu_open,
+  .companion_files = true,
 };
 
 static bool hamamatsu_ndpi_detect(const char *filename G_GNUC_UNUSED,
-                                  struct _openslide_tifflike *tl,
+                                  struct _openslide_probe *probe,
                                   GError **err) {
+  struct _openslide_tifflike *tl = probe->tl;
+
   // ensure we have a tifflike
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -2449,7 +2827,7 @@ FAIL:
   return init_jpeg_ops(osr,
                        level_count, levels,
                        num_jpegs, jpegs,
-                       restart_marker_scan, err);
+                       restart_marker_scan, quickhash1, err);
 }
 
 const struct _openslide_format _openslide_format_hamamatsu_ndpi = {
@@ -162,11 +162,11 @@ static bool read_tile(openslide_t *osr,
                                             args->area, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!_openslide_tiff_read_tile(tiffl, args->tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -174,7 +174,7 @@ static bool read_tile(openslide_t *osr,
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -223,6 +223,9 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
     };
     int64_t ax = x / l->base.downsample - area->offset_x;
     int64_t ay = y / l->base.downsample - area->offset_y;
+    // request the tiles all at once rather than one by one
+    _openslide_tiff_fetch_region(&area->tiffl, tiff, osr->cache, area,
+                                 ax, ay, w, h, 0, NULL);
     success = _openslide_grid_paint_region(area->grid, cr, &args,
                                            ax, ay, level, w, h,
                                            err);
@@ -235,13 +238,49 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool prefetch_region(openslide_t *osr,
+                            int64_t x, int64_t y,
+                            struct _openslide_level *level,
+                            int64_t w, int64_t h,
+                            int prefetch_id,
+                            GError **err) {
+  struct leica_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+  bool success = true;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+
+  for (uint32_t n = 0; n < l->areas->len; n++) {
+    struct area *area = l->areas->pdata[n];
+
+    int64_t ax = x / l->base.downsample - area->offset_x;
+    int64_t ay = y / l->base.downsample - area->offset_y;
+    success = _openslide_tiff_fetch_region(&area->tiffl, tiff,
+                                           osr->cache, area,
+                                           ax, ay, w, h, prefetch_id,
+                                           err);
+    if (!success) {
+      break;
+    }
+  }
+
+  _openslide_tiffcache_put(data->tc, tiff);
+  return success;
+}
+
 static const struct _openslide_ops leica_ops = {
   .paint_region = paint_region,
+  .prefetch_region = prefetch_region,
   .destroy = destroy,
 };
 
 static bool leica_detect(const char *filename G_GNUC_UNUSED,
-                         struct _openslide_tifflike *tl, GError **err) {
+                         struct _openslide_probe *probe, GError **err) {
+  struct _openslide_tifflike *tl = probe->tl;
+
   // ensure we have a TIFF
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -805,7 +844,7 @@ static bool leica_open(openslide_t *osr, const char *filename,
   GPtrArray *level_array = g_ptr_array_new();
 
   // open TIFF
-  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename);
+  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename, tl);
   TIFF *tiff = _openslide_tiffcache_get(tc, err);
   if (!tiff) {
     goto FAIL;
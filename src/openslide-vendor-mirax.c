@@ -205,6 +205,11 @@ struct level {
 
 struct mirax_ops_data {
   gchar **datafile_paths;
+  int32_t datafile_count;
+
+  // opened on first use, and shared for positional reads
+  GMutex *datafile_lock;
+  URLIO_FILE **datafiles;
 };
 
 static void image_unref(struct image *image) {
@@ -219,42 +224,71 @@ static void tile_free(gpointer data) {
   g_slice_free(struct tile, tile);
 }
 
-static uint32_t *read_image(openslide_t *osr,
+static URLIO_FILE *get_datafile(struct mirax_ops_data *data, int32_t fileno,
+                               GError **err) {
+  g_mutex_lock(data->datafile_lock);
+  URLIO_FILE *f = data->datafiles[fileno];
+  if (f == NULL) {
+    f = _openslide_fopen(data->datafile_paths[fileno], "rb", err);
+    data->datafiles[fileno] = f;
+  }
+  g_mutex_unlock(data->datafile_lock);
+  return f;
+}
+
+// one fetch of the image's bytes, usually without copying them out of
+// the block cache, and one decode of them into dest
+static bool read_image_data(struct mirax_ops_data *data,
                             struct image *image,
                             enum image_format format,
+                            uint32_t *dest,
                             int w, int h,
                             GError **err) {
-  struct mirax_ops_data *data = osr->data;
-  bool result = false;
-
-  uint32_t *dest = g_slice_alloc(w * h * 4);
-
+  URLIO_FILE *f = get_datafile(data, image->fileno, err);
+  if (f == NULL) {
+    return false;
+  }
+  URLIO_VIEW *view = urlio_read_view(f, image->start_in_file, image->length);
+  if (view == NULL) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Couldn't read image at %d in %s",
+                image->start_in_file, data->datafile_paths[image->fileno]);
+    return false;
+  }
+  bool success;
   switch (format) {
   case FORMAT_JPEG:
-    result = _openslide_jpeg_read(data->datafile_paths[image->fileno],
-                                  image->start_in_file,
-                                  dest, w, h,
-                                  err);
+    success = _openslide_jpeg_decode_buffer(view->data, view->len,
+                                            dest, w, h, err);
     break;
   case FORMAT_PNG:
-    result = _openslide_png_read(data->datafile_paths[image->fileno],
-                                 image->start_in_file,
-                                 dest, w, h,
-                                 err);
+    success = _openslide_png_decode_buffer(view->data, view->len,
+                                           dest, w, h, err);
     break;
   case FORMAT_BMP:
-    result = _openslide_gdkpixbuf_read("bmp",
-                                       data->datafile_paths[image->fileno],
-                                       image->start_in_file, image->length,
-                                       dest, w, h,
-                                       err);
+    success = _openslide_gdkpixbuf_decode_buffer("bmp",
+                                                 view->data, view->len,
+                                                 dest, w, h, err);
     break;
   default:
     g_assert_not_reached();
   }
+  urlio_view_release(view);
+  return success;
+}
+
+static uint32_t *read_image(openslide_t *osr,
+                            struct image *image,
+                            enum image_format format,
+                            int w, int h,
+                            GError **err) {
+  struct mirax_ops_data *data = osr->data;
+
+  uint32_t *dest = _openslide_buffer_alloc(w * h * 4);
+  bool result = read_image_data(data, image, format, dest, w, h, err);
 
   if (!result) {
-    g_slice_free1(w * h * 4, dest);
+    _openslide_buffer_free(w * h * 4, dest);
     return NULL;
   }
   return dest;
@@ -336,13 +370,98 @@ static bool read_tile(openslide_t *osr,
   return success;
 }
 
-static bool paint_region(openslide_t *osr G_GNUC_UNUSED, cairo_t *cr,
+static gint compare_image_offset(gconstpointer a, gconstpointer b) {
+  const struct image *ia = *(const struct image * const *) a;
+  const struct image *ib = *(const struct image * const *) b;
+
+  if (ia->fileno != ib->fileno) {
+    return ia->fileno < ib->fileno ? -1 : 1;
+  }
+  if (ia->start_in_file != ib->start_in_file) {
+    return ia->start_in_file < ib->start_in_file ? -1 : 1;
+  }
+  return 0;
+}
+
+// fetch the images of a region which aren't cached, neighbors in each
+// datafile in as few requests as possible
+static bool fetch_region(openslide_t *osr,
+                         struct level *l,
+                         double x, double y,
+                         int32_t w, int32_t h,
+                         GError **err) {
+  struct mirax_ops_data *data = osr->data;
+
+  // local reads are cheap enough one at a time
+  URLIO_FILE *f = get_datafile(data, 0, err);
+  if (f == NULL) {
+    return false;
+  }
+  if (f->type != CFTYPE_CURL) {
+    return true;
+  }
+
+  GPtrArray *tiles = g_ptr_array_new();
+  _openslide_grid_tilemap_get_tiles(l->grid, x, y, w, h, tiles);
+  GPtrArray *images = g_ptr_array_new();
+  for (guint i = 0; i < tiles->len; i++) {
+    struct tile *tile = tiles->pdata[i];
+    if (_openslide_cache_contains(osr->cache, l, tile->image->imageno, 0)) {
+      continue;
+    }
+    g_ptr_array_add(images, tile->image);
+  }
+  g_ptr_array_free(tiles, true);
+  g_ptr_array_sort(images, compare_image_offset);
+
+  // a request per datafile, skipping images shared by several tiles
+  bool success = true;
+  guint64 *offsets = g_new(guint64, MAX(images->len, 1));
+  guint64 *lens = g_new(guint64, MAX(images->len, 1));
+  for (guint start = 0; start < images->len && success; ) {
+    struct image *first = images->pdata[start];
+    int n = 0;
+    guint i;
+    for (i = start; i < images->len; i++) {
+      struct image *image = images->pdata[i];
+      if (image->fileno != first->fileno) {
+        break;
+      }
+      if (n && offsets[n - 1] == (guint64) image->start_in_file) {
+        continue;
+      }
+      offsets[n] = image->start_in_file;
+      lens[n] = image->length;
+      n++;
+    }
+    f = get_datafile(data, first->fileno, err);
+    if (f) {
+      urlio_fetch_ranges(f, offsets, lens, n);
+    } else {
+      success = false;
+    }
+    start = i;
+  }
+  g_free(offsets);
+  g_free(lens);
+  g_ptr_array_free(images, true);
+
+  return success;
+}
+
+static bool paint_region(openslide_t *osr, cairo_t *cr,
                          int64_t x, int64_t y,
                          struct _openslide_level *level,
                          int32_t w, int32_t h,
                          GError **err) {
   struct level *l = (struct level *) level;
 
+  // request the images all at once rather than one by one
+  if (!fetch_region(osr, l, x / level->downsample, y / level->downsample,
+                    w, h, err)) {
+    return false;
+  }
+
   return _openslide_grid_paint_region(l->grid, cr, NULL,
                                       x / level->downsample,
                                       y / level->downsample,
@@ -364,19 +483,40 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 
   // the ops data
+  for (int32_t i = 0; i < data->datafile_count; i++) {
+    if (data->datafiles[i]) {
+      urlio_fclose(data->datafiles[i]);
+    }
+  }
+  g_free(data->datafiles);
+  g_mutex_free(data->datafile_lock);
   g_strfreev(data->datafile_paths);
   g_slice_free(struct mirax_ops_data, data);
 }
 
+static bool prefetch_region(openslide_t *osr,
+                            int64_t x, int64_t y,
+                            struct _openslide_level *level,
+                            int64_t w, int64_t h,
+                            int prefetch_id G_GNUC_UNUSED,
+                            GError **err) {
+  struct level *l = (struct level *) level;
+
+  // the grid takes int32 sizes
+  return fetch_region(osr, l, x / level->downsample, y / level->downsample,
+                      MIN(w, INT32_MAX), MIN(h, INT32_MAX), err);
+}
+
 static const struct _openslide_ops mirax_ops = {
   .paint_region = paint_region,
+  .prefetch_region = prefetch_region,
   .destroy = destroy,
 };
 
-static bool mirax_detect(const char *filename, struct _openslide_tifflike *tl,
+static bool mirax_detect(const char *filename, struct _openslide_probe *probe,
                          GError **err) {
   // reject TIFFs
-  if (tl) {
+  if (probe->tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Is a TIFF file");
     return false;
@@ -390,7 +530,7 @@ static bool mirax_detect(const char *filename, struct _openslide_tifflike *tl,
   }
 
   // verify existence
-  if (!g_file_test(filename, G_FILE_TEST_EXISTS)) {
+  if (probe->size < 0) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "File does not exist");
     return false;
@@ -411,21 +551,78 @@ static bool mirax_detect(const char *filename, struct _openslide_tifflike *tl,
   return true;
 }
 
-static char *read_string_from_file(URLIO_FILE *f, int len) {
-  char *str = g_malloc(len + 1);
-  str[len] = '\0';
+// Index.dat, read whole and parsed from memory
+struct index_buf {
+  char *data;
+  int64_t len;
+  int64_t pos;
+};
+
+#define INDEX_READ_CHUNK (16 * 1024 * 1024)
+
+static struct index_buf *read_index(const char *filename, GError **err) {
+  URLIO_FILE *f = _openslide_fopen(filename, "rb", err);
+  if (f == NULL) {
+    return NULL;
+  }
+
+  gint64 len = urlio_fsize(f);
+  if (len < 0) {
+    _openslide_io_error(err, "Couldn't get size of %s", filename);
+    urlio_fclose(f);
+    return NULL;
+  }
+
+  // in large requests, rather than one per field
+  struct index_buf *idx = g_slice_new0(struct index_buf);
+  idx->data = g_malloc(MAX(len, 1));
+  idx->len = len;
+  for (int64_t pos = 0; pos < len; pos += INDEX_READ_CHUNK) {
+    size_t count = MIN(len - pos, INDEX_READ_CHUNK);
+    if (urlio_pread(f, idx->data + pos, count, pos) != count) {
+      g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                  "Couldn't read %s", filename);
+      g_free(idx->data);
+      g_slice_free(struct index_buf, idx);
+      urlio_fclose(f);
+      return NULL;
+    }
+  }
+  urlio_fclose(f);
+  return idx;
+}
+
+static void index_free(struct index_buf *idx) {
+  if (idx) {
+    g_free(idx->data);
+    g_slice_free(struct index_buf, idx);
+  }
+}
+
+static int index_seek(struct index_buf *idx, int64_t pos) {
+  if (pos < 0 || pos > idx->len) {
+    return -1;
+  }
+  idx->pos = pos;
+  return 0;
+}
 
-  if (urlio_fread(str, len, 1, f) != 1) {
-    g_free(str);
+static char *read_string_from_index(struct index_buf *idx, int len) {
+  if (idx->len - idx->pos < len) {
     return NULL;
   }
+  char *str = g_strndup(idx->data + idx->pos, len);
+  idx->pos += len;
   return str;
 }
 
-static bool read_le_int32_from_file_with_result(URLIO_FILE *f, int32_t *OUT) {
-  if (urlio_fread(OUT, 4, 1, f) != 1) {
+static bool read_le_int32_from_index_with_result(struct index_buf *idx,
+                                                 int32_t *OUT) {
+  if (idx->len - idx->pos < 4) {
     return false;
   }
+  memcpy(OUT, idx->data + idx->pos, 4);
+  idx->pos += 4;
 
   *OUT = GINT32_FROM_LE(*OUT);
   //  g_debug("%d", i);
@@ -433,10 +630,10 @@ static bool read_le_int32_from_file_with_result(URLIO_FILE *f, int32_t *OUT) {
   return true;
 }
 
-static int32_t read_le_int32_from_file(URLIO_FILE *f) {
+static int32_t read_le_int32_from_index(struct index_buf *idx) {
   int32_t i;
 
-  if (!read_le_int32_from_file_with_result(f, &i)) {
+  if (!read_le_int32_from_index_with_result(idx, &i)) {
     // -1 means error
     i = -1;
   }
@@ -445,7 +642,7 @@ static int32_t read_le_int32_from_file(URLIO_FILE *f) {
 }
 
 
-static bool read_nonhier_record(URLIO_FILE *f,
+static bool read_nonhier_record(struct index_buf *idx,
 				int64_t nonhier_root_position,
 				int datafile_count,
 				char **datafile_paths,
@@ -455,13 +652,13 @@ static bool read_nonhier_record(URLIO_FILE *f,
 				GError **err) {
   g_return_val_if_fail(recordno >= 0, false);
 
-  if (urlio_fseek(f, nonhier_root_position, SEEK_SET) == -1) {
+  if (index_seek(idx, nonhier_root_position) == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Cannot seek to nonhier root");
     return false;
   }
 
-  int32_t ptr = read_le_int32_from_file(f);
+  int32_t ptr = read_le_int32_from_index(idx);
   if (ptr == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Can't read initial nonhier pointer");
@@ -469,14 +666,14 @@ static bool read_nonhier_record(URLIO_FILE *f,
   }
 
   // seek to record pointer
-  if (urlio_fseek(f, ptr + 4 * recordno, SEEK_SET) == -1) {
+  if (index_seek(idx, ptr + 4 * recordno) == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Cannot seek to nonhier record pointer %d", recordno);
     return false;
   }
 
   // read pointer
-  ptr = read_le_int32_from_file(f);
+  ptr = read_le_int32_from_index(idx);
   if (ptr == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Can't read nonhier record %d", recordno);
@@ -484,21 +681,21 @@ static bool read_nonhier_record(URLIO_FILE *f,
   }
 
   // seek
-  if (urlio_fseek(f, ptr, SEEK_SET) == -1) {
+  if (index_seek(idx, ptr) == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Cannot seek to nonhier record %d", recordno);
     return false;
   }
 
   // read initial 0
-  if (read_le_int32_from_file(f) != 0) {
+  if (read_le_int32_from_index(idx) != 0) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Expected 0 value at beginning of data page");
     return false;
   }
 
   // read pointer
-  ptr = read_le_int32_from_file(f);
+  ptr = read_le_int32_from_index(idx);
   if (ptr == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Can't read initial data page pointer");
@@ -506,14 +703,14 @@ static bool read_nonhier_record(URLIO_FILE *f,
   }
 
   // seek to offset
-  if (urlio_fseek(f, ptr, SEEK_SET) == -1) {
+  if (index_seek(idx, ptr) == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Can't seek to initial data page");
     return false;
   }
 
   // read pagesize == 1
-  if (read_le_int32_from_file(f) != 1) {
+  if (read_le_int32_from_index(idx) != 1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Expected 1 value");
     return false;
@@ -522,32 +719,32 @@ static bool read_nonhier_record(URLIO_FILE *f,
   // read 3 zeroes
   // the first zero is sometimes 1253, for reasons that are not clear
   // http://lists.andrew.cmu.edu/pipermail/openslide-users/2013-August/000634.html
-  read_le_int32_from_file(f);
-  if (read_le_int32_from_file(f) != 0) {
+  read_le_int32_from_index(idx);
+  if (read_le_int32_from_index(idx) != 0) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Expected second 0 value");
     return false;
   }
-  if (read_le_int32_from_file(f) != 0) {
+  if (read_le_int32_from_index(idx) != 0) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Expected third 0 value");
     return false;
   }
 
   // finally read offset, size, fileno
-  *position = read_le_int32_from_file(f);
+  *position = read_le_int32_from_index(idx);
   if (*position == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Can't read position");
     return false;
   }
-  *size = read_le_int32_from_file(f);
+  *size = read_le_int32_from_index(idx);
   if (*size == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Can't read size");
     return false;
   }
-  int fileno = read_le_int32_from_file(f);
+  int fileno = read_le_int32_from_index(idx);
   if (fileno == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Can't read fileno");
@@ -677,7 +874,59 @@ static bool get_tile_position(int32_t *slide_positions,
   }
 }
 
-static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
+struct hash_range {
+  int32_t fileno;
+  int32_t offset;
+  int32_t length;
+};
+
+// hash images in order, after fetching those of each datafile together
+static bool hash_images(struct _openslide_hash *quickhash1,
+                        char **datafile_paths,
+                        int datafile_count,
+                        GArray *ranges,
+                        GError **err) {
+  if (quickhash1 == NULL) {
+    return true;
+  }
+
+  guint64 *offsets = g_new(guint64, MAX(ranges->len, 1));
+  guint64 *lens = g_new(guint64, MAX(ranges->len, 1));
+  bool success = true;
+  for (int fileno = 0; fileno < datafile_count && success; fileno++) {
+    int n = 0;
+    for (guint i = 0; i < ranges->len; i++) {
+      struct hash_range *range = &g_array_index(ranges, struct hash_range, i);
+      if (range->fileno == fileno) {
+        offsets[n] = range->offset;
+        lens[n] = range->length;
+        n++;
+      }
+    }
+    if (n == 0) {
+      continue;
+    }
+    URLIO_FILE *f = _openslide_fopen(datafile_paths[fileno], "rb", err);
+    if (f == NULL) {
+      success = false;
+      break;
+    }
+    urlio_fetch_ranges(f, offsets, lens, n);
+    urlio_fclose(f);
+  }
+  g_free(offsets);
+  g_free(lens);
+
+  for (guint i = 0; i < ranges->len && success; i++) {
+    struct hash_range *range = &g_array_index(ranges, struct hash_range, i);
+    success = _openslide_hash_file_part(quickhash1,
+                                        datafile_paths[range->fileno],
+                                        range->offset, range->length, err);
+  }
+  return success;
+}
+
+static bool process_hier_data_pages_from_indexfile(struct index_buf *idx,
 						   int64_t seek_location,
 						   int datafile_count,
 						   char **datafile_paths,
@@ -697,6 +946,7 @@ static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
   // used for storing which positions actually have data
   GHashTable *active_positions = g_hash_table_new_full(g_int_hash, g_int_equal,
 						       g_free, NULL);
+  GArray *hash_ranges = g_array_new(FALSE, FALSE, sizeof(struct hash_range));
 
   for (int zoom_level = 0; zoom_level < zoom_levels; zoom_level++) {
     struct level *l = levels[zoom_level];
@@ -706,33 +956,33 @@ static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
 
     //    g_debug("reading zoom_level %d", zoom_level);
 
-    if (urlio_fseek(f, seek_location, SEEK_SET) == -1) {
+    if (index_seek(idx, seek_location) == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Cannot seek to zoom level pointer %d", zoom_level);
       goto DONE;
     }
 
-    ptr = read_le_int32_from_file(f);
+    ptr = read_le_int32_from_index(idx);
     if (ptr == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Can't read zoom level pointer");
       goto DONE;
     }
-    if (urlio_fseek(f, ptr, SEEK_SET) == -1) {
+    if (index_seek(idx, ptr) == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Cannot seek to start of data pages");
       goto DONE;
     }
 
     // read initial 0
-    if (read_le_int32_from_file(f) != 0) {
+    if (read_le_int32_from_index(idx) != 0) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Expected 0 value at beginning of data page");
       goto DONE;
     }
 
     // read pointer
-    ptr = read_le_int32_from_file(f);
+    ptr = read_le_int32_from_index(idx);
     if (ptr == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Can't read initial data page pointer");
@@ -740,7 +990,7 @@ static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
     }
 
     // seek to offset
-    if (urlio_fseek(f, ptr, SEEK_SET) == -1) {
+    if (index_seek(idx, ptr) == -1) {
       g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                   "Can't seek to initial data page");
       goto DONE;
@@ -749,7 +999,7 @@ static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
     int32_t next_ptr;
     do {
       // read length
-      int32_t page_len = read_le_int32_from_file(f);
+      int32_t page_len = read_le_int32_from_index(idx);
       if (page_len == -1) {
         g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                     "Can't read page length");
@@ -759,7 +1009,7 @@ static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
       //    g_debug("page_len: %d", page_len);
 
       // read "next" pointer
-      next_ptr = read_le_int32_from_file(f);
+      next_ptr = read_le_int32_from_index(idx);
       if (next_ptr == -1) {
         g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                     "Cannot read \"next\" pointer");
@@ -768,10 +1018,10 @@ static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
 
       // read all the data into the list
       for (int i = 0; i < page_len; i++) {
-	int32_t image_index = read_le_int32_from_file(f);
-	int32_t offset = read_le_int32_from_file(f);
-	int32_t length = read_le_int32_from_file(f);
-	int32_t fileno = read_le_int32_from_file(f);
+	int32_t image_index = read_le_int32_from_index(idx);
+	int32_t offset = read_le_int32_from_index(idx);
+	int32_t length = read_le_int32_from_index(idx);
+	int32_t fileno = read_le_int32_from_index(idx);
 
 	if (image_index < 0) {
           g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -827,13 +1077,10 @@ static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
           goto DONE;
 	}
 
-	// hash in the lowest-res images
+	// hash in the lowest-res images, once they are all known
 	if (zoom_level == zoom_levels - 1) {
-	  if (!_openslide_hash_file_part(quickhash1, datafile_paths[fileno],
-	                                 offset, length, err)) {
-            g_prefix_error(err, "Can't hash images: ");
-            goto DONE;
-	  }
+	  struct hash_range range = { fileno, offset, length };
+	  g_array_append_val(hash_ranges, range);
 	}
 
 	// populate the image structure
@@ -907,9 +1154,16 @@ static bool process_hier_data_pages_from_indexfile(URLIO_FILE *f,
     seek_location += 4;
   }
 
+  if (!hash_images(quickhash1, datafile_paths, datafile_count,
+                   hash_ranges, err)) {
+    g_prefix_error(err, "Can't hash images: ");
+    goto DONE;
+  }
+
   success = true;
 
  DONE:
+  g_array_free(hash_ranges, TRUE);
   g_hash_table_unref(active_positions);
 
   return success;
@@ -1053,7 +1307,7 @@ static enum image_format parse_image_format(const char *name, GError **err) {
 }
 
 static bool add_associated_image(openslide_t *osr,
-                                 URLIO_FILE *indexfile,
+                                 struct index_buf *index,
                                  int64_t nonhier_root,
                                  int datafile_count,
                                  char **datafile_paths,
@@ -1069,7 +1323,7 @@ static bool add_associated_image(openslide_t *osr,
     return true;
   }
 
-  if (!read_nonhier_record(indexfile, nonhier_root,
+  if (!read_nonhier_record(index, nonhier_root,
                            datafile_count, datafile_paths, recordno,
                            &path, &size, &offset, err)) {
     g_prefix_error(err, "Cannot read %s associated image: ", name);
@@ -1096,7 +1350,7 @@ static bool process_indexfile(openslide_t *osr,
 			      double overlap_y,
 			      int image_divisions,
 			      const struct slide_zoom_level_params *slide_zoom_level_params,
-			      URLIO_FILE *indexfile,
+			      struct index_buf *index,
 			      struct level **levels,
 			      struct _openslide_hash *quickhash1,
 			      GError **err) {
@@ -1116,14 +1370,14 @@ static bool process_indexfile(openslide_t *osr,
 
   int32_t *slide_positions = NULL;
 
-  urlio_rewind(indexfile);
+  index->pos = 0;
 
   // save root positions
   const int64_t hier_root = strlen(INDEX_VERSION) + strlen(uuid);
   const int64_t nonhier_root = hier_root + 4;
 
   // verify version and uuid
-  teststr = read_string_from_file(indexfile, strlen(INDEX_VERSION));
+  teststr = read_string_from_index(index, strlen(INDEX_VERSION));
   match = (teststr != NULL) && (strcmp(teststr, INDEX_VERSION) == 0);
   g_free(teststr);
   if (!match) {
@@ -1132,7 +1386,7 @@ static bool process_indexfile(openslide_t *osr,
     goto DONE;
   }
 
-  teststr = read_string_from_file(indexfile, strlen(uuid));
+  teststr = read_string_from_index(index, strlen(uuid));
   match = (teststr != NULL) && (strcmp(teststr, uuid) == 0);
   g_free(teststr);
   if (!match) {
@@ -1153,7 +1407,7 @@ static bool process_indexfile(openslide_t *osr,
     char *slide_position_path;
     int64_t slide_position_size;
     int64_t slide_position_offset;
-    if (!read_nonhier_record(indexfile,
+    if (!read_nonhier_record(index,
 			     nonhier_root,
 			     datafile_count,
 			     datafile_paths,
@@ -1227,7 +1481,7 @@ static bool process_indexfile(openslide_t *osr,
 
   // read in the associated images
   if (!add_associated_image(osr,
-                            indexfile,
+                            index,
                             nonhier_root,
                             datafile_count,
                             datafile_paths,
@@ -1237,7 +1491,7 @@ static bool process_indexfile(openslide_t *osr,
     goto DONE;
   }
   if (!add_associated_image(osr,
-                            indexfile,
+                            index,
                             nonhier_root,
                             datafile_count,
                             datafile_paths,
@@ -1247,7 +1501,7 @@ static bool process_indexfile(openslide_t *osr,
     goto DONE;
   }
   if (!add_associated_image(osr,
-                            indexfile,
+                            index,
                             nonhier_root,
                             datafile_count,
                             datafile_paths,
@@ -1258,13 +1512,13 @@ static bool process_indexfile(openslide_t *osr,
   }
 
   // read hierarchical sections
-  if (urlio_fseek(indexfile, hier_root, SEEK_SET) == -1) {
+  if (index_seek(index, hier_root) == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Cannot seek to hier sections root");
     goto DONE;
   }
 
-  ptr = read_le_int32_from_file(indexfile);
+  ptr = read_le_int32_from_index(index);
   if (ptr == -1) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Can't read initial pointer");
@@ -1272,7 +1526,7 @@ static bool process_indexfile(openslide_t *osr,
   }
 
   // read these pages in
-  if (!process_hier_data_pages_from_indexfile(indexfile,
+  if (!process_hier_data_pages_from_indexfile(index,
 					      ptr,
 					      datafile_count,
 					      datafile_paths,
@@ -1524,7 +1778,7 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   int datafile_count = 0;
   char **datafile_paths = NULL;
 
-  URLIO_FILE *indexfile = NULL;
+  struct index_buf *index = NULL;
 
   int64_t base_w = 0;
   int64_t base_h = 0;
@@ -1780,11 +2034,11 @@ static bool mirax_open(openslide_t *osr, const char *filename,
 
   // read indexfile
   tmp = g_build_filename(dirname, index_filename, NULL);
-  indexfile = _openslide_fopen(tmp, "rb", err);
+  index = read_index(tmp, err);
   g_free(tmp);
   tmp = NULL;
 
-  if (!indexfile) {
+  if (!index) {
     goto FAIL;
   }
 
@@ -1952,12 +2206,15 @@ static bool mirax_open(openslide_t *osr, const char *filename,
 			 slide_zoom_level_sections[0].overlap_y,
 			 image_divisions,
 			 slide_zoom_level_params,
-			 indexfile,
+			 index,
 			 levels,
 			 quickhash1,
 			 err)) {
     goto FAIL;
   }
+  for (int i = 0; i < zoom_levels; i++) {
+    _openslide_grid_tilemap_finish_adding_tiles(levels[i]->grid);
+  }
 
   // set properties
   _openslide_set_bounds_props_from_grid(osr, levels[0]->grid);
@@ -2010,6 +2267,9 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   g_assert(osr->data == NULL);
   struct mirax_ops_data *data = g_slice_new0(struct mirax_ops_data);
   data->datafile_paths = datafile_paths;
+  data->datafile_count = datafile_count;
+  data->datafile_lock = g_mutex_new();
+  data->datafiles = g_new0(URLIO_FILE *, datafile_count);
   datafile_paths = NULL;
   osr->data = data;
 
@@ -2049,9 +2309,7 @@ static bool mirax_open(openslide_t *osr, const char *filename,
   if (slidedat) {
     g_key_file_free(slidedat);
   }
-  if (indexfile) {
-    urlio_fclose(indexfile);
-  }
+  index_free(index);
 
   return success;
 }
@@ -2061,4 +2319,5 @@ const struct _openslide_format _openslide_format_mirax = {
   .vendor = "mirax",
   .detect = mirax_detect,
   .open = mirax_open,
+  .companion_files = true,
 };
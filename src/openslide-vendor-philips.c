@@ -63,6 +63,10 @@ static const char MAIN_IMAGE_XPATH[] = SCANNED_IMAGE_XPATH("WSI");
 static const char LABEL_DATA_XPATH[] = ASSOCIATED_IMAGE_DATA_XPATH("LABELIMAGE");
 static const char MACRO_DATA_XPATH[] = ASSOCIATED_IMAGE_DATA_XPATH("MACROIMAGE");
 
+// text kept per element when parsing; associated image data past this
+// point is only decoded on read, and the JPEG header fits in it
+#define XML_TEXT_MAX (256 << 10)
+
 struct philips_ops_data {
   struct _openslide_tiffcache *tc;
 };
@@ -76,7 +80,7 @@ struct level {
 struct xml_associated_image {
   struct _openslide_associated_image base;
   struct _openslide_tiffcache *tc;
-  const char *xpath;  // static string; do not free
+  char *path;  // element holding the base64 data
 };
 
 static void destroy(openslide_t *osr) {
@@ -92,12 +96,13 @@ static void destroy(openslide_t *osr) {
   g_free(osr->levels);
 }
 
-static bool read_tile(openslide_t *osr,
-                      cairo_t *cr,
-                      struct _openslide_level *level,
-                      int64_t tile_col, int64_t tile_row,
-                      void *arg,
-                      GError **err) {
+static bool get_tile(openslide_t *osr,
+                     struct _openslide_level *level,
+                     int64_t tile_col, int64_t tile_row,
+                     void *arg,
+                     uint32_t **_tiledata,
+                     struct _openslide_cache_entry **_cache_entry,
+                     GError **err) {
   struct level *l = (struct level *) level;
   struct _openslide_tiff_level *tiffl = &l->tiffl;
   TIFF *tiff = arg;
@@ -122,14 +127,14 @@ static bool read_tile(openslide_t *osr,
 
     if (is_missing) {
       // fill with transparent
-      tiledata = g_slice_alloc0(tw * th * 4);
+      tiledata = _openslide_buffer_alloc0(tw * th * 4);
 
     } else {
-      tiledata = g_slice_alloc(tw * th * 4);
+      tiledata = _openslide_buffer_alloc(tw * th * 4);
       if (!_openslide_tiff_read_tile(tiffl, tiff,
                                      tiledata, tile_col, tile_row,
                                      err)) {
-        g_slice_free1(tw * th * 4, tiledata);
+        _openslide_buffer_free(tw * th * 4, tiledata);
         return false;
       }
 
@@ -139,7 +144,7 @@ static bool read_tile(openslide_t *osr,
                                 l->base.w - tile_col * tw,
                                 l->base.h - tile_row * th,
                                 err)) {
-        g_slice_free1(tw * th * 4, tiledata);
+        _openslide_buffer_free(tw * th * 4, tiledata);
         return false;
       }
     }
@@ -150,6 +155,30 @@ static bool read_tile(openslide_t *osr,
                          &cache_entry);
   }
 
+  *_tiledata = tiledata;
+  *_cache_entry = cache_entry;
+  return true;
+}
+
+static bool read_tile(openslide_t *osr,
+                      cairo_t *cr,
+                      struct _openslide_level *level,
+                      int64_t tile_col, int64_t tile_row,
+                      void *arg,
+                      GError **err) {
+  struct level *l = (struct level *) level;
+
+  // tile size
+  int64_t tw = l->tiffl.tile_w;
+  int64_t th = l->tiffl.tile_h;
+
+  uint32_t *tiledata;
+  struct _openslide_cache_entry *cache_entry;
+  if (!get_tile(osr, level, tile_col, tile_row, arg,
+                &tiledata, &cache_entry, err)) {
+    return false;
+  }
+
   // draw it
   cairo_surface_t *surface = cairo_image_surface_create_for_data((unsigned char *) tiledata,
                                                                  CAIRO_FORMAT_ARGB32,
@@ -178,6 +207,12 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
     return false;
   }
 
+  // request the tiles all at once rather than one by one
+  _openslide_tiff_fetch_region(&l->tiffl, tiff, osr->cache, level,
+                               x / l->base.downsample,
+                               y / l->base.downsample,
+                               w, h, 0, NULL);
+
   bool success = _openslide_grid_paint_region(l->grid, cr, tiff,
                                               x / l->base.downsample,
                                               y / l->base.downsample,
@@ -188,14 +223,81 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool prefetch_region(openslide_t *osr,
+                            int64_t x, int64_t y,
+                            struct _openslide_level *level,
+                            int64_t w, int64_t h,
+                            int prefetch_id,
+                            GError **err) {
+  struct philips_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+
+  bool success = _openslide_tiff_fetch_region(&l->tiffl, tiff,
+                                              osr->cache, level,
+                                              x / l->base.downsample,
+                                              y / l->base.downsample,
+                                              w, h, prefetch_id, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
+static bool read_level_tile(openslide_t *osr,
+                            struct _openslide_level *level,
+                            int64_t tile_col, int64_t tile_row,
+                            uint32_t **tiledata,
+                            struct _openslide_cache_entry **cache_entry,
+                            GError **err) {
+  struct philips_ops_data *data = osr->data;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool success = get_tile(osr, level, tile_col, tile_row, tiff,
+                          tiledata, cache_entry, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
+static bool prefetch_tiles(openslide_t *osr,
+                           struct _openslide_level *level,
+                           const int64_t *tiles, int64_t count,
+                           GError **err) {
+  struct philips_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+  bool success = _openslide_tiff_fetch_tiles(&l->tiffl, tiff,
+                                             osr->cache, level,
+                                             tiles, count, 0, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
 static const struct _openslide_ops philips_ops = {
   .paint_region = paint_region,
+  .prefetch_region = prefetch_region,
+  .read_level_tile = read_level_tile,
+  .prefetch_tiles = prefetch_tiles,
   .destroy = destroy,
 };
 
 static bool philips_detect(const char *filename G_GNUC_UNUSED,
-                           struct _openslide_tifflike *tl,
+                           struct _openslide_probe *probe,
                            GError **err) {
+  struct _openslide_tifflike *tl = probe->tl;
+
   // ensure we have a TIFF
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -224,7 +326,7 @@ static bool philips_detect(const char *filename G_GNUC_UNUSED,
   }
 
   // try to parse the XML
-  xmlDoc *doc = _openslide_xml_parse(image_desc, err);
+  xmlDoc *doc = _openslide_xml_parse_pruned(image_desc, XML_TEXT_MAX, err);
   if (doc == NULL) {
     return false;
   }
@@ -253,7 +355,7 @@ static bool philips_detect(const char *filename G_GNUC_UNUSED,
   return true;
 }
 
-static xmlDoc *parse_xml(TIFF *tiff, GError **err) {
+static const char *get_image_desc(TIFF *tiff, GError **err) {
   if (!_openslide_tiff_set_dir(tiff, 0, err)) {
     return NULL;
   }
@@ -264,25 +366,16 @@ static xmlDoc *parse_xml(TIFF *tiff, GError **err) {
                 "Couldn't read ImageDescription");
     return NULL;
   }
-  return _openslide_xml_parse(image_desc, err);
+  return image_desc;
 }
 
-static bool get_compressed_xml_associated_image_data(xmlDoc *doc,
-                                                     const char *xpath,
-                                                     void **out_data,
-                                                     gsize *out_len,
-                                                     GError **err) {
-  xmlXPathContext *ctx = _openslide_xml_xpath_create(doc);
-  char *b64_data = _openslide_xml_xpath_get_string(ctx, xpath);
-  if (b64_data) {
-    *out_data = g_base64_decode(b64_data, out_len);
-  } else {
-    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
-                "Couldn't read associated image data");
+// associated image data is cut to XML_TEXT_MAX
+static xmlDoc *parse_xml(TIFF *tiff, GError **err) {
+  const char *image_desc = get_image_desc(tiff, err);
+  if (!image_desc) {
+    return NULL;
   }
-  g_free(b64_data);
-  xmlXPathFreeContext(ctx);
-  return b64_data != NULL;
+  return _openslide_xml_parse_pruned(image_desc, XML_TEXT_MAX, err);
 }
 
 static bool get_xml_associated_image_data(struct _openslide_associated_image *_img,
@@ -297,14 +390,16 @@ static bool get_xml_associated_image_data(struct _openslide_associated_image *_i
     return false;
   }
 
-  xmlDoc *doc = parse_xml(tiff, err);
-  if (!doc) {
+  const char *image_desc = get_image_desc(tiff, err);
+  if (!image_desc) {
     goto DONE;
   }
 
   gsize len;
-  if (!get_compressed_xml_associated_image_data(doc, img->xpath,
-                                                &data, &len, err)) {
+  data = _openslide_xml_decode_base64_at_path(image_desc, img->path,
+                                              &len, err);
+  if (!data) {
+    g_prefix_error(err, "Couldn't read associated image data: ");
     goto DONE;
   }
 
@@ -313,9 +408,6 @@ static bool get_xml_associated_image_data(struct _openslide_associated_image *_i
 
 DONE:
   g_free(data);
-  if (doc) {
-    xmlFreeDoc(doc);
-  }
   _openslide_tiffcache_put(img->tc, tiff);
   return success;
 }
@@ -323,6 +415,7 @@ DONE:
 static void destroy_xml_associated_image(struct _openslide_associated_image *_img) {
   struct xml_associated_image *img = (struct xml_associated_image *) _img;
 
+  g_free(img->path);
   g_slice_free(struct xml_associated_image, img);
 }
 
@@ -331,7 +424,6 @@ static const struct _openslide_associated_image_ops philips_xml_associated_ops =
   .destroy = destroy_xml_associated_image,
 };
 
-// xpath is not copied (must be a static string)
 static bool maybe_add_xml_associated_image(openslide_t *osr,
                                            struct _openslide_tiffcache *tc,
                                            xmlDoc *doc,
@@ -343,13 +435,22 @@ static bool maybe_add_xml_associated_image(openslide_t *osr,
     return true;
   }
 
-  void *data;
-  gsize len;
-  if (!get_compressed_xml_associated_image_data(doc, xpath,
-                                                &data, &len, err)) {
-    g_prefix_error(err, "Can't locate %s associated image: ", name);
+  // the text may be cut short, but it starts with the JPEG header
+  xmlXPathContext *ctx = _openslide_xml_xpath_create(doc);
+  xmlXPathObject *result = _openslide_xml_xpath_eval(ctx, xpath);
+  xmlNode *text = result ? result->nodesetval->nodeTab[0] : NULL;
+  xmlXPathFreeObject(result);
+  xmlXPathFreeContext(ctx);
+  if (!text || !text->parent) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Can't locate %s associated image: "
+                "Couldn't read associated image data", name);
     return false;
   }
+  xmlChar *b64_data = xmlNodeGetContent(text);
+  gsize len;
+  void *data = g_base64_decode((const gchar *) b64_data, &len);
+  xmlFree(b64_data);
 
   int32_t w, h;
   bool success =
@@ -366,7 +467,7 @@ static bool maybe_add_xml_associated_image(openslide_t *osr,
   img->base.w = w;
   img->base.h = h;
   img->tc = tc;
-  img->xpath = xpath;
+  img->path = _openslide_xml_get_node_path(text->parent);
 
   g_hash_table_insert(osr->associated_images, g_strdup(name), img);
 
@@ -558,7 +659,7 @@ static bool philips_open(openslide_t *osr,
   bool success = false;
 
   // open TIFF
-  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename);
+  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename, tl);
   TIFF *tiff = _openslide_tiffcache_get(tc, err);
   if (!tiff) {
     goto FAIL;
@@ -629,6 +730,7 @@ static bool philips_open(openslide_t *osr,
                                               tiffl->tile_w,
                                               tiffl->tile_h,
                                               read_tile);
+      _openslide_grid_simple_set_tile_fn(l->grid, get_tile);
 
       // add to array
       g_ptr_array_add(level_array, l);
@@ -43,6 +43,9 @@
 
 static const char MAGIC_BYTES[] = "SVGigaPixelImage";
 
+// the file header of every SQLite 3 database, with its NUL
+static const char SQLITE_HEADER[] = "SQLite format 3";
+
 static const struct property {
   const char *table;
   const char *column;
@@ -87,11 +90,24 @@ enum color_index {
     }									\
   } while (0)
 
+// idle connections kept per slide
+#define CONN_CACHE_MAX 32
+
 struct sakura_ops_data {
   char *filename;
   char *data_sql;
   int32_t tile_size;
   int32_t focal_plane;
+
+  // idle connections, each with the tile query prepared; every thread
+  // painting at once gets one of its own
+  GMutex *conn_lock;
+  GQueue *conns;
+};
+
+struct sakura_conn {
+  sqlite3 *db;
+  sqlite3_stmt *tile_stmt;
 };
 
 struct level {
@@ -128,19 +144,27 @@ FAIL:
 }
 
 static bool sakura_detect(const char *filename,
-                          struct _openslide_tifflike *tl, GError **err) {
+                          struct _openslide_probe *probe, GError **err) {
   sqlite3_stmt *stmt = NULL;
   char *unique_table_name = NULL;
   char *sql = NULL;
   bool result = false;
 
   // reject TIFFs
-  if (tl) {
+  if (probe->tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
                 "Is a TIFF file");
     return false;
   }
 
+  // check the SQLite header before opening a database
+  if (probe->head_len < (int32_t) sizeof(SQLITE_HEADER) ||
+      memcmp(probe->head, SQLITE_HEADER, sizeof(SQLITE_HEADER))) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Not an SQLite database");
+    return false;
+  }
+
   // open database
   sqlite3 *db = _openslide_sqlite_open(filename, err);
   if (!db) {
@@ -180,8 +204,65 @@ static void destroy_level(struct level *l) {
   g_slice_free(struct level, l);
 }
 
+static void conn_free(struct sakura_conn *conn) {
+  sqlite3_finalize(conn->tile_stmt);
+  _openslide_sqlite_close(conn->db);
+  g_slice_free(struct sakura_conn, conn);
+}
+
+// takes ownership of db, even on failure
+static struct sakura_conn *conn_new(struct sakura_ops_data *data,
+                                    sqlite3 *db, GError **err) {
+  sqlite3_stmt *stmt = _openslide_sqlite_prepare(db, data->data_sql, err);
+  if (!stmt) {
+    _openslide_sqlite_close(db);
+    return NULL;
+  }
+  struct sakura_conn *conn = g_slice_new0(struct sakura_conn);
+  conn->db = db;
+  conn->tile_stmt = stmt;
+  return conn;
+}
+
+static struct sakura_conn *get_conn(struct sakura_ops_data *data,
+                                    GError **err) {
+  g_mutex_lock(data->conn_lock);
+  struct sakura_conn *conn = g_queue_pop_head(data->conns);
+  g_mutex_unlock(data->conn_lock);
+  if (conn) {
+    return conn;
+  }
+
+  sqlite3 *db = _openslide_sqlite_open(data->filename, err);
+  if (!db) {
+    return NULL;
+  }
+  return conn_new(data, db, err);
+}
+
+static void put_conn(struct sakura_ops_data *data, struct sakura_conn *conn) {
+  // end the read transaction of the statement
+  sqlite3_reset(conn->tile_stmt);
+
+  g_mutex_lock(data->conn_lock);
+  if (g_queue_get_length(data->conns) < CONN_CACHE_MAX) {
+    g_queue_push_head(data->conns, conn);
+    conn = NULL;
+  }
+  g_mutex_unlock(data->conn_lock);
+  if (conn) {
+    conn_free(conn);
+  }
+}
+
 static void destroy(openslide_t *osr) {
   struct sakura_ops_data *data = osr->data;
+  struct sakura_conn *conn;
+  while ((conn = g_queue_pop_head(data->conns))) {
+    conn_free(conn);
+  }
+  g_queue_free(data->conns);
+  g_mutex_free(data->conn_lock);
   g_free(data->filename);
   g_free(data->data_sql);
   g_slice_free(struct sakura_ops_data, data);
@@ -377,7 +458,7 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tile_size * tile_size * 4);
+    tiledata = _openslide_buffer_alloc(tile_size * tile_size * 4);
 
     // read tile
     if (!read_image(tiledata, tile_col, tile_row, l->base.downsample,
@@ -389,7 +470,7 @@ static bool read_tile(openslide_t *osr,
         return true;
       } else {
         g_propagate_error(err, tmp_err);
-        g_slice_free1(tile_size * tile_size * 4, tiledata);
+        _openslide_buffer_free(tile_size * tile_size * 4, tiledata);
         return false;
       }
     }
@@ -400,7 +481,7 @@ static bool read_tile(openslide_t *osr,
                               l->base.w - tile_col * tile_size,
                               l->base.h - tile_row * tile_size,
                               err)) {
-      g_slice_free1(tile_size * tile_size * 4, tiledata);
+      _openslide_buffer_free(tile_size * tile_size * 4, tiledata);
       return false;
     }
 
@@ -433,24 +514,19 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
                          GError **err) {
   struct sakura_ops_data *data = osr->data;
   struct level *l = (struct level *) level;
-  sqlite3_stmt *stmt = NULL;
-  bool success = false;
 
-  sqlite3 *db = _openslide_sqlite_open(data->filename, err);
-  if (!db) {
+  struct sakura_conn *conn = get_conn(data, err);
+  if (!conn) {
     return false;
   }
-  PREPARE_OR_FAIL(stmt, db, data->data_sql);
 
-  success = _openslide_grid_paint_region(l->grid, cr, stmt,
-                                         x / l->base.downsample,
-                                         y / l->base.downsample,
-                                         level, w, h,
-                                         err);
+  bool success = _openslide_grid_paint_region(l->grid, cr, conn->tile_stmt,
+                                              x / l->base.downsample,
+                                              y / l->base.downsample,
+                                              level, w, h,
+                                              err);
 
-FAIL:
-  sqlite3_finalize(stmt);
-  _openslide_sqlite_close(db);
+  put_conn(data, conn);
   return success;
 }
 
@@ -995,6 +1071,15 @@ static bool sakura_open(openslide_t *osr, const char *filename,
     g_strdup_printf("SELECT data FROM %s WHERE id=?", unique_table_name);
   data->tile_size = tile_size;
   data->focal_plane = chosen_focal_plane;
+  data->conn_lock = g_mutex_new();
+  data->conns = g_queue_new();
+
+  // keep the connection for reading tiles
+  struct sakura_conn *conn = conn_new(data, db, NULL);
+  db = NULL;
+  if (conn) {
+    put_conn(data, conn);
+  }
 
   // commit
   g_assert(osr->data == NULL);
@@ -1015,7 +1100,9 @@ FAIL:
   }
 
   sqlite3_finalize(stmt);
-  _openslide_sqlite_close(db);
+  if (db) {
+    _openslide_sqlite_close(db);
+  }
   clear_tileids(quickhash_tileids);
   g_queue_free(quickhash_tileids);
   g_hash_table_destroy(level_hash);
@@ -52,6 +52,10 @@ struct level {
   struct _openslide_level base;
   struct _openslide_tiff_level tiffl;
   struct _openslide_grid *grid;
+
+  // between the origins of neighboring tiles, which may overlap
+  int64_t tile_advance_x;
+  int64_t tile_advance_y;
 };
 
 static void destroy_data(struct trestle_ops_data *data,
@@ -100,11 +104,11 @@ static bool read_tile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!_openslide_tiff_read_tile(tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -112,7 +116,7 @@ static bool read_tile(openslide_t *osr,
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -137,6 +141,50 @@ static bool read_tile(openslide_t *osr,
   return true;
 }
 
+// start fetching the tiles of the grid covering a region of the level, in
+// level coordinates; unlike _openslide_tiff_fetch_region(), this places the
+// tiles at their advance, overlaps included
+static bool fetch_region(openslide_t *osr, struct level *l, TIFF *tiff,
+                         int64_t x, int64_t y, int64_t w, int64_t h,
+                         int prefetch_id, GError **err) {
+  struct _openslide_tiff_level *tiffl = &l->tiffl;
+
+  // clip to the level
+  int64_t end_x = MIN(x + w, l->base.w);
+  int64_t end_y = MIN(y + h, l->base.h);
+  x = MAX(x, 0);
+  y = MAX(y, 0);
+  if (end_x <= x || end_y <= y) {
+    return true;
+  }
+
+  // a tile reaches tile_w past its origin
+  int64_t start_col = x >= tiffl->tile_w ?
+    (x - tiffl->tile_w) / l->tile_advance_x + 1 : 0;
+  int64_t start_row = y >= tiffl->tile_h ?
+    (y - tiffl->tile_h) / l->tile_advance_y + 1 : 0;
+  int64_t end_col = MIN((end_x - 1) / l->tile_advance_x,
+                        tiffl->tiles_across - 1);
+  int64_t end_row = MIN((end_y - 1) / l->tile_advance_y,
+                        tiffl->tiles_down - 1);
+
+  GArray *tiles = g_array_new(FALSE, FALSE, sizeof(int64_t));
+  for (int64_t row = start_row; row <= end_row; row++) {
+    for (int64_t col = start_col; col <= end_col; col++) {
+      g_array_append_val(tiles, col);
+      g_array_append_val(tiles, row);
+    }
+  }
+  bool success = _openslide_tiff_fetch_tiles(tiffl, tiff, osr->cache,
+                                             &l->base,
+                                             (const int64_t *) tiles->data,
+                                             tiles->len / 2,
+                                             prefetch_id, err);
+  g_array_free(tiles, TRUE);
+
+  return success;
+}
+
 static bool paint_region(openslide_t *osr, cairo_t *cr,
                          int64_t x, int64_t y,
                          struct _openslide_level *level,
@@ -150,6 +198,11 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
     return false;
   }
 
+  // request the tiles all at once rather than one by one
+  fetch_region(osr, l, tiff,
+               x / l->base.downsample, y / l->base.downsample,
+               w, h, 0, NULL);
+
   bool success = _openslide_grid_paint_region(l->grid, cr, tiff,
                                               x / l->base.downsample,
                                               y / l->base.downsample,
@@ -160,14 +213,40 @@ static bool paint_region(openslide_t *osr, cairo_t *cr,
   return success;
 }
 
+static bool prefetch_region(openslide_t *osr,
+                            int64_t x, int64_t y,
+                            struct _openslide_level *level,
+                            int64_t w, int64_t h,
+                            int prefetch_id,
+                            GError **err) {
+  struct trestle_ops_data *data = osr->data;
+  struct level *l = (struct level *) level;
+
+  TIFF *tiff = _openslide_tiffcache_get(data->tc, err);
+  if (tiff == NULL) {
+    return false;
+  }
+
+  bool success = fetch_region(osr, l, tiff,
+                              x / l->base.downsample,
+                              y / l->base.downsample,
+                              w, h, prefetch_id, err);
+  _openslide_tiffcache_put(data->tc, tiff);
+
+  return success;
+}
+
 static const struct _openslide_ops trestle_ops = {
   .paint_region = paint_region,
+  .prefetch_region = prefetch_region,
   .destroy = destroy,
 };
 
 static bool trestle_detect(const char *filename G_GNUC_UNUSED,
-                           struct _openslide_tifflike *tl,
+                           struct _openslide_probe *probe,
                            GError **err) {
+  struct _openslide_tifflike *tl = probe->tl;
+
   // ensure we have a TIFF
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -303,7 +382,7 @@ static bool trestle_open(openslide_t *osr, const char *filename,
   int32_t level_count = 0;
 
   // open TIFF
-  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename);
+  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename, tl);
   TIFF *tiff = _openslide_tiffcache_get(tc, err);
   if (!tiff) {
     goto FAIL;
@@ -377,9 +456,11 @@ static bool trestle_open(openslide_t *osr, const char *filename,
     }
 
     // create grid
+    l->tile_advance_x = tiffl->tile_w - overlap_x;
+    l->tile_advance_y = tiffl->tile_h - overlap_y;
     l->grid = _openslide_grid_create_tilemap(osr,
-                                             tiffl->tile_w - overlap_x,
-                                             tiffl->tile_h - overlap_y,
+                                             l->tile_advance_x,
+                                             l->tile_advance_y,
                                              read_tile, NULL);
 
     // add tiles
@@ -392,6 +473,7 @@ static bool trestle_open(openslide_t *osr, const char *filename,
                                          NULL);
       }
     }
+    _openslide_grid_tilemap_finish_adding_tiles(l->grid);
   }
   g_free(overlaps);
   overlaps = NULL;
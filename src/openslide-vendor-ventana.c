@@ -70,6 +70,9 @@ static const char ATTR_OVERLAP_Y[] = "OverlapY";
 static const char DIRECTION_RIGHT[] = "RIGHT";
 static const char DIRECTION_UP[] = "UP";
 
+// only attributes are used, so element text is dropped past this
+#define XML_TEXT_MAX 4096
+
 #define PARSE_INT_ATTRIBUTE_OR_FAIL(NODE, NAME, OUT)		\
   do {								\
     GError *tmp_err = NULL;					\
@@ -174,11 +177,11 @@ static bool read_subtile(openslide_t *osr,
                                             level, tile_col, tile_row,
                                             &cache_entry);
   if (!tiledata) {
-    tiledata = g_slice_alloc(tw * th * 4);
+    tiledata = _openslide_buffer_alloc(tw * th * 4);
     if (!_openslide_tiff_read_tile(tiffl, tiff,
                                    tiledata, tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -186,7 +189,7 @@ static bool read_subtile(openslide_t *osr,
     if (!_openslide_tiff_clip_tile(tiffl, tiledata,
                                    tile_col, tile_row,
                                    err)) {
-      g_slice_free1(tw * th * 4, tiledata);
+      _openslide_buffer_free(tw * th * 4, tiledata);
       return false;
     }
 
@@ -300,8 +303,10 @@ static xmlNode *get_initial_xml_iscan(xmlDoc *doc, GError **err) {
 }
 
 static bool ventana_detect(const char *filename G_GNUC_UNUSED,
-                           struct _openslide_tifflike *tl,
+                           struct _openslide_probe *probe,
                            GError **err) {
+  struct _openslide_tifflike *tl = probe->tl;
+
   // ensure we have a TIFF
   if (!tl) {
     g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -324,7 +329,7 @@ static bool ventana_detect(const char *filename G_GNUC_UNUSED,
   }
 
   // parse
-  xmlDoc *doc = _openslide_xml_parse(xml, err);
+  xmlDoc *doc = _openslide_xml_parse_pruned(xml, XML_TEXT_MAX, err);
   if (!doc) {
     return false;
   }
@@ -371,7 +376,7 @@ static int width_compare(gconstpointer a, gconstpointer b) {
 static bool parse_initial_xml(openslide_t *osr, const char *xml,
                               GError **err) {
   // parse
-  xmlDoc *doc = _openslide_xml_parse(xml, err);
+  xmlDoc *doc = _openslide_xml_parse_pruned(xml, XML_TEXT_MAX, err);
   if (!doc) {
     return false;
   }
@@ -462,7 +467,7 @@ static struct bif *parse_level0_xml(const char *xml,
   bool success = false;
 
   // parse
-  xmlDoc *doc = _openslide_xml_parse(xml, err);
+  xmlDoc *doc = _openslide_xml_parse_pruned(xml, XML_TEXT_MAX, err);
   if (!doc) {
     g_prefix_error(err, "Parsing level 0 XML: ");
     goto FAIL;
@@ -759,6 +764,7 @@ static struct _openslide_grid *create_bif_grid(openslide_t *osr,
       }
     }
   }
+  _openslide_grid_tilemap_finish_adding_tiles(grid);
 
   return grid;
 }
@@ -790,7 +796,7 @@ static bool ventana_open(openslide_t *osr, const char *filename,
   GError *tmp_err = NULL;
 
   // open TIFF
-  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename);
+  struct _openslide_tiffcache *tc = _openslide_tiffcache_create(filename, tl);
   TIFF *tiff = _openslide_tiffcache_get(tc, err);
   if (!tiff) {
     goto FAIL;
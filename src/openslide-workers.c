@@ -0,0 +1,448 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // sched_setaffinity
+#endif
+
+#include <config.h>
+
+#include "openslide-private.h"
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
+
+/*
+ * One pool of workers runs the library's background work: decode bands,
+ * prefetch hints and long scans.  Each worker has a deque per priority.
+ * A worker pushes the tasks it submits onto its own deques and pops them
+ * newest first; tasks from other threads are dealt round robin.  An idle
+ * worker takes the most urgent task it can find, first from its own
+ * deques, then by stealing the oldest task of another worker.  Background
+ * tasks may block, so at most half the workers run them at once.
+ *
+ * A thread waiting for a group of interactive tasks runs queued ones
+ * itself, so tasks running on workers can wait for tasks they submit.
+ */
+
+#define WORKERS_ENV_VAR "OPENSLIDE_DECODE_THREADS"
+#define WORKERS_PINNING_ENV_VAR "OPENSLIDE_WORKER_PINNING"
+#define WORKERS_MAX 64
+#define WORKERS_DEFAULT_MAX 8
+
+struct task {
+  _openslide_work_fn fn;
+  void *data;
+  enum _openslide_work_priority priority;
+  struct _openslide_work_group *group;
+};
+
+struct worker {
+  int index;
+  GMutex *lock;
+  GQueue queues[OPENSLIDE_WORK_PRIORITIES];
+  bool running;  // under pool_lock
+};
+
+struct _openslide_work_group {
+  GMutex *lock;
+  GCond *cond;
+  int pending;
+};
+
+// configuration and sleeping workers, under pool_lock
+static GMutex pool_lock;
+static GCond *pool_cond;
+static int target_threads;  // 0 until configured
+static int sleeping;
+static openslide_executor_fn executor;
+static void *executor_data;
+
+// workers are never freed, so their deques can always be stolen from
+static struct worker *workers[WORKERS_MAX];
+static volatile gint worker_count;  // ever started
+static volatile gint next_worker;
+static volatile gint queued[OPENSLIDE_WORK_PRIORITIES];
+static volatile gint background_running;
+
+static GPrivate *current_worker;
+static GOnce init_once = G_ONCE_INIT;
+
+static gpointer init_pool(gpointer data G_GNUC_UNUSED) {
+  pool_cond = g_cond_new();
+  current_worker = g_private_new(NULL);
+  return NULL;
+}
+
+static int default_threads(void) {
+  const char *env = g_getenv(WORKERS_ENV_VAR);
+  if (env && *env) {
+    return CLAMP(atoi(env), 1, WORKERS_MAX);
+  }
+#ifdef _SC_NPROCESSORS_ONLN
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0) {
+    return MIN(cpus, WORKERS_DEFAULT_MAX);
+  }
+#endif
+  return 1;
+}
+
+static int background_limit(void) {
+  return MAX(1, target_threads / 2);
+}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+// parse a sysfs CPU list such as "0-3,8-11"
+static GArray *parse_cpulist(const char *list) {
+  GArray *cpus = g_array_new(false, false, sizeof(int));
+  char **ranges = g_strsplit(list, ",", 0);
+  for (char **r = ranges; *r; r++) {
+    char *end;
+    int first = strtol(*r, &end, 10);
+    if (end == *r) {
+      continue;
+    }
+    int last = *end == '-' ? atoi(end + 1) : first;
+    for (int cpu = first; cpu <= last; cpu++) {
+      g_array_append_val(cpus, cpu);
+    }
+  }
+  g_strfreev(ranges);
+  return cpus;
+}
+
+// the CPU for a worker: workers are spread over the NUMA nodes in turn,
+// then over the CPUs of each node
+static int get_worker_cpu(int index) {
+  GPtrArray *nodes = g_ptr_array_new();
+  for (int node = 0; ; node++) {
+    char *path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist",
+                                 node);
+    char *list;
+    bool ok = g_file_get_contents(path, &list, NULL, NULL);
+    g_free(path);
+    if (!ok) {
+      break;
+    }
+    GArray *cpus = parse_cpulist(list);
+    g_free(list);
+    if (cpus->len) {
+      g_ptr_array_add(nodes, cpus);
+    } else {
+      g_array_free(cpus, true);
+    }
+  }
+
+  int cpu = -1;
+  if (nodes->len) {
+    GArray *cpus = nodes->pdata[index % nodes->len];
+    cpu = g_array_index(cpus, int, (index / nodes->len) % cpus->len);
+  } else {
+#ifdef _SC_NPROCESSORS_ONLN
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0) {
+      cpu = index % count;
+    }
+#endif
+  }
+  for (guint i = 0; i < nodes->len; i++) {
+    g_array_free(nodes->pdata[i], true);
+  }
+  g_ptr_array_free(nodes, true);
+  return cpu;
+}
+
+static void pin_worker(int index) {
+  const char *env = g_getenv(WORKERS_PINNING_ENV_VAR);
+  if (!env || !*env || !strcmp(env, "0")) {
+    return;
+  }
+  int cpu = get_worker_cpu(index);
+  if (cpu >= 0 && cpu < CPU_SETSIZE) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+}
+#else
+static void pin_worker(int index G_GNUC_UNUSED) {
+}
+#endif
+
+static void group_done(struct _openslide_work_group *group) {
+  g_mutex_lock(group->lock);
+  if (--group->pending == 0) {
+    g_cond_broadcast(group->cond);
+  }
+  g_mutex_unlock(group->lock);
+}
+
+static void run_task(void *data) {
+  struct task *task = data;
+  task->fn(task->data);
+  if (task->group) {
+    group_done(task->group);
+  }
+  g_slice_free(struct task, task);
+}
+
+// take a task of a priority, from the given worker first
+static struct task *take(int first, enum _openslide_work_priority priority) {
+  if (g_atomic_int_get(&queued[priority]) == 0) {
+    return NULL;
+  }
+  int count = g_atomic_int_get(&worker_count);
+  for (int i = 0; i < count; i++) {
+    struct worker *w = workers[(first + i) % count];
+    g_mutex_lock(w->lock);
+    // our own newest, anyone else's oldest
+    struct task *task = i ? g_queue_pop_head(&w->queues[priority]) :
+                            g_queue_pop_tail(&w->queues[priority]);
+    g_mutex_unlock(w->lock);
+    if (task) {
+      g_atomic_int_add(&queued[priority], -1);
+      return task;
+    }
+  }
+  return NULL;
+}
+
+// the most urgent task a worker may run
+static struct task *take_any(int first) {
+  for (int p = 0; p < OPENSLIDE_WORK_PRIORITIES; p++) {
+    if (p != OPENSLIDE_WORK_BACKGROUND) {
+      struct task *task = take(first, p);
+      if (task) {
+        return task;
+      }
+      continue;
+    }
+
+    // reserve a background slot, then look
+    int running;
+    do {
+      running = g_atomic_int_get(&background_running);
+      if (running >= background_limit()) {
+        return NULL;
+      }
+    } while (!g_atomic_int_compare_and_exchange(&background_running,
+                                                running, running + 1));
+    struct task *task = take(first, p);
+    if (task) {
+      return task;
+    }
+    g_atomic_int_add(&background_running, -1);
+  }
+  return NULL;
+}
+
+static bool has_runnable_locked(void) {
+  return g_atomic_int_get(&queued[OPENSLIDE_WORK_INTERACTIVE]) ||
+         g_atomic_int_get(&queued[OPENSLIDE_WORK_PREFETCH]) ||
+         (g_atomic_int_get(&queued[OPENSLIDE_WORK_BACKGROUND]) &&
+          g_atomic_int_get(&background_running) < background_limit());
+}
+
+static gpointer worker_main(gpointer data) {
+  struct worker *w = data;
+  g_private_set(current_worker, w);
+  pin_worker(w->index);
+
+  for (;;) {
+    struct task *task = take_any(w->index);
+    if (task) {
+      bool background = task->priority == OPENSLIDE_WORK_BACKGROUND;
+      run_task(task);
+      if (background) {
+        // a waiting background task may run now
+        g_atomic_int_add(&background_running, -1);
+        g_mutex_lock(&pool_lock);
+        if (sleeping) {
+          g_cond_signal(pool_cond);
+        }
+        g_mutex_unlock(&pool_lock);
+      }
+      continue;
+    }
+
+    g_mutex_lock(&pool_lock);
+    while (!has_runnable_locked() && w->index < target_threads) {
+      sleeping++;
+      g_cond_wait(pool_cond, &pool_lock);
+      sleeping--;
+    }
+    if (w->index >= target_threads) {
+      // the pool shrank; others steal what is left here
+      w->running = false;
+      g_mutex_unlock(&pool_lock);
+      break;
+    }
+    g_mutex_unlock(&pool_lock);
+  }
+  g_private_set(current_worker, NULL);
+  return NULL;
+}
+
+// start workers up to the target; call with pool_lock held
+static void start_workers_locked(void) {
+  if (target_threads == 0) {
+    target_threads = default_threads();
+  }
+  for (int i = 0; i < target_threads; i++) {
+    if (workers[i] == NULL) {
+      struct worker *w = g_slice_new0(struct worker);
+      w->index = i;
+      w->lock = g_mutex_new();
+      for (int p = 0; p < OPENSLIDE_WORK_PRIORITIES; p++) {
+        g_queue_init(&w->queues[p]);
+      }
+      workers[i] = w;
+      g_atomic_int_set(&worker_count, MAX(worker_count, i + 1));
+    }
+    if (!workers[i]->running) {
+      workers[i]->running =
+        g_thread_create(worker_main, workers[i], false, NULL) != NULL;
+    }
+  }
+}
+
+void _openslide_work_submit(struct _openslide_work_group *group,
+                            enum _openslide_work_priority priority,
+                            _openslide_work_fn fn, void *data) {
+  g_once(&init_once, init_pool, NULL);
+
+  struct task *task = g_slice_new(struct task);
+  task->fn = fn;
+  task->data = data;
+  task->priority = priority;
+  task->group = group;
+  if (group) {
+    g_mutex_lock(group->lock);
+    group->pending++;
+    g_mutex_unlock(group->lock);
+  }
+
+  g_mutex_lock(&pool_lock);
+  openslide_executor_fn exec = executor;
+  void *exec_data = executor_data;
+  if (exec == NULL) {
+    start_workers_locked();
+  }
+  int threads = target_threads;
+  g_mutex_unlock(&pool_lock);
+
+  if (exec) {
+    exec(run_task, task, (enum openslide_task_priority) priority, exec_data);
+    return;
+  }
+
+  // our own deque on a worker, else the next worker's
+  struct worker *w = g_private_get(current_worker);
+  if (w == NULL || w->index >= threads) {
+    guint next = g_atomic_int_exchange_and_add(&next_worker, 1);
+    w = workers[next % threads];
+  }
+  // counted first, so the count is never short of the deques
+  g_atomic_int_inc(&queued[priority]);
+  g_mutex_lock(w->lock);
+  g_queue_push_tail(&w->queues[priority], task);
+  g_mutex_unlock(w->lock);
+
+  g_mutex_lock(&pool_lock);
+  if (sleeping) {
+    g_cond_signal(pool_cond);
+  }
+  g_mutex_unlock(&pool_lock);
+}
+
+struct _openslide_work_group *_openslide_work_group_new(void) {
+  struct _openslide_work_group *group =
+    g_slice_new0(struct _openslide_work_group);
+  group->lock = g_mutex_new();
+  group->cond = g_cond_new();
+  return group;
+}
+
+void _openslide_work_group_finish(struct _openslide_work_group *group,
+                                  bool help) {
+  g_once(&init_once, init_pool, NULL);
+  struct worker *w = g_private_get(current_worker);
+  int first = w ? w->index : 0;
+
+  g_mutex_lock(group->lock);
+  while (group->pending) {
+    g_mutex_unlock(group->lock);
+    // interactive tasks don't block, so running one here is safe
+    struct task *task = help ? take(first, OPENSLIDE_WORK_INTERACTIVE) : NULL;
+    g_mutex_lock(group->lock);
+    if (task) {
+      g_mutex_unlock(group->lock);
+      run_task(task);
+      g_mutex_lock(group->lock);
+    } else if (group->pending) {
+      // the rest are running; each completion wakes us
+      g_cond_wait(group->cond, group->lock);
+    }
+  }
+  g_mutex_unlock(group->lock);
+
+  g_mutex_free(group->lock);
+  g_cond_free(group->cond);
+  g_slice_free(struct _openslide_work_group, group);
+}
+
+int _openslide_work_get_threads(void) {
+  g_mutex_lock(&pool_lock);
+  if (target_threads == 0) {
+    target_threads = default_threads();
+  }
+  int threads = target_threads;
+  g_mutex_unlock(&pool_lock);
+  return threads;
+}
+
+void _openslide_work_set_threads(int threads) {
+  g_once(&init_once, init_pool, NULL);
+  g_mutex_lock(&pool_lock);
+  target_threads = threads > 0 ? MIN(threads, WORKERS_MAX) :
+                                 default_threads();
+  // grow now if running; surplus workers exit when idle
+  if (worker_count) {
+    start_workers_locked();
+  }
+  g_cond_broadcast(pool_cond);
+  g_mutex_unlock(&pool_lock);
+}
+
+void openslide_set_executor(openslide_executor_fn fn, void *data) {
+  g_mutex_lock(&pool_lock);
+  executor = fn;
+  executor_data = data;
+  g_mutex_unlock(&pool_lock);
+}
@@ -40,6 +40,10 @@ const char _openslide_release_info[] = "OpenSlide " SUFFIXED_VERSION ", copyrigh
 
 static const char * const EMPTY_STRING_ARRAY[] = { NULL };
 
+// large reads are split into bands for the worker pool
+#define DECODE_MIN_PIXELS (1024 * 1024)
+#define DECODE_BAND_UNIT 256
+
 static const struct _openslide_format *formats[] = {
   &_openslide_format_mirax,
   &_openslide_format_hamamatsu_vms_vmu,
@@ -100,35 +104,126 @@ static openslide_t *create_osr(void) {
   osr->associated_images = g_hash_table_new_full(g_str_hash, g_str_equal,
                                                  g_free,
                                                  destroy_associated_image);
+  osr->stats_id = _openslide_stats_id_new();
   return osr;
 }
 
-static const struct _openslide_format *detect_format(const char *filename,
-                                                     struct _openslide_tifflike **tl_OUT) {
-  GError *tmp_err = NULL;
+// bytes of the start of the file given to every detector
+#define PROBE_HEAD_SIZE 4096
+
+// how long a detection is kept for the open that usually follows it
+#define PROBE_CACHE_SECONDS 10.0
+
+static struct _openslide_probe *probe_create(const char *filename) {
+  struct _openslide_probe *probe = g_slice_new0(struct _openslide_probe);
+  probe->size = -1;
+
+  URLIO_FILE *f = urlio_fopen(filename, "rb");
+  if (f) {
+    probe->size = urlio_fsize(f);
+    uint8_t *head = g_malloc(PROBE_HEAD_SIZE);
+    probe->head_len = urlio_pread(f, head, PROBE_HEAD_SIZE, 0);
+    probe->head = head;
+    urlio_fclose(f);
+  } else {
+    probe->head = g_malloc(1);
+  }
 
-  struct _openslide_tifflike *tl = _openslide_tifflike_create(filename,
-                                                              &tmp_err);
-  if (!tl) {
+  GError *tmp_err = NULL;
+  probe->tl = _openslide_tifflike_create(filename, &tmp_err);
+  if (!probe->tl) {
     if (_openslide_debug(OPENSLIDE_DEBUG_DETECTION)) {
       g_message("tifflike: %s", tmp_err->message);
     }
     g_clear_error(&tmp_err);
   }
+  return probe;
+}
+
+static void probe_destroy(struct _openslide_probe *probe) {
+  if (probe == NULL) {
+    return;
+  }
+  _openslide_tifflike_destroy(probe->tl);
+  g_free((void *) probe->head);
+  g_slice_free(struct _openslide_probe, probe);
+}
+
+// the last detection, under probe_cache_lock
+static GMutex probe_cache_lock;
+static struct {
+  char *filename;
+  const struct _openslide_format *format;
+  struct _openslide_probe *probe;
+  GTimer *age;
+} probe_cache;
+
+static void probe_cache_clear_locked(void) {
+  g_free(probe_cache.filename);
+  probe_cache.filename = NULL;
+  probe_destroy(probe_cache.probe);
+  probe_cache.probe = NULL;
+  probe_cache.format = NULL;
+}
+
+// keep a detection, taking ownership of the probe
+static void probe_cache_put(const char *filename,
+                            const struct _openslide_format *format,
+                            struct _openslide_probe *probe) {
+  g_mutex_lock(&probe_cache_lock);
+  probe_cache_clear_locked();
+  probe_cache.filename = g_strdup(filename);
+  probe_cache.format = format;
+  probe_cache.probe = probe;
+  if (probe_cache.age == NULL) {
+    probe_cache.age = g_timer_new();
+  }
+  g_timer_start(probe_cache.age);
+  g_mutex_unlock(&probe_cache_lock);
+}
+
+// take back a recent detection of filename, or return NULL
+static const struct _openslide_format *probe_cache_take(const char *filename,
+                                                        struct _openslide_probe **probe_OUT) {
+  const struct _openslide_format *format = NULL;
+
+  g_mutex_lock(&probe_cache_lock);
+  if (probe_cache.filename && !strcmp(probe_cache.filename, filename)) {
+    if (g_timer_elapsed(probe_cache.age, NULL) < PROBE_CACHE_SECONDS) {
+      format = probe_cache.format;
+      *probe_OUT = probe_cache.probe;
+      probe_cache.probe = NULL;
+    }
+    probe_cache_clear_locked();
+  }
+  g_mutex_unlock(&probe_cache_lock);
+  return format;
+}
 
+static const struct _openslide_format *detect_format(const char *filename,
+                                                     struct _openslide_probe **probe_OUT) {
+  GError *tmp_err = NULL;
+
+  // reuse the probe of a detection just made
+  struct _openslide_probe *probe = NULL;
+  const struct _openslide_format *cached = probe_cache_take(filename, &probe);
+  if (cached) {
+    *probe_OUT = probe;
+    return cached;
+  }
+
+  _openslide_trace_begin("detect");
+  probe = probe_create(filename);
   for (const struct _openslide_format **cur = formats; *cur; cur++) {
     const struct _openslide_format *format = *cur;
 
     g_assert(format->name && format->vendor &&
              format->detect && format->open);
 
-    if (format->detect(filename, tl, &tmp_err)) {
+    if (format->detect(filename, probe, &tmp_err)) {
       // success!
-      if (tl_OUT) {
-        *tl_OUT = tl;
-      } else {
-        _openslide_tifflike_destroy(tl);
-      }
+      _openslide_trace_end();
+      *probe_OUT = probe;
       return format;
     }
 
@@ -140,7 +235,8 @@ static const struct _openslide_format *detect_format(const char *filename,
   }
 
   // no match
-  _openslide_tifflike_destroy(tl);
+  probe_destroy(probe);
+  _openslide_trace_end();
   return NULL;
 }
 
@@ -154,9 +250,11 @@ static bool open_backend(openslide_t *osr,
     *quickhash1_OUT = _openslide_hash_quickhash1_create();
   }
 
+  _openslide_trace_begin("open backend");
   bool result = format->open(osr, filename, tl,
                              quickhash1_OUT ? *quickhash1_OUT : NULL,
                              err);
+  _openslide_trace_end();
 
   // check for error-handling bugs in open function
   if (!result && err && !*err) {
@@ -181,10 +279,13 @@ static bool open_backend(openslide_t *osr,
 const char *openslide_detect_vendor(const char *filename) {
   g_assert(openslide_was_dynamically_loaded);
 
-  const struct _openslide_format *format = detect_format(filename, NULL);
+  struct _openslide_probe *probe;
+  const struct _openslide_format *format = detect_format(filename, &probe);
   if (!format) {
     return NULL;
   }
+  // keep the probe for an open of the same file
+  probe_cache_put(filename, format, probe);
   return format->vendor;
 }
 
@@ -192,17 +293,23 @@ bool openslide_can_open(const char *filename) {
   g_assert(openslide_was_dynamically_loaded);
 
   // detect format
-  struct _openslide_tifflike *tl;
-  const struct _openslide_format *format = detect_format(filename, &tl);
+  struct _openslide_probe *probe;
+  const struct _openslide_format *format = detect_format(filename, &probe);
   if (!format) {
     return false;
   }
 
   // try opening
   openslide_t *osr = create_osr();
-  bool success = open_backend(osr, format, filename, tl, NULL, NULL);
-  _openslide_tifflike_destroy(tl);
+  bool success = open_backend(osr, format, filename, probe->tl, NULL, NULL);
   openslide_close(osr);
+
+  // an open usually follows
+  if (success) {
+    probe_cache_put(filename, format, probe);
+  } else {
+    probe_destroy(probe);
+  }
   return success;
 }
 
@@ -236,7 +343,13 @@ static const char **strv_from_hashtable_keys(GHashTable *h) {
   return result;
 }
 
-openslide_t *openslide_open(const char *filename) {
+static void prefetch_region(openslide_t *osr,
+			    int64_t x, int64_t y,
+			    int32_t level,
+			    int64_t w, int64_t h,
+			    int prefetch_id);
+
+openslide_t *_openslide_open_native(const char *filename) {
   GError *tmp_err = NULL;
 
   urlio_initial();
@@ -244,8 +357,8 @@ openslide_t *openslide_open(const char *filename) {
   g_assert(openslide_was_dynamically_loaded);
 
   // detect format
-  struct _openslide_tifflike *tl;
-  const struct _openslide_format *format = detect_format(filename, &tl);
+  struct _openslide_probe *probe;
+  const struct _openslide_format *format = detect_format(filename, &probe);
   if (!format) {
     // not a slide file
     return NULL;
@@ -256,15 +369,16 @@ openslide_t *openslide_open(const char *filename) {
 
   // open backend
   struct _openslide_hash *quickhash1 = NULL;
-  bool success = open_backend(osr, format, filename, tl, &quickhash1,
+  bool success = open_backend(osr, format, filename, probe->tl, &quickhash1,
                               &tmp_err);
-  _openslide_tifflike_destroy(tl);
+  probe_destroy(probe);
   if (!success) {
     // failed to read slide
     _openslide_propagate_error(osr, tmp_err);
     return osr;
   }
   g_assert(osr->levels);
+  osr->companion_files = format->companion_files;
 
   // compute downsamples if not done already
   int64_t blw, blh;
@@ -304,10 +418,34 @@ openslide_t *openslide_open(const char *filename) {
   }
   _openslide_hash_destroy(quickhash1);
 
-  // set other properties
   g_hash_table_insert(osr->properties,
                       g_strdup(OPENSLIDE_PROPERTY_NAME_VENDOR),
                       g_strdup(format->vendor));
+
+  return osr;
+}
+
+static openslide_t *open_slide(const char *filename) {
+  urlio_initial();
+
+  // round trips for a remote file opened before
+  gint round_trips = MAX(urlio_get_round_trips(filename), 0);
+
+  // what an earlier open found, if the file hasn't changed since
+  openslide_t *osr = create_osr();
+  if (!_openslide_snapshot_load(osr, filename)) {
+    openslide_close(osr);
+    osr = _openslide_open_native(filename);
+    if (osr == NULL || openslide_get_error(osr)) {
+      return osr;
+    }
+    _openslide_snapshot_save(osr, filename);
+  }
+
+  // low-resolution levels the slide lacks, if built
+  _openslide_pyramid_attach(osr, filename);
+
+  // set other properties
   g_hash_table_insert(osr->properties,
 		      g_strdup(_OPENSLIDE_PROPERTY_NAME_LEVEL_COUNT),
 		      g_strdup_printf("%d", osr->level_count));
@@ -343,22 +481,136 @@ openslide_t *openslide_open(const char *filename) {
     }
   }
 
+  // for remote files, what it took to open this one
+  if (urlio_get_round_trips(filename) >= 0) {
+    g_hash_table_insert(osr->properties,
+                        g_strdup(_OPENSLIDE_PROPERTY_NAME_OPEN_ROUND_TRIPS),
+                        g_strdup_printf("%d", urlio_get_round_trips(filename) -
+                                        round_trips));
+  }
+
   // fill in names
   osr->associated_image_names = strv_from_hashtable_keys(osr->associated_images);
   osr->property_names = strv_from_hashtable_keys(osr->properties);
 
   // start cache
-  osr->cache = _openslide_cache_create(_OPENSLIDE_USEFUL_CACHE_SIZE);
-  //osr->cache = _openslide_cache_create(0);
+  osr->cache = _openslide_cache_binding_create();
 
   osr->urlname = (char*) malloc((strlen(filename)+1) * sizeof(char));
   strcpy(osr->urlname, filename);
 
+  osr->prefetch = _openslide_prefetch_create(osr, prefetch_region);
+
+  return osr;
+}
+
+openslide_t *openslide_open(const char *filename) {
+  _openslide_trace_begin("open");
+  openslide_t *osr = open_slide(filename);
+  _openslide_trace_end();
   return osr;
 }
 
+// opens wait for the network rather than a processor, so they have a pool
+// of their own with more threads than workers; on the work pool, or an
+// executor set with openslide_set_executor(), they would hold workers
+// while blocked on transfers
+#define OPEN_THREADS 32
+
+struct open_job {
+  char *filename;
+  openslide_open_callback_t callback;
+  void *user_data;
+};
+
+static GOnce open_pool_once = G_ONCE_INIT;
+static GPrivate *open_thread_key;  // set in the threads of the pool
+
+// for openslide_open_many(), whose batches all wait on the one cond
+static GMutex open_batch_lock;
+static GCond open_batch_cond;
+
+static void open_job_run(gpointer data, gpointer user_data G_GNUC_UNUSED) {
+  struct open_job *job = data;
+  g_private_set(open_thread_key, GINT_TO_POINTER(1));
+  openslide_t *osr = openslide_open(job->filename);
+  job->callback(job->filename, osr, job->user_data);
+  g_free(job->filename);
+  g_slice_free(struct open_job, job);
+}
+
+static gpointer open_pool_init(gpointer data G_GNUC_UNUSED) {
+  open_thread_key = g_private_new(NULL);
+  return g_thread_pool_new(open_job_run, NULL, OPEN_THREADS, FALSE, NULL);
+}
+
+void openslide_open_async(const char *filename,
+                          openslide_open_callback_t callback,
+                          void *user_data) {
+  // threads must be initialized before the pool is created
+  urlio_initial();
+
+  struct open_job *job = g_slice_new(struct open_job);
+  job->filename = g_strdup(filename);
+  job->callback = callback;
+  job->user_data = user_data;
+  GThreadPool *pool = g_once(&open_pool_once, open_pool_init, NULL);
+  g_thread_pool_push(pool, job, NULL);
+}
+
+struct open_slot {
+  int32_t *pending;
+  openslide_t **osr;
+};
+
+static void open_many_done(const char *filename G_GNUC_UNUSED,
+                           openslide_t *osr, void *user_data) {
+  struct open_slot *slot = user_data;
+  *slot->osr = osr;
+  g_mutex_lock(&open_batch_lock);
+  if (--*slot->pending == 0) {
+    g_cond_broadcast(&open_batch_cond);
+  }
+  g_mutex_unlock(&open_batch_lock);
+}
+
+void openslide_open_many(const char * const *filenames, int32_t count,
+                         openslide_t **osrs) {
+  if (count <= 0) {
+    return;
+  }
+
+  // from a callback, waiting for the pool could wait for ourselves
+  urlio_initial();
+  g_once(&open_pool_once, open_pool_init, NULL);
+  if (g_private_get(open_thread_key)) {
+    for (int32_t i = 0; i < count; i++) {
+      osrs[i] = openslide_open(filenames[i]);
+    }
+    return;
+  }
+
+  int32_t pending = count;
+  struct open_slot *slots = g_new(struct open_slot, count);
+  for (int32_t i = 0; i < count; i++) {
+    slots[i].pending = &pending;
+    slots[i].osr = &osrs[i];
+    openslide_open_async(filenames[i], open_many_done, &slots[i]);
+  }
+
+  g_mutex_lock(&open_batch_lock);
+  while (pending) {
+    g_cond_wait(&open_batch_cond, &open_batch_lock);
+  }
+  g_mutex_unlock(&open_batch_lock);
+
+  g_free(slots);
+}
 
 void openslide_close(openslide_t *osr) {
+  // prefetch tasks use the backend
+  _openslide_prefetch_destroy(osr->prefetch);
+
   if (osr->ops) {
     (osr->ops->destroy)(osr);
   }
@@ -370,15 +622,16 @@ void openslide_close(openslide_t *osr) {
   g_free(osr->property_names);
 
   if (osr->cache) {
-    _openslide_cache_destroy(osr->cache);
+    _openslide_cache_binding_destroy(osr->cache);
   }
 
   g_free(g_atomic_pointer_get(&osr->error));
 
+  free(osr->urlname);
+  _openslide_stats_forget(osr->stats_id);
   g_slice_free(openslide_t, osr);
 
   urlio_release();
-  free(osr->urlname);
 }
 
 
@@ -474,21 +727,6 @@ double openslide_get_layer_downsample(openslide_t *osr, int32_t level) {
 }
 
 
-int openslide_give_prefetch_hint(openslide_t *osr G_GNUC_UNUSED,
-				 int64_t x G_GNUC_UNUSED,
-				 int64_t y G_GNUC_UNUSED,
-				 int32_t level G_GNUC_UNUSED,
-				 int64_t w G_GNUC_UNUSED,
-				 int64_t h G_GNUC_UNUSED) {
-  g_warning("openslide_give_prefetch_hint has never been implemented and should not be called");
-  return 0;
-}
-
-void openslide_cancel_prefetch_hint(openslide_t *osr G_GNUC_UNUSED,
-				    int prefetch_id G_GNUC_UNUSED) {
-  g_warning("openslide_cancel_prefetch_hint has never been implemented and should not be called");
-}
-
 static bool read_region(openslide_t *osr,
 			cairo_t *cr,
 			int64_t x, int64_t y,
@@ -496,18 +734,26 @@ static bool read_region(openslide_t *osr,
 			int64_t w, int64_t h,
 			GError **err) {
   bool success = true;
-
-  // save the old pattern, it's the only thing push/pop won't restore
-  cairo_pattern_t *old_source = cairo_get_source(cr);
-  cairo_pattern_reference(old_source);
-
-  // push, so that saturate works with all sorts of backends
-  cairo_push_group(cr);
-
-  // clear to set the bounds of the group (seems to be a recent cairo bug)
-  cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
-  cairo_rectangle(cr, 0, 0, w, h);
-  cairo_fill(cr);
+  cairo_pattern_t *old_source = NULL;
+
+  // a cleared image from openslide_read_region() needs no group: saturating
+  // straight into it gives the same result, and grids may copy tiles in
+  bool direct = _openslide_grid_is_direct_target(cr);
+  if (direct) {
+    cairo_save(cr);
+  } else {
+    // save the old pattern, it's the only thing push/pop won't restore
+    old_source = cairo_get_source(cr);
+    cairo_pattern_reference(old_source);
+
+    // push, so that saturate works with all sorts of backends
+    cairo_push_group(cr);
+
+    // clear to set the bounds of the group (seems to be a recent cairo bug)
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_rectangle(cr, 0, 0, w, h);
+    cairo_fill(cr);
+  }
 
   // saturate those seams away!
   cairo_set_operator(cr, CAIRO_OPERATOR_SATURATE);
@@ -531,18 +777,34 @@ static bool read_region(openslide_t *osr,
     }
     cairo_translate(cr, tx, ty);
 
-    // paint
+    // paint, counting for this object on whichever thread
     if (w > 0 && h > 0) {
+      _openslide_trace_begin("paint region");
+      uint64_t prev_stats = _openslide_stats_set_current(osr->stats_id);
       success = osr->ops->paint_region(osr, cr, x, y, l, w, h, err);
+      _openslide_stats_set_current(prev_stats);
+      _openslide_trace_end();
     }
   }
 
+  if (direct) {
+    // on failure the caller clears the dest
+    cairo_restore(cr);
+    return success;
+  }
+
+  _openslide_trace_begin("composite");
+  int64_t start = g_get_monotonic_time();
   cairo_pop_group_to_source(cr);
 
   if (success) {
     // commit, nothing went wrong
     cairo_paint(cr);
   }
+  uint64_t prev_stats = _openslide_stats_set_current(osr->stats_id);
+  _openslide_stats_add_time(OPENSLIDE_STAT_TIMER_COMPOSITE, start);
+  _openslide_stats_set_current(prev_stats);
+  _openslide_trace_end();
 
   // restore old source
   cairo_set_source(cr, old_source);
@@ -551,6 +813,65 @@ static bool read_region(openslide_t *osr,
   return success;
 }
 
+// runs on a worker
+static void prefetch_region(openslide_t *osr,
+			    int64_t x, int64_t y,
+			    int32_t level,
+			    int64_t w, int64_t h,
+			    int prefetch_id) {
+  struct _openslide_level *l = osr->levels[level];
+  GError *tmp_err = NULL;
+
+  if (osr->ops->prefetch_region) {
+    // only fetch the data, decoding is left to the reader
+    if (!osr->ops->prefetch_region(osr, x, y, l, w, h, prefetch_id,
+                                    &tmp_err)) {
+      g_clear_error(&tmp_err);
+    }
+    return;
+  }
+
+  // paint into a nil surface, which leaves the tiles in the cache
+  const int64_t d = 4096;
+  for (int64_t row = 0; row < (h + d - 1) / d; row++) {
+    for (int64_t col = 0; col < (w + d - 1) / d; col++) {
+      cairo_surface_t *surface =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+      cairo_t *cr = cairo_create(surface);
+      cairo_surface_destroy(surface);
+      bool success = read_region(osr, cr,
+                                 x + col * d * l->downsample,
+                                 y + row * d * l->downsample,
+                                 level,
+                                 MIN(w - col * d, d), MIN(h - row * d, d),
+                                 &tmp_err);
+      cairo_destroy(cr);
+      if (!success) {
+        g_clear_error(&tmp_err);
+        return;
+      }
+    }
+  }
+}
+
+int openslide_give_prefetch_hint(openslide_t *osr,
+				 int64_t x, int64_t y,
+				 int32_t level,
+				 int64_t w, int64_t h) {
+  if (openslide_get_error(osr) || !level_in_range(osr, level) ||
+      w <= 0 || h <= 0) {
+    return 0;
+  }
+
+  return _openslide_prefetch_give_hint(osr->prefetch, x, y, level, w, h);
+}
+
+void openslide_cancel_prefetch_hint(openslide_t *osr, int prefetch_id) {
+  if (osr->prefetch) {
+    _openslide_prefetch_cancel_hint(osr->prefetch, prefetch_id);
+  }
+}
+
 static bool ensure_nonnegative_dimensions(openslide_t *osr, int64_t w, int64_t h) {
   if (w < 0 || h < 0) {
     GError *tmp_err = g_error_new(OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
@@ -563,17 +884,257 @@ static bool ensure_nonnegative_dimensions(openslide_t *osr, int64_t w, int64_t h
   return true;
 }
 
-void openslide_read_region(openslide_t *osr,
-			   uint32_t *dest,
-			   int64_t x, int64_t y,
-			   int32_t level,
-			   int64_t w, int64_t h) {
+// paint part of a region into dest, w pixels wide in rows of stride pixels
+static bool paint_piece(openslide_t *osr, uint32_t *dest, int64_t stride,
+                        int64_t x, int64_t y, int32_t level,
+                        int64_t w, int64_t h,
+                        GError **err) {
+  // create the cairo surface for the dest
+  cairo_surface_t *surface;
+  if (dest) {
+    surface = cairo_image_surface_create_for_data(
+            (unsigned char *) dest,
+            CAIRO_FORMAT_ARGB32, w, h, stride * 4);
+    // cleared by openslide_read_region()
+    _openslide_grid_set_direct_target(surface);
+  } else {
+    // nil surface
+    surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+  }
+
+  // create the cairo context
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+
+  // paint
+  bool success = read_region(osr, cr, x, y, level, w, h, err) &&
+    _openslide_check_cairo_status(cr, err);
+
+  // done
+  cairo_destroy(cr);
+  return success;
+}
+
+// a destination in a format other than ARGB
+struct pixel_output {
+  enum openslide_pixel_format format;
+  void *dest;
+  int64_t w;
+  int64_t h;
+  float scale[3];
+  float offset[3];
+};
+
+static int64_t pixel_format_size(enum openslide_pixel_format format) {
+  switch (format) {
+  case OPENSLIDE_PIXEL_FORMAT_RGB24:
+  case OPENSLIDE_PIXEL_FORMAT_BGR24:
+  case OPENSLIDE_PIXEL_FORMAT_RGB_PLANAR:
+    return 3;
+  case OPENSLIDE_PIXEL_FORMAT_RGB_PLANAR_FLOAT:
+    return 12;
+  default:
+    return 4;
+  }
+}
+
+// convert a painted piece into its place at ox, oy in the output
+static void convert_piece(const struct pixel_output *out,
+                          const uint32_t *src,
+                          int64_t ox, int64_t oy,
+                          int64_t w, int64_t h) {
+  int64_t plane = out->w * out->h;
+  for (int64_t row = 0; row < h; row++) {
+    const uint32_t *line = src + row * w;
+    int64_t offset = (oy + row) * out->w + ox;
+    switch (out->format) {
+    case OPENSLIDE_PIXEL_FORMAT_RGB24:
+    case OPENSLIDE_PIXEL_FORMAT_BGR24: {
+      uint8_t *dest = (uint8_t *) out->dest + 3 * offset;
+      _openslide_pixel_argb_to_packed(dest, line, w,
+                                      out->format == OPENSLIDE_PIXEL_FORMAT_BGR24);
+      break;
+    }
+    case OPENSLIDE_PIXEL_FORMAT_RGB_PLANAR: {
+      uint8_t *dest = (uint8_t *) out->dest + offset;
+      _openslide_pixel_argb_to_planar(dest, dest + plane, dest + 2 * plane,
+                                      line, w);
+      break;
+    }
+    case OPENSLIDE_PIXEL_FORMAT_RGB_PLANAR_FLOAT: {
+      float *dest = (float *) out->dest + offset;
+      _openslide_pixel_argb_to_planar_float(dest, dest + plane,
+                                            dest + 2 * plane,
+                                            line, w,
+                                            out->scale, out->offset);
+      break;
+    }
+    default:
+      g_assert_not_reached();
+    }
+  }
+}
+
+// paint part of a region into a scratch buffer, then convert it while
+// it's still in cache
+static bool paint_output_piece(openslide_t *osr,
+                               const struct pixel_output *out,
+                               int64_t ox, int64_t oy,
+                               int64_t x, int64_t y, int32_t level,
+                               int64_t w, int64_t h,
+                               GError **err) {
+  uint32_t *buf = _openslide_buffer_alloc0(w * h * 4);
+  bool success = paint_piece(osr, buf, w, x, y, level, w, h, err);
+  if (success) {
+    convert_piece(out, buf, ox, oy, w, h);
+  }
+  _openslide_buffer_free(w * h * 4, buf);
+  return success;
+}
+
+struct read_job {
+  struct _openslide_work_group *group;
+  GMutex *lock;
+  GError *err;  // first error of a band
+  const URLIO_INTERRUPT *interrupt;  // of the reader, for the workers
+};
+
+struct _openslide_cancel {
+  volatile gint cancelled;
+};
+
+// fail a read whose deadline passed or which was cancelled, rather than
+// decoding more of it
+static bool check_interrupt(GError **err) {
+  if (urlio_interrupted(urlio_get_interrupt())) {
+    g_set_error(err, OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                "Read interrupted");
+    return false;
+  }
+  return true;
+}
+
+// a tile decoded once for a batch of regions
+struct batch_tile {
+  struct _openslide_level *level;
+  int64_t col;
+  int64_t row;
+  struct _openslide_cache_entry *cache_entry;  // held once decoded
+};
+
+struct read_piece {
+  struct read_job *job;
+  openslide_t *osr;
+  uint32_t *dest;
+  int64_t stride;
+  const struct pixel_output *out;  // instead of dest
+  int64_t ox;
+  int64_t oy;
+  struct batch_tile *tile;  // instead of a region
+  bool passive;  // its tiles were decoded for it, hits don't promote them
+  GError **status;  // for errors of this piece alone, instead of the job's
+  int64_t x;
+  int64_t y;
+  int32_t level;
+  int64_t w;
+  int64_t h;
+};
+
+// runs on a worker
+static void decode_piece(void *data) {
+  struct read_piece *piece = data;
+  struct read_job *job = piece->job;
   GError *tmp_err = NULL;
+  const URLIO_INTERRUPT *old_interrupt = urlio_set_interrupt(job->interrupt);
+
+  // skip the rest of a job which failed
+  g_mutex_lock(job->lock);
+  bool failed = job->err != NULL;
+  g_mutex_unlock(job->lock);
+  if (!failed && !check_interrupt(&tmp_err)) {
+    failed = true;
+  }
 
-  if (!ensure_nonnegative_dimensions(osr, w, h)) {
-    return;
+  if (!failed && piece->tile) {
+    struct batch_tile *tile = piece->tile;
+    uint32_t *tiledata;
+    if (!piece->osr->ops->read_level_tile(piece->osr, tile->level,
+                                          tile->col, tile->row,
+                                          &tiledata, &tile->cache_entry,
+                                          &tmp_err)) {
+      // the regions using the tile will fail as they read it
+      tile->cache_entry = NULL;
+      g_clear_error(&tmp_err);
+    }
+  } else if (!failed && piece->out) {
+    paint_output_piece(piece->osr, piece->out, piece->ox, piece->oy,
+                       piece->x, piece->y, piece->level, piece->w, piece->h,
+                       &tmp_err);
+  } else if (!failed) {
+    _openslide_cache_set_passive(piece->passive);
+    paint_piece(piece->osr, piece->dest, piece->stride,
+                piece->x, piece->y, piece->level, piece->w, piece->h,
+                &tmp_err);
+    _openslide_cache_set_passive(false);
   }
 
+  g_mutex_lock(job->lock);
+  if (tmp_err && piece->status) {
+    *piece->status = tmp_err;
+  } else if (tmp_err) {
+    if (job->err) {
+      g_error_free(tmp_err);
+    } else {
+      job->err = tmp_err;
+    }
+  }
+  g_mutex_unlock(job->lock);
+
+  urlio_set_interrupt(old_interrupt);
+  g_slice_free(struct read_piece, piece);
+}
+
+static struct read_job *read_job_new(void) {
+  struct read_job *job = g_slice_new0(struct read_job);
+  job->group = _openslide_work_group_new();
+  job->lock = g_mutex_new();
+  job->interrupt = urlio_get_interrupt();
+  return job;
+}
+
+// wait for the pieces, decoding some here, and return the first error
+static GError *read_job_finish(struct read_job *job) {
+  _openslide_work_group_finish(job->group, true);
+  GError *err = job->err;
+  g_mutex_free(job->lock);
+  g_slice_free(struct read_job, job);
+  return err;
+}
+
+static void read_job_push(struct read_job *job, struct read_piece *piece) {
+  piece->job = job;
+  _openslide_work_submit(job->group, OPENSLIDE_WORK_INTERACTIVE,
+                         decode_piece, piece);
+}
+
+static int get_decode_threads(void) {
+  return _openslide_work_get_threads();
+}
+
+void openslide_set_decode_threads(int threads) {
+  _openslide_work_set_threads(threads);
+}
+
+// paint into dest, or convert into out; on failure the output is cleared
+static bool read_region_output(openslide_t *osr,
+                               uint32_t *dest,
+                               const struct pixel_output *out,
+                               int64_t x, int64_t y,
+                               int32_t level,
+                               int64_t w, int64_t h,
+                               GError **err) {
+  GError *tmp_err = NULL;
+
   // clear the dest
   if (dest) {
     memset(dest, 0, w * h * 4);
@@ -581,9 +1142,11 @@ void openslide_read_region(openslide_t *osr,
 
   // now that it's cleared, return if an error occurred
   if (openslide_get_error(osr)) {
-    return;
+    return true;
   }
 
+  _openslide_trace_begin("read region");
+
   // Break the work into smaller pieces if the region is large, because:
   // 1. Cairo will not allow surfaces larger than 32767 pixels on a side.
   // 2. cairo_push_group() creates an intermediate surface backed by a
@@ -591,55 +1154,487 @@ void openslide_read_region(openslide_t *osr,
   //    be addressable in 31 bits.
   // 3. We would like to constrain the intermediate surface to a reasonable
   //    amount of RAM.
+  // Large pieces are further split into bands of tile rows for the decode
+  // threads.
   const int64_t d = 4096;
   double ds = openslide_get_level_downsample(osr, level);
+  int threads = dest || out ? get_decode_threads() : 1;
+  struct read_job *job = NULL;
   for (int64_t row = 0; row < (h + d - 1) / d; row++) {
     for (int64_t col = 0; col < (w + d - 1) / d; col++) {
       // calculate surface coordinates and size
       int64_t sx = x + col * d * ds;     // level 0 plane
-      int64_t sy = y + row * d * ds;     // level 0 plane
       int64_t sw = MIN(w - col * d, d);  // level plane
       int64_t sh = MIN(h - row * d, d);  // level plane
 
-      // create the cairo surface for the dest
-      cairo_surface_t *surface;
-      if (dest) {
-        surface = cairo_image_surface_create_for_data(
-                (unsigned char *) (dest + w * row * d + col * d),
-                CAIRO_FORMAT_ARGB32, sw, sh, w * 4);
-      } else {
-        // nil surface
-        surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 0, 0);
+      int64_t band = sh;
+      int64_t first = sh;
+      bool parallel = threads > 1 && level_in_range(osr, level) &&
+        sw * sh >= DECODE_MIN_PIXELS;
+      if (parallel || out) {
+        // about two bands per thread, on tile row boundaries; converted
+        // output goes a row of tiles at a time
+        int64_t tile_h = level_in_range(osr, level) ?
+          osr->levels[level]->tile_h : 0;
+        int64_t unit = tile_h > 0 ? tile_h : DECODE_BAND_UNIT;
+        int64_t per_band = parallel ?
+          (sh + 2 * threads - 1) / (2 * threads) : unit;
+        band = MAX(unit, (per_band + unit - 1) / unit * unit);
+        int64_t phase = ((int64_t) ((y + row * d * ds) / ds)) % unit;
+        first = band - (phase < 0 ? phase + unit : phase);
       }
 
-      // create the cairo context
-      cairo_t *cr = cairo_create(surface);
-      cairo_surface_destroy(surface);
-
-      // paint
-      if (!read_region(osr, cr, sx, sy, level, sw, sh, &tmp_err)) {
-        cairo_destroy(cr);
-        goto OUT;
+      for (int64_t top = 0; top < sh; top += (top ? band : first)) {
+        int64_t sy = y + (row * d + top) * ds;  // level 0 plane
+        int64_t bh = MIN(sh - top, top ? band : first);
+        uint32_t *piece_dest = dest ? dest + w * (row * d + top) + col * d : NULL;
+
+        if (!check_interrupt(&tmp_err)) {
+          goto OUT;
+        }
+        if (!parallel) {
+          bool success = out ?
+            paint_output_piece(osr, out, col * d, row * d + top,
+                               sx, sy, level, sw, bh, &tmp_err) :
+            paint_piece(osr, piece_dest, w, sx, sy, level, sw, bh,
+                        &tmp_err);
+          if (!success) {
+            goto OUT;
+          }
+          continue;
+        }
+
+        if (job == NULL) {
+          job = read_job_new();
+        }
+        struct read_piece *piece = g_slice_new0(struct read_piece);
+        piece->osr = osr;
+        piece->dest = piece_dest;
+        piece->stride = w;
+        piece->out = out;
+        piece->ox = col * d;
+        piece->oy = row * d + top;
+        piece->x = sx;
+        piece->y = sy;
+        piece->level = level;
+        piece->w = sw;
+        piece->h = bh;
+        read_job_push(job, piece);
       }
+    }
+  }
 
-      // done
-      if (!_openslide_check_cairo_status(cr, &tmp_err)) {
-        cairo_destroy(cr);
-        goto OUT;
+OUT:
+  if (job) {
+    // wait for the bands, keeping the first error
+    GError *job_err = read_job_finish(job);
+    if (job_err) {
+      if (tmp_err) {
+        g_error_free(job_err);
+      } else {
+        tmp_err = job_err;
       }
-
-      cairo_destroy(cr);
     }
   }
+  _openslide_trace_end();
 
-OUT:
   if (tmp_err) {
-    _openslide_propagate_error(osr, tmp_err);
+    // ensure we don't return a partial result
     if (dest) {
-      // ensure we don't return a partial result
       memset(dest, 0, w * h * 4);
+    } else if (out) {
+      memset(out->dest, 0, w * h * pixel_format_size(out->format));
     }
+    g_propagate_error(err, tmp_err);
+    return false;
   }
+  return true;
+}
+
+void openslide_read_region(openslide_t *osr,
+			   uint32_t *dest,
+			   int64_t x, int64_t y,
+			   int32_t level,
+			   int64_t w, int64_t h) {
+  GError *tmp_err = NULL;
+
+  if (!ensure_nonnegative_dimensions(osr, w, h)) {
+    return;
+  }
+
+  if (!read_region_output(osr, dest, NULL, x, y, level, w, h, &tmp_err)) {
+    _openslide_propagate_error(osr, tmp_err);
+  }
+}
+
+static bool ensure_pixel_format(openslide_t *osr,
+                                enum openslide_pixel_format format) {
+  if (format < OPENSLIDE_PIXEL_FORMAT_ARGB32 ||
+      format > OPENSLIDE_PIXEL_FORMAT_RGB_PLANAR_FLOAT) {
+    GError *tmp_err = g_error_new(OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                                  "Unknown pixel format %d", format);
+    _openslide_propagate_error(osr, tmp_err);
+    return false;
+  }
+  return true;
+}
+
+// read into dest in format; on failure dest is cleared
+static bool read_region_format(openslide_t *osr,
+                               void *dest,
+                               int64_t x, int64_t y,
+                               int32_t level,
+                               int64_t w, int64_t h,
+                               enum openslide_pixel_format format,
+                               const float *mean, const float *std,
+                               GError **err) {
+  if (format == OPENSLIDE_PIXEL_FORMAT_ARGB32) {
+    return read_region_output(osr, dest, NULL, x, y, level, w, h, err);
+  }
+
+  // return a cleared dest if an error occurred
+  if (openslide_get_error(osr)) {
+    memset(dest, 0, w * h * pixel_format_size(format));
+    return true;
+  }
+
+  struct pixel_output out = {
+    .format = format,
+    .dest = dest,
+    .w = w,
+    .h = h,
+  };
+  for (int c = 0; c < 3; c++) {
+    double m = mean ? mean[c] : 0;
+    double sd = std ? std[c] : 1;
+    out.scale[c] = 1 / (255 * sd);
+    out.offset[c] = -m / sd;
+  }
+  return read_region_output(osr, NULL, &out, x, y, level, w, h, err);
+}
+
+void openslide_read_region_ex(openslide_t *osr,
+			      void *dest,
+			      int64_t x, int64_t y,
+			      int32_t level,
+			      int64_t w, int64_t h,
+			      enum openslide_pixel_format format,
+			      const float *mean, const float *std) {
+  GError *tmp_err = NULL;
+
+  if (!ensure_nonnegative_dimensions(osr, w, h) ||
+      !ensure_pixel_format(osr, format)) {
+    return;
+  }
+
+  if (!read_region_format(osr, dest, x, y, level, w, h,
+                          format, mean, std, &tmp_err)) {
+    _openslide_propagate_error(osr, tmp_err);
+  }
+}
+
+enum openslide_read_status openslide_read_region_with_options(
+    openslide_t *osr,
+    void *dest,
+    int64_t x, int64_t y,
+    int32_t level,
+    int64_t w, int64_t h,
+    const struct openslide_read_options *options) {
+  static const struct openslide_read_options defaults;
+  GError *tmp_err = NULL;
+
+  if (options == NULL) {
+    options = &defaults;
+  }
+  if (!ensure_nonnegative_dimensions(osr, w, h) ||
+      !ensure_pixel_format(osr, options->format)) {
+    return OPENSLIDE_READ_FAILED;
+  }
+
+  // the fetches of this thread, and of the workers decoding for it, give
+  // up once the interrupt fires
+  openslide_cancel_t *cancel = options->cancel;
+  URLIO_INTERRUPT interrupt = {
+    .cancelled = cancel ? &cancel->cancelled : NULL,
+    .deadline = options->timeout_ms > 0 ?
+      g_get_monotonic_time() + options->timeout_ms * 1000 : 0,
+  };
+  const URLIO_INTERRUPT *old_interrupt = urlio_set_interrupt(&interrupt);
+  bool success = read_region_format(osr, dest, x, y, level, w, h,
+                                    options->format,
+                                    options->mean, options->std,
+                                    &tmp_err);
+  urlio_set_interrupt(old_interrupt);
+
+  if (success) {
+    return openslide_get_error(osr) ? OPENSLIDE_READ_FAILED : OPENSLIDE_READ_OK;
+  }
+
+  // a read given up leaves the object usable
+  if (cancel && g_atomic_int_get(&cancel->cancelled)) {
+    g_error_free(tmp_err);
+    return OPENSLIDE_READ_CANCELLED;
+  }
+  if (urlio_interrupted(&interrupt)) {
+    g_error_free(tmp_err);
+    return OPENSLIDE_READ_TIMED_OUT;
+  }
+  _openslide_propagate_error(osr, tmp_err);
+  return OPENSLIDE_READ_FAILED;
+}
+
+openslide_cancel_t *openslide_cancel_create(void) {
+  return g_slice_new0(struct _openslide_cancel);
+}
+
+void openslide_cancel_request(openslide_cancel_t *cancel) {
+  g_atomic_int_set(&cancel->cancelled, 1);
+  // abort transfers now rather than at the reactor's next poll
+  urlio_wake();
+}
+
+void openslide_cancel_release(openslide_cancel_t *cancel) {
+  g_slice_free(struct _openslide_cancel, cancel);
+}
+
+static guint batch_tile_hash(gconstpointer key) {
+  const struct batch_tile *tile = key;
+  return g_direct_hash(tile->level) ^
+         g_int64_hash(&tile->col) ^
+         (g_int64_hash(&tile->row) * 31);
+}
+
+static gboolean batch_tile_equal(gconstpointer a, gconstpointer b) {
+  const struct batch_tile *ta = a;
+  const struct batch_tile *tb = b;
+  return ta->level == tb->level && ta->col == tb->col && ta->row == tb->row;
+}
+
+static void batch_tile_release(gpointer data) {
+  struct batch_tile *tile = data;
+  if (tile->cache_entry) {
+    _openslide_cache_entry_unref(tile->cache_entry);
+  }
+  g_slice_free(struct batch_tile, tile);
+}
+
+static void free_coords(gpointer data) {
+  g_array_free(data, TRUE);
+}
+
+// the tile range of a request to read through the tile cache, or false
+static bool get_request_tiles(openslide_t *osr,
+                              const struct openslide_region_req *req,
+                              int64_t *start_col, int64_t *start_row,
+                              int64_t *end_col, int64_t *end_row) {
+  if (!osr->ops->read_level_tile || !level_in_range(osr, req->level) ||
+      req->w <= 0 || req->h <= 0) {
+    return false;
+  }
+  struct _openslide_level *l = osr->levels[req->level];
+  if (l->tile_w <= 0 || l->tile_h <= 0) {
+    return false;
+  }
+
+  // the level plane, as painted, clipped to the level
+  double x = MAX(req->x / l->downsample, 0);
+  double y = MAX(req->y / l->downsample, 0);
+  double end_x = MIN(req->x / l->downsample + req->w, l->w);
+  double end_y = MIN(req->y / l->downsample + req->h, l->h);
+  if (end_x <= x || end_y <= y) {
+    return false;
+  }
+  *start_col = x / l->tile_w;
+  *start_row = y / l->tile_h;
+  *end_col = (int64_t) (end_x - 1e-9) / l->tile_w;
+  *end_row = (int64_t) (end_y - 1e-9) / l->tile_h;
+  return true;
+}
+
+// paint a request too large for one piece, 4096 pixels at a time
+static bool paint_request(openslide_t *osr,
+                          const struct openslide_region_req *req,
+                          uint32_t *dest,
+                          GError **err) {
+  const int64_t d = 4096;
+  double ds = openslide_get_level_downsample(osr, req->level);
+  for (int64_t row = 0; row < (req->h + d - 1) / d; row++) {
+    for (int64_t col = 0; col < (req->w + d - 1) / d; col++) {
+      if (!paint_piece(osr, dest + req->w * row * d + col * d, req->w,
+                       req->x + col * d * ds, req->y + row * d * ds,
+                       req->level,
+                       MIN(req->w - col * d, d), MIN(req->h - row * d, d),
+                       err)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int64_t openslide_read_regions(openslide_t *osr,
+			       const struct openslide_region_req *reqs,
+			       int64_t count,
+			       uint32_t * const *dests,
+			       bool *success) {
+  // clear the dests
+  for (int64_t i = 0; i < count; i++) {
+    if (success) {
+      success[i] = false;
+    }
+    if (reqs[i].w > 0 && reqs[i].h > 0) {
+      memset(dests[i], 0, reqs[i].w * reqs[i].h * 4);
+    }
+  }
+
+  // now that they're cleared, return if an error occurred
+  if (openslide_get_error(osr) || count <= 0) {
+    return 0;
+  }
+
+  GError **errs = g_new0(GError *, count);
+
+  // batches of requests whose tiles fit in the cache, so that none is
+  // evicted before the regions using it are painted
+  uint64_t budget = _openslide_cache_binding_get_capacity(osr->cache) / 2;
+  int64_t start = 0;
+  while (start < count) {
+    GHashTable *tiles = g_hash_table_new_full(batch_tile_hash,
+                                              batch_tile_equal,
+                                              batch_tile_release, NULL);
+    GHashTable *level_tiles =
+      g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                            free_coords);
+    uint64_t bytes = 0;
+    int64_t end;
+    for (end = start; end < count; end++) {
+      const struct openslide_region_req *req = &reqs[end];
+      int64_t start_col, start_row, end_col, end_row;
+      if (!get_request_tiles(osr, req, &start_col, &start_row,
+                             &end_col, &end_row)) {
+        continue;
+      }
+      struct _openslide_level *l = osr->levels[req->level];
+      uint64_t req_bytes = (end_col - start_col + 1) *
+                           (end_row - start_row + 1) *
+                           l->tile_w * l->tile_h * 4;
+      if (end > start && bytes + req_bytes > budget) {
+        break;
+      }
+      bytes += req_bytes;
+
+      // the union of the tiles
+      GArray *coords = g_hash_table_lookup(level_tiles, l);
+      if (coords == NULL) {
+        coords = g_array_new(FALSE, FALSE, sizeof(int64_t));
+        g_hash_table_insert(level_tiles, l, coords);
+      }
+      for (int64_t row = start_row; row <= end_row; row++) {
+        for (int64_t col = start_col; col <= end_col; col++) {
+          struct batch_tile key = { l, col, row, NULL };
+          if (g_hash_table_lookup(tiles, &key)) {
+            continue;
+          }
+          struct batch_tile *tile = g_slice_new(struct batch_tile);
+          *tile = key;
+          g_hash_table_insert(tiles, tile, tile);
+          g_array_append_val(coords, col);
+          g_array_append_val(coords, row);
+        }
+      }
+    }
+
+    // fetch the tiles in merged requests
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, level_tiles);
+    while (osr->ops->prefetch_tiles &&
+           g_hash_table_iter_next(&iter, &key, &value)) {
+      GArray *coords = value;
+      GError *tmp_err = NULL;
+      if (!osr->ops->prefetch_tiles(osr, key,
+                                    (const int64_t *) coords->data,
+                                    coords->len / 2, &tmp_err)) {
+        // the reads will report it
+        g_clear_error(&tmp_err);
+      }
+    }
+
+    // decode each tile once
+    struct read_job *job = read_job_new();
+    g_hash_table_iter_init(&iter, tiles);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+      struct read_piece *piece = g_slice_new0(struct read_piece);
+      piece->osr = osr;
+      piece->tile = key;
+      read_job_push(job, piece);
+    }
+    GError *job_err = read_job_finish(job);
+    g_clear_error(&job_err);
+
+    // paint the regions from the held tiles; they were inserted for this
+    // batch, so reading them back mustn't protect them from a scan
+    job = read_job_new();
+    for (int64_t i = start; i < end; i++) {
+      const struct openslide_region_req *req = &reqs[i];
+      if (req->w < 0 || req->h < 0) {
+        errs[i] = g_error_new(OPENSLIDE_ERROR, OPENSLIDE_ERROR_FAILED,
+                              "negative width (%"PRId64") "
+                              "or negative height (%"PRId64") "
+                              "not allowed", req->w, req->h);
+      } else if (req->w > 4096 || req->h > 4096) {
+        continue;
+      } else if (req->w > 0 && req->h > 0) {
+        struct read_piece *piece = g_slice_new0(struct read_piece);
+        piece->osr = osr;
+        piece->dest = dests[i];
+        piece->stride = req->w;
+        piece->passive = true;
+        piece->status = &errs[i];
+        piece->x = req->x;
+        piece->y = req->y;
+        piece->level = req->level;
+        piece->w = req->w;
+        piece->h = req->h;
+        read_job_push(job, piece);
+      }
+    }
+    // large regions meanwhile, on this thread
+    _openslide_cache_set_passive(true);
+    for (int64_t i = start; i < end; i++) {
+      const struct openslide_region_req *req = &reqs[i];
+      if (req->w > 4096 || req->h > 4096) {
+        paint_request(osr, req, dests[i], &errs[i]);
+      }
+    }
+    _openslide_cache_set_passive(false);
+    job_err = read_job_finish(job);
+    g_clear_error(&job_err);
+
+    g_hash_table_destroy(level_tiles);
+    g_hash_table_destroy(tiles);
+    start = end;
+  }
+
+  // report
+  int64_t read = 0;
+  for (int64_t i = 0; i < count; i++) {
+    if (errs[i]) {
+      if (reqs[i].w > 0 && reqs[i].h > 0) {
+        // ensure we don't return a partial result
+        memset(dests[i], 0, reqs[i].w * reqs[i].h * 4);
+      }
+      g_error_free(errs[i]);
+      continue;
+    }
+    if (success) {
+      success[i] = true;
+    }
+    read++;
+  }
+  g_free(errs);
+
+  return read;
 }
 
 
@@ -668,6 +1663,169 @@ void openslide_cairo_read_region(openslide_t *osr,
 }
 
 
+void openslide_get_level_tile_size(openslide_t *osr, int32_t level,
+				   int64_t *w, int64_t *h) {
+  *w = -1;
+  *h = -1;
+
+  if (openslide_get_error(osr)) {
+    return;
+  }
+
+  if (!level_in_range(osr, level)) {
+    return;
+  }
+
+  struct _openslide_level *l = osr->levels[level];
+  if (l->tile_w > 0 && l->tile_h > 0) {
+    *w = l->tile_w;
+    *h = l->tile_h;
+  }
+}
+
+bool openslide_read_raw_tile(openslide_t *osr, int32_t level,
+			     int64_t tile_col, int64_t tile_row,
+			     void **buf, size_t *len, const char **codec) {
+  GError *tmp_err = NULL;
+
+  *buf = NULL;
+  *len = 0;
+  *codec = NULL;
+
+  if (openslide_get_error(osr)) {
+    return false;
+  }
+
+  if (!level_in_range(osr, level) || !osr->ops->read_raw_tile) {
+    return false;
+  }
+
+  struct _openslide_level *l = osr->levels[level];
+  if (l->tile_w <= 0 || l->tile_h <= 0 ||
+      tile_col < 0 || tile_col * l->tile_w >= l->w ||
+      tile_row < 0 || tile_row * l->tile_h >= l->h) {
+    return false;
+  }
+
+  void *data;
+  int32_t data_len;
+  const char *data_codec = NULL;
+  if (!osr->ops->read_raw_tile(osr, l, tile_col, tile_row,
+                               &data, &data_len, &data_codec, &tmp_err)) {
+    _openslide_propagate_error(osr, tmp_err);
+    return false;
+  }
+  if (data == NULL) {
+    return false;
+  }
+
+  *buf = data;
+  *len = data_len;
+  *codec = data_codec;
+  return true;
+}
+
+void openslide_free_raw_tile(void *buf) {
+  g_free(buf);
+}
+
+struct _openslide_tile_ref {
+  // either a cached tile, or a buffer of our own
+  struct _openslide_cache_entry *cache_entry;
+  uint32_t *buf;
+};
+
+static bool tile_in_range(openslide_t *osr, int32_t level,
+                          int64_t tile_col, int64_t tile_row) {
+  if (!level_in_range(osr, level)) {
+    return false;
+  }
+  struct _openslide_level *l = osr->levels[level];
+  return l->tile_w > 0 && l->tile_h > 0 &&
+         tile_col >= 0 && tile_col * l->tile_w < l->w &&
+         tile_row >= 0 && tile_row * l->tile_h < l->h;
+}
+
+const uint32_t *openslide_get_level_tile_ref(openslide_t *osr, int32_t level,
+					     int64_t tile_col, int64_t tile_row,
+					     openslide_tile_ref_t **ref) {
+  GError *tmp_err = NULL;
+
+  *ref = NULL;
+
+  if (openslide_get_error(osr)) {
+    return NULL;
+  }
+
+  if (!tile_in_range(osr, level, tile_col, tile_row)) {
+    return NULL;
+  }
+
+  struct _openslide_level *l = osr->levels[level];
+  struct _openslide_tile_ref *tref = g_slice_new0(struct _openslide_tile_ref);
+
+  if (osr->ops->read_level_tile) {
+    // share the cached tile
+    uint32_t *tiledata;
+    if (!osr->ops->read_level_tile(osr, l, tile_col, tile_row,
+                                   &tiledata, &tref->cache_entry,
+                                   &tmp_err)) {
+      g_slice_free(struct _openslide_tile_ref, tref);
+      _openslide_propagate_error(osr, tmp_err);
+      return NULL;
+    }
+    tref->buf = tiledata;
+  } else {
+    // read the tile's region
+    tref->buf = g_malloc(l->tile_w * l->tile_h * 4);
+    openslide_read_region(osr, tref->buf,
+                          tile_col * l->tile_w * l->downsample,
+                          tile_row * l->tile_h * l->downsample,
+                          level, l->tile_w, l->tile_h);
+    if (openslide_get_error(osr)) {
+      openslide_release_tile_ref(tref);
+      return NULL;
+    }
+  }
+
+  *ref = tref;
+  return tref->buf;
+}
+
+void openslide_release_tile_ref(openslide_tile_ref_t *ref) {
+  if (ref == NULL) {
+    return;
+  }
+  if (ref->cache_entry) {
+    _openslide_cache_entry_unref(ref->cache_entry);
+  } else {
+    g_free(ref->buf);
+  }
+  g_slice_free(struct _openslide_tile_ref, ref);
+}
+
+void openslide_read_level_tile(openslide_t *osr, int32_t level,
+			       int64_t tile_col, int64_t tile_row,
+			       uint32_t *dest) {
+  int64_t tw, th;
+  openslide_get_level_tile_size(osr, level, &tw, &th);
+  if (tw <= 0 || th <= 0) {
+    return;
+  }
+
+  openslide_tile_ref_t *ref;
+  const uint32_t *tiledata = openslide_get_level_tile_ref(osr, level,
+                                                          tile_col, tile_row,
+                                                          &ref);
+  if (tiledata) {
+    memcpy(dest, tiledata, tw * th * 4);
+  } else {
+    memset(dest, 0, tw * th * 4);
+  }
+  openslide_release_tile_ref(ref);
+}
+
+
 const char * const *openslide_get_property_names(openslide_t *osr) {
   if (openslide_get_error(osr)) {
     return EMPTY_STRING_ARRAY;
@@ -738,6 +1896,240 @@ void openslide_read_associated_image(openslide_t *osr,
   }
 }
 
+// the largest source read for a thumbnail when an associated thumbnail
+// could be used instead
+#define THUMBNAIL_SOURCE_MAX_PIXELS (64 * 1024 * 1024)
+// source pixels read at a time
+#define THUMBNAIL_BAND_PIXELS (16 * 1024 * 1024)
+
+struct thumbnail_source {
+  struct _openslide_associated_image *img;  // or a level
+  int32_t level;
+  int64_t w;
+  int64_t h;
+};
+
+// fit w x h into max_w x max_h, without enlarging
+static void fit_thumbnail(int64_t w, int64_t h, int64_t max_w, int64_t max_h,
+                          int64_t *tw, int64_t *th) {
+  double scale = MIN(1.0, MIN((double) max_w / w, (double) max_h / h));
+  *tw = MAX(1, (int64_t) (w * scale + 0.5));
+  *th = MAX(1, (int64_t) (h * scale + 0.5));
+}
+
+// the cheapest image with enough pixels for the thumbnail
+static bool get_thumbnail_source(openslide_t *osr,
+                                 int64_t max_w, int64_t max_h,
+                                 struct thumbnail_source *src,
+                                 int64_t *tw, int64_t *th) {
+  if (openslide_get_error(osr) || osr->level_count == 0 ||
+      max_w <= 0 || max_h <= 0) {
+    return false;
+  }
+
+  // the smallest level which is at least the size of the thumbnail
+  struct _openslide_level *l0 = osr->levels[0];
+  fit_thumbnail(l0->w, l0->h, max_w, max_h, tw, th);
+  memset(src, 0, sizeof(*src));
+  for (int32_t i = osr->level_count - 1; i >= 0; i--) {
+    struct _openslide_level *l = osr->levels[i];
+    if (i == 0 || (l->w >= *tw && l->h >= *th)) {
+      src->level = i;
+      src->w = l->w;
+      src->h = l->h;
+      break;
+    }
+  }
+
+  // a stored thumbnail, if it has fewer pixels; or if the level is too
+  // large to read quickly
+  struct _openslide_associated_image *img =
+    g_hash_table_lookup(osr->associated_images, "thumbnail");
+  if (img) {
+    int64_t iw, ih;
+    fit_thumbnail(img->w, img->h, max_w, max_h, &iw, &ih);
+    // as large as the fit of a level in one direction
+    bool enough = iw >= *tw || ih >= *th;
+    if ((enough && img->w * img->h < src->w * src->h) ||
+        src->w * src->h > THUMBNAIL_SOURCE_MAX_PIXELS) {
+      src->img = img;
+      src->w = img->w;
+      src->h = img->h;
+      *tw = iw;
+      *th = ih;
+    }
+  }
+  return true;
+}
+
+// average sw x rows source pixels into tw x (dest_rows) dest pixels, each
+// covering the source columns cols[x] to cols[x + 1] and the rows given
+static void box_reduce(uint32_t *dest, int64_t tw,
+                       const uint32_t *src, int64_t sw,
+                       const int64_t *cols,
+                       const int64_t *rows, int64_t dest_rows,
+                       int64_t src_y) {
+  for (int64_t r = 0; r < dest_rows; r++) {
+    int64_t y0 = rows[r] - src_y;
+    int64_t y1 = rows[r + 1] - src_y;
+    for (int64_t x = 0; x < tw; x++) {
+      uint64_t sum[4] = {0, 0, 0, 0};
+      for (int64_t y = y0; y < y1; y++) {
+        const uint32_t *p = src + y * sw;
+        for (int64_t c = cols[x]; c < cols[x + 1]; c++) {
+          sum[0] += p[c] >> 24;
+          sum[1] += (p[c] >> 16) & 0xff;
+          sum[2] += (p[c] >> 8) & 0xff;
+          sum[3] += p[c] & 0xff;
+        }
+      }
+      uint64_t n = (y1 - y0) * (cols[x + 1] - cols[x]);
+      dest[r * tw + x] = (uint32_t) ((sum[0] + n / 2) / n) << 24 |
+                         (uint32_t) ((sum[1] + n / 2) / n) << 16 |
+                         (uint32_t) ((sum[2] + n / 2) / n) << 8 |
+                         (uint32_t) ((sum[3] + n / 2) / n);
+    }
+  }
+}
+
+// source spans of each output pixel along one axis
+static int64_t *get_spans(int64_t src_len, int64_t dest_len) {
+  int64_t *spans = g_new(int64_t, dest_len + 1);
+  for (int64_t i = 0; i <= dest_len; i++) {
+    spans[i] = i * src_len / dest_len;
+  }
+  for (int64_t i = 1; i <= dest_len; i++) {
+    spans[i] = MAX(spans[i], spans[i - 1] + 1);
+  }
+  return spans;
+}
+
+void openslide_get_thumbnail_dimensions(openslide_t *osr,
+					int64_t max_w, int64_t max_h,
+					int64_t *w, int64_t *h) {
+  struct thumbnail_source src;
+  if (!get_thumbnail_source(osr, max_w, max_h, &src, w, h)) {
+    *w = -1;
+    *h = -1;
+  }
+}
+
+void openslide_get_thumbnail(openslide_t *osr,
+			     int64_t max_w, int64_t max_h,
+			     uint32_t *dest) {
+  GError *tmp_err = NULL;
+  struct thumbnail_source src;
+  int64_t tw, th;
+  if (!get_thumbnail_source(osr, max_w, max_h, &src, &tw, &th)) {
+    return;
+  }
+
+  int64_t *cols = get_spans(src.w, tw);
+  int64_t *rows = get_spans(src.h, th);
+
+  if (src.img) {
+    uint32_t *buf = g_new(uint32_t, src.w * src.h);
+    if (src.img->ops->get_argb_data(src.img, buf, &tmp_err)) {
+      box_reduce(dest, tw, buf, src.w, cols, rows, th, 0);
+    } else {
+      _openslide_propagate_error(osr, tmp_err);
+      memset(dest, 0, tw * th * 4);
+    }
+    g_free(buf);
+  } else {
+    // bands of whole output rows; each read fetches its tiles together
+    double ds = osr->levels[src.level]->downsample;
+    int64_t per_row = src.w * (rows[1] - rows[0] + 1);
+    int64_t band = MAX(1, THUMBNAIL_BAND_PIXELS / per_row);
+    uint32_t *buf = NULL;
+    gsize buf_len = 0;
+    for (int64_t r = 0; r < th; r += band) {
+      int64_t count = MIN(band, th - r);
+      int64_t sy = rows[r];
+      int64_t sh = rows[r + count] - sy;
+      if (buf_len < (gsize) (src.w * sh)) {
+        g_free(buf);
+        buf_len = src.w * sh;
+        buf = g_new(uint32_t, buf_len);
+      }
+      openslide_read_region(osr, buf, 0, sy * ds, src.level, src.w, sh);
+      if (openslide_get_error(osr)) {
+        memset(dest, 0, tw * th * 4);
+        break;
+      }
+      box_reduce(dest + r * tw, tw, buf, src.w, cols, rows + r, count, sy);
+    }
+    g_free(buf);
+  }
+
+  g_free(cols);
+  g_free(rows);
+}
+
+openslide_cache_t *openslide_cache_create(size_t capacity_in_bytes) {
+  return _openslide_cache_create(capacity_in_bytes);
+}
+
+void openslide_cache_set_capacity(openslide_cache_t *cache,
+				  size_t capacity_in_bytes) {
+  _openslide_cache_set_capacity(cache, capacity_in_bytes);
+}
+
+void openslide_set_memory_budget(uint64_t bytes) {
+  _openslide_budget_set(bytes);
+}
+
+uint64_t openslide_get_memory_budget(void) {
+  return _openslide_budget_get();
+}
+
+void openslide_release_memory(double fraction) {
+  _openslide_budget_release(fraction);
+}
+
+void openslide_cache_get_stats(openslide_cache_t *cache,
+			       uint64_t *hits, uint64_t *misses,
+			       uint64_t *evictions, uint64_t *size_in_bytes) {
+  struct _openslide_cache_stats stats;
+  _openslide_cache_get_stats(cache, &stats);
+  if (hits) {
+    *hits = stats.hits;
+  }
+  if (misses) {
+    *misses = stats.misses;
+  }
+  if (evictions) {
+    *evictions = stats.evictions;
+  }
+  if (size_in_bytes) {
+    *size_in_bytes = stats.size;
+  }
+}
+
+void openslide_set_cache(openslide_t *osr, openslide_cache_t *cache) {
+  if (osr->cache) {
+    _openslide_cache_binding_set(osr->cache, cache);
+  }
+}
+
+void openslide_set_cache_streaming(openslide_t *osr, bool streaming) {
+  if (osr->cache) {
+    _openslide_cache_binding_set_streaming(osr->cache, streaming);
+  }
+}
+
+void openslide_cache_release(openslide_cache_t *cache) {
+  _openslide_cache_release(cache);
+}
+
+void openslide_get_stats(openslide_t *osr, struct openslide_stats *stats) {
+  _openslide_stats_collect(osr->stats_id, stats);
+}
+
+void openslide_get_global_stats(struct openslide_stats *stats) {
+  _openslide_stats_collect(0, stats);
+}
+
 const char *openslide_get_version(void) {
   return SUFFIXED_VERSION;
 }
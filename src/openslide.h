@@ -33,6 +33,7 @@
 #include "openslide-features.h"
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -43,6 +44,11 @@ extern "C" {
  */
 typedef struct _openslide openslide_t;
 
+/**
+ * An OpenSlide tile cache.
+ */
+typedef struct _openslide_cache openslide_cache_t;
+
 
 /**
  * @name Basic Usage
@@ -89,6 +95,55 @@ OPENSLIDE_PUBLIC()
 openslide_t *openslide_open(const char *filename);
 
 
+/**
+ * The function called with the result of openslide_open_async().
+ *
+ * @param filename The filename given to openslide_open_async().
+ * @param osr What openslide_open() would have returned for it, to be
+ *            closed by the callee.
+ * @param user_data The data given to openslide_open_async().
+ */
+typedef void (*openslide_open_callback_t)(const char *filename,
+                                          openslide_t *osr,
+                                          void *user_data);
+
+
+/**
+ * Open a whole slide image in the background.
+ *
+ * The open runs on a pool of threads kept for opening, so that many
+ * opens, of remote slides especially, wait for their transfers at the
+ * same time.  The callback is called on one of those threads; it may
+ * read the slide, but shouldn't wait for other opens.
+ *
+ * @param filename The filename to open.  On Windows, this must be in UTF-8.
+ * @param callback The function to call with the result.
+ * @param user_data Data to pass to the callback.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_open_async(const char *filename,
+                          openslide_open_callback_t callback,
+                          void *user_data);
+
+
+/**
+ * Open several whole slide images in parallel, and wait for all of them.
+ *
+ * Called from an openslide_open_async() callback, which runs on the pool
+ * the opens would wait for, it opens the slides one after another on the
+ * calling thread instead.
+ *
+ * @param filenames The filenames to open.  On Windows, these must be in
+ *                  UTF-8.
+ * @param count The number of filenames.
+ * @param[out] osrs What openslide_open() would have returned for each
+ *                  filename, in the same order.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_open_many(const char * const *filenames, int32_t count,
+                         openslide_t **osrs);
+
+
 /**
  * Get the number of levels in the whole slide image.
  *
@@ -179,6 +234,236 @@ void openslide_read_region(openslide_t *osr,
 			   int64_t w, int64_t h);
 
 
+/**
+ * Pixel formats for openslide_read_region_ex().
+ *
+ * Other than #OPENSLIDE_PIXEL_FORMAT_ARGB32, the formats drop alpha:
+ * samples are un-premultiplied, and transparent pixels have zero samples.
+ */
+enum openslide_pixel_format {
+  /** Pre-multiplied ARGB, as written by openslide_read_region(). */
+  OPENSLIDE_PIXEL_FORMAT_ARGB32,
+  /** Packed 8-bit R, G, B, 3 bytes per pixel. */
+  OPENSLIDE_PIXEL_FORMAT_RGB24,
+  /** Packed 8-bit B, G, R, 3 bytes per pixel. */
+  OPENSLIDE_PIXEL_FORMAT_BGR24,
+  /** Planes of 8-bit R, then G, then B samples, each @p w * @p h bytes. */
+  OPENSLIDE_PIXEL_FORMAT_RGB_PLANAR,
+  /** Planes of float R, then G, then B samples, each normalized to
+      (sample / 255 - mean) / std. */
+  OPENSLIDE_PIXEL_FORMAT_RGB_PLANAR_FLOAT,
+};
+
+
+/**
+ * Copy data from a whole slide image in a given pixel format.
+ *
+ * This is openslide_read_region() writing @p format, converting each
+ * band of the region as it is painted rather than in a pass of its own.
+ * @p dest must hold (@p w * @p h) pixels of 4 bytes for
+ * #OPENSLIDE_PIXEL_FORMAT_ARGB32, 3 bytes for the 8-bit RGB formats, or
+ * 12 bytes for #OPENSLIDE_PIXEL_FORMAT_RGB_PLANAR_FLOAT.  If an error
+ * occurs or has occurred, then the memory pointed to by @p dest will be
+ * cleared.
+ *
+ * @param osr The OpenSlide object.
+ * @param dest The destination buffer.
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @param format The pixel format of @p dest.
+ * @param mean The R, G and B means subtracted from the float samples,
+ *             or NULL for zeros.  Ignored for other formats.
+ * @param std The R, G and B standard deviations dividing the float
+ *            samples, or NULL for ones.  Ignored for other formats.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_region_ex(openslide_t *osr,
+			      void *dest,
+			      int64_t x, int64_t y,
+			      int32_t level,
+			      int64_t w, int64_t h,
+			      enum openslide_pixel_format format,
+			      const float *mean, const float *std);
+
+
+/**
+ * A region for openslide_read_regions().
+ */
+struct openslide_region_req {
+  int64_t x;      /**< The top left x-coordinate, in the level 0 frame. */
+  int64_t y;      /**< The top left y-coordinate, in the level 0 frame. */
+  int32_t level;  /**< The desired level. */
+  int64_t w;      /**< The width of the region. */
+  int64_t h;      /**< The height of the region. */
+};
+
+
+/**
+ * Copy pre-multiplied ARGB data from many regions of a whole slide image.
+ *
+ * This reads each region as openslide_read_region() would, but fetches
+ * the tiles needed by all of them together, decodes each shared tile
+ * once, and paints the regions in parallel.  Reading many small regions
+ * this way, such as random patches, is faster than reading them one by
+ * one.
+ *
+ * Unlike other errors, an error reading one region, or a region with a
+ * negative size, doesn't move the object into the error state: the
+ * region's buffer is cleared and its status is false.  If the object is
+ * already in the error state, then every buffer is cleared.
+ *
+ * @param osr The OpenSlide object.
+ * @param reqs The regions.
+ * @param count The number of regions.
+ * @param dests The destination buffer for each region, each at least
+ *              (w * h * 4) bytes in length.
+ * @param[out] success Whether each region was read, or NULL.
+ * @return The number of regions read.
+ */
+OPENSLIDE_PUBLIC()
+int64_t openslide_read_regions(openslide_t *osr,
+			       const struct openslide_region_req *reqs,
+			       int64_t count,
+			       uint32_t * const *dests,
+			       bool *success);
+
+
+/**
+ * A cancellation token for openslide_read_region_with_options().
+ */
+typedef struct _openslide_cancel openslide_cancel_t;
+
+
+/**
+ * How openslide_read_region_with_options() ended.
+ */
+enum openslide_read_status {
+  OPENSLIDE_READ_OK,         /**< The region was read. */
+  OPENSLIDE_READ_FAILED,     /**< An error occurred or has occurred. */
+  OPENSLIDE_READ_TIMED_OUT,  /**< The timeout passed first. */
+  OPENSLIDE_READ_CANCELLED,  /**< The token was cancelled first. */
+};
+
+
+/**
+ * Options of openslide_read_region_with_options().  Zeroed options
+ * read ARGB with no timeout.
+ */
+struct openslide_read_options {
+  enum openslide_pixel_format format;  /**< The pixel format of the dest. */
+  const float *mean;      /**< As for openslide_read_region_ex(). */
+  const float *std;       /**< As for openslide_read_region_ex(). */
+  int64_t timeout_ms;     /**< Give up this long after the call, or 0. */
+  openslide_cancel_t *cancel;  /**< Give up once cancelled, or NULL. */
+};
+
+
+/**
+ * Copy data from a whole slide image, giving up at a deadline or on
+ * cancellation.
+ *
+ * This is openslide_read_region_ex() with a timeout and a cancellation
+ * token, for reads which are useless once late, such as the tiles of a
+ * viewport the user has panned away from.  A read which gives up
+ * aborts its remote transfers, clears @p dest and returns
+ * #OPENSLIDE_READ_TIMED_OUT or #OPENSLIDE_READ_CANCELLED; unlike an
+ * error, it doesn't move the object into the error state.  Transfers
+ * shared with other reads go on for them.
+ *
+ * @param osr The OpenSlide object.
+ * @param dest The destination buffer, sized as for
+ *             openslide_read_region_ex().
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @param options The options, or NULL for the defaults.
+ * @return How the read ended.
+ */
+OPENSLIDE_PUBLIC()
+enum openslide_read_status openslide_read_region_with_options(
+    openslide_t *osr,
+    void *dest,
+    int64_t x, int64_t y,
+    int32_t level,
+    int64_t w, int64_t h,
+    const struct openslide_read_options *options);
+
+
+/**
+ * Create a cancellation token.
+ *
+ * A token can be given to any number of reads, from any thread, and
+ * stays cancelled once cancelled.
+ *
+ * @return A new token.
+ */
+OPENSLIDE_PUBLIC()
+openslide_cancel_t *openslide_cancel_create(void);
+
+
+/**
+ * Cancel the reads given a token, now and from now on.
+ *
+ * Safe to call from any thread while the reads are running.
+ *
+ * @param cancel The token.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cancel_request(openslide_cancel_t *cancel);
+
+
+/**
+ * Free a cancellation token, once no read uses it.
+ *
+ * @param cancel The token.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cancel_release(openslide_cancel_t *cancel);
+
+
+/**
+ * Hint that a region of a whole slide image will be read soon.
+ *
+ * The region is fetched in the background, so that a later
+ * openslide_read_region() covering it finds its data ready. This is
+ * useful for the next viewport of a panning viewer. Hints are served
+ * in order; when many are pending, the oldest are dropped. Errors
+ * during prefetch are ignored.
+ *
+ * @param osr The OpenSlide object.
+ * @param x The top left x-coordinate, in the level 0 reference frame.
+ * @param y The top left y-coordinate, in the level 0 reference frame.
+ * @param level The desired level.
+ * @param w The width of the region. Must be non-negative.
+ * @param h The height of the region. Must be non-negative.
+ * @return An identifier for openslide_cancel_prefetch_hint(), or 0 if
+ *         the hint was ignored.
+ */
+OPENSLIDE_PUBLIC()
+int openslide_give_prefetch_hint(openslide_t *osr,
+				 int64_t x, int64_t y,
+				 int32_t level,
+				 int64_t w, int64_t h);
+
+
+/**
+ * Cancel a prefetch hint.
+ *
+ * The hint is dropped if its prefetch has not started yet. A prefetch
+ * already running completes.
+ *
+ * @param osr The OpenSlide object.
+ * @param prefetch_id An identifier from openslide_give_prefetch_hint().
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cancel_prefetch_hint(openslide_t *osr, int prefetch_id);
+
+
 /**
  * Close an OpenSlide object.
  * No other threads may be using the object.
@@ -422,6 +707,379 @@ OPENSLIDE_PUBLIC()
 void openslide_read_associated_image(openslide_t *osr,
 				     const char *name,
 				     uint32_t *dest);
+
+
+/**
+ * Get the dimensions of a thumbnail of a whole slide image.
+ *
+ * The thumbnail keeps the aspect ratio of its source and fits within
+ * @p max_w x @p max_h pixels, without being larger than the source.
+ * Use openslide_get_thumbnail() to read it.
+ *
+ * @param osr The OpenSlide object.
+ * @param max_w The largest width wanted.
+ * @param max_h The largest height wanted.
+ * @param[out] w The width of the thumbnail, or -1 if an error occurred.
+ * @param[out] h The height of the thumbnail, or -1 if an error occurred.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_thumbnail_dimensions(openslide_t *osr,
+					int64_t max_w, int64_t max_h,
+					int64_t *w, int64_t *h);
+
+
+/**
+ * Copy pre-multiplied ARGB data of a thumbnail of a whole slide image.
+ *
+ * The thumbnail is box-filtered from the cheapest source with enough
+ * pixels: the smallest level at least its size, or the slide's
+ * "thumbnail" associated image if it has fewer pixels than that level,
+ * or if the smallest level is too large to read quickly.  Levels are
+ * read in bands, fetching the tiles of each band together.  @p dest must
+ * hold (width * height * 4) bytes, as given by
+ * openslide_get_thumbnail_dimensions() for the same maximum size.  If an
+ * error occurs, @p dest is cleared.  This call does nothing if an error
+ * occurred before.
+ *
+ * @param osr The OpenSlide object.
+ * @param max_w The largest width wanted.
+ * @param max_h The largest height wanted.
+ * @param dest The destination buffer for the ARGB data.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_thumbnail(openslide_t *osr,
+			     int64_t max_w, int64_t max_h,
+			     uint32_t *dest);
+//@}
+
+/**
+ * @name Tiles
+ * Reading the tiles of a level as they are stored.
+ *
+ * Tile servers reading tile-aligned regions can avoid decoding a tile
+ * only to encode it again, by passing through the compressed tiles of
+ * formats which store them in a codec the client understands.
+ */
+//@{
+
+/**
+ * Raw tiles are standalone JPEG images.
+ */
+#define OPENSLIDE_TILE_CODEC_JPEG "jpeg"
+
+/**
+ * Raw tiles are JPEG 2000 codestreams.
+ */
+#define OPENSLIDE_TILE_CODEC_JP2K "jp2k"
+
+
+/**
+ * Get the size of the tiles of a level.
+ *
+ * Tiles are numbered from the top left of the level, and the tiles of the
+ * last column and row may extend past the level's edges.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param[out] w The width of a tile, or -1 if an error occurred, the level
+ *               was out of range, or the level isn't tiled.
+ * @param[out] h The height of a tile, or -1 if an error occurred, the level
+ *               was out of range, or the level isn't tiled.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_level_tile_size(openslide_t *osr, int32_t level,
+				   int64_t *w, int64_t *h);
+
+
+/**
+ * Read a tile of a level without decoding it.
+ *
+ * On success the compressed tile, in the codec named by @p codec, is
+ * returned in a new buffer to be freed with openslide_free_raw_tile().
+ * JPEG tiles include their tables, and are marked as RGB when the slide
+ * doesn't store YCbCr.  Edge tiles keep the padding stored with them.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param tile_col The column of the tile.
+ * @param tile_row The row of the tile.
+ * @param[out] buf The compressed tile.
+ * @param[out] len The length of the compressed tile.
+ * @param[out] codec One of the OPENSLIDE_TILE_CODEC_ constants.
+ * @return true if the tile was read.  false if an error occurred, or the
+ *         tile isn't stored in a form which can be passed through, in
+ *         which case it should be read with openslide_read_region().
+ */
+OPENSLIDE_PUBLIC()
+bool openslide_read_raw_tile(openslide_t *osr, int32_t level,
+			     int64_t tile_col, int64_t tile_row,
+			     void **buf, size_t *len, const char **codec);
+
+
+/**
+ * Free a tile returned by openslide_read_raw_tile().
+ *
+ * @param buf The compressed tile.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_free_raw_tile(void *buf);
+
+
+/**
+ * An opaque reference to a decoded tile.
+ */
+typedef struct _openslide_tile_ref openslide_tile_ref_t;
+
+
+/**
+ * Read a tile of a level into a buffer.
+ *
+ * This is equivalent to reading the tile's region with
+ * openslide_read_region(), but skips compositing the tile into the
+ * destination.  Pixels past the edges of the level are transparent.
+ *
+ * If an error occurs or has occurred, then the buffer will be cleared.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param tile_col The column of the tile.
+ * @param tile_row The row of the tile.
+ * @param dest The destination buffer for the ARGB data, the size of a
+ *             tile as given by openslide_get_level_tile_size().
+ */
+OPENSLIDE_PUBLIC()
+void openslide_read_level_tile(openslide_t *osr, int32_t level,
+			       int64_t tile_col, int64_t tile_row,
+			       uint32_t *dest);
+
+
+/**
+ * Get a decoded tile of a level without copying it.
+ *
+ * The tile is returned from the cache, in the format written by
+ * openslide_read_level_tile(), and stays valid until the reference is
+ * released with openslide_release_tile_ref().  Tiles which are already
+ * cached cost no decoding or copying.  The tile must not be modified.
+ *
+ * @param osr The OpenSlide object.
+ * @param level The desired level.
+ * @param tile_col The column of the tile.
+ * @param tile_row The row of the tile.
+ * @param[out] ref The reference to release, or NULL if an error occurred.
+ * @return The ARGB data of the tile, or NULL if an error occurred, the
+ *         level is out of range, the level isn't tiled, or the tile is
+ *         out of range.
+ */
+OPENSLIDE_PUBLIC()
+const uint32_t *openslide_get_level_tile_ref(openslide_t *osr, int32_t level,
+					     int64_t tile_col, int64_t tile_row,
+					     openslide_tile_ref_t **ref);
+
+
+/**
+ * Release a tile returned by openslide_get_level_tile_ref().
+ *
+ * @param ref The reference to the tile.  May be NULL.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_release_tile_ref(openslide_tile_ref_t *ref);
+
+//@}
+
+/**
+ * @name Caching
+ * Managing the tile cache.
+ *
+ * Each OpenSlide object starts with a private tile cache, or the one the
+ * memory budget shares, if there is one.  A cache created
+ * here can instead be shared by many objects, so that one memory budget
+ * covers all of them and recently used slides keep their tiles while idle
+ * ones give memory back.
+ */
+//@{
+
+/**
+ * Create a tile cache, which can be shared by several OpenSlide objects.
+ *
+ * @param capacity_in_bytes The capacity of the cache, in bytes.
+ * @return A new cache.  Release it with openslide_cache_release().
+ */
+OPENSLIDE_PUBLIC()
+openslide_cache_t *openslide_cache_create(size_t capacity_in_bytes);
+
+
+/**
+ * Change the capacity of a tile cache, evicting tiles if it shrinks.
+ *
+ * @param cache The cache.
+ * @param capacity_in_bytes The new capacity of the cache, in bytes.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_set_capacity(openslide_cache_t *cache,
+				  size_t capacity_in_bytes);
+
+
+/**
+ * Attach a tile cache to an OpenSlide object, replacing its current cache.
+ * The object keeps its own reference to the cache, and the tiles it had in
+ * the previous cache are dropped.  This may be called while other threads
+ * are reading from the object.
+ *
+ * @param osr The OpenSlide object.
+ * @param cache The cache.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_cache(openslide_t *osr, openslide_cache_t *cache);
+
+
+/**
+ * Get the counters of a tile cache.
+ *
+ * Tiles enter the cache on probation, and are protected from eviction by
+ * new tiles once they are read again, so a single pass over a slide can't
+ * flush the tiles read repeatedly.  Any of the pointers may be NULL.
+ *
+ * @param cache The cache.
+ * @param[out] hits The number of reads of tiles found in the cache.
+ * @param[out] misses The number of reads of tiles not in the cache.
+ * @param[out] evictions The number of tiles evicted to make room.
+ * @param[out] size_in_bytes The bytes of tiles in the cache.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_get_stats(openslide_cache_t *cache,
+			       uint64_t *hits, uint64_t *misses,
+			       uint64_t *evictions, uint64_t *size_in_bytes);
+
+
+/**
+ * Mark the reads of an OpenSlide object as streaming, such as a pass over
+ * a whole level which won't read the same tiles again.  Tiles read by a
+ * streaming object are the first to be evicted and never displace the
+ * tiles of other readers.
+ *
+ * @param osr The OpenSlide object.
+ * @param streaming Whether the reads are streaming.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_cache_streaming(openslide_t *osr, bool streaming);
+
+
+/**
+ * Set one memory budget for the caches of the process: the tiles decoded,
+ * the compressed data fetched from remote slides, and the spare buffers
+ * kept for decoding.  OpenSlide objects opened afterward share one tile
+ * cache, instead of a private cache each; tiles cached by earlier objects
+ * and caches created with openslide_cache_create() are outside the budget.
+ * The budget moves memory between decoded tiles and compressed data
+ * according to where the misses cost more time.  It can also be given
+ * as a number of bytes in the OPENSLIDE_MEMORY_BUDGET environment variable.
+ *
+ * Buffers of the decodes and reads in progress aren't counted.
+ *
+ * @param bytes The budget, in bytes, or 0 to go back to the separate
+ *              limits of each cache.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_memory_budget(uint64_t bytes);
+
+
+/**
+ * Get the memory budget of the process.
+ *
+ * @return The budget, in bytes, or 0 if there is none.
+ */
+OPENSLIDE_PUBLIC()
+uint64_t openslide_get_memory_budget(void);
+
+
+/**
+ * Give memory back, such as when the system is short of it.  The least
+ * recently used part of every tile cache and of the compressed data is
+ * dropped, and the spare decode buffers are freed.  The caches fill up
+ * again as slides are read; lower the budget to keep them smaller.
+ *
+ * @param fraction The part of the cached data to drop, from 0 to 1.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_release_memory(double fraction);
+
+
+/**
+ * Release a tile cache.  The cache is freed once no OpenSlide object
+ * uses it.
+ *
+ * @param cache The cache.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_cache_release(openslide_cache_t *cache);
+
+//@}
+
+/**
+ * @name Statistics
+ * Counters of the library's work, for monitoring.
+ *
+ * The counters are kept per thread and summed when read, so counting
+ * doesn't slow down concurrent readers.  They only grow; a monitoring
+ * system can take rates of them.
+ */
+//@{
+
+/**
+ * The number of buckets of a time histogram.  Bucket 0 counts the times
+ * under 1 microsecond, bucket i those from 2^(i-1) up to 2^i microseconds,
+ * and the last bucket all the longer ones.
+ */
+#define OPENSLIDE_STATS_TIME_BUCKETS 24
+
+
+/**
+ * Counters of the work done for reads.
+ */
+struct openslide_stats {
+  uint64_t tile_cache_hits;          /**< Tiles found in the tile cache. */
+  uint64_t tile_cache_misses;        /**< Tiles not in the tile cache. */
+  uint64_t tile_cache_evictions;     /**< Tiles evicted to make room. */
+  uint64_t tile_cache_insert_bytes;  /**< Bytes of tiles added to the cache. */
+  uint64_t tiles_decoded_jpeg;       /**< Tiles decoded with libjpeg. */
+  uint64_t tiles_decoded_jp2k;       /**< Tiles decoded with OpenJPEG. */
+  uint64_t tiles_decoded_png;        /**< Images decoded with libpng. */
+  uint64_t tiles_decoded_libtiff;    /**< Tiles decoded through libtiff. */
+  uint64_t slow_path_reads;  /**< Reads hitting a slow path, as logged by
+                                  OPENSLIDE_DEBUG=performance. */
+  uint64_t decode_us;        /**< Time spent decoding, in microseconds. */
+  uint64_t decode_histogram[OPENSLIDE_STATS_TIME_BUCKETS];
+                             /**< Decodes by time taken. */
+  uint64_t composite_us;     /**< Time spent compositing regions, in
+                                  microseconds. */
+  uint64_t composite_histogram[OPENSLIDE_STATS_TIME_BUCKETS];
+                             /**< Composites by time taken. */
+};
+
+
+/**
+ * Get the counters of the reads of an OpenSlide object.
+ *
+ * This includes the work done for it by the worker pool, such as decoding
+ * bands and serving prefetch hints.  Evictions are those made to fit the
+ * tiles of this object, of any object sharing its cache.
+ *
+ * @param osr The OpenSlide object.
+ * @param[out] stats The counters.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_stats(openslide_t *osr, struct openslide_stats *stats);
+
+
+/**
+ * Get the counters of all reads of the process, including those of
+ * OpenSlide objects since closed.
+ *
+ * @param[out] stats The counters.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_get_global_stats(struct openslide_stats *stats);
+
 //@}
 
 /**
@@ -430,6 +1088,61 @@ void openslide_read_associated_image(openslide_t *osr,
  */
 //@{
 
+/**
+ * Set the number of threads of the worker pool.
+ *
+ * One pool of threads, shared by all OpenSlide objects, runs the
+ * library's background work.  openslide_read_region() splits regions of a
+ * megapixel or more into bands of tile rows which the workers decode in
+ * parallel; they also serve prefetch hints and long scans such as the
+ * Hamamatsu restart marker search, in that order of priority.  By default
+ * there is one thread per processor, up to 8, or the number in the
+ * OPENSLIDE_DECODE_THREADS environment variable.  If
+ * OPENSLIDE_WORKER_PINNING is set, each worker is pinned to a processor,
+ * spreading the workers over the NUMA nodes.
+ *
+ * @param threads The number of threads, 1 to decode on the calling thread
+ *                only, or 0 for the default.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_decode_threads(int threads);
+
+
+/**
+ * The priority of a task given to an executor.
+ */
+enum openslide_task_priority {
+  OPENSLIDE_TASK_INTERACTIVE,  /**< Part of a read someone is waiting for. */
+  OPENSLIDE_TASK_PREFETCH,     /**< Serving a prefetch hint. */
+  OPENSLIDE_TASK_BACKGROUND,   /**< A long scan, which may block. */
+};
+
+
+/**
+ * A function running the library's tasks on the host application's
+ * threads.  Each call must arrange for exactly one later or immediate
+ * call of run(task), on any thread.  Tasks can wait for other tasks, so
+ * the executor must not run them one at a time.
+ */
+typedef void (*openslide_executor_fn)(void (*run)(void *task), void *task,
+				      enum openslide_task_priority priority,
+				      void *data);
+
+
+/**
+ * Run the library's background work with an executor of the host
+ * application instead of the worker pool.
+ *
+ * Tasks submitted from then on go to @p executor; the band splitting of
+ * openslide_read_region() still follows openslide_set_decode_threads().
+ *
+ * @param executor The executor, or NULL for the worker pool.
+ * @param data Passed to the executor.
+ */
+OPENSLIDE_PUBLIC()
+void openslide_set_executor(openslide_executor_fn executor, void *data);
+
+
 /**
  * Get the version of the OpenSlide library.
  *
@@ -559,17 +1272,6 @@ const char *openslide_get_comment(openslide_t *osr);
 
 //@}
 
-#ifndef OPENSLIDE_SIMPLIFY_HEADERS
-// these are meant to throw compile- and link-time errors,
-// since the functions they replace were never implemented
-int _openslide_give_prefetch_hint_UNIMPLEMENTED(void);
-void _openslide_cancel_prefetch_hint_UNIMPLEMENTED(void);
-#define openslide_give_prefetch_hint(osr, x, y, level, w, h)	\
-  _openslide_give_prefetch_hint_UNIMPLEMENTED(-1);
-#define openslide_cancel_prefetch_hint(osr, prefetch_id)	\
-  _openslide_cancel_prefetch_hint_UNIMPLEMENTED(-1)
-#endif
-
 /**
  * @mainpage OpenSlide
  *
@@ -0,0 +1,305 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Run one workload against a slide, usually a URL served by the driver's
+   benchmark server, and print its wall-clock timings as a JSON object.
+   The server counts the requests and bytes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <glib.h>
+#include <openslide.h>
+#include "openslide-common.h"
+
+#define PATCH_SIZE 400
+#define PATCH_COUNT 200
+#define VIEWPORT_W 1280
+#define VIEWPORT_H 800
+#define PAN_STEP 160
+#define PAN_STEPS 60
+#define PAN_DOWNSAMPLE 4
+#define SWEEP_SIZE 1024
+#define SEED 1
+
+struct bench {
+  const char *path;
+  openslide_t *osr;
+  GMutex *lock;
+  GArray *latencies;  // of each operation, in ms
+  char *error;
+};
+
+struct worker {
+  struct bench *bench;
+  int index;
+};
+
+static void record(struct bench *bench, GTimer *timer) {
+  double ms = g_timer_elapsed(timer, NULL) * 1000;
+  g_mutex_lock(bench->lock);
+  g_array_append_val(bench->latencies, ms);
+  g_mutex_unlock(bench->lock);
+}
+
+static bool check_error(struct bench *bench, openslide_t *osr) {
+  const char *err = osr ? openslide_get_error(osr) : "Unrecognized slide";
+  if (err == NULL) {
+    return true;
+  }
+  g_mutex_lock(bench->lock);
+  if (bench->error == NULL) {
+    bench->error = g_strdup(err);
+  }
+  g_mutex_unlock(bench->lock);
+  return false;
+}
+
+static void run_open(struct bench *bench) {
+  GTimer *timer = g_timer_new();
+  openslide_t *osr = openslide_open(bench->path);
+  record(bench, timer);
+  check_error(bench, osr);
+  if (osr) {
+    openslide_close(osr);
+  }
+  g_timer_destroy(timer);
+}
+
+static void run_properties(struct bench *bench) {
+  GTimer *timer = g_timer_new();
+  openslide_t *osr = openslide_open(bench->path);
+  if (check_error(bench, osr)) {
+    const char * const *names = openslide_get_property_names(osr);
+    for (int i = 0; names[i]; i++) {
+      openslide_get_property_value(osr, names[i]);
+    }
+    names = openslide_get_associated_image_names(osr);
+    for (int i = 0; names[i]; i++) {
+      int64_t w, h;
+      openslide_get_associated_image_dimensions(osr, names[i], &w, &h);
+    }
+    record(bench, timer);
+  }
+  if (osr) {
+    openslide_close(osr);
+  }
+  g_timer_destroy(timer);
+}
+
+// random patches of level 0, the same ones in every run
+static void *patch_thread(void *data) {
+  struct worker *worker = data;
+  struct bench *bench = worker->bench;
+  uint32_t *buf = g_new(uint32_t, PATCH_SIZE * PATCH_SIZE);
+  GRand *rand = g_rand_new_with_seed(SEED + worker->index);
+  GTimer *timer = g_timer_new();
+
+  int64_t w, h;
+  openslide_get_level0_dimensions(bench->osr, &w, &h);
+  for (int i = 0; i < PATCH_COUNT && w > 0 && h > 0; i++) {
+    int64_t x = g_rand_double(rand) * MAX(w - PATCH_SIZE, 1);
+    int64_t y = g_rand_double(rand) * MAX(h - PATCH_SIZE, 1);
+    g_timer_start(timer);
+    openslide_read_region(bench->osr, buf, x, y, 0, PATCH_SIZE, PATCH_SIZE);
+    record(bench, timer);
+  }
+
+  g_timer_destroy(timer);
+  g_rand_free(rand);
+  g_free(buf);
+  return NULL;
+}
+
+static void run_patches(struct bench *bench, int threads) {
+  struct worker *workers = g_new0(struct worker, threads);
+  GThread **handles = g_new0(GThread *, threads);
+  for (int i = 0; i < threads; i++) {
+    workers[i].bench = bench;
+    workers[i].index = i;
+    handles[i] = g_thread_create(patch_thread, &workers[i], TRUE, NULL);
+    if (handles[i] == NULL) {
+      common_fail("Couldn't start thread");
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    g_thread_join(handles[i]);
+  }
+  g_free(handles);
+  g_free(workers);
+}
+
+// a viewer panning right across the middle of a low-resolution level,
+// hinting the next viewport as it goes
+static void run_pan(struct bench *bench) {
+  int32_t level = openslide_get_best_level_for_downsample(bench->osr,
+                                                          PAN_DOWNSAMPLE);
+  if (level < 0) {
+    return;
+  }
+  double ds = openslide_get_level_downsample(bench->osr, level);
+  int64_t w, h;
+  openslide_get_level_dimensions(bench->osr, level, &w, &h);
+  int64_t y = MAX(h - VIEWPORT_H, 0) / 2 * ds;
+
+  uint32_t *buf = g_new(uint32_t, VIEWPORT_W * VIEWPORT_H);
+  GTimer *timer = g_timer_new();
+  for (int i = 0; i < PAN_STEPS; i++) {
+    int64_t x = (int64_t) i * PAN_STEP % MAX(w - VIEWPORT_W, 1) * ds;
+    openslide_give_prefetch_hint(bench->osr, x + PAN_STEP * ds, y, level,
+                                 VIEWPORT_W, VIEWPORT_H);
+    g_timer_start(timer);
+    openslide_read_region(bench->osr, buf, x, y, level,
+                          VIEWPORT_W, VIEWPORT_H);
+    record(bench, timer);
+  }
+  g_timer_destroy(timer);
+  g_free(buf);
+}
+
+// all of level 0
+static void run_sweep(struct bench *bench) {
+  int64_t w, h;
+  openslide_get_level0_dimensions(bench->osr, &w, &h);
+
+  uint32_t *buf = g_new(uint32_t, SWEEP_SIZE * SWEEP_SIZE);
+  GTimer *timer = g_timer_new();
+  for (int64_t y = 0; y < h; y += SWEEP_SIZE) {
+    for (int64_t x = 0; x < w; x += SWEEP_SIZE) {
+      g_timer_start(timer);
+      openslide_read_region(bench->osr, buf, x, y, 0,
+                            MIN(SWEEP_SIZE, w - x), MIN(SWEEP_SIZE, h - y));
+      record(bench, timer);
+    }
+  }
+  g_timer_destroy(timer);
+  g_free(buf);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+  return (da > db) - (da < db);
+}
+
+static double percentile(GArray *sorted, int p) {
+  if (sorted->len == 0) {
+    return 0;
+  }
+  return g_array_index(sorted, double, (sorted->len - 1) * p / 100);
+}
+
+static void print_json_string(const char *str) {
+  if (str == NULL) {
+    printf("null");
+    return;
+  }
+  putchar('"');
+  for (const char *c = str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      printf("\\%c", *c);
+    } else if ((unsigned char) *c < 0x20) {
+      printf("\\u%04x", *c);
+    } else {
+      putchar(*c);
+    }
+  }
+  putchar('"');
+}
+
+int main(int argc, char **argv) {
+  common_fix_argv(&argc, &argv);
+  if (argc < 3 || argc > 4) {
+    common_fail("Usage: %s <slide> "
+                "open|properties|patches|pan|sweep|parallel [threads]",
+                argv[0]);
+  }
+  const char *workload = argv[2];
+  int threads = argc > 3 ? atoi(argv[3]) : 4;
+  if (threads < 1) {
+    common_fail("Invalid thread count");
+  }
+  if (strcmp(workload, "parallel")) {
+    threads = 1;
+  }
+
+  struct bench bench = {
+    .path = argv[1],
+    .lock = g_mutex_new(),
+    .latencies = g_array_new(FALSE, FALSE, sizeof(double)),
+  };
+
+  // the slide is opened outside the timed part of the reading workloads
+  bool reads = strcmp(workload, "open") && strcmp(workload, "properties");
+  if (reads) {
+    bench.osr = openslide_open(bench.path);
+  }
+
+  GTimer *wall = g_timer_new();
+  if (reads && !check_error(&bench, bench.osr)) {
+    // nothing to run
+  } else if (!strcmp(workload, "open")) {
+    run_open(&bench);
+  } else if (!strcmp(workload, "properties")) {
+    run_properties(&bench);
+  } else if (!strcmp(workload, "patches") ||
+             !strcmp(workload, "parallel")) {
+    run_patches(&bench, threads);
+  } else if (!strcmp(workload, "pan")) {
+    run_pan(&bench);
+  } else if (!strcmp(workload, "sweep")) {
+    run_sweep(&bench);
+  } else {
+    common_fail("Unknown workload: %s", workload);
+  }
+  double wall_ms = g_timer_elapsed(wall, NULL) * 1000;
+  g_timer_destroy(wall);
+
+  if (bench.osr) {
+    check_error(&bench, bench.osr);
+    openslide_close(bench.osr);
+  }
+
+  GArray *sorted = bench.latencies;
+  qsort(sorted->data, sorted->len, sizeof(double), compare_double);
+  double total = 0;
+  for (guint i = 0; i < sorted->len; i++) {
+    total += g_array_index(sorted, double, i);
+  }
+
+  printf("{\"workload\": \"%s\", \"threads\": %d, \"ops\": %u, "
+         "\"wall_ms\": %.3f, \"latency_ms\": {\"mean\": %.3f, "
+         "\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}, "
+         "\"error\": ",
+         workload, threads, sorted->len, wall_ms,
+         sorted->len ? total / sorted->len : 0,
+         percentile(sorted, 50), percentile(sorted, 95),
+         percentile(sorted, 99), percentile(sorted, 100));
+  print_json_string(bench.error);
+  printf("}\n");
+
+  bool failed = bench.error != NULL;
+  g_free(bench.error);
+  g_array_free(bench.latencies, TRUE);
+  g_mutex_free(bench.lock);
+  return failed ? 1 : 0;
+}
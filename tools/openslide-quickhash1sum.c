@@ -24,21 +24,20 @@
 #include "openslide.h"
 #include "openslide-common.h"
 
-static gboolean process(const char *file) {
-  openslide_t *osr = openslide_open(file);
+static bool process(const char *file, openslide_t *osr,
+                    void *data G_GNUC_UNUSED) {
   if (osr == NULL) {
     fprintf(stderr, "%s: %s: Not a file that OpenSlide can recognize\n",
 	    g_get_prgname(), file);
     fflush(stderr);
-    return FALSE;
+    return false;
   }
 
   const char *err = openslide_get_error(osr);
   if (err) {
     fprintf(stderr, "%s: %s: %s\n", g_get_prgname(), file, err);
     fflush(stderr);
-    openslide_close(osr);
-    return FALSE;
+    return false;
   }
 
   const char *hash = openslide_get_property_value(osr,
@@ -49,18 +48,17 @@ static gboolean process(const char *file) {
     fprintf(stderr, "%s: %s: No quickhash-1 available\n", g_get_prgname(),
             file);
     fflush(stderr);
-    openslide_close(osr);
-    return FALSE;
+    return false;
   }
 
-  openslide_close(osr);
-  return TRUE;
+  return true;
 }
 
 
 static const struct common_usage_info usage_info = {
   "FILE...",
-  "Print OpenSlide quickhash-1 (256-bit) checksums.",
+  "Print OpenSlide quickhash-1 (256-bit) checksums.  With FILE -, read the\n"
+  "slide names from standard input, one per line.",
 };
 
 int main (int argc, char **argv) {
@@ -69,12 +67,5 @@ int main (int argc, char **argv) {
     common_usage(&usage_info);
   }
 
-  int ret = 0;
-  for (int i = 1; i < argc; i++) {
-    if (!process(argv[i])) {
-      ret = 1;
-    }
-  }
-
-  return ret;
+  return !common_process_slides(argc - 1, argv + 1, process, NULL);
 }
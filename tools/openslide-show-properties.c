@@ -20,32 +20,38 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <glib.h>
 #include "openslide.h"
 #include "openslide-common.h"
 
-static gboolean process(const char *file, int successes, int total) {
-  openslide_t *osr = openslide_open(file);
+struct state {
+  int successes;
+  bool headers;
+};
+
+static bool process(const char *file, openslide_t *osr, void *data) {
+  struct state *state = data;
+
   if (osr == NULL) {
     fprintf(stderr, "%s: %s: Not a file that OpenSlide can recognize\n",
 	    g_get_prgname(), file);
     fflush(stderr);
-    return FALSE;
+    return false;
   }
 
   const char *err = openslide_get_error(osr);
   if (err) {
     fprintf(stderr, "%s: %s: %s\n", g_get_prgname(), file, err);
     fflush(stderr);
-    openslide_close(osr);
-    return FALSE;
+    return false;
   }
 
   // print header
-  if (successes > 0) {
+  if (state->successes > 0) {
     printf("\n");
   }
-  if (total > 1) {
+  if (state->headers) {
     // format inspired by head(1)/tail(1)
     printf("==> %s <==\n", file);
   }
@@ -60,14 +66,15 @@ static gboolean process(const char *file, int successes, int total) {
     property_names++;
   }
 
-  openslide_close(osr);
-  return TRUE;
+  state->successes++;
+  return true;
 }
 
 
 static const struct common_usage_info usage_info = {
   "FILE...",
-  "Print OpenSlide properties for a slide.",
+  "Print OpenSlide properties for a slide.  With FILE -, read the slide\n"
+  "names from standard input, one per line.",
 };
 
 int main (int argc, char **argv) {
@@ -76,12 +83,11 @@ int main (int argc, char **argv) {
     common_usage(&usage_info);
   }
 
-  int successes = 0;
-  for (int i = 1; i < argc; i++) {
-    if (process(argv[i], successes, argc - 1)) {
-      successes++;
-    }
-  }
+  // slides named on standard input may be many
+  struct state state = {
+    .headers = argc > 2 || !strcmp(argv[1], "-"),
+  };
+  bool success = common_process_slides(argc - 1, argv + 1, process, &state);
 
-  return successes != argc - 1;
+  return !success;
 }
@@ -0,0 +1,625 @@
+/*
+ *  OpenSlide, a library for reading whole slide image files
+ *
+ *  Copyright (c) 2019 huangch
+ *  All rights reserved.
+ *
+ *  OpenSlide is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation, version 2.1.
+ *
+ *  OpenSlide is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with OpenSlide. If not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Write a Deep Zoom pyramid of a slide.  Level 0 is read in strips of
+ * tile rows, which the library decodes in parallel; each row goes to the
+ * full-resolution Deep Zoom level and, paired with the next one, is
+ * reduced 2x2 into the level below, and so on down to 1x1.  Every level
+ * buffers one row of tiles, so memory grows with the width of the slide
+ * but not its height.  Tiles are encoded and written by a pool of writer
+ * threads, behind a bounded queue.
+ */
+
+#include "openslide.h"
+#include "openslide-common.h"
+
+#include <png.h>
+#include <jpeglib.h>
+#include <inttypes.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <unistd.h>
+
+#define DEFAULT_TILE_SIZE 254
+#define DEFAULT_OVERLAP 1
+#define JPEG_QUALITY 75
+
+// tiles waiting for a writer, per writer
+#define QUEUED_PER_WRITER 4
+#define MAX_WRITERS 16
+
+enum format {
+  FORMAT_JPEG,
+  FORMAT_PNG,
+};
+
+struct level {
+  int index;       // Deep Zoom level
+  int64_t w, h;
+
+  // the rows of the tile row being assembled, from image row first
+  uint32_t *rows;
+  int64_t first;
+  int64_t count;
+  int64_t tile_row;
+
+  // an even row waiting for its pair, to be reduced into the level below
+  uint32_t *pending;
+  bool have_pending;
+};
+
+struct dzi {
+  openslide_t *osr;
+  int64_t tile_size;
+  int64_t overlap;
+  enum format format;
+  const char *ext;
+  char *files_dir;
+  uint8_t background[3];
+
+  // level 0 tiles of the slide are the JPEG tiles of the top level
+  bool passthrough;
+  int64_t passthrough_count;
+
+  int level_count;
+  struct level *levels;  // by Deep Zoom level
+
+  // writers
+  GAsyncQueue *queue;
+  GMutex *lock;
+  GCond *cond;
+  int queued;
+  int max_queued;
+};
+
+struct tile_job {
+  struct dzi *dzi;
+  int level;
+  int64_t col, row;
+  int64_t w, h;
+  uint32_t *pixels;  // premultiplied ARGB, NULL to stop the writer
+  bool raw;          // try the slide's own tile first
+};
+
+
+static void fail(const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  char *msg = g_strdup_vprintf(format, ap);
+  va_end(ap);
+
+  fprintf(stderr, "%s: %s\n", g_get_prgname(), msg);
+  fflush(stderr);
+
+  exit(1);
+}
+
+
+/* encoding */
+
+static char *tile_path(struct dzi *dzi, int level, int64_t col, int64_t row) {
+  return g_strdup_printf("%s/%d/%" PRId64 "_%" PRId64 ".%s", dzi->files_dir,
+                         level, col, row, dzi->ext);
+}
+
+static FILE *open_tile(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fail("Can't open %s for writing: %s", path, strerror(errno));
+  }
+  return f;
+}
+
+static void close_tile(FILE *f, const char *path) {
+  if (fclose(f)) {
+    fail("Can't write %s: %s", path, strerror(errno));
+  }
+}
+
+// un-premultiply alpha into RGBA bytes, in place
+static void to_rgba(uint32_t *buf, int64_t count) {
+  for (int64_t i = 0; i < count; i++) {
+    uint32_t p = buf[i];
+    uint8_t *p8 = (uint8_t *) (buf + i);
+
+    uint8_t a = (p >> 24) & 0xFF;
+    uint8_t r = (p >> 16) & 0xFF;
+    uint8_t g = (p >> 8) & 0xFF;
+    uint8_t b = p & 0xFF;
+
+    switch (a) {
+    case 0:
+      r = 0;
+      b = 0;
+      g = 0;
+      break;
+
+    case 255:
+      // no action
+      break;
+
+    default:
+      r = (r * 255 + a / 2) / a;
+      g = (g * 255 + a / 2) / a;
+      b = (b * 255 + a / 2) / a;
+      break;
+    }
+
+    p8[0] = r;
+    p8[1] = g;
+    p8[2] = b;
+    p8[3] = a;
+  }
+}
+
+// composite premultiplied ARGB over the background into RGB bytes
+static void to_rgb(uint8_t *dest, const uint32_t *src, int64_t count,
+                   const uint8_t *bg) {
+  for (int64_t i = 0; i < count; i++) {
+    uint32_t p = src[i];
+    uint32_t ia = 255 - ((p >> 24) & 0xFF);
+    dest[3 * i] = ((p >> 16) & 0xFF) + (bg[0] * ia + 127) / 255;
+    dest[3 * i + 1] = ((p >> 8) & 0xFF) + (bg[1] * ia + 127) / 255;
+    dest[3 * i + 2] = (p & 0xFF) + (bg[2] * ia + 127) / 255;
+  }
+}
+
+static void write_png_tile(struct tile_job *job, FILE *f) {
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                NULL, NULL, NULL);
+  if (!png_ptr) {
+    fail("Could not initialize PNG");
+  }
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    fail("Could not initialize PNG");
+  }
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    fail("Error writing PNG");
+  }
+
+  png_init_io(png_ptr, f);
+  png_set_IHDR(png_ptr, info_ptr, job->w, job->h, 8,
+               PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+               PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png_ptr, info_ptr);
+
+  to_rgba(job->pixels, job->w * job->h);
+  for (int64_t y = 0; y < job->h; y++) {
+    png_write_row(png_ptr, (png_bytep) (job->pixels + y * job->w));
+  }
+
+  png_write_end(png_ptr, info_ptr);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+}
+
+// libjpeg's default error handler exits, which is what we'd do anyway
+static void write_jpeg_tile(struct tile_job *job, FILE *f) {
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, f);
+
+  cinfo.image_width = job->w;
+  cinfo.image_height = job->h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, JPEG_QUALITY, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+
+  uint8_t *row = g_malloc(job->w * 3);
+  for (int64_t y = 0; y < job->h; y++) {
+    to_rgb(row, job->pixels + y * job->w, job->w, job->dzi->background);
+    JSAMPROW rows[1] = { row };
+    jpeg_write_scanlines(&cinfo, rows, 1);
+  }
+  g_free(row);
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+}
+
+// the slide's own JPEG tile, if it can be passed through
+static bool write_raw_tile(struct tile_job *job, FILE *f) {
+  void *buf;
+  size_t len;
+  const char *codec;
+  if (!openslide_read_raw_tile(job->dzi->osr, 0, job->col, job->row,
+                               &buf, &len, &codec)) {
+    return false;
+  }
+  bool ok = !strcmp(codec, OPENSLIDE_TILE_CODEC_JPEG);
+  if (ok && fwrite(buf, len, 1, f) != 1) {
+    fail("Can't write tile: %s", strerror(errno));
+  }
+  openslide_free_raw_tile(buf);
+  return ok;
+}
+
+static void *writer_thread(void *data) {
+  struct dzi *dzi = data;
+  struct tile_job *job;
+
+  while ((job = g_async_queue_pop(dzi->queue))->pixels) {
+    char *path = tile_path(dzi, job->level, job->col, job->row);
+    FILE *f = open_tile(path);
+    bool written = job->raw && write_raw_tile(job, f);
+    if (written) {
+      g_mutex_lock(dzi->lock);
+      dzi->passthrough_count++;
+      g_mutex_unlock(dzi->lock);
+    } else if (dzi->format == FORMAT_PNG) {
+      write_png_tile(job, f);
+    } else {
+      write_jpeg_tile(job, f);
+    }
+    close_tile(f, path);
+    g_free(path);
+
+    g_free(job->pixels);
+    g_slice_free(struct tile_job, job);
+
+    g_mutex_lock(dzi->lock);
+    dzi->queued--;
+    g_cond_signal(dzi->cond);
+    g_mutex_unlock(dzi->lock);
+  }
+  g_slice_free(struct tile_job, job);
+  return NULL;
+}
+
+// waits while the writers are behind, so that memory stays bounded
+static void submit_tile(struct dzi *dzi, struct tile_job *job) {
+  g_mutex_lock(dzi->lock);
+  while (dzi->queued >= dzi->max_queued) {
+    g_cond_wait(dzi->cond, dzi->lock);
+  }
+  dzi->queued++;
+  g_mutex_unlock(dzi->lock);
+  g_async_queue_push(dzi->queue, job);
+}
+
+
+/* the pyramid */
+
+// dest[i] is the rounded mean of pixels 2i and 2i+1 of both rows, with the
+// red and blue channels summed in one word and alpha and green in another
+static void reduce_row(uint32_t *dest, const uint32_t *row0,
+                       const uint32_t *row1, int64_t src_w) {
+  int64_t pairs = src_w / 2;
+  for (int64_t i = 0; i < pairs; i++) {
+    uint32_t a = row0[2 * i], b = row0[2 * i + 1];
+    uint32_t c = row1[2 * i], d = row1[2 * i + 1];
+    uint32_t rb = (a & 0x00ff00ff) + (b & 0x00ff00ff) +
+                  (c & 0x00ff00ff) + (d & 0x00ff00ff) + 0x00020002;
+    uint32_t ag = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff) +
+                  ((c >> 8) & 0x00ff00ff) + ((d >> 8) & 0x00ff00ff) +
+                  0x00020002;
+    dest[i] = ((rb >> 2) & 0x00ff00ff) | (((ag >> 2) & 0x00ff00ff) << 8);
+  }
+  if (src_w & 1) {
+    // the last column on its own
+    uint32_t last0[2] = { row0[src_w - 1], row0[src_w - 1] };
+    uint32_t last1[2] = { row1[src_w - 1], row1[src_w - 1] };
+    reduce_row(dest + pairs, last0, last1, 2);
+  }
+}
+
+static int64_t tile_start(struct dzi *dzi, int64_t index) {
+  return MAX(index * dzi->tile_size - dzi->overlap, 0);
+}
+
+static int64_t tile_end(struct dzi *dzi, int64_t index, int64_t size) {
+  return MIN((index + 1) * dzi->tile_size + dzi->overlap, size);
+}
+
+static void emit_tile_row(struct dzi *dzi, struct level *l) {
+  int64_t y0 = tile_start(dzi, l->tile_row);
+  int64_t h = tile_end(dzi, l->tile_row, l->h) - y0;
+  int64_t cols = (l->w + dzi->tile_size - 1) / dzi->tile_size;
+  for (int64_t col = 0; col < cols; col++) {
+    int64_t x0 = tile_start(dzi, col);
+    int64_t w = tile_end(dzi, col, l->w) - x0;
+
+    struct tile_job *job = g_slice_new0(struct tile_job);
+    job->dzi = dzi;
+    job->level = l->index;
+    job->col = col;
+    job->row = l->tile_row;
+    job->w = w;
+    job->h = h;
+    job->pixels = g_new(uint32_t, w * h);
+    for (int64_t y = 0; y < h; y++) {
+      memcpy(job->pixels + y * w, l->rows + (y0 - l->first + y) * l->w + x0,
+             w * 4);
+    }
+    job->raw = dzi->passthrough && l->index == dzi->level_count - 1 &&
+      w == dzi->tile_size && h == dzi->tile_size;
+    submit_tile(dzi, job);
+  }
+}
+
+static void push_row(struct dzi *dzi, int level, const uint32_t *row);
+
+// the level is complete: reduce a last unpaired row on its own
+static void flush_level(struct dzi *dzi, int level) {
+  struct level *l = &dzi->levels[level];
+  if (level > 0 && l->have_pending) {
+    uint32_t *half = g_new(uint32_t, dzi->levels[level - 1].w);
+    reduce_row(half, l->pending, l->pending, l->w);
+    l->have_pending = false;
+    push_row(dzi, level - 1, half);
+    g_free(half);
+  }
+  if (level > 0) {
+    flush_level(dzi, level - 1);
+  }
+}
+
+static void push_row(struct dzi *dzi, int level, const uint32_t *row) {
+  struct level *l = &dzi->levels[level];
+  int64_t y = l->first + l->count;
+  g_assert(y < l->h);
+
+  memcpy(l->rows + l->count * l->w, row, l->w * 4);
+  l->count++;
+
+  // a tile row is complete
+  if (y + 1 == tile_end(dzi, l->tile_row, l->h)) {
+    emit_tile_row(dzi, l);
+    l->tile_row++;
+    int64_t first = tile_start(dzi, l->tile_row);
+    int64_t keep = MAX(y + 1 - first, 0);
+    memmove(l->rows, l->rows + (first - l->first) * l->w, keep * l->w * 4);
+    l->first = first;
+    l->count = keep;
+  }
+
+  // into the level below
+  if (level > 0) {
+    if (l->have_pending) {
+      uint32_t *half = g_new(uint32_t, dzi->levels[level - 1].w);
+      reduce_row(half, l->pending, row, l->w);
+      l->have_pending = false;
+      push_row(dzi, level - 1, half);
+      g_free(half);
+    } else {
+      memcpy(l->pending, row, l->w * 4);
+      l->have_pending = true;
+    }
+  }
+}
+
+static void init_levels(struct dzi *dzi, int64_t w, int64_t h) {
+  int count = 1;
+  for (int64_t size = MAX(w, h); size > 1; size = (size + 1) / 2) {
+    count++;
+  }
+  dzi->level_count = count;
+  dzi->levels = g_new0(struct level, count);
+  int64_t lw = w;
+  int64_t lh = h;
+  for (int i = count - 1; i >= 0; i--) {
+    struct level *l = &dzi->levels[i];
+    l->index = i;
+    l->w = lw;
+    l->h = lh;
+    l->rows = g_new(uint32_t, lw * (dzi->tile_size + 2 * dzi->overlap));
+    l->pending = g_new(uint32_t, lw);
+    lw = (lw + 1) / 2;
+    lh = (lh + 1) / 2;
+
+    char *dir = g_strdup_printf("%s/%d", dzi->files_dir, i);
+    if (g_mkdir_with_parents(dir, 0777)) {
+      fail("Can't create %s: %s", dir, strerror(errno));
+    }
+    g_free(dir);
+  }
+}
+
+static void write_descriptor(struct dzi *dzi, const char *path,
+                             int64_t w, int64_t h) {
+  char *xml = g_strdup_printf(
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+    "Format=\"%s\" Overlap=\"%" PRId64 "\" TileSize=\"%" PRId64 "\">"
+    "<Size Width=\"%" PRId64 "\" Height=\"%" PRId64 "\"/></Image>\n",
+    dzi->ext, dzi->overlap, dzi->tile_size, w, h);
+  GError *err = NULL;
+  if (!g_file_set_contents(path, xml, -1, &err)) {
+    fail("%s", err->message);
+  }
+  g_free(xml);
+}
+
+static int writer_count(void) {
+  long cpus = 4;
+#ifdef _SC_NPROCESSORS_ONLN
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return CLAMP(cpus, 1, MAX_WRITERS);
+}
+
+static void write_dzi(struct dzi *dzi, const char *descriptor) {
+  int64_t w, h;
+  openslide_get_level0_dimensions(dzi->osr, &w, &h);
+  init_levels(dzi, w, h);
+
+  // writers
+  int writers = writer_count();
+  dzi->queue = g_async_queue_new();
+  dzi->lock = g_mutex_new();
+  dzi->cond = g_cond_new();
+  dzi->max_queued = QUEUED_PER_WRITER * writers;
+  GThread **threads = g_new(GThread *, writers);
+  for (int i = 0; i < writers; i++) {
+    threads[i] = g_thread_create(writer_thread, dzi, TRUE, NULL);
+    if (threads[i] == NULL) {
+      fail("Couldn't start writer thread");
+    }
+  }
+
+  // level 0 in strips of a row of tiles, hinting the next one so that its
+  // tiles are fetched while this one is reduced
+  int64_t strip_h = dzi->tile_size;
+  uint32_t *strip = g_new(uint32_t, w * strip_h);
+  int hint = -1;
+  openslide_set_cache_streaming(dzi->osr, true);
+  for (int64_t y = 0; y < h; y += strip_h) {
+    int64_t sh = MIN(strip_h, h - y);
+    int next_hint = -1;
+    if (y + sh < h) {
+      next_hint = openslide_give_prefetch_hint(dzi->osr, 0, y + sh, 0,
+                                               w, MIN(strip_h, h - y - sh));
+    }
+    openslide_read_region(dzi->osr, strip, 0, y, 0, w, sh);
+    if (hint >= 0) {
+      openslide_cancel_prefetch_hint(dzi->osr, hint);
+    }
+    hint = next_hint;
+    const char *err = openslide_get_error(dzi->osr);
+    if (err) {
+      fail("%s", err);
+    }
+    for (int64_t r = 0; r < sh; r++) {
+      push_row(dzi, dzi->level_count - 1, strip + r * w);
+    }
+  }
+  flush_level(dzi, dzi->level_count - 1);
+  g_free(strip);
+
+  // stop the writers
+  for (int i = 0; i < writers; i++) {
+    g_async_queue_push(dzi->queue, g_slice_new0(struct tile_job));
+  }
+  for (int i = 0; i < writers; i++) {
+    g_thread_join(threads[i]);
+  }
+  g_free(threads);
+
+  write_descriptor(dzi, descriptor, w, h);
+
+  for (int i = 0; i < dzi->level_count; i++) {
+    g_free(dzi->levels[i].rows);
+    g_free(dzi->levels[i].pending);
+  }
+  g_free(dzi->levels);
+  g_async_queue_unref(dzi->queue);
+  g_mutex_free(dzi->lock);
+  g_cond_free(dzi->cond);
+}
+
+
+static const struct common_usage_info usage_info = {
+  "slide output-base [tile-size [overlap [jpeg|png]]]",
+  "Write a virtual slide as a Deep Zoom pyramid, output-base.dzi and "
+  "output-base_files.",
+};
+
+int main (int argc, char **argv) {
+  common_parse_commandline(&usage_info, &argc, &argv);
+  if (argc < 3 || argc > 6) {
+    common_usage(&usage_info);
+  }
+
+  // get args
+  const char *slide = argv[1];
+  const char *output = argv[2];
+  struct dzi dzi = {
+    .tile_size = argc > 3 ? g_ascii_strtoll(argv[3], NULL, 10) :
+      DEFAULT_TILE_SIZE,
+    .overlap = argc > 4 ? g_ascii_strtoll(argv[4], NULL, 10) :
+      DEFAULT_OVERLAP,
+    .format = FORMAT_JPEG,
+    .ext = "jpeg",
+    .background = { 255, 255, 255 },
+  };
+  if (argc > 5) {
+    if (!strcmp(argv[5], "png")) {
+      dzi.format = FORMAT_PNG;
+      dzi.ext = "png";
+    } else if (strcmp(argv[5], "jpeg")) {
+      fail("format must be jpeg or png");
+    }
+  }
+  if (dzi.tile_size <= 0) {
+    fail("tile-size must be positive");
+  }
+  if (dzi.overlap < 0) {
+    fail("overlap must be non-negative");
+  }
+
+  // open slide
+  dzi.osr = openslide_open(slide);
+
+  // check errors
+  if (dzi.osr == NULL) {
+    fail("%s: Not a file that OpenSlide can recognize", slide);
+  }
+
+  const char *err = openslide_get_error(dzi.osr);
+  if (err) {
+    fail("%s: %s", slide, err);
+  }
+
+  // background of JPEG tiles
+  const char *bgcolor = openslide_get_property_value(dzi.osr,
+                                                     OPENSLIDE_PROPERTY_NAME_BACKGROUND_COLOR);
+  if (bgcolor) {
+    unsigned int r, g, b;
+    if (sscanf(bgcolor, "%2x%2x%2x", &r, &g, &b) == 3) {
+      dzi.background[0] = r;
+      dzi.background[1] = g;
+      dzi.background[2] = b;
+    }
+  }
+
+  // the slide's tiles are the tiles of the top level
+  int64_t tw, th;
+  openslide_get_level_tile_size(dzi.osr, 0, &tw, &th);
+  dzi.passthrough = dzi.format == FORMAT_JPEG && dzi.overlap == 0 &&
+    tw == dzi.tile_size && th == dzi.tile_size;
+
+  dzi.files_dir = g_strdup_printf("%s_files", output);
+  char *descriptor = g_strdup_printf("%s.dzi", output);
+  write_dzi(&dzi, descriptor);
+  if (dzi.passthrough) {
+    printf("%" PRId64 " tiles passed through\n", dzi.passthrough_count);
+  }
+
+  g_free(descriptor);
+  g_free(dzi.files_dir);
+  openslide_close(dzi.osr);
+
+  return 0;
+}
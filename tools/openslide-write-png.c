@@ -35,6 +35,9 @@
 static const char SOFTWARE[] = "Software";
 static const char OPENSLIDE[] = "OpenSlide <https://openslide.org/>";
 
+// pixels read at a time, in two buffers
+#define BAND_PIXELS (4 << 20)
+
 #define ENSURE_NONNEG(i) \
   if (i < 0) {					\
     fail(#i " must be non-negative");	\
@@ -59,6 +62,71 @@ static void fail(const char *format, ...) {
 }
 
 
+// un-premultiply alpha and pack into expected format
+static void to_rgba(uint32_t *buf, int32_t w) {
+  for (int i = 0; i < w; i++) {
+    uint32_t p = buf[i];
+    uint8_t *p8 = (uint8_t *) (buf + i);
+
+    uint8_t a = (p >> 24) & 0xFF;
+    uint8_t r = (p >> 16) & 0xFF;
+    uint8_t g = (p >> 8) & 0xFF;
+    uint8_t b = p & 0xFF;
+
+    switch (a) {
+    case 0:
+      r = 0;
+      b = 0;
+      g = 0;
+      break;
+
+    case 255:
+      // no action
+      break;
+
+    default:
+      r = (r * 255 + a / 2) / a;
+      g = (g * 255 + a / 2) / a;
+      b = (b * 255 + a / 2) / a;
+      break;
+    }
+
+    // write back
+    p8[0] = r;
+    p8[1] = g;
+    p8[2] = b;
+    p8[3] = a;
+  }
+}
+
+
+struct band {
+  openslide_t *osr;
+  uint32_t *dest;
+  int64_t x, y;
+  int32_t level;
+  int32_t w, h;
+};
+
+static void *read_band(void *data) {
+  struct band *band = data;
+  openslide_read_region(band->osr, band->dest, band->x, band->y,
+			band->level, band->w, band->h);
+  g_slice_free(struct band, band);
+  return NULL;
+}
+
+// the band is copied, so the caller may reuse it
+static GThread *start_band(const struct band *band) {
+  struct band *copy = g_slice_dup(struct band, band);
+  GThread *thread = g_thread_create(read_band, copy, TRUE, NULL);
+  if (thread == NULL) {
+    fail("Couldn't start reader thread");
+  }
+  return thread;
+}
+
+
 static void write_png(openslide_t *osr, FILE *f,
 		      int64_t x, int64_t y, int32_t level,
 		      int32_t w, const int32_t h) {
@@ -110,61 +178,44 @@ static void write_png(openslide_t *osr, FILE *f,
   // start writing
   png_write_info(png_ptr, info_ptr);
 
-  uint32_t *dest = g_malloc(w * 4);
-  int32_t lines_to_draw = h;
+  // bands of about BAND_PIXELS, the next one read while this one is
+  // compressed
+  int32_t band_h = CLAMP(BAND_PIXELS / w, 1, h);
+  uint32_t *bufs[2] = { g_new(uint32_t, (int64_t) w * band_h),
+                        g_new(uint32_t, (int64_t) w * band_h) };
   double ds = openslide_get_level_downsample(osr, level);
   int32_t yy = y / ds;
-  while (lines_to_draw) {
-    openslide_read_region(osr, dest,
-			  x, yy * ds, level, w, 1);
-
+  struct band next = { osr, bufs[0], x, yy * ds, level, w,
+                       MIN(band_h, h) };
+  GThread *reader = start_band(&next);
+  for (int32_t top = 0; top < h; top += band_h) {
+    g_thread_join(reader);
+    struct band cur = next;
     const char *err = openslide_get_error(osr);
     if (err) {
       fail("%s", err);
     }
 
-    // un-premultiply alpha and pack into expected format
-    for (int i = 0; i < w; i++) {
-      uint32_t p = dest[i];
-      uint8_t *p8 = (uint8_t *) (dest + i);
-
-      uint8_t a = (p >> 24) & 0xFF;
-      uint8_t r = (p >> 16) & 0xFF;
-      uint8_t g = (p >> 8) & 0xFF;
-      uint8_t b = p & 0xFF;
-
-      switch (a) {
-      case 0:
-	r = 0;
-	b = 0;
-	g = 0;
-	break;
-
-      case 255:
-	// no action
-	break;
-
-      default:
-	r = (r * 255 + a / 2) / a;
-	g = (g * 255 + a / 2) / a;
-	b = (b * 255 + a / 2) / a;
-	break;
-      }
-
-      // write back
-      p8[0] = r;
-      p8[1] = g;
-      p8[2] = b;
-      p8[3] = a;
+    // read ahead
+    reader = NULL;
+    if (top + band_h < h) {
+      next.dest = cur.dest == bufs[0] ? bufs[1] : bufs[0];
+      next.y = (yy + top + band_h) * ds;
+      next.h = MIN(band_h, h - top - band_h);
+      reader = start_band(&next);
     }
 
-    png_write_row(png_ptr, (png_bytep) dest);
-    yy++;
-    lines_to_draw--;
+    // un-premultiply alpha and pack into expected format, in place
+    for (int32_t r = 0; r < cur.h; r++) {
+      uint32_t *row = cur.dest + (int64_t) r * w;
+      to_rgba(row, w);
+      png_write_row(png_ptr, (png_bytep) row);
+    }
   }
 
   // end
-  g_free(dest);
+  g_free(bufs[0]);
+  g_free(bufs[1]);
   g_free(key);
   g_free(text);
   png_write_end(png_ptr, info_ptr);